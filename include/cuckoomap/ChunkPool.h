@@ -0,0 +1,108 @@
+#ifndef CHUNK_POOL_H
+#define CHUNK_POOL_H 1
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "CuckooHelpers.h"
+
+// An allocator for chunks of 2^sizeClass values of a fixed byte size and
+// alignment, see ChunkedCuckooMultiMap. Every size class has a free list
+// of its own. Small chunks are cut from slabs of growing size, placed
+// according to an AllocationPolicy, large ones are allocated one by one,
+// and memory is only given back when the pool is destroyed.
+// This class is not thread-safe, the map using it holds its mutex.
+
+class ChunkPool {
+  static constexpr size_t FirstSlabBytes = 65536;
+  static constexpr size_t MaxSlabBytes = 4 << 20;
+
+ public:
+  static constexpr uint32_t MaxSizeClass = 31;
+
+  ChunkPool(size_t valueSize, size_t valueAlign,
+            AllocationPolicy const& policy = AllocationPolicy())
+      : _stride(valueSize),
+        _align((valueAlign < alignof(char*)) ? alignof(char*) : valueAlign),
+        _slabBytes(FirstSlabBytes),
+        _next(nullptr),
+        _end(nullptr),
+        _nrBytes(0),
+        _freeLists(MaxSizeClass + 1, nullptr),
+        _policy(policy) {
+    // values are stride bytes apart, a free chunk holds the pointer to the
+    // next one, we assume two powers for all alignments, up to 64
+    _stride = (_stride + valueAlign - 1) & ~(valueAlign - 1);
+    if (_stride == 0) {
+      _stride = valueAlign;
+    }
+  }
+
+  ChunkPool(ChunkPool const&) = delete;
+  ChunkPool& operator=(ChunkPool const&) = delete;
+
+  size_t stride() const { return _stride; }
+
+  size_t chunkBytes(uint32_t sizeClass) const {
+    size_t bytes = _stride << sizeClass;
+    return (bytes + _align - 1) & ~(_align - 1);
+  }
+
+  char* allocate(uint32_t sizeClass) {
+    // return an uninitialized chunk, throws std::bad_alloc on failure
+    char* chunk = _freeLists[sizeClass];
+    if (chunk != nullptr) {
+      std::memcpy(&_freeLists[sizeClass], chunk, sizeof(char*));
+      return chunk;
+    }
+    size_t bytes = chunkBytes(sizeClass);
+    if (bytes > _slabBytes / 4) {
+      return newMemory(bytes);
+    }
+    if (static_cast<size_t>(_end - _next) < bytes) {
+      // the rest of the slab is left unused
+      _next = newMemory(_slabBytes);
+      _end = _next + _slabBytes;
+      if (_slabBytes < MaxSlabBytes) {
+        _slabBytes *= 2;
+      }
+    }
+    chunk = _next;
+    _next += bytes;
+    return chunk;
+  }
+
+  void free(char* chunk, uint32_t sizeClass) {
+    // give back a chunk returned by allocate for the same size class
+    std::memcpy(chunk, &_freeLists[sizeClass], sizeof(char*));
+    _freeLists[sizeClass] = chunk;
+  }
+
+  uint64_t memoryUsage() const {
+    return sizeof(ChunkPool) + _nrBytes +
+           _memory.size() * (sizeof(TableMemory) + 64);
+  }
+
+ private:
+  char* newMemory(size_t bytes) {
+    std::unique_ptr<TableMemory> memory(new TableMemory());
+    memory->allocate(bytes + 64, false, _policy);
+    _memory.push_back(std::move(memory));
+    _nrBytes += bytes;
+    return _memory.back()->base();
+  }
+
+  size_t _stride;      // value size rounded up to the alignment
+  size_t _align;       // of the chunks
+  size_t _slabBytes;   // size of the next slab
+  char* _next;         // next never used byte of the last slab
+  char* _end;          // end of the last slab
+  uint64_t _nrBytes;   // in all slabs and large chunks
+  std::vector<char*> _freeLists;  // per size class, first free chunk
+  AllocationPolicy _policy;
+  std::vector<std::unique_ptr<TableMemory>> _memory;
+};
+
+#endif
@@ -0,0 +1,315 @@
+#ifndef CHUNKED_CUCKOO_MULTI_MAP_H
+#define CHUNKED_CUCKOO_MULTI_MAP_H 1
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include "ChunkPool.h"
+#include "CuckooMap.h"
+
+// As CuckooMultiMap, with the same template parameters and Finding, but
+// for keys with many values: a key is stored once in an inner CuckooMap,
+// and its values lie next to each other in a chunk from a ChunkPool,
+// which doubles when full and halves when three quarters are unused. So
+// going through the values of a key with Finding::next or get touches no
+// hash table at all, removing all values of a key is a single removal,
+// and the hash functions only see the key. A key with few values pays
+// for a chunk of at least 2^MinSizeClass values though, CuckooMultiMap
+// is the better choice for those.
+
+template <class Key, class Value,
+          class HashKey1 = HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
+          class HashKey2 = HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
+          class CompKey = std::equal_to<Key>>
+class ChunkedCuckooMultiMap {
+  static constexpr uint32_t MinSizeClass = 2;  // 4 values
+
+  struct InnerKey : Key {
+    uint32_t used;
+    constexpr InnerKey() noexcept : Key(), used(0) {}
+    explicit InnerKey(Key const& other) : Key(other), used(1) {}
+    bool empty() const { return used == 0; }
+  };
+
+  struct InnerHashKey1 {
+    HashKey1 hasher;
+    uint64_t operator()(InnerKey const& k) const {
+      return hasher(static_cast<Key const&>(k));
+    }
+  };
+
+  struct InnerHashKey2 {
+    HashKey2 hasher;
+    uint64_t operator()(InnerKey const& k) const {
+      return hasher(static_cast<Key const&>(k));
+    }
+  };
+
+  struct InnerCompKey {
+    CompKey comp;
+    bool operator()(InnerKey const& a, InnerKey const& b) const {
+      // empty slots never match, even if their bytes make an equal Key
+      return a.used == b.used &&
+             comp(static_cast<Key const&>(a), static_cast<Key const&>(b));
+    }
+  };
+
+  struct Chunk {
+    // the value of a key in the inner map
+    char* values;        // count of them, stride bytes apart
+    uint32_t count;
+    uint32_t sizeClass;  // room for 2^sizeClass values
+  };
+
+  typedef CuckooMap<InnerKey, Chunk, InnerHashKey1, InnerHashKey2,
+                    InnerCompKey>
+      InnerCuckooMap;
+
+  InnerCuckooMap _innerMap;
+  ChunkPool _pool;
+  size_t _valueSize;
+  std::atomic<uint64_t> _nrValues;
+
+ public:
+  typedef Key KeyType;  // these are for ShardedMap
+  typedef Value ValueType;
+  typedef HashKey1 HashKey1Type;
+  typedef HashKey2 HashKey2Type;
+  typedef CompKey CompKeyType;
+
+  ChunkedCuckooMultiMap(size_t firstSize, size_t valueSize = sizeof(Value),
+                        size_t valueAlign = alignof(Value))
+      : _innerMap(firstSize, sizeof(Chunk), alignof(Chunk)),
+        _pool(valueSize, valueAlign),
+        _valueSize(valueSize),
+        _nrValues(0) {}
+
+  ChunkedCuckooMultiMap(size_t firstSize, size_t valueSize, size_t valueAlign,
+                        AllocationPolicy const& policy)
+      : _innerMap(firstSize, sizeof(Chunk), alignof(Chunk), policy),
+        _pool(valueSize, valueAlign, policy),
+        _valueSize(valueSize),
+        _nrValues(0) {}
+
+  // Destruction, copying and moving exactly as CuckooMap, the chunks are
+  // freed with the pool.
+
+  // As the Finding of CuckooMultiMap: it holds the mutex as long as it
+  // lives, found() is the number of values of the key, and value() is the
+  // one at the current position, which next() and get() move.
+
+  struct Finding {
+    friend class ChunkedCuckooMultiMap;
+
+   private:
+    ChunkedCuckooMultiMap* _map;
+    typename InnerCuckooMap::Finding _innerFinding;
+    uint32_t _pos;
+
+   public:
+    Finding() : _map(nullptr), _pos(0) {}
+
+    Finding(Key const& k, ChunkedCuckooMultiMap* m)
+        : _map(m), _innerFinding(m->_innerMap.lookup(InnerKey(k))), _pos(0) {}
+
+    int32_t found() const {
+      if (_innerFinding.found() == 0) {
+        return 0;
+      }
+      return static_cast<int32_t>(chunk()->count);
+    }
+
+    Key* key() const { return static_cast<Key*>(_innerFinding.key()); }
+
+    Value* value() const {
+      // nullptr after the last value was removed from the current position
+      if (_innerFinding.found() == 0 || _pos >= chunk()->count) {
+        return nullptr;
+      }
+      return reinterpret_cast<Value*>(chunk()->values +
+                                      _pos * _map->_pool.stride());
+    }
+
+    Value* values() const {
+      // all values of the key, _map->valueStride() bytes apart, valid as
+      // long as the mutex is held and no value is inserted or removed
+      return (_innerFinding.found() == 0)
+                 ? nullptr
+                 : reinterpret_cast<Value*>(chunk()->values);
+    }
+
+    // the map whose mutex this holds, or nullptr
+    ChunkedCuckooMultiMap* map() const {
+      return (_innerFinding.map() != nullptr) ? _map : nullptr;
+    }
+
+    bool next() {
+      if (_innerFinding.found() == 0 || _pos + 1 >= chunk()->count) {
+        return false;
+      }
+      ++_pos;
+      return true;
+    }
+
+    bool get(int32_t pos) {
+      if (_innerFinding.found() == 0 || pos < 0 ||
+          static_cast<uint32_t>(pos) >= chunk()->count) {
+        return false;
+      }
+      _pos = static_cast<uint32_t>(pos);
+      return true;
+    }
+
+   private:
+    Chunk* chunk() const {
+      return reinterpret_cast<Chunk*>(_innerFinding.value());
+    }
+  };
+
+  Finding lookup(Key const& k) {
+    // look up a key, see CuckooMultiMap::lookup
+    return Finding(k, this);
+  }
+
+  bool lookup(Key const& k, Finding& f) {
+    f._map = this;
+    f._pos = 0;
+    return _innerMap.lookup(InnerKey(k), f._innerFinding);
+  }
+
+  bool insert(Key const& k, Value const* v) {
+    // append the value *v to those of k, returns true
+    Finding f(k, this);
+    return innerInsert(f, k, v);
+  }
+
+  bool insert(Key const& k, Value const* v, Finding& f) {
+    // the same with the mutex held by f, which is left at the new value
+    f._map = this;
+    _innerMap.lookup(InnerKey(k), f._innerFinding);
+    return innerInsert(f, k, v);
+  }
+
+  bool remove(Key const& k) {
+    // remove all values of k at once, return false if there are none
+    Finding f(k, this);
+    return removeAll(f);
+  }
+
+  bool remove(Key const& k, Finding& f) {
+    // the same with the mutex held by f
+    lookup(k, f);
+    return removeAll(f);
+  }
+
+  bool remove(Finding& f) {
+    // remove the value at the current position of f, the last value of
+    // the key takes its place, so f then points to that one
+    if (f.value() == nullptr) {
+      return false;
+    }
+    Chunk* chunk = f.chunk();
+    size_t stride = _pool.stride();
+    uint32_t last = chunk->count - 1;
+    if (f._pos < last) {
+      std::memcpy(chunk->values + f._pos * stride,
+                  chunk->values + last * stride, _valueSize);
+    }
+    chunk->count = last;
+    _nrValues.fetch_sub(1, std::memory_order_relaxed);
+    if (last == 0) {
+      _pool.free(chunk->values, chunk->sizeClass);
+      _innerMap.remove(f._innerFinding);
+      f._pos = 0;
+    } else if (chunk->sizeClass > MinSizeClass &&
+               (uint64_t(last) << 2) <= (uint64_t(1) << chunk->sizeClass)) {
+      resize(*chunk, chunk->sizeClass - 1);
+    }
+    return true;
+  }
+
+  uint64_t nrUsed() const {
+    // the number of values, as the number of pairs of a CuckooMultiMap
+    return _nrValues.load(std::memory_order_relaxed);
+  }
+
+  uint64_t nrKeys() const { return _innerMap.nrUsed(); }
+
+  size_t valueStride() const {
+    // bytes between two values of a key, see Finding::values
+    return _pool.stride();
+  }
+
+  uint64_t memoryUsage() {
+    return _innerMap.memoryUsage() + _pool.memoryUsage();
+  }
+
+  // the hot path counters of the inner map, see CuckooMap::stats
+  typedef typename InnerCuckooMap::Statistics Statistics;
+
+  Statistics stats() const { return _innerMap.stats(); }
+
+  void resetStats() { _innerMap.resetStats(); }
+
+ private:
+  bool removeAll(Finding& f) {
+    // f must just have been used to look for the key
+    if (f.found() == 0) {
+      return false;
+    }
+    Chunk chunk = *f.chunk();
+    _innerMap.remove(f._innerFinding);
+    _pool.free(chunk.values, chunk.sizeClass);
+    _nrValues.fetch_sub(chunk.count, std::memory_order_relaxed);
+    return true;
+  }
+
+  bool innerInsert(Finding& f, Key const& k, Value const* v) {
+    // f must just have been used to look for k, and holds the mutex
+    if (f._innerFinding.found() == 0) {
+      Chunk chunk;
+      chunk.values = _pool.allocate(MinSizeClass);
+      chunk.count = 0;
+      chunk.sizeClass = MinSizeClass;
+      bool inserted;
+      try {
+        inserted = _innerMap.insert(InnerKey(k), &chunk, f._innerFinding);
+      } catch (...) {
+        _pool.free(chunk.values, chunk.sizeClass);
+        throw;
+      }
+      if (!inserted) {
+        // only a read-only inner map refuses a new key
+        _pool.free(chunk.values, chunk.sizeClass);
+        return false;
+      }
+      _innerMap.lookup(InnerKey(k), f._innerFinding);
+    }
+    Chunk* chunk = f.chunk();
+    if ((uint64_t(chunk->count) >> chunk->sizeClass) != 0) {
+      if (chunk->sizeClass == ChunkPool::MaxSizeClass) {
+        throw std::length_error("too many values for one key");
+      }
+      resize(*chunk, chunk->sizeClass + 1);
+    }
+    std::memcpy(chunk->values + chunk->count * _pool.stride(), v, _valueSize);
+    f._pos = chunk->count;
+    chunk->count += 1;
+    _nrValues.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  void resize(Chunk& chunk, uint32_t sizeClass) {
+    // move the values to a chunk of another size class
+    char* values = _pool.allocate(sizeClass);
+    std::memcpy(values, chunk.values, chunk.count * _pool.stride());
+    _pool.free(chunk.values, chunk.sizeClass);
+    chunk.values = values;
+    chunk.sizeClass = sizeClass;
+  }
+};
+
+#endif
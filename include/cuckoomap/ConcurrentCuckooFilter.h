@@ -0,0 +1,362 @@
+#ifndef CONCURRENT_CUCKOO_FILTER_H
+#define CONCURRENT_CUCKOO_FILTER_H 1
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+#include "CuckooHelpers.h"
+
+// A cuckoo filter which can be used by many threads at the same time
+// without a lock. The hash functions and the placement of fingerprints are
+// the same as in CuckooFilter (without SemiSorted), see there for the
+// template parameters; FingerprintBits must be 8, 16 or 32, such that every
+// slot is an atomic integer of its own.
+//   lookup()  reads the slots of the two buckets of a key without writing
+//             anything, it only repeats the reads if it found nothing and
+//             a fingerprint was moved between the same two buckets in the
+//             meantime, which the move counters tell,
+//   insert()  puts the fingerprint into a free slot of its buckets with a
+//             compare-and-swap, or searches a path of at most MaxKicks
+//             displacements to a free slot and executes it backwards, each
+//             fingerprint is copied to its other bucket before the slot
+//             it leaves is overwritten, and the move counter of the two
+//             buckets is incremented in between. So a concurrent lookup
+//             never misses a fingerprint which is being moved. If a slot of
+//             the path has changed in the meantime, the path is abandoned
+//             there: the copy just written to the next bucket is removed
+//             again, the moves already executed stay, and a new path is
+//             searched, at most MaxPaths times,
+//   remove()  clears a slot holding the fingerprint with a compare-and-swap.
+// Unlike CuckooFilter::insert, a failing insert loses no fingerprint, every
+// fingerprint it moved is in its other bucket, but the moves executed
+// before it gave up are not undone. As with every cuckoo filter, only keys
+// which were inserted may be removed. Lookups concurrent with a remove of
+// the same fingerprint may see it or not, and a lookup concurrent with an
+// abandoned path may see a fingerprint in two buckets, which only can
+// cause a false positive.
+template <class Key, class HashKey = HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
+          class Fingerprint = HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
+          class HashShort = HashWithSeed<uint16_t, 0xfedcbafedcba4321ULL>,
+          uint32_t SlotsPerBucket = 4, uint32_t FingerprintBits = 16>
+class ConcurrentCuckooFilter {
+  static_assert(SlotsPerBucket >= 4 && SlotsPerBucket <= 256 &&
+                    (SlotsPerBucket & (SlotsPerBucket - 1)) == 0,
+                "SlotsPerBucket must be a power of two of at least 4");
+  static_assert(FingerprintBits == 8 || FingerprintBits == 16 ||
+                    FingerprintBits == 32,
+                "FingerprintBits must be 8, 16 or 32");
+
+  typedef typename std::conditional<
+      FingerprintBits == 8, uint8_t,
+      typename std::conditional<FingerprintBits == 16, uint16_t,
+                                uint32_t>::type>::type Slot;
+  typedef std::atomic<Slot> AtomicSlot;
+  static_assert(sizeof(AtomicSlot) == sizeof(Slot),
+                "atomic slots must have the size of the slots");
+
+ public:
+  // maximal length of a displacement path and number of paths per insert
+  static constexpr unsigned MaxKicks = 500;
+  static constexpr unsigned MaxPaths = 8;
+  static constexpr uint32_t LogMoveStripes = 10;
+
+  ConcurrentCuckooFilter(bool useMmap, uint64_t size,
+                         AllocationPolicy const& policy = AllocationPolicy())
+      : _moves(new std::atomic<uint32_t>[1ULL << LogMoveStripes]),
+        _nrUsed(0) {
+    for (uint64_t s = 0; s < (1ULL << LogMoveStripes); ++s) {
+      _moves[s].store(0, std::memory_order_relaxed);
+    }
+
+    // sized like CuckooFilter, with some padding to avoid failure
+    size *= 2;
+    size = (size >= 1024) ? size : 1024;  // want 256 buckets minimum
+
+    size /= SlotsPerBucket;
+    _size = size;
+    uint64_t niceSize = 256;
+    _logSize = 8;
+    while (niceSize < size) {
+      niceSize <<= 1;
+      _logSize += 1;
+    }
+    _sizeMask = niceSize - 1;
+    _sizeShift = (64 - _logSize) / 2;
+    _allocSize = _size * SlotsPerBucket * sizeof(Slot) + 64;
+
+    // Zeroed memory has all slots empty, the atomics need no construction:
+    _memory.allocate(_allocSize, useMmap, policy, true);
+    _slots = reinterpret_cast<AtomicSlot*>(_memory.base());
+  }
+
+  ConcurrentCuckooFilter(ConcurrentCuckooFilter const&) = delete;
+  ConcurrentCuckooFilter& operator=(ConcurrentCuckooFilter const&) = delete;
+
+  bool lookup(Key const& k) const {
+    // look up a key, return either false if k was never inserted or true,
+    // maybe falsely
+    uint64_t hash1, hashFingerprint;
+    DualHash<Key, HashKey, Fingerprint>::compute(_hasherKey, _fingerprint, k,
+                                                 &hash1, &hashFingerprint);
+    return lookup(hash1, hashFingerprint);
+  }
+
+  bool lookup(uint64_t hash1, uint64_t hashFingerprint) const {
+    // as above, but with the values of HashKey and Fingerprint for the key
+    // already computed by the caller.
+    uint64_t pos1 = hashToPos(hash1);
+    Slot fingerprint = hashToFingerprint(hashFingerprint);
+    uint64_t pos2 = alternativePos(pos1, fingerprint);
+    std::atomic<uint32_t>& moves = moveCounter(pos1, pos2);
+    uint32_t before = moves.load(std::memory_order_acquire);
+    while (true) {
+      if (findInBucket(pos1, fingerprint) >= 0 ||
+          findInBucket(pos2, fingerprint) >= 0) {
+        return true;
+      }
+      uint32_t after = moves.load(std::memory_order_acquire);
+      if (after == before) {
+        return false;
+      }
+      before = after;
+    }
+  }
+
+  bool insert(Key const& k) {
+    // insert the key k, return false if no free slot could be reached, in
+    // which case k is not in the filter and no other fingerprint is lost,
+    // though some may have moved to their other bucket
+    uint64_t pos1;
+    Slot fingerprint;
+    hashKey(k, &pos1, &fingerprint);
+    uint64_t pos2 = alternativePos(pos1, fingerprint);
+
+    // the pseudo random choices are local to this call, derived from the
+    // positions, such that no state is shared between threads
+    uint64_t randState = (pos1 << 16) ^ pos2 ^ 0x2636283625154737ULL;
+    uint64_t buckets[MaxKicks + 1];
+    uint32_t slots[MaxKicks];
+    Slot victims[MaxKicks];
+    for (unsigned path = 0; path < MaxPaths; ++path) {
+      if (insertIntoBucket(pos1, fingerprint) ||
+          insertIntoBucket(pos2, fingerprint)) {
+        _nrUsed.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      // Search a path of displacements without changing anything: the
+      // fingerprint victims[d] in slot slots[d] of buckets[d] has to move
+      // to its other bucket, buckets[d + 1], to make room for victims[d - 1]
+      // (or the new fingerprint for d == 0).
+      uint64_t pos = (pseudoRandomChoice(randState) & 1) ? pos2 : pos1;
+      unsigned depth = 0;
+      int freeSlot = -1;
+      while (depth < MaxKicks) {
+        freeSlot = findInBucket(pos, 0);
+        if (freeSlot >= 0) {
+          break;
+        }
+        uint32_t i = pseudoRandomChoice(randState) & (SlotsPerBucket - 1);
+        Slot victim = slot(pos, i).load(std::memory_order_relaxed);
+        if (victim == 0) {
+          freeSlot = static_cast<int>(i);
+          break;
+        }
+        buckets[depth] = pos;
+        slots[depth] = i;
+        victims[depth] = victim;
+        ++depth;
+        pos = alternativePos(pos, victim);
+      }
+      if (freeSlot < 0) {
+        continue;
+      }
+      buckets[depth] = pos;
+      // Execute the path from its end, every fingerprint is written to its
+      // new slot before its old slot is overwritten:
+      Slot moving = (depth > 0) ? victims[depth - 1] : fingerprint;
+      Slot expected = 0;
+      if (!slot(pos, freeSlot)
+               .compare_exchange_strong(expected, moving,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+        continue;
+      }
+      bool done = true;
+      while (depth > 0) {
+        --depth;
+        moving = (depth > 0) ? victims[depth - 1] : fingerprint;
+        expected = victims[depth];
+        moveCounter(buckets[depth], buckets[depth + 1])
+            .fetch_add(1, std::memory_order_acq_rel);
+        if (!slot(buckets[depth], slots[depth])
+                 .compare_exchange_strong(expected, moving,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+          // the copy of victims[depth] in its other bucket is one too many
+          removeCopy(buckets[depth], victims[depth]);
+          done = false;
+          break;
+        }
+      }
+      if (done) {
+        _nrUsed.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool remove(Key const& k) {
+    // remove one element with key k, if one is in the table. Return true if
+    // a key was removed and false otherwise.
+    uint64_t pos1;
+    Slot fingerprint;
+    hashKey(k, &pos1, &fingerprint);
+    if (removeCopy(pos1, fingerprint)) {
+      _nrUsed.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+
+  void prefetch(uint64_t hash1, uint64_t hashFingerprint) const {
+    // issue prefetches for both buckets a later lookup will probe.
+    uint64_t pos1 = hashToPos(hash1);
+    Slot fingerprint = hashToFingerprint(hashFingerprint);
+    uint64_t pos2 = alternativePos(pos1, fingerprint);
+    __builtin_prefetch(&slot(pos1, 0), 0, 3);
+    __builtin_prefetch(&slot(pos2, 0), 0, 3);
+  }
+
+  uint64_t capacity() const { return _size * SlotsPerBucket; }
+
+  uint64_t nrUsed() const { return _nrUsed.load(std::memory_order_relaxed); }
+
+  uint64_t memoryUsage() const {
+    return sizeof(ConcurrentCuckooFilter) + _allocSize +
+           (1ULL << LogMoveStripes) * sizeof(std::atomic<uint32_t>);
+  }
+
+ private:  // methods
+  AtomicSlot& slot(uint64_t pos, uint64_t i) const {
+    return _slots[pos * SlotsPerBucket + i];
+  }
+
+  int findInBucket(uint64_t pos, Slot fingerprint) const {
+    // slot of fingerprint in bucket pos, or -1
+    for (uint32_t i = 0; i < SlotsPerBucket; ++i) {
+      if (slot(pos, i).load(std::memory_order_acquire) == fingerprint) {
+        return static_cast<int>(i);
+      }
+    }
+    return -1;
+  }
+
+  bool insertIntoBucket(uint64_t pos, Slot fingerprint) {
+    // put fingerprint into a free slot of bucket pos, if there is one
+    for (uint32_t i = 0; i < SlotsPerBucket; ++i) {
+      Slot expected = 0;
+      if (slot(pos, i).load(std::memory_order_relaxed) == 0 &&
+          slot(pos, i).compare_exchange_strong(expected, fingerprint,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::atomic<uint32_t>& moveCounter(uint64_t pos1, uint64_t pos2) const {
+    // the counter of moves between the two buckets of a fingerprint
+    uint64_t pos = (pos1 < pos2) ? pos1 : pos2;
+    return _moves[pos & ((1ULL << LogMoveStripes) - 1)];
+  }
+
+  bool removeCopy(uint64_t pos, Slot fingerprint) {
+    // clear one slot holding fingerprint in bucket pos or its other bucket,
+    // a fingerprint which is moved between the two is not missed, see
+    // lookup
+    uint64_t positions[2] = {pos, alternativePos(pos, fingerprint)};
+    std::atomic<uint32_t>& moves = moveCounter(positions[0], positions[1]);
+    uint32_t before = moves.load(std::memory_order_acquire);
+    while (true) {
+      for (uint64_t p : positions) {
+        int i;
+        while ((i = findInBucket(p, fingerprint)) >= 0) {
+          Slot expected = fingerprint;
+          if (slot(p, i).compare_exchange_strong(expected, 0,
+                                                 std::memory_order_release,
+                                                 std::memory_order_relaxed)) {
+            return true;
+          }
+        }
+      }
+      uint32_t after = moves.load(std::memory_order_acquire);
+      if (after == before) {
+        return false;
+      }
+      before = after;
+    }
+  }
+
+  uint64_t hashToPos(uint64_t hash) const {
+    uint64_t relevantBits = (hash >> _sizeShift) & _sizeMask;
+    return ((relevantBits < _size) ? relevantBits : (relevantBits - _size));
+  }
+
+  void hashKey(Key const& k, uint64_t* pos, Slot* fingerprint) const {
+    // first bucket and fingerprint of k, see DualHash
+    uint64_t hash1, hashFingerprint;
+    DualHash<Key, HashKey, Fingerprint>::compute(_hasherKey, _fingerprint, k,
+                                                 &hash1, &hashFingerprint);
+    *pos = hashToPos(hash1);
+    *fingerprint = hashToFingerprint(hashFingerprint);
+  }
+
+  Slot hashToFingerprint(uint64_t hash) const {
+    // fold all bits of the hash into FingerprintBits, 0 marks empty slots
+    uint64_t folded = hash;
+    for (uint32_t shift = FingerprintBits; shift < 64;
+         shift += FingerprintBits) {
+      folded ^= hash >> shift;
+    }
+    Slot fingerprint = static_cast<Slot>(folded);
+    return (fingerprint ? fingerprint : 1);
+  }
+
+  uint64_t alternativePos(uint64_t pos, uint32_t fingerprint) const {
+    // symmetric, as in CuckooFilter
+    uint64_t hash = _hasherShort(static_cast<uint16_t>(fingerprint));
+    if (FingerprintBits > 16) {
+      hash ^= _hasherShort(static_cast<uint16_t>(fingerprint >> 16)) << 1;
+    }
+    uint64_t h = static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(hash) * _size) >> 64);
+    return (h >= pos) ? h - pos : h + _size - pos;
+  }
+
+  static uint32_t pseudoRandomChoice(uint64_t& randState) {
+    randState = randState * 997 + 17;  // ignore overflows
+    return static_cast<uint32_t>((randState >> 37) & 0xff);
+  }
+
+ private:              // member variables
+  uint64_t _logSize;    // logarithm (base 2) of the power of two >= _size
+  uint64_t _size;       // actual number of buckets
+  uint64_t _sizeMask;   // used to mask out some bits from the hash
+  uint32_t _sizeShift;  // used to shift the bits down to get a position
+  uint64_t _allocSize;  // number of allocated bytes
+  TableMemory _memory;  // owns the slots
+  AtomicSlot* _slots;   // 64-byte aligned
+  std::unique_ptr<std::atomic<uint32_t>[]> _moves;  // see moveCounter
+  std::atomic<uint64_t> _nrUsed;  // number of fingerprints in the filter
+
+  HashKey _hasherKey;        // Instance to compute the first hash function
+  Fingerprint _fingerprint;  // Instance to compute a fingerprint of a key
+  HashShort _hasherShort;    // Instance to compute the second hash function
+};
+
+#endif
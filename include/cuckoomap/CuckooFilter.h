@@ -14,6 +14,7 @@
 #endif
 #endif
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
@@ -40,21 +41,88 @@
 //     table no constructors or destructors or assignment operators are
 //     called for Value, the data is only copied with std::memcpy. So Value
 //     must only contain POD!
-// This class is not thread-safe!
+//   SlotsPerBucket is the number of fingerprints of a bucket, a power of
+//     two of at least 4.
+//   FingerprintBits is the width of a fingerprint, between 4 and 32, the
+//     fingerprints are bit-packed, so for example 12 bits need 12 bits per
+//     slot, and the false positive rate is about
+//     2 * SlotsPerBucket / 2^FingerprintBits at full load.
+//   SemiSorted (only for 4 slots per bucket) stores the fingerprints of a
+//     bucket sorted, with their top 4 bits encoded together in 12 instead
+//     of 16 bits, which saves one bit per slot, see SemiSortedCodec.
+// The two buckets of a fingerprint are symmetric, each is computed from the
+// other one and the fingerprint alone, such that fingerprints can be moved
+// to their other bucket on insert.
+// This class is not thread-safe, see ConcurrentCuckooFilter for one which is.
+
+class SemiSortedCodec {
+  // The 3876 sorted tuples of four 4-bit values, packed into 16 bits with
+  // the smallest value in the top nibble, in increasing order. The index of
+  // a tuple is its 12-bit code.
+ public:
+  static constexpr uint32_t NrCodes = 3876;
+
+  static SemiSortedCodec const& instance() {
+    static SemiSortedCodec codec;
+    return codec;
+  }
+
+  uint16_t decode(uint32_t code) const { return _tuples[code]; }
+
+  uint32_t encode(uint16_t tuple) const {
+    return static_cast<uint32_t>(
+        std::lower_bound(_tuples, _tuples + NrCodes, tuple) - _tuples);
+  }
+
+ private:
+  SemiSortedCodec() {
+    uint32_t n = 0;
+    for (uint16_t a = 0; a < 16; ++a) {
+      for (uint16_t b = a; b < 16; ++b) {
+        for (uint16_t c = b; c < 16; ++c) {
+          for (uint16_t d = c; d < 16; ++d) {
+            _tuples[n++] = (a << 12) | (b << 8) | (c << 4) | d;
+          }
+        }
+      }
+    }
+  }
+
+  uint16_t _tuples[NrCodes];
+};
 
 template <class Key, class HashKey = HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
           class Fingerprint = HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
           class HashShort = HashWithSeed<uint16_t, 0xfedcbafedcba4321ULL>,
-          class CompKey = std::equal_to<Key>>
+          class CompKey = std::equal_to<Key>, uint32_t SlotsPerBucket = 4,
+          uint32_t FingerprintBits = 16, bool SemiSorted = false>
 class CuckooFilter {
-  // Note that the following has to be a power of two and at least 4!
-  static constexpr uint32_t SlotsPerBucket = 4;
+  static_assert(SlotsPerBucket >= 4 && SlotsPerBucket <= 256 &&
+                    (SlotsPerBucket & (SlotsPerBucket - 1)) == 0,
+                "SlotsPerBucket must be a power of two of at least 4");
+  static_assert(FingerprintBits >= 4 && FingerprintBits <= 32,
+                "FingerprintBits must be between 4 and 32");
+  static_assert(!SemiSorted || SlotsPerBucket == 4,
+                "semi-sorted buckets need 4 slots per bucket");
+
+  static constexpr uint32_t FingerprintMask =
+      static_cast<uint32_t>((1ULL << FingerprintBits) - 1);
+  static constexpr uint32_t LowBits = FingerprintBits - 4;  // if SemiSorted
+  static constexpr uint64_t BucketBits =
+      SemiSorted ? 12 + 4 * LowBits : SlotsPerBucket * FingerprintBits;
+  // number of keys whose buckets are prefetched together in lookupBatch
+  static constexpr size_t BatchSize = 16;
+  // bound for the number of cuckoo rounds on insertion, a filter which
+  // needs more is practically full
+  static constexpr uint64_t MaxKicks = 500;
 
  public:
-  CuckooFilter(bool useMmap, uint64_t size)
+  CuckooFilter(bool useMmap, uint64_t size,
+               AllocationPolicy const& policy = AllocationPolicy())
       : _randState(0x2636283625154737ULL),
-        _slotSize(sizeof(uint16_t)), // Sort out offsets and alignments
-        _useMmap(useMmap) { 
+        _useMmap(useMmap),
+        _nrUsed(0),
+        _codec(SemiSorted ? &SemiSortedCodec::instance() : nullptr) {
 
     // Inflate size so that we have some padding to avoid failure
     size *= 2.0;
@@ -71,68 +139,39 @@ class CuckooFilter {
     }
     _sizeMask = _niceSize - 1;
     _sizeShift = (64 - _logSize) / 2;
-    _maxRounds = _size;  // TODO: tune this
-    _allocSize = _size * _slotSize * SlotsPerBucket +
+    _maxRounds = (_size < MaxKicks) ? _size : MaxKicks;
+    _allocSize = dataSize() +
                  64;  // give 64 bytes padding to enable 64-byte alignment
 
-    if (_useMmap) {
-      char* namePicked = std::tmpnam(_tmpFileName);
-      if (namePicked == nullptr) {
-        throw;
-      }
-      _tmpFile = open(_tmpFileName, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600);
-      if (_tmpFile == -1) {
-        throw;
-      }
-      try {
-        int result = lseek(_tmpFile, _allocSize - 1, SEEK_SET);
-        if (result == -1) {
-          throw;
-        }
-        result = write(_tmpFile, "", 1);  // make the file a certain size
-        if (result == -1) {
-          throw;
-        }
-
-        _allocBase = reinterpret_cast<char*>(mmap(nullptr, _allocSize,
-                                                  PROT_READ | PROT_WRITE,
-                                                  MAP_SHARED, _tmpFile, 0));
-        if (_allocBase == MAP_FAILED) {
-          std::cout << "MAP_FAILED in filter" << std::endl;
-          throw;
-        }
-      } catch (...) {
-        close(_tmpFile);
-        std::remove(_tmpFileName);
-      }
-      _base = _allocBase;
-    } else {
-      _allocBase = new char[_allocSize];
-
-      _base = reinterpret_cast<char*>(
-          (reinterpret_cast<uintptr_t>(_allocBase) + 63) &
-          ~((uintptr_t)0x3fu));  // to actually implement the 64-byte alignment,
-                                 // shift base pointer within allocated space to
-                                 // 64-byte boundary
-    }
-
-    // Now initialize all slots in all buckets with zero data:
-    for (uint32_t b = 0; b < _size; ++b) {
-      for (size_t i = 0; i < SlotsPerBucket; ++i) {
-        uint16_t* f = findSlot(b, i);
-        *f = 0;  //
-      }
-    }
+    // Zeroed memory has all fingerprints 0, that is, all slots empty (also
+    // semi-sorted, code 0 is four times 0), without touching the pages here:
+    _memory.allocate(_allocSize, _useMmap, policy, true);
+    _base = _memory.base();
   }
 
-  ~CuckooFilter() {
-    if (_useMmap) {
-      munmap(_allocBase, _allocSize);
-      close(_tmpFile);
-      std::remove(_tmpFileName);
-    } else {
-      delete[] _allocBase;
+  CuckooFilter(char const* fileName, PersistentMode mode)
+      : _randState(0x2636283625154737ULL),
+        _useMmap(true),
+        _nrUsed(0),
+        _codec(SemiSorted ? &SemiSortedCodec::instance() : nullptr) {
+    // attach to a filter written by save(), with ReadOnly the filter must
+    // not be changed
+    PersistentHeader header;
+    _memory.attach(fileName, mode, header);
+    _size = header.size;
+    _logSize = header.extra;
+    if (_logSize >= 64 || (1ULL << _logSize) < _size) {
+      throw std::runtime_error("persistent file does not match the type");
     }
+    _niceSize = 1ULL << _logSize;
+    _sizeMask = _niceSize - 1;
+    _sizeShift = (64 - _logSize) / 2;
+    _maxRounds = (_size < MaxKicks) ? _size : MaxKicks;
+    checkPersistentHeader(header, persistentHeader(), dataSize(),
+                          _memory.size());
+    _allocSize = _memory.size();
+    _base = _memory.base();
+    _nrUsed = header.nrUsed;
   }
 
   CuckooFilter(CuckooFilter const&) = delete;
@@ -143,30 +182,58 @@ class CuckooFilter {
   bool lookup(Key const& k) const {
     // look up a key, return either false if no pair with key k is
     // found or true.
-    uint64_t hash1 = _hasherKey(k);
+    uint64_t hash1, hashFingerprint;
+    DualHash<Key, HashKey, Fingerprint>::compute(_hasherKey, _fingerprint, k,
+                                                 &hash1, &hashFingerprint);
+    return lookup(hash1, hashFingerprint);
+  }
+
+  bool lookup(uint64_t hash1, uint64_t hashFingerprint) const {
+    // as above, but with the values of HashKey and Fingerprint for the key
+    // already computed by the caller.
     uint64_t pos1 = hashToPos(hash1);
-    uint16_t fingerprint = keyToFingerprint(k);
-    // We compute the second hash already here to allow the result to
+    uint32_t fingerprint = hashToFingerprint(hashFingerprint);
+    // We compute the second position already here to allow the result to
     // survive a mispredicted branch in the first loop. Is this sensible?
-    uint64_t hash2 = _hasherPosFingerprint(pos1, fingerprint);
-    uint64_t pos2 = hashToPos(hash2);
+    uint64_t pos2 = alternativePos(pos1, fingerprint);
+    return probe(pos1, pos2, fingerprint);
+  }
 
-    for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
-      uint16_t* fTable = findSlot(pos1, i);
-      if (fingerprint == *fTable) {
-        return true;
+  size_t lookupBatch(Key const* keys, size_t n, uint64_t* hits) const {
+    // look up n keys and set bit i % 64 of hits[i / 64] if keys[i] might be
+    // in the filter and clear it otherwise, hits must have room for
+    // (n + 63) / 64 words. The keys are hashed and the buckets of a group of
+    // keys are prefetched before the first of them is probed, such that
+    // the cache misses of the group overlap. Returns the number of hits.
+    std::memset(hits, 0, ((n + 63) / 64) * sizeof(uint64_t));
+    uint64_t pos1[BatchSize];
+    uint64_t pos2[BatchSize];
+    uint32_t fingerprints[BatchSize];
+    size_t nrHits = 0;
+    for (size_t start = 0; start < n; start += BatchSize) {
+      size_t count = (n - start < BatchSize) ? n - start : BatchSize;
+      // hashing has no dependencies between the keys, keep it apart from
+      // the probes:
+      for (size_t j = 0; j < count; ++j) {
+        hashKey(keys[start + j], &pos1[j], &fingerprints[j]);
       }
-    }
-    for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
-      uint16_t* fTable = findSlot(pos2, i);
-      if (fingerprint == *fTable) {
-        return true;
+      for (size_t j = 0; j < count; ++j) {
+        pos2[j] = alternativePos(pos1[j], fingerprints[j]);
+        __builtin_prefetch(_base + pos1[j] * BucketBits / 8, 0, 3);
+        __builtin_prefetch(_base + pos2[j] * BucketBits / 8, 0, 3);
+      }
+      for (size_t j = 0; j < count; ++j) {
+        if (probe(pos1[j], pos2[j], fingerprints[j])) {
+          size_t i = start + j;
+          hits[i / 64] |= 1ULL << (i % 64);
+          ++nrHits;
+        }
       }
     }
-    return false;
+    return nrHits;
   }
 
-  bool insert(Key& k) {
+  bool insert(Key const& k) {
     // insert the key k
     //
     // The inserted key will have its fingerprint input entered in the table. If
@@ -174,59 +241,39 @@ class CuckooFilter {
     // number of attempts will be made. After that, a given fingerprint may
     // simply be expunged. If something is expunged, the function will return
     // false, otherwise true.
-    uint16_t* fTable;
-
-    uint64_t hash1 = _hasherKey(k);
-    uint64_t pos1 = hashToPos(hash1);
-    uint16_t fingerprint = keyToFingerprint(k);
-    // We compute the second hash already here to let it survive a
-    // mispredicted
-    // branch in the first loop:
-    uint64_t hash2 = _hasherPosFingerprint(pos1, fingerprint);
-    uint64_t pos2 = hashToPos(hash2);
-
-    for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
-      fTable = findSlot(pos1, i);
-      if (!*fTable) {
-        *fTable = fingerprint;
-        ++_nrUsed;
-        return true;
-      }
-    }
-    for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
-      fTable = findSlot(pos2, i);
-      if (!*fTable) {
-        *fTable = fingerprint;
-        ++_nrUsed;
-        return true;
-      }
+    uint64_t pos1;
+    uint32_t fingerprint;
+    hashKey(k, &pos1, &fingerprint);
+    uint64_t pos2 = alternativePos(pos1, fingerprint);
+
+    if (insertIntoBucket(pos1, fingerprint) ||
+        insertIntoBucket(pos2, fingerprint)) {
+      ++_nrUsed;
+      return true;
     }
 
     uint8_t r = pseudoRandomChoice();
     if ((r & 1) != 0) {
       std::swap(pos1, pos2);
     }
+    uint32_t bucket[SlotsPerBucket];
     for (unsigned attempt = 0; attempt < _maxRounds; attempt++) {
       std::swap(pos1, pos2);
       // Now expunge a random element from any of these slots:
       r = pseudoRandomChoice();
       uint64_t i = r & (SlotsPerBucket - 1);
-      // We expunge the element at position pos1 and slot i:
-      fTable = findSlot(pos1, i);
-      uint16_t fDummy = *fTable;
-      *fTable = fingerprint;
+      // We expunge the element at position pos1 and slot i, it goes to its
+      // other bucket:
+      loadBucket(pos1, bucket);
+      uint32_t fDummy = bucket[i];
+      bucket[i] = fingerprint;
+      storeBucket(pos1, bucket);
       fingerprint = fDummy;
 
-      hash2 = _hasherPosFingerprint(pos1, fingerprint);
-      pos2 = hashToPos(hash2);
-
-      for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
-        fTable = findSlot(pos2, i);
-        if (!*fTable) {
-          *fTable = fingerprint;
-          ++_nrUsed;
-          return true;
-        }
+      pos2 = alternativePos(pos1, fingerprint);
+      if (insertIntoBucket(pos2, fingerprint)) {
+        ++_nrUsed;
+        return true;
       }
     }
 
@@ -236,45 +283,235 @@ class CuckooFilter {
   bool remove(Key const& k) {
     // remove one element with key k, if one is in the table. Return true if
     // a key was removed and false otherwise.
-    // look up a key, return either false if no pair with key k is
-    // found or true.
-    uint64_t hash1 = _hasherKey(k);
-    uint64_t pos1 = hashToPos(hash1);
-    uint16_t fingerprint = keyToFingerprint(k);
-    // We compute the second hash already here to allow the result to
-    // survive a mispredicted branch in the first loop. Is this sensible?
-    uint64_t hash2 = _hasherPosFingerprint(pos1, fingerprint);
-    uint64_t pos2 = hashToPos(hash2);
-    for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
-      uint16_t* fTable = findSlot(pos1, i);
-      if (fingerprint == *fTable) {
-        *fTable = 0;
-        _nrUsed--;
-        return true;
-      }
-    }
-    for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
-      uint16_t* fTable = findSlot(pos2, i);
-      if (fingerprint == *fTable) {
-        *fTable = 0;
-        _nrUsed--;
-        return true;
-      }
+    uint64_t pos1;
+    uint32_t fingerprint;
+    hashKey(k, &pos1, &fingerprint);
+    uint64_t pos2 = alternativePos(pos1, fingerprint);
+    if (removeFromBucket(pos1, fingerprint) ||
+        removeFromBucket(pos2, fingerprint)) {
+      _nrUsed--;
+      return true;
     }
     return false;
   }
 
+  void prefetch(uint64_t hash1, uint64_t hashFingerprint) const {
+    // issue prefetches for both buckets a later lookup will probe.
+    uint64_t pos1 = hashToPos(hash1);
+    uint32_t fingerprint = hashToFingerprint(hashFingerprint);
+    uint64_t pos2 = alternativePos(pos1, fingerprint);
+    __builtin_prefetch(_base + pos1 * BucketBits / 8, 0, 3);
+    __builtin_prefetch(_base + pos2 * BucketBits / 8, 0, 3);
+  }
+
   uint64_t capacity() const { return _size * SlotsPerBucket; }
 
   uint64_t nrUsed() const { return _nrUsed; }
 
   uint64_t memoryUsage() const { return sizeof(CuckooFilter) + _allocSize; }
 
+  bool save(char const* fileName) const {
+    // write the filter to fileName, such that it can be attached to again
+    // with the constructor taking a file name, return whether this was
+    // successful
+    return writePersistentFile(fileName, persistentHeader(), _base,
+                               dataSize());
+  }
+
  private:  // methods
-  uint16_t* findSlot(uint64_t pos, uint64_t slot) const {
-    char* address = _base + _slotSize * (pos * SlotsPerBucket + slot);
-    auto ret = reinterpret_cast<uint16_t*>(address);
-    return ret;
+  uint64_t dataSize() const {
+    // packed buckets and 8 bytes, such that every slot can be accessed
+    // with a 64-bit word
+    return (_size * BucketBits + 7) / 8 + 8;
+  }
+
+  PersistentHeader persistentHeader() const {
+    PersistentHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "CUCKOOF1", sizeof(header.magic));
+    header.version = 2;  // symmetric buckets, packed fingerprints
+    header.flags = SemiSorted ? 1 : 0;
+    header.size = _size;
+    header.nrUsed = _nrUsed;
+    Key probe;  // all bytes zero, to not depend on padding
+    std::memset(static_cast<void*>(&probe), 0, sizeof(Key));
+    header.hashCheck = _hasherKey(probe) ^ (_fingerprint(probe) << 1) ^
+                       (_hasherShort(0x1234) << 2);
+    header.keySize = sizeof(Key);
+    header.slotSize = FingerprintBits;  // in bits
+    header.valueSize = SlotsPerBucket;  // filters have no values
+    header.extra = _logSize;
+    return header;
+  }
+
+  uint64_t readBits(uint64_t bit, uint32_t n) const {
+    // n <= 32 bits starting at bit offset bit
+    uint64_t word;
+    std::memcpy(&word, _base + (bit >> 3), sizeof(word));
+    return (word >> (bit & 7)) & ((1ULL << n) - 1);
+  }
+
+  void writeBits(uint64_t bit, uint32_t n, uint64_t value) {
+    uint64_t word;
+    std::memcpy(&word, _base + (bit >> 3), sizeof(word));
+    uint64_t mask = ((1ULL << n) - 1) << (bit & 7);
+    word = (word & ~mask) | ((value << (bit & 7)) & mask);
+    std::memcpy(_base + (bit >> 3), &word, sizeof(word));
+  }
+
+  uint32_t getSlot(uint64_t pos, uint64_t slot) const {
+    // without SemiSorted, whole bytes are read directly
+    uint64_t bit = (pos * SlotsPerBucket + slot) * FingerprintBits;
+    char const* address = _base + bit / 8;
+    if (FingerprintBits == 8) {
+      return *reinterpret_cast<uint8_t const*>(address);
+    } else if (FingerprintBits == 16) {
+      uint16_t f;
+      std::memcpy(&f, address, sizeof(f));
+      return f;
+    } else if (FingerprintBits == 32) {
+      uint32_t f;
+      std::memcpy(&f, address, sizeof(f));
+      return f;
+    }
+    return static_cast<uint32_t>(readBits(bit, FingerprintBits));
+  }
+
+  void setSlot(uint64_t pos, uint64_t slot, uint32_t fingerprint) {
+    uint64_t bit = (pos * SlotsPerBucket + slot) * FingerprintBits;
+    char* address = _base + bit / 8;
+    if (FingerprintBits == 8) {
+      *reinterpret_cast<uint8_t*>(address) = static_cast<uint8_t>(fingerprint);
+    } else if (FingerprintBits == 16) {
+      uint16_t f = static_cast<uint16_t>(fingerprint);
+      std::memcpy(address, &f, sizeof(f));
+    } else if (FingerprintBits == 32) {
+      std::memcpy(address, &fingerprint, sizeof(fingerprint));
+    } else {
+      writeBits(bit, FingerprintBits, fingerprint);
+    }
+  }
+
+  void loadBucket(uint64_t pos, uint32_t* fingerprints) const {
+    if (!SemiSorted) {
+      for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
+        fingerprints[i] = getSlot(pos, i);
+      }
+      return;
+    }
+    uint64_t bit = pos * BucketBits;
+    uint16_t high = _codec->decode(static_cast<uint32_t>(readBits(bit, 12)));
+    bit += 12;
+    for (uint32_t i = 0; i < 4; ++i) {
+      uint32_t low = static_cast<uint32_t>(readBits(bit + i * LowBits, LowBits));
+      fingerprints[i] = (((high >> (12 - 4 * i)) & 0xfu) << LowBits) | low;
+    }
+  }
+
+  void storeBucket(uint64_t pos, uint32_t* fingerprints) {
+    // the order of the slots is not kept with SemiSorted
+    if (!SemiSorted) {
+      for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
+        setSlot(pos, i, fingerprints[i]);
+      }
+      return;
+    }
+    std::sort(fingerprints, fingerprints + 4);
+    uint16_t high = 0;
+    for (uint32_t i = 0; i < 4; ++i) {
+      high = static_cast<uint16_t>((high << 4) | (fingerprints[i] >> LowBits));
+    }
+    uint64_t bit = pos * BucketBits;
+    writeBits(bit, 12, _codec->encode(high));
+    bit += 12;
+    for (uint32_t i = 0; i < 4; ++i) {
+      writeBits(bit + i * LowBits, LowBits,
+                fingerprints[i] & ((1u << LowBits) - 1));
+    }
+  }
+
+  bool probe(uint64_t pos1, uint64_t pos2, uint32_t fingerprint) const {
+    // whether fingerprint is in one of the buckets, buckets of 4 fingerprints
+    // of 8 or 16 bits are compared at once
+    if (!SemiSorted && SlotsPerBucket == 4 && FingerprintBits == 16) {
+      uint64_t w1, w2;
+      std::memcpy(&w1, _base + pos1 * 8, sizeof(w1));
+      std::memcpy(&w2, _base + pos2 * 8, sizeof(w2));
+      return anyLaneEquals16(w1, w2, static_cast<uint16_t>(fingerprint));
+    }
+    if (!SemiSorted && SlotsPerBucket == 4 && FingerprintBits == 8) {
+      uint32_t w1, w2;
+      std::memcpy(&w1, _base + pos1 * 4, sizeof(w1));
+      std::memcpy(&w2, _base + pos2 * 4, sizeof(w2));
+      return matchTagBytes(static_cast<uint64_t>(w1) |
+                               (static_cast<uint64_t>(w2) << 32),
+                           static_cast<uint8_t>(fingerprint)) != 0;
+    }
+    return findInBucket(pos1, fingerprint) >= 0 ||
+           findInBucket(pos2, fingerprint) >= 0;
+  }
+
+  int findInBucket(uint64_t pos, uint32_t fingerprint) const {
+    // slot of fingerprint in bucket pos, or -1
+    if (!SemiSorted) {
+      for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
+        if (getSlot(pos, i) == fingerprint) {
+          return static_cast<int>(i);
+        }
+      }
+      return -1;
+    }
+    uint32_t bucket[SlotsPerBucket];
+    loadBucket(pos, bucket);
+    for (uint32_t i = 0; i < SlotsPerBucket; ++i) {
+      if (bucket[i] == fingerprint) {
+        return static_cast<int>(i);
+      }
+    }
+    return -1;
+  }
+
+  bool insertIntoBucket(uint64_t pos, uint32_t fingerprint) {
+    // put fingerprint into a free slot of bucket pos, if there is one
+    if (!SemiSorted) {
+      int i = findInBucket(pos, 0);
+      if (i < 0) {
+        return false;
+      }
+      setSlot(pos, i, fingerprint);
+      return true;
+    }
+    uint32_t bucket[SlotsPerBucket];
+    loadBucket(pos, bucket);
+    for (uint32_t i = 0; i < SlotsPerBucket; ++i) {
+      if (bucket[i] == 0) {
+        bucket[i] = fingerprint;
+        storeBucket(pos, bucket);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool removeFromBucket(uint64_t pos, uint32_t fingerprint) {
+    if (!SemiSorted) {
+      int i = findInBucket(pos, fingerprint);
+      if (i < 0) {
+        return false;
+      }
+      setSlot(pos, i, 0);
+      return true;
+    }
+    uint32_t bucket[SlotsPerBucket];
+    loadBucket(pos, bucket);
+    for (uint32_t i = 0; i < SlotsPerBucket; ++i) {
+      if (bucket[i] == fingerprint) {
+        bucket[i] = 0;
+        storeBucket(pos, bucket);
+        return true;
+      }
+    }
+    return false;
   }
 
   uint64_t hashToPos(uint64_t hash) const {
@@ -282,15 +519,37 @@ class CuckooFilter {
     return ((relevantBits < _size) ? relevantBits : (relevantBits - _size));
   }
 
-  uint16_t keyToFingerprint(Key const& k) const {
-    uint64_t hash = _fingerprint(k);
-    uint16_t fingerprint = (uint16_t)(
-        (hash ^ (hash >> 16) ^ (hash >> 32) ^ (hash >> 48)) & 0xFFFF);
+  void hashKey(Key const& k, uint64_t* pos, uint32_t* fingerprint) const {
+    // first bucket and fingerprint of k, see DualHash
+    uint64_t hash1, hashFingerprint;
+    DualHash<Key, HashKey, Fingerprint>::compute(_hasherKey, _fingerprint, k,
+                                                 &hash1, &hashFingerprint);
+    *pos = hashToPos(hash1);
+    *fingerprint = hashToFingerprint(hashFingerprint);
+  }
+
+  uint32_t hashToFingerprint(uint64_t hash) const {
+    // fold all bits of the hash into FingerprintBits, 0 marks empty slots
+    uint64_t folded = hash;
+    for (uint32_t shift = FingerprintBits; shift < 64;
+         shift += FingerprintBits) {
+      folded ^= hash >> shift;
+    }
+    uint32_t fingerprint = static_cast<uint32_t>(folded) & FingerprintMask;
     return (fingerprint ? fingerprint : 1);
   }
 
-  uint64_t _hasherPosFingerprint(uint64_t pos, uint16_t fingerprint) const {
-    return ((pos << _sizeShift) ^ _hasherShort(fingerprint));
+  uint64_t alternativePos(uint64_t pos, uint32_t fingerprint) const {
+    // the other bucket of a fingerprint in bucket pos, this is symmetric,
+    // alternativePos(alternativePos(pos, f), f) == pos, because it
+    // subtracts pos from a bucket h chosen by the fingerprint, modulo _size
+    uint64_t hash = _hasherShort(static_cast<uint16_t>(fingerprint));
+    if (FingerprintBits > 16) {
+      hash ^= _hasherShort(static_cast<uint16_t>(fingerprint >> 16)) << 1;
+    }
+    uint64_t h = static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(hash) * _size) >> 64);
+    return (h >= pos) ? h - pos : h + _size - pos;
   }
 
   uint8_t pseudoRandomChoice() {
@@ -301,23 +560,19 @@ class CuckooFilter {
  private:               // member variables
   uint64_t _randState;  // pseudo random state for expunging
 
-  size_t _slotSize;  // total size of a slot
-
   uint64_t _logSize;    // logarithm (base 2) of number of buckets
   uint64_t _size;       // actual number of buckets
   uint64_t _niceSize;   // smallest power of 2 at least number of buckets, ==
                         // 2^_logSize
   uint64_t _sizeMask;   // used to mask out some bits from the hash
   uint32_t _sizeShift;  // used to shift the bits down to get a position
-  uint64_t _allocSize;  // number of allocated bytes,
-                        // == _size * SlotsPerBucket * _slotSize + 64
+  uint64_t _allocSize;  // number of allocated bytes, == dataSize() + 64
   bool _useMmap;
+  TableMemory _memory;  // owns the slots
   char* _base;  // pointer to allocated space, 64-byte aligned
-  char _tmpFileName[L_tmpnam + 1];
-  int _tmpFile;
-  char* _allocBase;     // base of original allocation
   uint64_t _nrUsed;     // number of pairs stored in the table
   unsigned _maxRounds;  // maximum number of cuckoo rounds on insertion
+  SemiSortedCodec const* _codec;  // only with SemiSorted
 
   HashKey _hasherKey;        // Instance to compute the first hash function
   Fingerprint _fingerprint;  // Instance to compute a fingerprint of a key
@@ -1,8 +1,49 @@
 #ifndef CUCKOO_HELPERS_H
 #define CUCKOO_HELPERS_H 1
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#include <atomic>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifndef CUCKOO_MAP_ANON
+#ifdef MAP_ANONYMOUS
+#define CUCKOO_MAP_ANON MAP_ANONYMOUS
+#elif MAP_ANON
+#define CUCKOO_MAP_ANON MAP_ANON
+#endif
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define CUCKOO_MAP_CRC32C 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CUCKOO_MAP_CRC32C 1
+#else
+#define CUCKOO_MAP_CRC32C 0
+#endif
 
 // For fasthash64:
 static inline uint64_t mix(uint64_t h) {
@@ -64,6 +105,262 @@ class HashWithSeed {
   }
 };
 
+// Alternative hash functions. All of them can also compute 128 bits at once
+// for FirstOf128 and SecondOf128 below, such that both hash values of a key
+// for a CuckooMap take a single pass over the key.
+
+// Multiply two words to 128 bits and fold the halves together, as in XXH3:
+static inline uint64_t mulFold64(uint64_t a, uint64_t b) {
+  unsigned __int128 p = static_cast<unsigned __int128>(a) * b;
+  return static_cast<uint64_t>(p) ^ static_cast<uint64_t>(p >> 64);
+}
+
+// The finalizer of splitmix64, a bijection with good avalanche:
+static inline uint64_t splitmix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// The shorter final mix of XXH3:
+static inline uint64_t avalanche64(uint64_t h) {
+  h ^= h >> 37;
+  h *= 0x165667919e3779f9ULL;
+  return h ^ (h >> 32);
+}
+
+// A hash in the style of XXH3: 16 bytes per step go into two independent
+// accumulators with one 128-bit multiplication each, the tail is zero
+// padded. *low and *high come from one accumulator each, so that the
+// compiler drops the second one if only *low is used.
+static inline void foldhash128(const void* buf, size_t len, uint64_t seed,
+                               uint64_t* low, uint64_t* high) {
+  uint64_t const k1 = 0x9e3779b185ebca87ULL;
+  uint64_t const k2 = 0xc2b2ae3d27d4eb4fULL;
+  uint64_t const k3 = 0x165667b19e3779f9ULL;
+  uint64_t const k4 = 0x27d4eb2f165667c5ULL;
+  unsigned char const* pos = static_cast<unsigned char const*>(buf);
+  uint64_t acc1 = seed ^ (len * k3);
+  uint64_t acc2 = (seed + k4) ^ (len * k1);
+  do {
+    uint64_t a = 0;
+    uint64_t b = 0;
+    size_t n = (len < 16) ? len : 16;
+    std::memcpy(&a, pos, (n < 8) ? n : 8);
+    if (n > 8) {
+      std::memcpy(&b, pos + 8, n - 8);
+    }
+    acc1 = mulFold64(a ^ acc1 ^ k1, b ^ k2);
+    acc2 = mulFold64(b ^ acc2 ^ k3, a ^ k4);
+    pos += n;
+    len -= n;
+  } while (len > 0);
+  *low = avalanche64(acc1);
+  *high = avalanche64(acc2);
+}
+
+static inline uint64_t foldhash64(const void* buf, size_t len, uint64_t seed) {
+  uint64_t low, high;
+  foldhash128(buf, len, seed, &low, &high);
+  return low;
+}
+
+// A hash based on the CRC32C instruction (SSE 4.2 or ARMv8 CRC): two CRCs
+// per word are combined into 64 bits, *high is a second mixture of them.
+// A CRC is linear, so a second CRC of the same words would be the same
+// function again; the second one gets every word multiplied by an odd
+// constant after adding the seed, which is not linear, such that keys
+// which agree in one CRC do not agree in the other, and that depends on
+// the seed. Without the instruction this is foldhash128.
+static inline void crc32chash128(const void* buf, size_t len, uint64_t seed,
+                                 uint64_t* low, uint64_t* high) {
+#if CUCKOO_MAP_CRC32C
+  unsigned char const* pos = static_cast<unsigned char const*>(buf);
+  uint32_t c1 = static_cast<uint32_t>(seed);
+  uint32_t c2 = static_cast<uint32_t>(seed >> 32) ^ 0x9e3779b9u;
+  uint64_t lengthWord = len;
+  while (true) {
+    uint64_t w = 0;
+    size_t n = (len < 8) ? len : 8;
+    std::memcpy(&w, pos, n);
+    uint64_t m = ((w ^ lengthWord) + seed) * 0x9e3779b97f4a7c15ULL;
+#if defined(__SSE4_2__)
+    c1 = static_cast<uint32_t>(_mm_crc32_u64(c1, w));
+    c2 = static_cast<uint32_t>(_mm_crc32_u64(c2, m));
+#else
+    c1 = __crc32cd(c1, w);
+    c2 = __crc32cd(c2, m);
+#endif
+    pos += n;
+    len -= n;
+    if (len == 0) {
+      break;
+    }
+  }
+  uint64_t h = (static_cast<uint64_t>(c1) << 32) | c2;
+  *low = avalanche64(h);
+  *high = avalanche64(h ^ 0xc2b2ae3d27d4eb4fULL);
+#else
+  foldhash128(buf, len, seed, low, high);
+#endif
+}
+
+// C++ wrappers for these, with the same interface as HashWithSeed:
+template <class T, uint64_t Seed>
+class HashFold {
+ public:
+  uint64_t operator()(T const& t) const {
+    return foldhash64(&t, sizeof(T), Seed);
+  }
+  void operator()(T const& t, uint64_t* first, uint64_t* second) const {
+    foldhash128(&t, sizeof(T), Seed, first, second);
+  }
+};
+
+template <class T, uint64_t Seed>
+class HashCrc32c {
+ public:
+  uint64_t operator()(T const& t) const {
+    uint64_t low, high;
+    crc32chash128(&t, sizeof(T), Seed, &low, &high);
+    return low;
+  }
+  void operator()(T const& t, uint64_t* first, uint64_t* second) const {
+    crc32chash128(&t, sizeof(T), Seed, first, second);
+  }
+};
+
+// For keys of 4, 8 or 16 bytes which are plain integers or structs of
+// them without padding: no loop, only one or two rounds of splitmix64.
+// The second half of the 128 bits is one more mix of the first.
+template <class T, uint64_t Seed>
+class HashInteger {
+  static_assert(sizeof(T) == 4 || sizeof(T) == 8 || sizeof(T) == 16,
+                "HashInteger needs keys of 4, 8 or 16 bytes");
+
+ public:
+  uint64_t operator()(T const& t) const {
+    uint64_t words[2] = {0, 0};
+    std::memcpy(words, &t, sizeof(T));
+    uint64_t h = splitmix64(words[0] ^ Seed);
+    if (sizeof(T) == 16) {
+      h = splitmix64(h ^ words[1]);
+    }
+    return h;
+  }
+  void operator()(T const& t, uint64_t* first, uint64_t* second) const {
+    *first = (*this)(t);
+    *second = avalanche64(*first ^ 0x9e3779b97f4a7c15ULL);
+  }
+};
+
+// Hash functions for CuckooMap (HashKey1, HashKey2) and CuckooFilter
+// (HashKey, Fingerprint) taking the two halves of one 128-bit hash. Used
+// as a pair, as in
+//   CuckooMap<Key, Value, FirstOf128<Key, HashFold<Key, 1>>,
+//             SecondOf128<Key, HashFold<Key, 1>>>,
+// both are computed together, see DualHash:
+template <class T, class Hash128>
+class FirstOf128 {
+ public:
+  template <class K>
+  uint64_t operator()(K const& t) const {
+    uint64_t first, second;
+    _hash(t, &first, &second);
+    return first;
+  }
+  Hash128 const& hash128() const { return _hash; }
+
+ private:
+  Hash128 _hash;
+};
+
+template <class T, class Hash128>
+class SecondOf128 {
+ public:
+  template <class K>
+  uint64_t operator()(K const& t) const {
+    uint64_t first, second;
+    _hash(t, &first, &second);
+    return second;
+  }
+
+ private:
+  Hash128 _hash;
+};
+
+// Compute both hash values of a key, with one computation for a matching
+// FirstOf128 and SecondOf128 and with two otherwise. The key may also be of
+// another type than T which the hash functions accept, see the transparent
+// lookups of CuckooMap:
+template <class T, class Hash1, class Hash2>
+struct DualHash {
+  template <class K>
+  static void compute(Hash1 const& hash1, Hash2 const& hash2, K const& t,
+                      uint64_t* first, uint64_t* second) {
+    *first = hash1(t);
+    *second = hash2(t);
+  }
+};
+
+template <class T, class Hash128>
+struct DualHash<T, FirstOf128<T, Hash128>, SecondOf128<T, Hash128>> {
+  template <class K>
+  static void compute(FirstOf128<T, Hash128> const& hash1,
+                      SecondOf128<T, Hash128> const&, K const& t,
+                      uint64_t* first, uint64_t* second) {
+    hash1.hash128()(t, first, second);
+  }
+};
+
+// Compare the 8 bytes in word against tag, returning a mask with bit i
+// set if and only if byte i of word (in memory order) equals tag:
+static inline uint32_t matchTagBytes(uint64_t word, uint8_t tag) {
+#if defined(__SSE2__)
+  __m128i v = _mm_set_epi64x(0, static_cast<long long>(word));
+  __m128i eq = _mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(tag)));
+  return static_cast<uint32_t>(_mm_movemask_epi8(eq)) & 0xffu;
+#else
+  uint64_t t;
+#if defined(__ARM_NEON)
+  uint8x8_t eq = vceq_u8(vcreate_u8(word), vdup_n_u8(tag));
+  t = vget_lane_u64(vreinterpret_u64_u8(eq), 0) & 0x8080808080808080ULL;
+#else
+  // Exact per-byte zero test on word ^ broadcast(tag), no borrows between
+  // the bytes, the top bit of each byte is set if the byte matched:
+  uint64_t const low7 = 0x7f7f7f7f7f7f7f7fULL;
+  uint64_t x = word ^ (0x0101010101010101ULL * tag);
+  t = ~(((x & low7) + low7) | x | low7);
+#endif
+  // Gather the top bits of all bytes into the top byte:
+  return static_cast<uint32_t>(((t >> 7) * 0x0102040810204080ULL) >> 56);
+#endif
+}
+
+// Whether any of the eight 16-bit lanes of word1 and word2 equals value,
+// in one 128-bit compare where available:
+static inline bool anyLaneEquals16(uint64_t word1, uint64_t word2,
+                                   uint16_t value) {
+#if defined(__SSE2__)
+  __m128i v = _mm_set_epi64x(static_cast<long long>(word2),
+                             static_cast<long long>(word1));
+  __m128i eq = _mm_cmpeq_epi16(v, _mm_set1_epi16(static_cast<short>(value)));
+  return _mm_movemask_epi8(eq) != 0;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  uint16x8_t v = vreinterpretq_u16_u64(
+      vcombine_u64(vcreate_u64(word1), vcreate_u64(word2)));
+  return vmaxvq_u16(vceqq_u16(v, vdupq_n_u16(value))) != 0;
+#else
+  // A lane of x is zero if and only if it matched, and the classic test
+  // for a zero lane is exact as to whether there is one:
+  uint64_t const ones = 0x0001000100010001ULL;
+  uint64_t const highs = 0x8000800080008000ULL;
+  uint64_t x1 = word1 ^ (ones * value);
+  uint64_t x2 = word2 ^ (ones * value);
+  return (((x1 - ones) & ~x1) | ((x2 - ones) & ~x2)) & highs;
+#endif
+}
+
 class MyMutexGuard {
   std::mutex& _mutex;
   bool _locked;
@@ -83,4 +380,493 @@ class MyMutexGuard {
   }
 };
 
+// Striped version counters for optimistic (seqlock style) readers. Stripe
+// s guards all buckets whose index is s modulo the number of stripes, in
+// every table using this object. A writer makes the stripes of all buckets
+// it changes odd before touching them (writeBegin) and even again once the
+// whole operation is finished (writeEndAll), such that a pair in transit
+// between two buckets or tables is covered for the whole operation. Readers
+// remember the even versions of the stripes they probed (readBegin) and
+// check afterwards that none of them has changed (readValidate).
+// writeBegin and writeEndAll must only be called by one thread at a time.
+// Alternatively, the stripes can be used as striped spin locks by several
+// concurrent writers (lock and unlock), which then exclude each other on a
+// stripe and are seen as writers by the readers. The two ways of writing
+// must not be mixed at the same time.
+
+class VersionStripes {
+  std::unique_ptr<std::atomic<uint32_t>[]> _versions;
+  uint64_t _mask;
+  std::vector<uint64_t> _held;  // stripes made odd by the current writer
+
+ public:
+  explicit VersionStripes(uint32_t logNrStripes = 12)
+      : _versions(new std::atomic<uint32_t>[1ULL << logNrStripes]),
+        _mask((1ULL << logNrStripes) - 1) {
+    for (uint64_t s = 0; s <= _mask; ++s) {
+      _versions[s].store(0, std::memory_order_relaxed);
+    }
+    _held.reserve(64);
+  }
+
+  uint64_t stripe(uint64_t pos) const { return pos & _mask; }
+
+  uint64_t memoryUsage() const {
+    return sizeof(VersionStripes) +
+           (_mask + 1) * sizeof(std::atomic<uint32_t>) +
+           _held.capacity() * sizeof(uint64_t);
+  }
+
+  uint32_t readBegin(uint64_t s) const {
+    uint32_t v = _versions[s].load(std::memory_order_acquire);
+    while ((v & 1) != 0) {
+      std::this_thread::yield();
+      v = _versions[s].load(std::memory_order_acquire);
+    }
+    return v;
+  }
+
+  bool readValidate(uint64_t s, uint32_t v) const {
+    // must be called after an acquire fence following the reads
+    return _versions[s].load(std::memory_order_relaxed) == v;
+  }
+
+  void writeBegin(uint64_t pos) {
+    uint64_t s = stripe(pos);
+    uint32_t v = _versions[s].load(std::memory_order_relaxed);
+    if ((v & 1) == 0) {
+      _versions[s].store(v + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      _held.push_back(s);
+    }
+  }
+
+  void lock(uint64_t s) {
+    uint32_t v = _versions[s].load(std::memory_order_relaxed);
+    while ((v & 1) != 0 ||
+           !_versions[s].compare_exchange_weak(v, v + 1,
+                                               std::memory_order_acquire,
+                                               std::memory_order_relaxed)) {
+      if ((v & 1) != 0) {
+        std::this_thread::yield();
+        v = _versions[s].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void unlock(uint64_t s) {
+    uint32_t v = _versions[s].load(std::memory_order_relaxed);
+    _versions[s].store(v + 1, std::memory_order_release);
+  }
+
+  void writeEndAll() {
+    for (uint64_t s : _held) {
+      uint32_t v = _versions[s].load(std::memory_order_relaxed);
+      _versions[s].store(v + 1, std::memory_order_release);
+    }
+    _held.clear();
+  }
+};
+
+// Hot path statistics: compiled with CUCKOO_MAP_STATS defined (for example
+// with -DCUCKOO_MAP_STATS, before any header of the library is included),
+// the maps count probes, displacements, layer hits, filter results and lock
+// contention in relaxed atomic counters, see CuckooMap::stats(). Without it
+// a counter is an empty object whose updates compile to nothing, and all
+// values read as 0.
+
+class StatisticsCounter {
+#ifdef CUCKOO_MAP_STATS
+  std::atomic<uint64_t> _value;
+
+ public:
+  static constexpr bool Enabled = true;
+
+  StatisticsCounter() : _value(0) {}
+  void add(uint64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t get() const { return _value.load(std::memory_order_relaxed); }
+  void reset() { _value.store(0, std::memory_order_relaxed); }
+#else
+ public:
+  static constexpr bool Enabled = false;
+
+  void add(uint64_t = 1) {}
+  uint64_t get() const { return 0; }
+  void reset() {}
+#endif
+};
+
+struct TableStatistics {
+  // what happens inside the tables of a map, which all count into the same
+  // object, see InternalCuckooMap::setStatistics
+  StatisticsCounter probes;    // slots whose key a lookup compared
+  StatisticsCounter kicks;     // pairs displaced by inserts into full buckets
+  StatisticsCounter expunges;  // calls of expungeRandom
+
+  void reset() {
+    probes.reset();
+    kicks.reset();
+    expunges.reset();
+  }
+};
+
+// What the callback of a scan wants done with the pair it has just been
+// given, see InternalCuckooMap::scan and CuckooMap::scan:
+enum class ScanAction { Continue, Remove, Stop };
+
+// Persistent files: save() of InternalCuckooMap, CuckooFilter and CuckooMap
+// writes a 64-byte header followed by the raw slot data, which can later be
+// mapped again instead of being rebuilt. With ReadOnly the file is mapped
+// shared and read-only, such that all processes attached to it share one
+// copy in the page cache, with CopyOnWrite it is mapped privately and
+// writable, changes never reach the file.
+
+enum class PersistentMode { ReadOnly, CopyOnWrite };
+
+struct PersistentHeader {
+  char magic[8];        // identifies the kind of file
+  uint32_t version;     // of the format
+  uint32_t flags;       // depend on the kind of file
+  uint64_t size;        // number of buckets or layers
+  uint64_t nrUsed;      // number of pairs or fingerprints
+  uint64_t hashCheck;   // hash values of an empty key, to detect other seeds
+  uint32_t keySize;     // sizeof(Key)
+  uint32_t slotSize;    // byte size of a slot
+  uint32_t valueSize;   // configured value size
+  uint32_t valueOffset; // offset of the value within a slot
+  uint64_t extra;       // depends on the kind of file
+};
+
+static constexpr size_t PersistentHeaderSize = 64;
+static_assert(sizeof(PersistentHeader) <= PersistentHeaderSize,
+              "persistent header too large");
+
+static inline bool writePersistentFile(char const* fileName,
+                                       PersistentHeader const& header,
+                                       char const* data, uint64_t length) {
+  // write the header, padded to PersistentHeaderSize, followed by length
+  // bytes of data to fileName, return whether this was successful
+  int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0644);
+  if (fd == -1) {
+    return false;
+  }
+  char padded[PersistentHeaderSize];
+  std::memset(padded, 0, sizeof(padded));
+  std::memcpy(padded, &header, sizeof(header));
+  bool ok = true;
+  char const* chunks[2] = {padded, data};
+  uint64_t lengths[2] = {PersistentHeaderSize, length};
+  for (int c = 0; c < 2 && ok; ++c) {
+    uint64_t done = 0;
+    while (done < lengths[c]) {
+      ssize_t n = write(fd, chunks[c] + done, lengths[c] - done);
+      if (n <= 0) {
+        ok = false;
+        break;
+      }
+      done += n;
+    }
+  }
+  return (close(fd) == 0) && ok;
+}
+
+static inline char* mapPersistentFile(char const* fileName,
+                                      PersistentMode mode,
+                                      PersistentHeader& header,
+                                      uint64_t& mappedSize) {
+  // map a file written by writePersistentFile and copy its header to
+  // header, the mapping stays valid after the file is closed
+  int fd = open(fileName, O_RDONLY);
+  if (fd == -1) {
+    throw std::runtime_error(std::string("cannot open ") + fileName);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<uint64_t>(st.st_size) < PersistentHeaderSize) {
+    close(fd);
+    throw std::runtime_error(std::string("not a cuckoo file: ") + fileName);
+  }
+  mappedSize = st.st_size;
+  void* p;
+  if (mode == PersistentMode::ReadOnly) {
+    p = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+  } else {
+    p = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw std::runtime_error(std::string("cannot map ") + fileName);
+  }
+  std::memcpy(&header, p, sizeof(header));
+  return reinterpret_cast<char*>(p);
+}
+
+static inline void checkPersistentHeader(PersistentHeader const& header,
+                                         PersistentHeader const& expected,
+                                         uint64_t dataSize,
+                                         uint64_t mappedSize) {
+  // compare everything but the counts of a header read from a file with the
+  // header the reader would write itself, throw if they do not match
+  if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+      header.version != expected.version ||
+      header.flags != expected.flags || header.size != expected.size ||
+      header.hashCheck != expected.hashCheck ||
+      header.keySize != expected.keySize ||
+      header.slotSize != expected.slotSize ||
+      header.valueSize != expected.valueSize ||
+      header.valueOffset != expected.valueOffset ||
+      header.extra != expected.extra ||
+      PersistentHeaderSize + dataSize > mappedSize) {
+    throw std::runtime_error("persistent file does not match the type");
+  }
+}
+
+// Placement of the memory of a table or filter. By default it comes from
+// the heap, or from a temporary file if the table is created with useMmap.
+// With anonymous, it is an anonymous private mapping instead, which the
+// other options need: hugePages advises the kernel to back it with
+// transparent huge pages, explicitHugePages first tries MAP_HUGETLB from
+// the reserved pool of (2MB) huge pages, numaNode binds the pages to one
+// NUMA node and interleave spreads them over all nodes. All of these are
+// best effort, if the system does not support them the memory is used as
+// it is.
+
+struct AllocationPolicy {
+  bool anonymous;
+  bool hugePages;
+  bool explicitHugePages;
+  int numaNode;  // -1 for no binding
+  bool interleave;
+
+  AllocationPolicy()
+      : anonymous(false),
+        hugePages(false),
+        explicitHugePages(false),
+        numaNode(-1),
+        interleave(false) {}
+};
+
+static inline int currentNumaNode() {
+  // node of the CPU the calling thread runs on, -1 if unknown
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu;
+  unsigned node;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+    return static_cast<int>(node);
+  }
+#endif
+  return -1;
+}
+
+static inline int numaNodeCount() {
+  int n = 0;
+  char path[64];
+  while (n < 1024) {
+    std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+    if (access(path, F_OK) != 0) {
+      break;
+    }
+    ++n;
+  }
+  return (n > 0) ? n : 1;
+}
+
+// Specialize this to std::true_type for a key type whose empty key,
+// Key(), consists of zero bytes only, for example a wrapped integer with
+// 0 as the empty value. Tables then take their memory zeroed from the
+// operating system (or calloc) and skip constructing every slot, which is
+// what makes creating a large layer cheap: its pages are only touched
+// when they are first used.
+template <class Key>
+struct EmptyKeyIsZero : std::false_type {};
+
+class TableMemory {
+  // owns the memory of a table or filter, placed according to an
+  // AllocationPolicy, or the mapping of a persistent file
+  enum Kind { None, Heap, ZeroedHeap, TemporaryFile, Anonymous, Mapped };
+
+  Kind _kind;
+  char* _allocBase;     // start of the allocation or mapping
+  uint64_t _allocSize;  // its length in bytes
+  char* _base;          // 64-byte aligned start of the usable memory
+  char _tmpFileName[L_tmpnam + 1];
+  int _tmpFile;
+
+ public:
+  TableMemory()
+      : _kind(None),
+        _allocBase(nullptr),
+        _allocSize(0),
+        _base(nullptr),
+        _tmpFile(-1) {}
+
+  ~TableMemory() { release(); }
+
+  TableMemory(TableMemory const&) = delete;
+  TableMemory& operator=(TableMemory const&) = delete;
+
+  void allocate(uint64_t size, bool useMmap, AllocationPolicy const& policy,
+                bool zeroed = false) {
+    // provide size bytes, of which the first up to 63 may be skipped to
+    // align base(), throws std::bad_alloc on failure, with zeroed the
+    // memory is all zero bytes even if it comes from the heap
+    if (policy.anonymous) {
+      allocateAnonymous(size, policy);
+    } else if (useMmap) {
+      allocateTemporaryFile(size);
+    } else {
+      if (zeroed) {
+        // calloc gets large blocks as fresh zero pages without writing
+        _allocBase = static_cast<char*>(std::calloc(size, 1));
+        if (_allocBase == nullptr) {
+          throw std::bad_alloc();
+        }
+        _kind = ZeroedHeap;
+      } else {
+        _allocBase = new char[size];
+        _kind = Heap;
+      }
+      _allocSize = size;
+      // to actually implement the 64-byte alignment, shift base pointer
+      // within allocated space to 64-byte boundary
+      _base = reinterpret_cast<char*>(
+          (reinterpret_cast<uintptr_t>(_allocBase) + 63) & ~((uintptr_t)0x3fu));
+    }
+  }
+
+  void attach(char const* fileName, PersistentMode mode,
+              PersistentHeader& header) {
+    // map a file written by writePersistentFile, base() is the first byte
+    // after its header
+    _allocBase = mapPersistentFile(fileName, mode, header, _allocSize);
+    _kind = Mapped;
+    _base = _allocBase + PersistentHeaderSize;
+  }
+
+  char* base() const { return _base; }
+
+  char* begin() const { return _allocBase; }
+
+  uint64_t size() const { return _allocSize; }
+
+  bool isZeroed() const {
+    // whether all bytes are known to be zero after allocate
+    return _kind == ZeroedHeap || _kind == Anonymous || _kind == TemporaryFile;
+  }
+
+ private:
+  void allocateAnonymous(uint64_t size, AllocationPolicy const& policy) {
+    void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (policy.explicitHugePages) {
+      uint64_t const hugePageSize = 2ULL << 20;
+      uint64_t rounded = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+      p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | CUCKOO_MAP_ANON | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED) {
+        size = rounded;
+      }
+    }
+#endif
+    if (p == MAP_FAILED) {
+      p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | CUCKOO_MAP_ANON, -1, 0);
+      if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+#ifdef MADV_HUGEPAGE
+      if (policy.hugePages) {
+        madvise(p, size, MADV_HUGEPAGE);
+      }
+#endif
+    }
+    bindToNodes(p, size, policy);
+    _allocBase = reinterpret_cast<char*>(p);
+    _allocSize = size;
+    _kind = Anonymous;
+    _base = _allocBase;
+  }
+
+  static void bindToNodes(void* p, uint64_t size,
+                          AllocationPolicy const& policy) {
+    // must happen before the pages are touched for the first time
+#if defined(__linux__) && defined(SYS_mbind)
+    int const bindMode = 2;        // MPOL_BIND
+    int const interleaveMode = 3;  // MPOL_INTERLEAVE
+    int const bitsPerWord = 8 * sizeof(unsigned long);
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+    std::memset(mask, 0, sizeof(mask));
+    int mode;
+    if (policy.interleave) {
+      int n = numaNodeCount();
+      for (int node = 0; node < n; ++node) {
+        mask[node / bitsPerWord] |= 1UL << (node % bitsPerWord);
+      }
+      mode = interleaveMode;
+    } else if (policy.numaNode >= 0 && policy.numaNode < 1024) {
+      mask[policy.numaNode / bitsPerWord] |= 1UL
+                                            << (policy.numaNode % bitsPerWord);
+      mode = bindMode;
+    } else {
+      return;
+    }
+    syscall(SYS_mbind, p, size, mode, mask, 8 * sizeof(mask) + 1, 0);
+#else
+    (void)p;
+    (void)size;
+    (void)policy;
+#endif
+  }
+
+  void allocateTemporaryFile(uint64_t size) {
+    char* namePicked = std::tmpnam(_tmpFileName);
+    if (namePicked == nullptr) {
+      throw std::bad_alloc();
+    }
+    _tmpFile = open(_tmpFileName, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600);
+    if (_tmpFile == -1) {
+      throw std::bad_alloc();
+    }
+    void* p = MAP_FAILED;
+    // make the file a certain size
+    if (lseek(_tmpFile, size - 1, SEEK_SET) != -1 &&
+        write(_tmpFile, "", 1) != -1) {
+      p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _tmpFile, 0);
+    }
+    if (p == MAP_FAILED) {
+      close(_tmpFile);
+      std::remove(_tmpFileName);
+      _tmpFile = -1;
+      throw std::bad_alloc();
+    }
+    _allocBase = reinterpret_cast<char*>(p);
+    _allocSize = size;
+    _kind = TemporaryFile;
+    _base = _allocBase;
+  }
+
+  void release() {
+    switch (_kind) {
+      case Heap:
+        delete[] _allocBase;
+        break;
+      case ZeroedHeap:
+        std::free(_allocBase);
+        break;
+      case TemporaryFile:
+        munmap(_allocBase, _allocSize);
+        close(_tmpFile);
+        std::remove(_tmpFileName);
+        break;
+      case Anonymous:
+      case Mapped:
+        munmap(_allocBase, _allocSize);
+        break;
+      case None:
+        break;
+    }
+    _kind = None;
+  }
+};
+
 #endif
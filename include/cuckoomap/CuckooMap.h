@@ -1,12 +1,21 @@
 #ifndef CUCKOO_MAP_H
 #define CUCKOO_MAP_H 1
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <vector>
 
+#include "FrozenCuckooMap.h"
 #include "InternalCuckooMap.h"
+#include "ValueArena.h"
 
 // In the following template:
 //   Key is the key type, it must be copyable and movable, furthermore, Key
@@ -26,17 +35,144 @@
 //     table no constructors or destructors or assignment operators are
 //     called for Value, the data is only copied with std::memcpy. So Value
 //     must only contain POD!
+//   SlotsPerBucket and MaxLoadSixteenths determine the bucket geometry of
+//     all layers, FilterSlotsPerBucket, FilterFingerprintBits and
+//     FilterSemiSorted the one of the filters, see InternalCuckooMap and
+//     CuckooFilter.
 // This class is thread safe and can safely be used from multiple threads.
 // Mutexes are built in, note that a lookup returns a `Finding` object which
 // keeps a mutex until it is destroyed. This for example allows to change
 // values that are actually currently stored in the map. Keys must only be
 // changed as long as their hash and fingerprint does not change!
+// If the map is constructed with optimisticReads, lookupCopy does not take
+// the mutex at all: every bucket is covered by a striped version counter,
+// which writers make odd for the duration of their operation, and readers
+// retry if a bucket they probed changed in the meantime. This requires Key
+// to be trivially copyable, since keys are compared while a writer might be
+// moving them. Lookups through a Finding count as writers to the bucket of
+// the found pair for as long as they hold the mutex.
+// If the map is constructed with stripedWrites (and without filters),
+// insert(k, v) and remove(k) first try a fast path which only locks the
+// version stripes of the candidate buckets of k in all layers, in
+// increasing order, such that they can run concurrently as long as they
+// touch different stripes. This succeeds whenever the pair can be placed
+// without displacing another one, or, with bfsInsert and a trivially
+// copyable Key, by a displacement path in the last layer, whose stripes
+// are then locked as well. Everything else, including the fast path when it
+// does not succeed, takes the mutex and waits until no fast path is running
+// any more.
+// If the map is constructed with bfsInsert, all layers search for the
+// shortest displacement path breadth-first on insert, see
+// InternalCuckooMap, which reaches higher load factors before pairs spill
+// over into the next layer.
+// If the map is constructed with incrementalResize (and without
+// optimisticReads), growing does not leave the old layers in place: the new
+// layer, which is 4 times the size of the last one and thus large enough for
+// all of them, becomes the target of a migration, and every insert and
+// remove(k) moves the pairs of a few buckets of the old layers into it and
+// frees every layer which has been drained, until only the new layer is
+// left. A background thread can speed this up with migrate(). Pairs are not
+// moved to the front during a migration.
+// compact() merges all layers into a single one sized for the pairs in the
+// map and frees the others, which gives back the memory after a burst of
+// inserts followed by removes. With incrementalResize this also happens
+// automatically, as a migration, once removes through the mutex bring the
+// load below 1/8 and the merged layer would be at most a quarter of the
+// current capacity.
+// save(path) writes all layers and filters to files next to path, see
+// InternalCuckooMap and CuckooFilter, and a list of them to path, and the
+// constructor taking a path and a PersistentMode attaches to them again, for
+// example in another process. With PersistentMode::ReadOnly the map only
+// allows lookups, inserts and removes return false, pairs are not moved to
+// the front and pairs found must not be changed. With CopyOnWrite the map
+// can be used as usual, without changing the files.
+// If the map is constructed with valueArena (and without optimisticReads),
+// values are kept out of line in a ValueArena owned by the map, and the
+// slots of the layers only hold a pointer to them. Displacements,
+// migrations and moves to the front then only copy keys and pointers, and
+// a value is never copied after its insertion, which pays off for large
+// values. Such a map cannot be saved.
+// If the map is constructed with splitLayout, all layers keep their keys
+// and values in separate arrays, see InternalCuckooMap, such that probes
+// which do not find a key do not touch any values.
+// The memory of all layers and filters is placed according to an
+// AllocationPolicy, for example on huge pages or on a certain NUMA node.
+// If CompKey has a member type is_transparent, lookup and lookupCopy also
+// take keys of any other type KeyLike, for which HashKey1 and HashKey2
+// give the same values as for the equal Key and CompKey compares a Key
+// with a KeyLike, such that no Key has to be built for a lookup, see
+// ShortStringKey.
+// Pairs found by lookup in a later layer move towards the front. With
+// Promotion::Random (the default), a pair moves one layer up with a
+// probability which only depends on the distance of its layer from the
+// back. With Promotion::Adaptive (see setPromotion), a pair moves straight
+// to the first layer when it is found a second time within a window of
+// hits, which is told by reference bits indexed by hash value and cleared
+// at the end of every window, as in CLOCK. So the hot pairs of a skewed
+// access pattern gather in the first layer, and single hits on cold pairs
+// do not push them out. The window adapts to the hits counted per layer:
+// it grows while less than 15/16 of the hits are in the first layer and
+// hardly any pair moves, such that hot pairs with longer reuse distances
+// are recognized, and shrinks while a lot of pairs move, which means that
+// they push each other out of the first layer again. promotionStatistics()
+// returns the counters.
+// With setBound, the map is a cache of at most a number of pairs or bytes:
+// an insert of a new key into a full map first evicts a pair, chosen at
+// random (Eviction::Random), by CLOCK with a reference bit per slot which
+// lookups under the mutex set (Eviction::Clock), or at random from the
+// last layer with pairs in at least 1/16 of its slots, where the coldest
+// ones are (Eviction::DeepestLayer). Instead of growing by four times, the map only appends
+// layers as large as the bound needs, and none which would exceed it. A
+// pair which spills out of the last layer when no layer may be added is
+// evicted as well, and with a memory bound the number of pairs at that
+// point becomes the bound. Every evicted pair is handed to a callback.
+// Compiled with CUCKOO_MAP_STATS, the map counts what happens on its hot
+// paths: probes per lookup, displacements per insert, hits per layer,
+// filter rejections and false positives, spills to later layers, calls of
+// expungeRandom and the waits for the mutex, see stats(). The counters are
+// relaxed atomics, without CUCKOO_MAP_STATS they vanish, see
+// StatisticsCounter.
+
+// How pairs move to the front, see above:
+enum class Promotion { Random, Adaptive };
+
+// Which pair a full map evicts, see above:
+enum class Eviction { Random, Clock, DeepestLayer };
+
+// The options a CuckooMap is constructed with, see above, all off by
+// default:
+//   CuckooMapOptions options;
+//   options.useFilters = true;
+//   CuckooMap<Key, Value> m(1024, sizeof(Value), alignof(Value), options);
+struct CuckooMapOptions {
+  bool useFilters;         // a CuckooFilter in front of every layer
+  bool useTags;            // a tag byte per slot, see InternalCuckooMap
+  bool optimisticReads;
+  bool stripedWrites;      // ignored with useFilters
+  bool bfsInsert;
+  bool incrementalResize;  // ignored with optimisticReads
+  bool valueArena;         // ignored with optimisticReads
+  bool splitLayout;
+
+  CuckooMapOptions()
+      : useFilters(false),
+        useTags(false),
+        optimisticReads(false),
+        stripedWrites(false),
+        bfsInsert(false),
+        incrementalResize(false),
+        valueArena(false),
+        splitLayout(false) {}
+};
 
 template <class Key, class Value,
           class HashKey1 = HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
           class HashKey2 = HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
           class CompKey = std::equal_to<Key>,
-          class HashShort = HashWithSeed<uint16_t, 0xfedcbafedcba4321ULL>>
+          class HashShort = HashWithSeed<uint16_t, 0xfedcbafedcba4321ULL>,
+          uint32_t SlotsPerBucket = 4, uint32_t MaxLoadSixteenths = 15,
+          uint32_t FilterSlotsPerBucket = 4,
+          uint32_t FilterFingerprintBits = 16, bool FilterSemiSorted = false>
 class CuckooMap {
  public:
   typedef Key KeyType;  // these are for ShardedMap
@@ -44,41 +180,185 @@ class CuckooMap {
   typedef HashKey1 HashKey1Type;
   typedef HashKey2 HashKey2Type;
   typedef CompKey CompKeyType;
-  typedef InternalCuckooMap<Key, Value, HashKey1, HashKey2, CompKey> Subtable;
-  typedef CuckooFilter<Key, HashKey1, HashKey2, HashShort, CompKey> Filter;
+  typedef InternalCuckooMap<Key, Value, HashKey1, HashKey2, CompKey,
+                            SlotsPerBucket, MaxLoadSixteenths>
+      Subtable;
+  typedef CuckooFilter<Key, HashKey1, HashKey2, HashShort, CompKey,
+                       FilterSlotsPerBucket, FilterFingerprintBits,
+                       FilterSemiSorted>
+      Filter;
+  typedef FrozenCuckooMap<Key, Value, HashKey1, HashKey2, CompKey,
+                          SlotsPerBucket, MaxLoadSixteenths>
+      Frozen;
 
  private:
   size_t _firstSize;
   size_t _valueSize;
   size_t _valueAlign;
+  size_t _slotValueSize;  // of the layers, _valueSize or a value pointer
+  size_t _slotValueAlign;
   CompKey _compKey;
+  HashKey1 _hasher1;  // shared by all layers and filters, see innerLookup
+  HashKey2 _hasher2;
+
+  // number of keys whose buckets are prefetched together in lookupBatch
+  static constexpr size_t BatchSize = 16;
+  // number of layers reserved up front with optimistic reads, such that
+  // _tables never reallocates under a concurrent reader; since each layer
+  // is 4 times as large as the previous one, this is never reached
+  static constexpr size_t MaxLayers = 64;
+  // number of counters of concurrent striped writers, see enterShared
+  static constexpr size_t NrWriterSlots = 16;
+  // number of buckets migrated by every write with incrementalResize
+  static constexpr size_t MigrationStep = 16;
+  // number of reference bits of Promotion::Adaptive, and the bounds of the
+  // number of hits per window
+  static constexpr uint64_t ReferenceBits = 8192;
+  static constexpr uint64_t MinWindow = ReferenceBits / 4;
+  static constexpr uint64_t MaxWindow = ReferenceBits * 16;
 
  public:
   CuckooMap(size_t firstSize, size_t valueSize = sizeof(Value),
-            size_t valueAlign = alignof(Value), bool useFilters = false)
+            size_t valueAlign = alignof(Value),
+            CuckooMapOptions const& options = CuckooMapOptions(),
+            AllocationPolicy const& policy = AllocationPolicy())
       : _firstSize(firstSize),
         _valueSize(valueSize),
         _valueAlign(valueAlign),
+        _slotValueSize(valueSize),
+        _slotValueAlign(valueAlign),
         _randState(0x2636283625154737ULL),
+        _promotion(Promotion::Random),
+        _window(ReferenceBits),
+        _windowHits(0),
+        _windowFrontHits(0),
+        _windowPromotions(0),
+        _lookups(0),
+        _layerHits(),
+        _promotions(0),
         _dummyFilter(false, 0),
+        _nrLayers(0),
+        _exclusive(false),
         _nrUsed(0),
-        _useFilters(useFilters) {
-    auto t = new Subtable(false, firstSize, valueSize, valueAlign);
-    try {
-      _tables.emplace_back(t);
-    } catch (...) {
-      delete t;
-      throw;
+        _useFilters(options.useFilters),
+        _useTags(options.useTags),
+        _split(options.splitLayout),
+        _optimistic(options.optimisticReads),
+        _striped(options.stripedWrites && !options.useFilters),
+        _bfs(options.bfsInsert),
+        _incremental(options.incrementalResize && !options.optimisticReads),
+        _migrateEnd(0),
+        _migrateBucket(0),
+        _readOnly(false),
+        _policy(policy),
+        _maxPairs(0),
+        _maxBytes(0),
+        _eviction(Eviction::Random),
+        _nrEvictions(0),
+        _clockLayer(0),
+        _clockSlot(0) {
+    if (_optimistic || _striped) {
+      _versions.reset(new VersionStripes());
     }
-    if (_useFilters) {
-      auto f = new Filter(false, _tables.back()->capacity());
+    if (options.valueArena && !_optimistic) {
+      _arena.reset(new ValueArena(valueSize, valueAlign, policy));
+      _slotValueSize = sizeof(char*);
+      _slotValueAlign = alignof(char*);
+    }
+    if (_optimistic) {
+      _tables.reserve(MaxLayers);
+    }
+    if (_striped) {
+      _sharedWriters.reset(new WriterSlot[NrWriterSlots]);
+      for (size_t i = 0; i < NrWriterSlots; ++i) {
+        _sharedWriters[i].count.store(0, std::memory_order_relaxed);
+      }
+    }
+    allocateBuffers();
+    appendLayer(firstSize, false);
+  }
+
+  CuckooMap(size_t firstSize, size_t valueSize, size_t valueAlign,
+            AllocationPolicy const& policy)
+      : CuckooMap(firstSize, valueSize, valueAlign, CuckooMapOptions(),
+                  policy) {}
+
+  CuckooMap(std::string const& path, PersistentMode mode,
+            size_t valueSize = sizeof(Value),
+            size_t valueAlign = alignof(Value))
+      : _firstSize(0),
+        _valueSize(valueSize),
+        _valueAlign(valueAlign),
+        _slotValueSize(valueSize),
+        _slotValueAlign(valueAlign),
+        _randState(0x2636283625154737ULL),
+        _promotion(Promotion::Random),
+        _window(ReferenceBits),
+        _windowHits(0),
+        _windowFrontHits(0),
+        _windowPromotions(0),
+        _lookups(0),
+        _layerHits(),
+        _promotions(0),
+        _dummyFilter(false, 0),
+        _nrLayers(0),
+        _exclusive(false),
+        _nrUsed(0),
+        _useFilters(false),
+        _useTags(false),
+        _split(false),
+        _optimistic(false),
+        _striped(false),
+        _bfs(false),
+        _incremental(false),
+        _migrateEnd(0),
+        _migrateBucket(0),
+        _readOnly(mode == PersistentMode::ReadOnly),
+        _maxPairs(0),
+        _maxBytes(0),
+        _eviction(Eviction::Random),
+        _nrEvictions(0),
+        _clockLayer(0),
+        _clockSlot(0) {
+    // attach to a map written by save(path), see above
+    PersistentHeader header;
+    uint64_t mappedSize;
+    char* p = mapPersistentFile(path.c_str(), PersistentMode::ReadOnly, header,
+                                mappedSize);
+    munmap(p, mappedSize);
+    if (std::memcmp(header.magic, "CUCKOOM1", sizeof(header.magic)) != 0 ||
+        header.version != 1 || header.keySize != sizeof(Key) ||
+        header.valueSize != valueSize || header.size == 0 ||
+        header.size > MaxLayers) {
+      throw std::runtime_error("persistent file does not match the type");
+    }
+    _firstSize = header.extra;
+    _useFilters = (header.flags & 1) != 0;
+    _useTags = (header.flags & 2) != 0;
+    _split = (header.flags & 4) != 0;
+    for (uint64_t layer = 0; layer < header.size; ++layer) {
+      auto t = new Subtable(layerFileName(path, "layer", layer).c_str(), mode,
+                            valueSize, valueAlign);
+      t->setStatistics(&_tableStatistics);
       try {
-        _filters.emplace_back(f);
+        _tables.emplace_back(t);
       } catch (...) {
-        delete f;
+        delete t;
         throw;
       }
+      _nrUsed.fetch_add(t->nrUsed(), std::memory_order_relaxed);
+      if (_useFilters) {
+        auto f = new Filter(layerFileName(path, "filter", layer).c_str(), mode);
+        try {
+          _filters.emplace_back(f);
+        } catch (...) {
+          delete f;
+          throw;
+        }
+      }
     }
+    _nrLayers.store(_tables.size(), std::memory_order_release);
+    allocateBuffers();
   }
 
   struct Finding {
@@ -99,6 +379,9 @@ class CuckooMap {
 
     Value* value() const { return _value; }
 
+    // the map whose mutex this holds, or nullptr
+    CuckooMap* map() const { return _map; }
+
    private:
     Key* _key;
     Value* _value;
@@ -121,34 +404,29 @@ class CuckooMap {
     Finding& operator=(Finding const& other) = delete;
 
     // Allow moving, we need this to allow for copy elision where we
-    // return by value:
+    // return by value, the mutex goes along with the pair:
    public:
-    Finding(Finding&& other) {
-      std::cout << "move" << std::endl;
-      if (_map != nullptr) {
-        _map->release();
-      }
-      _map = other._map;
-      other._map = nullptr;
-
-      _key = other._key;
-      _value = other._value;
-      _layer = other._layer;
+    Finding(Finding&& other) noexcept
+        : _key(other._key),
+          _value(other._value),
+          _map(other._map),
+          _layer(other._layer) {
       other._key = nullptr;
+      other._map = nullptr;
     }
 
-    Finding& operator=(Finding&& other) {
-      std::cout << "move assign" << std::endl;
-      if (_map != nullptr) {
-        _map->release();
+    Finding& operator=(Finding&& other) noexcept {
+      if (this != &other) {
+        if (_map != nullptr) {
+          _map->release();
+        }
+        _key = other._key;
+        _value = other._value;
+        _map = other._map;
+        _layer = other._layer;
+        other._key = nullptr;
+        other._map = nullptr;
       }
-      _map = other._map;
-      other._map = nullptr;
-
-      _key = other._key;
-      _value = other._value;
-      _layer = other._layer;
-      other._key = nullptr;
       return *this;
     }
 
@@ -180,135 +458,1165 @@ class CuckooMap {
     //       // work with *res.key() and *res.value()
     //     }
     //   }
-    MyMutexGuard guard(_mutex);
+    uint64_t hash1, hash2;
+    hashKey(k, &hash1, &hash2);
+    return lookup(k, hash1, hash2);
+  }
+
+  bool lookup(Key const& k, Finding& f) {
+    uint64_t hash1, hash2;
+    hashKey(k, &hash1, &hash2);
+    return lookup(k, hash1, hash2, f);
+  }
+
+  // The following variants of lookup, lookupCopy, insert, upsert and
+  // remove take the hash values of k as computed by hash(k, ...), such
+  // that a caller which needs them anyway, like ShardedMap choosing the
+  // shard, hashes a key only once.
+
+  template <class KeyLike>
+  void hash(KeyLike const& k, uint64_t* hash1, uint64_t* hash2) const {
+    hashKey(k, hash1, hash2);
+  }
+
+  Finding lookup(Key const& k, uint64_t hash1, uint64_t hash2) {
+    Guard guard(*this);
     Finding f(nullptr, nullptr, this, -1);
-    innerLookup(k, f, true);
-    guard.release();
+    innerLookup(k, hash1, hash2, f, true);
+    pin(f);
+    guard.dismiss();
     return f;
   }
 
-  bool lookup(Key const& k, Finding& f) {
-    if (f._map != this) {
-      f._map->_mutex.unlock();
-      f._map = this;
-      _mutex.lock();
+  bool lookup(Key const& k, uint64_t hash1, uint64_t hash2, Finding& f) {
+    adopt(f);
+    f._key = nullptr;
+    innerLookup(k, hash1, hash2, f, true);
+    pin(f);
+    return f.found() > 0;
+  }
+
+  bool lookupCopy(Key const& k, uint64_t hash1, uint64_t hash2, Value* v) {
+    if (_optimistic) {
+      return optimisticLookup(k, hash1, hash2, v);
     }
+    Guard guard(*this);
+    Finding f;
+    innerLookup(k, hash1, hash2, f, false);
+    if (f._key == nullptr) {
+      return false;
+    }
+    std::memcpy(v, f._value, _valueSize);
+    return true;
+  }
+
+  bool insert(Key const& k, uint64_t hash1, uint64_t hash2, Value const* v) {
+    if (_readOnly) {
+      return false;
+    }
+    _counters.inserts.add();
+    char* handle = nullptr;
+    v = storeValue(v, handle);
+    bool res;
+    if (_striped && !bounded()) {
+      int fast = stripedInsert(k, v, hash1, hash2);
+      if (fast <= 0) {
+        res = (fast == 0);
+        discardValue(res, handle);
+        return res;
+      }
+    }
+    {
+      Guard guard(*this);
+      migrateStep(MigrationStep);
+      res = insertNew(k, v, hash1, hash2);
+    }
+    discardValue(res, handle);
+    return res;
+  }
+
+  bool insert(Key const& k, uint64_t hash1, uint64_t hash2, Value const* v,
+              Finding& f) {
+    adopt(f);
+    _counters.inserts.add();
+    char* handle = nullptr;
+    v = storeValue(v, handle);
+    migrateStep(MigrationStep);
+    bool res = insertNew(k, v, hash1, hash2);
+    discardValue(res, handle);
     f._key = nullptr;
-    innerLookup(k, f, true);
+    return res;
+  }
+
+  template <class Updater>
+  bool upsert(Key const& k, uint64_t hash1, uint64_t hash2, Updater updater) {
+    if (_readOnly) {
+      return false;
+    }
+    Guard guard(*this);
+    migrateStep(MigrationStep);
+    Finding f(nullptr, nullptr, this, -1);
+    innerLookup(k, hash1, hash2, f, false);
+    guard.dismiss();
+    if (f.found() != 0) {
+      pin(f);
+      updater(f._value, false);
+      return false;
+    }
+    // a new value is made in a buffer and then inserted like any other
+    _counters.inserts.add();
+    std::memset(_upsertBuffer.get(), 0, _valueSize);
+    Value* v = reinterpret_cast<Value*>(_upsertBuffer.get());
+    updater(v, true);
+    if (full()) {
+      evictOne();
+    }
+    char* handle = nullptr;
+    innerInsert(k, storeValue(v, handle), nullptr, -1, hash1, hash2);
+    return true;
+  }
+
+  bool remove(Key const& k, uint64_t hash1, uint64_t hash2) {
+    if (_readOnly) {
+      return false;
+    }
+    if (_striped) {
+      int res = stripedRemove(k, hash1, hash2);
+      if (res <= 0) {
+        return res == 0;
+      }
+    }
+    Guard guard(*this);
+    migrateStep(MigrationStep);
+    Finding f(nullptr, nullptr, this, -1);
+    innerLookup(k, hash1, hash2, f, false);
+    guard.dismiss();
+    if (f.found() == 0) {
+      return false;
+    }
+    innerRemove(f);
+    maybeShrink();
+    return true;
+  }
+
+  template <class KeyLike, class C = CompKey,
+            class = typename C::is_transparent>
+  Finding lookup(KeyLike const& k) {
+    // transparent lookup, see above
+    Guard guard(*this);
+    Finding f(nullptr, nullptr, this, -1);
+    uint64_t hash1, hash2;
+    hashKey(k, &hash1, &hash2);
+    innerLookup(k, hash1, hash2, f, true);
+    pin(f);
+    guard.dismiss();
+    return f;
+  }
+
+  template <class KeyLike, class C = CompKey,
+            class = typename C::is_transparent>
+  bool lookup(KeyLike const& k, Finding& f) {
+    // transparent lookup with the mutex held by f, see above
+    adopt(f);
+    f._key = nullptr;
+    uint64_t hash1, hash2;
+    hashKey(k, &hash1, &hash2);
+    innerLookup(k, hash1, hash2, f, true);
+    pin(f);
     return f.found() > 0;
   }
 
+  bool lookupCopy(Key const& k, Value* v) {
+    // look up a key and copy its value to *v, return whether it was
+    // found. This is the read-only variant of lookup: it does not keep the
+    // mutex and does not move the pair to the front. If the map was
+    // constructed with optimisticReads, it does not take the mutex at all.
+    // Must not be called by a thread holding a Finding of this map.
+    uint64_t hash1, hash2;
+    hashKey(k, &hash1, &hash2);
+    return lookupCopy(k, hash1, hash2, v);
+  }
+
+  template <class KeyLike, class C = CompKey,
+            class = typename C::is_transparent>
+  bool lookupCopy(KeyLike const& k, Value* v) {
+    // transparent lookupCopy, see above
+    uint64_t hash1, hash2;
+    hashKey(k, &hash1, &hash2);
+    if (_optimistic) {
+      return optimisticLookup(k, hash1, hash2, v);
+    }
+    Guard guard(*this);
+    Finding f;
+    innerLookup(k, hash1, hash2, f, false);
+    if (f._key == nullptr) {
+      return false;
+    }
+    std::memcpy(v, f._value, _valueSize);
+    return true;
+  }
+
+  size_t lookupBatch(Key const* keys, size_t n, Value* values, bool* found) {
+    // look up n keys under a single acquisition of the mutex. For every
+    // i < n, found[i] is set to whether keys[i] is in the table, and if so,
+    // its value is copied to position i of values, which must have room for
+    // n values of the configured value size. The hash values of a group of
+    // keys are computed and their buckets in all layers are prefetched
+    // before the first of them is resolved, such that the cache misses of
+    // the group overlap. Returns the number of keys found.
+    Guard guard(*this);
+    char* out = reinterpret_cast<char*>(values);
+    uint64_t hashes1[BatchSize];
+    uint64_t hashes2[BatchSize];
+    size_t nrFound = 0;
+    Finding f;  // not associated with the map, thus does not unlock
+    for (size_t start = 0; start < n; start += BatchSize) {
+      size_t count = (n - start < BatchSize) ? n - start : BatchSize;
+      for (size_t j = 0; j < count; ++j) {
+        hashKey(keys[start + j], &hashes1[j], &hashes2[j]);
+        prefetch(hashes1[j], hashes2[j]);
+      }
+      for (size_t j = 0; j < count; ++j) {
+        size_t i = start + j;
+        f._key = nullptr;
+        innerLookup(keys[i], hashes1[j], hashes2[j], f, true);
+        found[i] = (f._key != nullptr);
+        if (found[i]) {
+          std::memcpy(out + i * _valueSize, f._value, _valueSize);
+          ++nrFound;
+        }
+      }
+    }
+    return nrFound;
+  }
+
+  size_t removeBatch(Key const* keys, size_t n, bool* removed = nullptr) {
+    // remove the pairs with the n given keys under a single acquisition of
+    // the mutex, with the buckets of a group of keys prefetched as in
+    // lookupBatch. If removed is not nullptr, removed[i] is set to whether
+    // a pair with key keys[i] was removed. Returns the number of pairs
+    // removed.
+    Guard guard(*this);
+    if (_readOnly) {
+      return 0;
+    }
+    uint64_t hashes1[BatchSize];
+    uint64_t hashes2[BatchSize];
+    size_t nrRemoved = 0;
+    Finding f;  // not associated with the map, thus does not unlock
+    for (size_t start = 0; start < n; start += BatchSize) {
+      size_t count = (n - start < BatchSize) ? n - start : BatchSize;
+      for (size_t j = 0; j < count; ++j) {
+        hashKey(keys[start + j], &hashes1[j], &hashes2[j]);
+        prefetch(hashes1[j], hashes2[j]);
+      }
+      for (size_t j = 0; j < count; ++j) {
+        f._key = nullptr;
+        innerLookup(keys[start + j], hashes1[j], hashes2[j], f, false);
+        bool found = (f._key != nullptr);
+        if (found) {
+          innerRemove(f);
+          ++nrRemoved;
+        }
+        if (removed != nullptr) {
+          removed[start + j] = found;
+        }
+      }
+    }
+    if (nrRemoved > 0) {
+      maybeShrink();
+    }
+    return nrRemoved;
+  }
+
   bool insert(Key const& k, Value const* v) {
     // inserts a pair (k, v) into the table
     // returns true if the insertion took place and false if there was
     // already a pair with the same key k in the table, in which case
     // the table is unchanged.
-    MyMutexGuard guard(_mutex);
-    return innerInsert(k, v, nullptr, -1);
+    uint64_t hash1, hash2;
+    hashKey(k, &hash1, &hash2);
+    return insert(k, hash1, hash2, v);
   }
 
   bool insert(Key const& k, Value const* v, Finding& f) {
-    if (f._map != this) {
-      f._map->_mutex.unlock();
-      f._map = this;
-      _mutex.lock();
-    }
-    bool res = innerInsert(k, v, nullptr, -1);
-    f._key = nullptr;
-    return res;
+    uint64_t hash1, hash2;
+    hashKey(k, &hash1, &hash2);
+    return insert(k, hash1, hash2, v, f);
+  }
+
+  bool insertOrAssign(Key const& k, Value const* v) {
+    // set the value of k to *v, inserting the pair if k is not yet in the
+    // table, with a single probe of the layers. Returns true if the pair
+    // was inserted and false if an existing value was overwritten or the
+    // map is read-only.
+    return upsert(k, [this, v](Value* slot, bool) {
+      std::memcpy(slot, v, _valueSize);
+    });
+  }
+
+  template <class Updater>
+  bool upsert(Key const& k, Updater updater) {
+    // call updater(Value* value, bool isNew) on the value of k in its slot,
+    // where a new pair with key k and a zeroed value is inserted first if
+    // there is none, so an update needs one probe instead of a lookup and
+    // an insert. The updater runs under the mutex and must not call other
+    // methods of the map. Returns whether the pair is new.
+    uint64_t hash1, hash2;
+    hashKey(k, &hash1, &hash2);
+    return upsert(k, hash1, hash2, updater);
   }
 
   bool remove(Key const& k) {
     // remove the pair with key k, if one is in the table. Return true if
     // a pair was removed and false otherwise.
-    MyMutexGuard guard(_mutex);
-    Finding f(nullptr, nullptr, this, -1);
-    innerLookup(k, f, false);
-    guard.release();
-    if (f.found() == 0) {
+    uint64_t hash1, hash2;
+    hashKey(k, &hash1, &hash2);
+    return remove(k, hash1, hash2);
+  }
+
+  bool remove(Finding& f) {
+    // no migration step here, it would move the pair f points to
+    adopt(f);
+    if (f._key == nullptr || _readOnly) {
       return false;
     }
     innerRemove(f);
+    maybeShrink();
     return true;
   }
 
-  bool remove(Finding& f) {
+  size_t bulkLoad(Key const* keys, Value const* values, size_t n) {
+    // insert the n pairs (keys[i], values[i]) under a single acquisition of
+    // the mutex, where values holds n values of the configured value size,
+    // and return the number of pairs inserted, keys which are already in
+    // the map are skipped, as are all but the first of equal keys. The
+    // pairs are inserted in the order of their buckets in the last layer,
+    // such that it is written front to back. If
+    // the map is empty (and was not constructed with optimisticReads), its
+    // layers are first replaced by a single one sized for all n pairs, the
+    // pairs go directly into it and its filter is filled afterwards in the
+    // same order. Only pairs which cannot be placed there go through the
+    // usual insert. Throws std::runtime_error if a filter overflows, see
+    // insertIntoFilter.
+    Guard guard(*this);
+    if (_readOnly) {
+      return 0;
+    }
+    _counters.inserts.add(n);
+    char const* in = reinterpret_cast<char const*>(values);
+    std::vector<char*> handles;
+    if (_arena != nullptr) {
+      // from here on, in holds the pointers to the values in the arena
+      handles.reserve(n);
+      for (size_t i = 0; i < n; ++i) {
+        handles.push_back(_arena->allocate());
+        std::memcpy(handles.back(), in + i * _valueSize, _valueSize);
+      }
+      in = reinterpret_cast<char const*>(handles.data());
+    }
+    size_t const inSize = _slotValueSize;
+    bool presize = (nrUsed() == 0 && !_optimistic && !bounded());
+    if (presize) {
+      uint64_t size = _bfs ? n + n / 8 : 2 * n;
+      size = std::max(size, static_cast<uint64_t>(_firstSize));
+      _tables.clear();
+      _filters.clear();
+      _migrateEnd = 0;
+      _migrateBucket = 0;
+      appendLayer(size, size >= 64 * _firstSize);
+    }
+    Subtable& sub = *_tables.back();
+    std::vector<uint64_t> hashes(2 * n);
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) {
+      hashKey(keys[i], &hashes[2 * i], &hashes[2 * i + 1]);
+      order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return sub.bucketFor(hashes[2 * a]) < sub.bucketFor(hashes[2 * b]);
+    });
+    size_t nrInserted = 0;
+    if (!presize) {
+      for (size_t i : order) {
+        uint64_t hash1 = hashes[2 * i];
+        uint64_t hash2 = hashes[2 * i + 1];
+        bool inserted = insertNew(
+            keys[i], reinterpret_cast<Value const*>(in + i * inSize), hash1,
+            hash2);
+        if (inserted) {
+          ++nrInserted;
+        } else if (_arena != nullptr) {
+          _arena->free(handles[i]);
+        }
+      }
+      return nrInserted;
+    }
+    std::vector<char> buffer(inSize);
+    Value* v = reinterpret_cast<Value*>(buffer.data());
+    std::vector<bool> isNew(n, false);
+    std::vector<Key> spilledKeys;
+    std::vector<char> spilledValues;
+    int maxRounds = _bfs ? 2 : 128;
+    for (size_t i : order) {
+      Key k = keys[i];
+      std::memcpy(v, in + i * inSize, inSize);
+      int res = sub.insert(k, hashes[2 * i], hashes[2 * i + 1], v, nullptr,
+                           nullptr);
+      if (res < 0) {
+        if (_arena != nullptr) {
+          _arena->free(handles[i]);
+        }
+        continue;
+      }
+      isNew[i] = true;
+      ++nrInserted;
+      for (int round = 1; res > 0 && round < maxRounds; ++round) {
+        res = sub.insert(k, v, nullptr, nullptr);
+      }
+      if (res > 0) {
+        // k is now some pair which was kicked out
+        spilledKeys.push_back(k);
+        spilledValues.insert(spilledValues.end(), buffer.begin(),
+                             buffer.end());
+      }
+    }
+    _nrUsed.store(sub.nrUsed(), std::memory_order_relaxed);
+    if (_useFilters) {
+      Filter& filter = *_filters.back();
+      for (size_t i : order) {
+        if (isNew[i]) {
+          insertIntoFilter(filter, keys[i]);
+        }
+      }
+      for (Key const& k : spilledKeys) {
+        filter.remove(k);
+      }
+    }
+    for (size_t j = 0; j < spilledKeys.size(); ++j) {
+      uint64_t hash1, hash2;
+      hashKey(spilledKeys[j], &hash1, &hash2);
+      innerInsert(spilledKeys[j], reinterpret_cast<Value const*>(
+                                      spilledValues.data() + j * inSize),
+                  nullptr, -1, hash1, hash2);
+    }
+    return nrInserted;
+  }
+
+  template <class Callback>
+  bool scan(Callback callback) {
+    // call callback(Key const&, Value const*) for every pair in the map,
+    // layer by layer and bucket by bucket in memory order, which the
+    // hardware prefetcher follows, under the mutex, such that the pairs
+    // seen are a consistent snapshot. The callback returns a ScanAction:
+    // Continue, Remove to remove the pair (for example one whose time to
+    // live is over) or Stop to end the scan, in which case false is
+    // returned. It must not call other methods of the map.
+    Guard guard(*this);
+    return innerScan(callback);
+  }
+
+  template <class Callback>
+  bool scan(Callback callback, Finding& f) {
+    // the same with the mutex held by f, see acquire
+    adopt(f);
+    f._key = nullptr;
+    return innerScan(callback);
+  }
+
+  template <class Callback>
+  bool scanStep(Callback callback, uint64_t& cursor, size_t nrBuckets) {
+    // a scan spread over many short holds of the mutex: visit the pairs of
+    // the next nrBuckets buckets from cursor on, as scan does, and advance
+    // cursor, which starts at 0 and counts the buckets of all layers. At
+    // the end of the last layer the cursor goes back to 0 and false is
+    // returned. Stop skips the rest of the step. Between the steps pairs
+    // may be inserted, displaced or migrated, so a pair may be visited
+    // twice or not at all.
+    Guard guard(*this);
+    bool removed = false;
+    uint64_t offset = 0;
+    for (size_t layer = 0; layer < _tables.size(); ++layer) {
+      uint64_t size = _tables[layer]->nrBuckets();
+      if (nrBuckets > 0 && cursor < offset + size) {
+        uint64_t first = cursor - offset;
+        uint64_t end = (size - first > nrBuckets) ? first + nrBuckets : size;
+        nrBuckets -= end - first;
+        cursor = offset + end;
+        if (!scanLayer(layer, first, end, callback, removed)) {
+          nrBuckets = 0;
+        }
+      }
+      offset += size;
+    }
+    bool more = cursor < offset;
+    if (!more) {
+      cursor = 0;
+    }
+    if (removed) {
+      maybeShrink();
+    }
+    return more;
+  }
+
+  void acquire(Finding& f) {
+    // make f hold the mutex, without a current pair, for a series of calls
+    // of the variants taking a Finding, the mutex is released with f
+    adopt(f);
+    f._key = nullptr;
+  }
+
+  uint64_t nrUsed() const { return _nrUsed.load(std::memory_order_relaxed); }
+
+  void setPromotion(Promotion promotion) {
+    // choose how found pairs move to the front, see above
+    Guard guard(*this);
+    _promotion = promotion;
+    _window = ReferenceBits;
+    _windowHits = 0;
+    _windowFrontHits = 0;
+    _windowPromotions = 0;
+    _references.assign(
+        (promotion == Promotion::Adaptive) ? ReferenceBits / 64 : 0, 0);
+  }
+
+  struct PromotionStatistics {
+    uint64_t lookups;  // through the mutex, all others are not counted
+    std::vector<uint64_t> layerHits;  // per layer, the rest were misses
+    uint64_t promotions;              // pairs moved to the front
+  };
+
+  PromotionStatistics promotionStatistics() {
+    // the counters since construction or the last reset, per layer number
+    // at the time of the lookup
+    Guard guard(*this);
+    PromotionStatistics statistics;
+    statistics.lookups = _lookups;
+    statistics.layerHits.assign(_layerHits, _layerHits + _tables.size());
+    statistics.promotions = _promotions;
+    return statistics;
+  }
+
+  void resetPromotionStatistics() {
+    Guard guard(*this);
+    _lookups = 0;
+    std::fill(_layerHits, _layerHits + MaxLayers, 0);
+    _promotions = 0;
+  }
+
+  void setBound(
+      uint64_t maxPairs, uint64_t maxBytes,
+      Eviction eviction = Eviction::Random,
+      std::function<void(Key const&, Value const*)> onEvict = nullptr) {
+    // turn the map into a cache of at most maxPairs pairs and maxBytes of
+    // memoryUsage(), 0 for no bound of that kind, see above. onEvict is
+    // called with every evicted pair under the mutex and must not call
+    // methods of the map. Pairs beyond maxPairs are evicted right away.
+    // Inserts take the mutex in a bounded map, also with stripedWrites.
+    // Must be called before the map is used by several threads.
+    Guard guard(*this);
+    _maxPairs = maxPairs;
+    _maxBytes = maxBytes;
+    _eviction = eviction;
+    _onEvict = std::move(onEvict);
+    _clockLayer = 0;
+    _clockSlot = 0;
+    if (bounded() && eviction == Eviction::Clock) {
+      for (auto& t : _tables) {
+        t->enableReferenceBits();
+      }
+    }
+    while (!_readOnly && _maxPairs != 0 && nrUsed() > _maxPairs &&
+           evictOne()) {
+    }
+  }
+
+  uint64_t nrEvictions() const {
+    // the number of pairs evicted since the map was constructed
+    return _nrEvictions.load(std::memory_order_relaxed);
+  }
+
+  struct Statistics {
+    // the hot path counters, all 0 unless enabled, see above
+    bool enabled;            // compiled with CUCKOO_MAP_STATS
+    uint64_t lookups;        // searches for a key, also those of remove
+    uint64_t layerProbes;    // layers they consulted
+    uint64_t slotProbes;     // slots whose key they compared
+    std::vector<uint64_t> layerHits;  // per layer, the rest were misses
+    uint64_t filterRejects;  // layers skipped since their filter said no
+    uint64_t filterFalsePositives;  // layers whose filter said yes in vain
+    uint64_t inserts;        // pairs given to insert and bulkLoad
+    uint64_t kicks;          // pairs displaced within a layer
+    uint64_t spills;         // pairs pushed on to another layer
+    uint64_t expunges;       // calls of expungeRandom on overfull layers
+    uint64_t layersAppended;
+    uint64_t lockAcquisitions;  // of the mutex
+    uint64_t lockContentions;   // those of them which had to wait
+    uint64_t lockWaitNanoseconds;
+    uint64_t optimisticRetries;  // optimistic lookups repeated after writes
+
+    void add(Statistics const& other) {
+      // sum up the counters of several maps, see ShardedMap
+      enabled = enabled || other.enabled;
+      lookups += other.lookups;
+      layerProbes += other.layerProbes;
+      slotProbes += other.slotProbes;
+      if (layerHits.size() < other.layerHits.size()) {
+        layerHits.resize(other.layerHits.size(), 0);
+      }
+      for (size_t i = 0; i < other.layerHits.size(); ++i) {
+        layerHits[i] += other.layerHits[i];
+      }
+      filterRejects += other.filterRejects;
+      filterFalsePositives += other.filterFalsePositives;
+      inserts += other.inserts;
+      kicks += other.kicks;
+      spills += other.spills;
+      expunges += other.expunges;
+      layersAppended += other.layersAppended;
+      lockAcquisitions += other.lockAcquisitions;
+      lockContentions += other.lockContentions;
+      lockWaitNanoseconds += other.lockWaitNanoseconds;
+      optimisticRetries += other.optimisticRetries;
+    }
+  };
+
+  Statistics stats() const {
+    // a snapshot of the counters since construction or the last
+    // resetStats(), per layer number at the time of the lookup; it does not
+    // take the mutex, so the counters of concurrent operations may be
+    // partly included
+    Statistics s;
+    s.enabled = StatisticsCounter::Enabled;
+    s.lookups = _counters.lookups.get();
+    s.layerProbes = _counters.layerProbes.get();
+    s.slotProbes = _tableStatistics.probes.get();
+    size_t n = nrLayers();
+    s.layerHits.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      s.layerHits[i] = _counters.layerHits[i].get();
+    }
+    s.filterRejects = _counters.filterRejects.get();
+    s.filterFalsePositives = _counters.filterFalsePositives.get();
+    s.inserts = _counters.inserts.get();
+    s.kicks = _tableStatistics.kicks.get();
+    s.spills = _counters.spills.get();
+    s.expunges = _tableStatistics.expunges.get();
+    s.layersAppended = _counters.layersAppended.get();
+    s.lockAcquisitions = _counters.lockAcquisitions.get();
+    s.lockContentions = _counters.lockContentions.get();
+    s.lockWaitNanoseconds = _counters.lockWaitNanoseconds.get();
+    s.optimisticRetries = _counters.optimisticRetries.get();
+    return s;
+  }
+
+  void resetStats() {
+    _counters.reset();
+    _tableStatistics.reset();
+  }
+
+  size_t nrLayers() const { return _nrLayers.load(std::memory_order_relaxed); }
+
+  bool migrate(size_t nrBuckets = MigrationStep) {
+    // advance a migration started by growing with incrementalResize by up to
+    // nrBuckets buckets, for example from a background thread, and return
+    // whether it still has to go on. Must not be called by a thread holding
+    // a Finding of this map.
+    Guard guard(*this);
+    return migrateStep(nrBuckets);
+  }
+
+  uint64_t compact() {
+    // merge all layers into a single one with room for twice the number of
+    // pairs in the map (at least firstSize), unless there is only one layer
+    // which is not larger than that, and free the others. Returns the
+    // number of bytes given back. Does nothing with optimisticReads, since
+    // lock-free readers could still be probing the freed layers. Must not be
+    // called by a thread holding a Finding of this map.
+    Guard guard(*this);
+    if (_optimistic || _readOnly) {
+      return 0;
+    }
+    uint64_t before = innerMemoryUsage();
+    if (_tables.size() > 1 || _tables[0]->capacity() > shrunkSize()) {
+      startShrink();
+    }
+    while (migrateStep(_tables[0]->nrBuckets())) {
+    }
+    uint64_t after = innerMemoryUsage();
+    return (after < before) ? before - after : 0;
+  }
+
+  bool save(std::string const& path) {
+    // write the map to path and the files of its layers, see above, return
+    // whether this was successful
+    Guard guard(*this);
+    if (_arena != nullptr) {
+      return false;  // the values are not in the layers
+    }
+    for (size_t layer = 0; layer < _tables.size(); ++layer) {
+      if (!_tables[layer]->save(layerFileName(path, "layer", layer).c_str())) {
+        return false;
+      }
+      if (_useFilters &&
+          !_filters[layer]->save(
+              layerFileName(path, "filter", layer).c_str())) {
+        return false;
+      }
+    }
+    PersistentHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "CUCKOOM1", sizeof(header.magic));
+    header.version = 1;
+    header.flags =
+        (_useFilters ? 1 : 0) | (_useTags ? 2 : 0) | (_split ? 4 : 0);
+    header.size = _tables.size();
+    header.nrUsed = nrUsed();
+    header.keySize = sizeof(Key);
+    header.valueSize = _valueSize;
+    header.extra = _firstSize;
+    return writePersistentFile(path.c_str(), header, nullptr, 0);
+  }
+
+  Frozen freeze(AllocationPolicy const& policy = AllocationPolicy()) {
+    // an immutable copy of all pairs in a single table without a mutex,
+    // for data which is only read from now on, see FrozenCuckooMap. The
+    // pairs are a snapshot taken with scan, the map itself is unchanged.
+    // Must not be called by a thread holding a Finding of this map.
+    std::vector<Key> keys;
+    std::vector<char> values;
+    keys.reserve(nrUsed());
+    values.reserve(nrUsed() * _valueSize);
+    size_t valueSize = _valueSize;
+    scan([&keys, &values, valueSize](Key const& k,
+                                     Value const* v) -> ScanAction {
+      keys.push_back(k);
+      char const* bytes = reinterpret_cast<char const*>(v);
+      values.insert(values.end(), bytes, bytes + valueSize);
+      return ScanAction::Continue;
+    });
+    Frozen frozen(keys.data(), reinterpret_cast<Value const*>(values.data()),
+                  keys.size(), _valueSize, _valueAlign, policy);
+    return frozen;
+  }
+
+  uint64_t memoryUsage() {
+    // number of bytes used by the map, including all layers and filters
+    Guard guard(*this);
+    return innerMemoryUsage();
+  }
+
+ private:
+  class Guard {
+    // locks the mutex of a map and releases it again (see release) on
+    // destruction, unless the responsibility is handed over to a Finding
+    // with dismiss().
+    CuckooMap& _map;
+    bool _active;
+
+   public:
+    explicit Guard(CuckooMap& map) : _map(map), _active(true) {
+      _map.lock();
+    }
+    ~Guard() {
+      if (_active) {
+        _map.release();
+      }
+    }
+    void dismiss() { _active = false; }
+  };
+
+  void adopt(Finding& f) {
+    // make f hold the mutex of this map, releasing the one of another map
     if (f._map != this) {
-      f._map->_mutex.unlock();
+      if (f._map != nullptr) {
+        f._map->release();
+      }
       f._map = this;
+      lock();
+    }
+  }
+
+  void pin(Finding& f) {
+    // the holder of f may change the value in place, so optimistic readers
+    // have to treat the bucket as being written until the mutex is released
+    if (_optimistic && f._key != nullptr) {
+      _versions->writeBegin(_tables[f._layer]->bucketOf(f._key));
+    }
+  }
+
+  template <class KeyLike>
+  bool optimisticLookup(KeyLike const& k, uint64_t hash1, uint64_t hash2,
+                        Value* v) {
+    uint64_t stripes[2 * MaxLayers];
+    uint32_t versions[2 * MaxLayers];
+    _counters.lookups.add();
+    while (true) {
+      size_t nrLayers = _nrLayers.load(std::memory_order_acquire);
+      size_t nrProbed = 0;
+      bool found = false;
+      size_t layer = 0;
+      for (; layer < nrLayers && !found; ++layer) {
+        Subtable& sub = *_tables[layer];
+        stripes[nrProbed] = _versions->stripe(sub.bucketFor(hash1));
+        versions[nrProbed] = _versions->readBegin(stripes[nrProbed]);
+        ++nrProbed;
+        stripes[nrProbed] = _versions->stripe(sub.bucketFor(hash2));
+        versions[nrProbed] = _versions->readBegin(stripes[nrProbed]);
+        ++nrProbed;
+        Key* key;
+        Value* value;
+        if (sub.lookup(k, hash1, hash2, key, value)) {
+          std::memcpy(v, value, _valueSize);
+          found = true;
+        }
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      // a pair might have been moved to a layer appended in the meantime:
+      bool valid = (_nrLayers.load(std::memory_order_relaxed) == nrLayers);
+      for (size_t i = 0; i < nrProbed && valid; ++i) {
+        valid = _versions->readValidate(stripes[i], versions[i]);
+      }
+      _counters.layerProbes.add(layer);
+      if (valid) {
+        if (found) {
+          _counters.layerHits[layer - 1].add();
+        }
+        return found;
+      }
+      _counters.optimisticRetries.add();
+    }
+  }
+
+  struct WriterSlot {
+    std::atomic<uint32_t> count;
+    char padding[64 - sizeof(std::atomic<uint32_t>)];
+  };
+
+  void lock() {
+    // exclusive access: take the mutex and wait for striped writers to end
+#ifdef CUCKOO_MAP_STATS
+    if (!_mutex.try_lock()) {
+      auto start = std::chrono::steady_clock::now();
       _mutex.lock();
+      _counters.lockContentions.add();
+      _counters.lockWaitNanoseconds.add(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start)
+              .count());
     }
-    if (f._key == nullptr) {
+#else
+    _mutex.lock();
+#endif
+    _counters.lockAcquisitions.add();
+    if (_striped) {
+      _exclusive.store(true);
+      for (size_t i = 0; i < NrWriterSlots; ++i) {
+        while (_sharedWriters[i].count.load() != 0) {
+          std::this_thread::yield();
+        }
+      }
+    }
+  }
+
+  bool enterShared(size_t slot) {
+    // register a striped writer, fails while someone has exclusive access
+    _sharedWriters[slot].count.fetch_add(1);
+    if (_exclusive.load()) {
+      _sharedWriters[slot].count.fetch_sub(1, std::memory_order_release);
       return false;
     }
-    innerRemove(f);
     return true;
   }
 
-  uint64_t nrUsed() const {
-    MyMutexGuard guard(_mutex);
-    return _nrUsed;
+  void leaveShared(size_t slot) {
+    _sharedWriters[slot].count.fetch_sub(1, std::memory_order_release);
   }
 
- private:
-  void innerLookup(Key const& k, Finding& f, bool moveToFront) {
-    char buffer[_valueSize];
-    // f must be initialized with _key == nullptr
+  size_t lockStripes(uint64_t hash1, uint64_t hash2,
+                     typename Subtable::Path const& path, uint64_t* stripes) {
+    // lock the stripes of both buckets of a key in all layers and of the
+    // buckets on path in increasing order, the layers cannot change since
+    // we are a striped writer
+    size_t n = 0;
+    for (size_t layer = 0; layer < _tables.size(); ++layer) {
+      stripes[n++] = _versions->stripe(_tables[layer]->bucketFor(hash1));
+      stripes[n++] = _versions->stripe(_tables[layer]->bucketFor(hash2));
+    }
+    for (uint32_t step = 0; step < path.length; ++step) {
+      stripes[n++] = _versions->stripe(path.buckets[step]);
+    }
+    std::sort(stripes, stripes + n);
+    n = std::unique(stripes, stripes + n) - stripes;
+    for (size_t i = 0; i < n; ++i) {
+      _versions->lock(stripes[i]);
+    }
+    return n;
+  }
+
+  void unlockStripes(uint64_t const* stripes, size_t n) {
+    for (size_t i = n; i > 0; --i) {
+      _versions->unlock(stripes[i - 1]);
+    }
+  }
+
+  int stripedInsert(Key const& k, Value const* v, uint64_t hash1,
+                    uint64_t hash2) {
+    // fast path for insert, returns -1 if k is already in the map, 0 if the
+    // pair was inserted and 1 if we have to fall back to the slow path.
+    size_t slot = hash1 & (NrWriterSlots - 1);
+    if (!enterShared(slot)) {
+      return 1;
+    }
+    if (_migrateEnd > 0) {
+      // the slow path moves the migration along
+      leaveShared(slot);
+      return 1;
+    }
+    uint64_t stripes[2 * MaxLayers + Subtable::MaxPathLength + 1];
+    typename Subtable::Path path;
+    path.length = 0;
+    Key pathKeys[Subtable::MaxPathLength + 1];
+    int res = 1;
+    bool retry = true;
+    for (int attempt = 0; attempt < 2 && retry; ++attempt) {
+      retry = false;
+      size_t n = lockStripes(hash1, hash2, path, stripes);
+      Key* key;
+      Value* value;
+      size_t layer = 0;
+      for (; layer < _tables.size(); ++layer) {
+        if (_tables[layer]->lookup(k, hash1, hash2, key, value)) {
+          break;
+        }
+      }
+      Subtable& sub = *_tables.back();
+      if (layer < _tables.size()) {
+        res = -1;
+      } else if (sub.overfull()) {
+        // leave the expunging to the slow path
+      } else if (sub.insertIntoFreeSlot(k, v, hash1, hash2)) {
+        res = 0;
+      } else if (path.length > 0) {
+        // second attempt, the stripes of the path are locked now, but
+        // others might have changed it in between
+        if (sub.pathValid(path, pathKeys)) {
+          sub.applyPath(path, k, v, hash1, false);
+          res = 0;
+        }
+      } else if (_bfs && std::is_trivially_copyable<Key>::value) {
+        // The search reads buckets whose stripes we do not hold, hence the
+        // restriction to trivially copyable keys, the path is validated
+        // before it is applied:
+        retry = sub.findPath(hash1, hash2, path, pathKeys);
+      }
+      if (res == 0) {
+        _nrUsed.fetch_add(1, std::memory_order_relaxed);
+      }
+      unlockStripes(stripes, n);
+    }
+    leaveShared(slot);
+    return res;
+  }
+
+  int stripedRemove(Key const& k, uint64_t hash1, uint64_t hash2) {
+    // fast path for remove, returns -1 if k is not in the map, 0 if the
+    // pair was removed and 1 if we have to fall back to the slow path.
+    size_t slot = hash1 & (NrWriterSlots - 1);
+    if (!enterShared(slot)) {
+      return 1;
+    }
+    if (_migrateEnd > 0) {
+      leaveShared(slot);
+      return 1;
+    }
+    uint64_t stripes[2 * MaxLayers];
+    typename Subtable::Path noPath;
+    noPath.length = 0;
+    size_t n = lockStripes(hash1, hash2, noPath, stripes);
+    int res = -1;
+    for (size_t layer = 0; layer < _tables.size(); ++layer) {
+      Key* key;
+      Value* value;
+      if (_tables[layer]->lookup(k, hash1, hash2, key, value)) {
+        freeValue(value);
+        _tables[layer]->removeUnmarked(key, value);
+        _nrUsed.fetch_sub(1, std::memory_order_relaxed);
+        res = 0;
+        break;
+      }
+    }
+    unlockStripes(stripes, n);
+    leaveShared(slot);
+    return res;
+  }
+
+  void prefetch(uint64_t hash1, uint64_t hash2) const {
+    for (size_t layer = 0; layer < _tables.size(); ++layer) {
+      if (_useFilters) {
+        _filters[layer]->prefetch(hash1, hash2);
+      }
+      _tables[layer]->prefetch(hash1, hash2);
+    }
+  }
+
+  template <class KeyLike>
+  void hashKey(KeyLike const& k, uint64_t* hash1, uint64_t* hash2) const {
+    // both hash values of k, with a single computation if HashKey1 and
+    // HashKey2 are the two halves of one 128-bit hash, see DualHash
+    DualHash<Key, HashKey1, HashKey2>::compute(_hasher1, _hasher2, k, hash1,
+                                               hash2);
+  }
+
+  template <class KeyLike>
+  void innerLookup(KeyLike const& k, uint64_t hash1, uint64_t hash2,
+                   Finding& f, bool moveToFront) {
+    // f must be initialized with _key == nullptr, hash1 and hash2 must be
+    // the values of HashKey1 and HashKey2 for k, they are the same for all
+    // layers and also serve as key hash and fingerprint hash of the filters.
+    _counters.lookups.add();
     for (int32_t layer = 0; static_cast<uint32_t>(layer) < _tables.size();
          ++layer) {
       Subtable& sub = *_tables[layer];
-      Filter& filter = _useFilters ? *_filters[layer] : _dummyFilter;
       Key* key;
       Value* value;
-      bool found = _useFilters ? (filter.lookup(k) && sub.lookup(k, key, value))
-                               : sub.lookup(k, key, value);
+      bool found;
+      _counters.layerProbes.add();
+      if (_useFilters) {
+        bool candidate = _filters[layer]->lookup(hash1, hash2);
+        found = candidate && sub.lookup(k, hash1, hash2, key, value);
+        if (!candidate) {
+          _counters.filterRejects.add();
+        } else if (!found) {
+          _counters.filterFalsePositives.add();
+        }
+      } else {
+        found = sub.lookup(k, hash1, hash2, key, value);
+      }
       if (found) {
+        _counters.layerHits[layer].add();
         f._key = key;
-        f._value = value;
+        f._value = resolveValue(value);
         f._layer = layer;
-        if (moveToFront && layer > 0) {
-          uint8_t fromBack = _tables.size() - layer;
-          uint8_t denominator = (fromBack >= 6) ? (2 << 6) : (2 << fromBack);
-          uint8_t mask = denominator - 1;
-          uint8_t r = pseudoRandomChoice();
-          if ((r & mask) == 0) {
+        countLookup(layer);
+        if (moveToFront && layer > 0 && _migrateEnd == 0 && !_readOnly) {
+          int32_t target = promotionTarget(layer, hash2);
+          if (target >= 0) {
             Key kCopy = *key;
-            memcpy(buffer, value, _valueSize);
-            Value* vCopy = reinterpret_cast<Value*>(&buffer);
+            Value* vCopy = reinterpret_cast<Value*>(_promoteBuffer.get());
+            memcpy(vCopy, value, _slotValueSize);
+            Value* resolved = f._value;
 
-            innerRemove(f);
-            innerInsert(kCopy, vCopy, &f, layer - 1);
+            innerRemove(f, false);
+            innerInsert(kCopy, vCopy, &f, target, hash1, hash2);
+            if (_arena != nullptr) {
+              f._value = resolved;  // the value itself has not moved
+            }
+            ++_promotions;
+            ++_windowPromotions;
           }
         }
+        if (_eviction == Eviction::Clock && f._key != nullptr) {
+          _tables[f._layer]->reference(f._key);
+        }
         return;
       };
     }
+    countLookup(-1);
   }
 
-  bool innerInsert(Key const& k, Value const* v, Finding* f, int layerHint) {
-    // inserts a pair (k, v) into the table
+  void countLookup(int32_t layer) {
+    // count a lookup which found its pair in layer, or nothing for -1, and
+    // with Promotion::Adaptive adapt the window at its end, see above
+    ++_lookups;
+    if (layer < 0 || static_cast<size_t>(layer) >= MaxLayers) {
+      return;
+    }
+    ++_layerHits[layer];
+    if (_promotion != Promotion::Adaptive) {
+      return;
+    }
+    ++_windowHits;
+    _windowFrontHits += (layer == 0) ? 1 : 0;
+    if (_windowHits >= _window) {
+      if (_windowPromotions * 8 > _windowHits) {
+        _window = (_window / 2 > MinWindow) ? _window / 2 : MinWindow;
+      } else if (_windowFrontHits * 16 < _windowHits * 15 &&
+                 _windowPromotions * 64 < _windowHits) {
+        _window = (_window * 2 < MaxWindow) ? _window * 2 : MaxWindow;
+      }
+      _windowHits = 0;
+      _windowFrontHits = 0;
+      _windowPromotions = 0;
+      std::fill(_references.begin(), _references.end(), 0);
+    }
+  }
+
+  int32_t promotionTarget(int32_t layer, uint64_t hash2) {
+    // the layer a pair found in layer > 0 moves to, or -1 if it stays
+    if (_promotion == Promotion::Adaptive) {
+      uint64_t bit = (hash2 >> 16) & (ReferenceBits - 1);
+      uint64_t mask = 1ULL << (bit % 64);
+      bool referenced = (_references[bit / 64] & mask) != 0;
+      _references[bit / 64] |= mask;
+      return referenced ? 0 : -1;
+    }
+    uint8_t fromBack = _tables.size() - layer;
+    uint8_t denominator = (fromBack >= 6) ? (2 << 6) : (2 << fromBack);
+    uint8_t mask = denominator - 1;
+    uint8_t r = pseudoRandomChoice();
+    return ((r & mask) == 0) ? layer - 1 : -1;
+  }
+
+  bool innerInsert(Key const& k, Value const* v, Finding* f, int layerHint,
+                   uint64_t hash1, uint64_t hash2) {
+    // inserts a pair (k, v) into the table, hash1 and hash2 are those of k
     // returns true if the insertion took place and false if there was
-    // already a pair with the same key k in the table, in which case
-    // the table is unchanged.
+    // already a pair with the same key k in the layer it goes to, in which
+    // case the table is unchanged, the caller checks the other layers.
+    if (_readOnly) {
+      return false;
+    }
+
+    int32_t lastLayer = _tables.size() - 1;
+    int32_t layer = (layerHint < 0) ? lastLayer : layerHint;
+    Key** kPtr = (f != nullptr) ? &(f->_key) : nullptr;
+    Value** vPtr = (f != nullptr) ? &(f->_value) : nullptr;
+    if (_tables[layer]->roomForOne()) {
+      // the common case: the pair goes into a free slot of one of its two
+      // buckets, directly from k and v, unless k is there already
+      int res = _tables[layer]->insertIntoBuckets(k, hash1, hash2, v, kPtr,
+                                                  vPtr);
+      if (res < 0) {
+        return false;
+      } else if (res == 0) {
+        if (_useFilters) {
+          insertIntoFilter(*_filters[layer], k);
+        }
+        _nrUsed.fetch_add(1, std::memory_order_relaxed);
+        if (f != nullptr) {
+          f->_layer = layer;
+        }
+        return true;
+      }
+    }
 
+    // otherwise pairs are displaced, so we work on copies
     Key kCopy = k;
-    Key originalKey = k;
     Key originalKeyAtLayer = k;
-    char buffer[_valueSize];
-    memcpy(buffer, v, _valueSize);
-    Value* vCopy = reinterpret_cast<Value*>(&buffer);
+    Value* vCopy = reinterpret_cast<Value*>(_insertBuffer.get());
+    memcpy(vCopy, v, _slotValueSize);
 
-    int32_t lastLayer = _tables.size() - 1;
-    int32_t layer = (layerHint < 0) ? lastLayer : layerHint;
     int res;
-    bool filterRes;
     bool somethingExpunged = true;
     while (static_cast<uint32_t>(layer) < _tables.size()) {
       Subtable& sub = *_tables[layer];
       Filter& filter = _useFilters ? *_filters[layer] : _dummyFilter;
-      int maxRounds = (layerHint < 0) ? 128 : 4;
+      // With breadth-first search, a failed insert means that there is no
+      // short path, so we only try once more with the expunged pair:
+      int maxRounds = _bfs ? 2 : ((layerHint < 0) ? 128 : 4);
       for (int i = 0; i < maxRounds; ++i) {
-        if (f != nullptr && _compKey(originalKey, kCopy)) {
+        if (f != nullptr && _compKey(k, kCopy)) {
           res = sub.insert(kCopy, vCopy, &(f->_key), &(f->_value));
           f->_layer = layer;
         } else {
@@ -318,34 +1626,32 @@ class CuckooMap {
           return false;
         } else if (res == 0) {
           if (_useFilters) {
-            filterRes = filter.insert(originalKeyAtLayer);
-            if (!filterRes) {
-              throw;
-            }
+            insertIntoFilter(filter, originalKeyAtLayer);
           }
-          ++_nrUsed;
+          _nrUsed.fetch_add(1, std::memory_order_relaxed);
           somethingExpunged = false;
           break;
         }
       }
-      // check if table is too full; if so, expunge a random element
+      // check if table is too full; if so, expunge a random element, which
+      // is then no longer counted until it is inserted again further down:
       if (!somethingExpunged && sub.overfull()) {
-        bool expunged = sub.expungeRandom(kCopy, vCopy);
-        if (!expunged) {
-          throw;
+        if (!sub.expungeRandom(kCopy, vCopy)) {
+          inconsistent("overfull layer without a pair");
+        }
+        _nrUsed.fetch_sub(1, std::memory_order_relaxed);
+        if (_useFilters) {
+          removeFromFilter(filter, kCopy);
+          originalKeyAtLayer = kCopy;
         }
         somethingExpunged = true;
+        res = 1;
       }
       if (somethingExpunged) {
+        _counters.spills.add();
         if (_useFilters && !_compKey(kCopy, originalKeyAtLayer)) {
-          filterRes = filter.remove(kCopy);
-          if (!filterRes) {
-            throw;
-          }
-          filterRes = filter.insert(originalKeyAtLayer);
-          if (!filterRes) {
-            throw;
-          }
+          removeFromFilter(filter, kCopy);
+          insertIntoFilter(filter, originalKeyAtLayer);
           originalKeyAtLayer = kCopy;
         }
         layer = (layer == lastLayer) ? layer + 1 : lastLayer;
@@ -356,31 +1662,29 @@ class CuckooMap {
     // If we get here, then some pair has been expunged from all tables and
     // we have to append a new table:
     uint64_t lastSize = _tables.back()->capacity();
+    uint64_t size = grownSize(lastSize);
+    if (size == 0) {
+      // a bounded map which may not grow drops the pair instead
+      if (f != nullptr && _compKey(k, kCopy)) {
+        f->_key = nullptr;
+      }
+      evicted(kCopy, vCopy);
+      return true;
+    }
     /*std::cout << "Insertion failure at level " << _tables.size() - 1 << " at
        "
               << 100.0 *
                      (((double)_tables.back()->nrUsed()) / ((double)lastSize))
               << "% capacity with cold " << coldInsert << std::endl;*/
-    bool useMmap = (_tables.size() >= 3);
-    auto t = new Subtable(useMmap, lastSize * 4, _valueSize, _valueAlign);
-    try {
-      _tables.emplace_back(t);
-    } catch (...) {
-      delete t;
-      throw;
-    }
-    if (_useFilters) {
-      auto fil = new Filter(useMmap, lastSize * 4);
-      try {
-        _filters.emplace_back(fil);
-      } catch (...) {
-        delete f;
-        throw;
-      }
+    appendLayer(size, _tables.size() >= 3);
+    if (_incremental) {
+      // drain all other layers into the new one, a running migration just
+      // goes on with them
+      _migrateEnd = _tables.size() - 1;
     }
     originalKeyAtLayer = kCopy;
     while (res > 0) {
-      if (f != nullptr && _compKey(originalKey, kCopy)) {
+      if (f != nullptr && _compKey(k, kCopy)) {
         res = _tables.back()->insert(kCopy, vCopy, &(f->_key), &(f->_value));
         f->_layer = layer;
       } else {
@@ -388,13 +1692,194 @@ class CuckooMap {
       }
     }
     if (_useFilters) {
-      filterRes = _filters.back()->insert(originalKeyAtLayer);
-      if (!filterRes) {
+      insertIntoFilter(*_filters.back(), originalKeyAtLayer);
+    }
+    _nrUsed.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  void insertIntoFilter(Filter& filter, Key const& k) {
+    // A filter is sized for the capacity of its layer, so its insert only
+    // fails when it is overloaded. Then it has dropped some fingerprint and
+    // would hide a pair of the layer, which must not go unnoticed.
+    if (!filter.insert(k)) {
+      inconsistent("cuckoo filter overflow");
+    }
+  }
+
+  void removeFromFilter(Filter& filter, Key const& k) {
+    // the fingerprint of a pair of the layer is missing, which happens
+    // after an overflow, see insertIntoFilter
+    if (!filter.remove(k)) {
+      inconsistent("cuckoo filter lost a fingerprint");
+    }
+  }
+
+  [[noreturn]] static void inconsistent(char const* what) {
+    // the error path of innerInsert, which cannot go on consistently
+    throw std::runtime_error(what);
+  }
+
+  template <class Callback>
+  bool innerScan(Callback& callback) {
+    // see scan, removing a pair moves no other one, so the layers can be
+    // walked on
+    bool removed = false;
+    bool complete = true;
+    for (size_t layer = 0; layer < _tables.size() && complete; ++layer) {
+      complete = scanLayer(layer, 0, _tables[layer]->nrBuckets(), callback,
+                           removed);
+    }
+    if (removed) {
+      maybeShrink();
+    }
+    return complete;
+  }
+
+  template <class Callback>
+  bool scanLayer(size_t layer, uint64_t first, uint64_t end,
+                 Callback& callback, bool& removed) {
+    // scan the buckets first to end - 1 of a layer, see innerScan
+    auto visit = [this, layer, &callback, &removed](
+                     Key* k, Value* slot) -> ScanAction {
+      ScanAction action =
+          callback(static_cast<Key const&>(*k),
+                   static_cast<Value const*>(resolveValue(slot)));
+      if (action == ScanAction::Remove) {
+        if (_readOnly) {
+          return ScanAction::Continue;
+        }
+        if (_useFilters) {
+          _filters[layer]->remove(*k);
+        }
+        freeValue(slot);
+        _nrUsed.fetch_sub(1, std::memory_order_relaxed);
+        removed = true;
+      }
+      return action;
+    };
+    return _tables[layer]->scan(first, end, visit);
+  }
+
+  bool migrateStep(size_t nrBuckets) {
+    // move the pairs of up to nrBuckets buckets of the layers being drained,
+    // which are the layers before _migrateEnd, into the last layer by
+    // inserting them again, and free every layer once it is drained. Layers
+    // are drained front to back, the next bucket to move is _migrateBucket
+    // of layer 0. Returns whether the migration is still in progress.
+    Key k;
+    Value* v = reinterpret_cast<Value*>(_migrateBuffer.get());
+    uint64_t hash1, hash2;
+    while (_migrateEnd > 0 && nrBuckets > 0) {
+      Subtable& sub = *_tables[0];
+      if (_migrateBucket < sub.nrBuckets()) {
+        while (sub.takeFromBucket(_migrateBucket, k, v)) {
+          _nrUsed.fetch_sub(1, std::memory_order_relaxed);
+          if (_useFilters) {
+            _filters[0]->remove(k);
+          }
+          hashKey(k, &hash1, &hash2);
+          innerInsert(k, v, nullptr, -1, hash1, hash2);
+        }
+        ++_migrateBucket;
+        --nrBuckets;
+      } else {
+        // nothing is inserted into a layer being drained, so it is empty
+        _tables.erase(_tables.begin());
+        if (_useFilters) {
+          _filters.erase(_filters.begin());
+        }
+        _nrLayers.store(_tables.size(), std::memory_order_release);
+        --_migrateEnd;
+        _migrateBucket = 0;
+      }
+    }
+    return _migrateEnd > 0;
+  }
+
+  static std::string layerFileName(std::string const& path, char const* kind,
+                                   uint64_t layer) {
+    return path + "." + kind + std::to_string(layer);
+  }
+
+  uint64_t shrunkSize() const {
+    // the capacity of a layer for twice the pairs, as a layer of that size
+    // would have, such that it compares with the capacity of others
+    return Subtable::capacityFor(
+        std::max(static_cast<uint64_t>(_firstSize), 2 * nrUsed()));
+  }
+
+  void startShrink() {
+    // append a layer sized for the pairs in the map as the target of a
+    // migration of all other layers
+    uint64_t size = shrunkSize();
+    appendLayer(size, size >= 64 * _firstSize);  // as for the fourth layer
+    _migrateEnd = _tables.size() - 1;
+  }
+
+  void appendLayer(uint64_t size, bool useMmap) {
+    // Everything which can throw happens before the layer is published to
+    // optimistic readers by _nrLayers, such that a published layer is never
+    // taken back. The filter comes first, readers do not look at it.
+    std::unique_ptr<Subtable> t(new Subtable(useMmap, size, _slotValueSize,
+                                             _slotValueAlign, _useTags, _bfs,
+                                             _split, _policy));
+    t->setVersionStripes(_versions.get());
+    t->setStatistics(&_tableStatistics);
+    if (bounded() && _eviction == Eviction::Clock) {
+      t->enableReferenceBits();
+    }
+    if (_useFilters) {
+      auto fil = new Filter(useMmap, t->capacity(), _policy);
+      try {
+        _filters.emplace_back(fil);
+      } catch (...) {
+        delete fil;
         throw;
       }
     }
-    ++_nrUsed;
-    return true;
+    try {
+      _tables.emplace_back(t.get());
+    } catch (...) {
+      if (_useFilters) {
+        _filters.pop_back();
+      }
+      throw;
+    }
+    t.release();
+    _counters.layersAppended.add();
+    _nrLayers.store(_tables.size(), std::memory_order_release);
+  }
+
+  void maybeShrink() {
+    // automatic shrinking with incrementalResize, see above
+    if (!_incremental || _migrateEnd > 0) {
+      return;
+    }
+    uint64_t capacity = 0;
+    for (auto const& t : _tables) {
+      capacity += t->capacity();
+    }
+    if (nrUsed() * 8 < capacity && shrunkSize() * 4 <= capacity) {
+      startShrink();
+    }
+  }
+
+  uint64_t innerMemoryUsage() const {
+    uint64_t total = sizeof(CuckooMap);
+    for (auto const& t : _tables) {
+      total += t->memoryUsage();
+    }
+    for (auto const& f : _filters) {
+      total += f->memoryUsage();
+    }
+    if (_versions != nullptr) {
+      total += _versions->memoryUsage();
+    }
+    if (_arena != nullptr) {
+      total += _arena->memoryUsage();
+    }
+    return total;
   }
 
   uint8_t pseudoRandomChoice() {
@@ -402,24 +1887,318 @@ class CuckooMap {
     return static_cast<uint8_t>((_randState >> 37) & 0xff);
   }
 
-  void release() { _mutex.unlock(); }
+  uint64_t pseudoRandomNumber() {
+    _randState = _randState * 997 + 17;
+    return _randState >> 16;
+  }
+
+  void release() {
+    if (_versions != nullptr) {
+      _versions->writeEndAll();
+    }
+    if (_striped) {
+      _exclusive.store(false);
+    }
+    _mutex.unlock();
+  }
 
-  void innerRemove(Finding& f) {
+  void innerRemove(Finding& f, bool dropValue = true) {
+    // remove the pair f points to, without dropValue its value stays in
+    // the arena, since the pair is about to be inserted again
+    Subtable& sub = *_tables[f._layer];
     if (_useFilters) {
       _filters[f._layer]->remove(*(f._key));
     }
-    _tables[f._layer]->remove(f._key, f._value);
+    Value* slot = sub.valueOf(f._key);
+    if (dropValue) {
+      freeValue(slot);
+    }
+    sub.remove(f._key, slot);
     f._key = nullptr;
-    --_nrUsed;
+    _nrUsed.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  void allocateBuffers() {
+    // see _insertBuffer, once _slotValueSize is final
+    _insertBuffer.reset(new char[_slotValueSize]);
+    _promoteBuffer.reset(new char[_slotValueSize]);
+    _migrateBuffer.reset(new char[_slotValueSize]);
+    _upsertBuffer.reset(new char[_valueSize]);
+  }
+
+  bool inEarlierLayers(Key const& k, uint64_t hash1, uint64_t hash2) {
+    // whether k is in a layer before the last one, where innerInsert does
+    // not look for it
+    for (size_t layer = 0; layer + 1 < _tables.size(); ++layer) {
+      if (_useFilters && !_filters[layer]->lookup(hash1, hash2)) {
+        continue;
+      }
+      Key* key;
+      Value* value;
+      if (_tables[layer]->lookup(k, hash1, hash2, key, value)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool bounded() const {
+    // insert asks this without the mutex, _maxPairs only changes under it
+    // when _maxBytes is set
+    return _maxBytes != 0 || _maxPairs != 0;
+  }
+
+  bool full() const { return _maxPairs != 0 && nrUsed() >= _maxPairs; }
+
+  bool insertNew(Key const& k, Value const* v, uint64_t hash1,
+                 uint64_t hash2) {
+    // insert a pair with the mutex held, after checking the layers which
+    // innerInsert does not check, and making room in a full map
+    if (inEarlierLayers(k, hash1, hash2)) {
+      return false;
+    }
+    if (full()) {
+      Key* key;
+      Value* value;
+      if (_tables.back()->lookup(k, hash1, hash2, key, value)) {
+        return false;
+      }
+      evictOne();
+    }
+    return innerInsert(k, v, nullptr, -1, hash1, hash2);
+  }
+
+  bool evictOne() {
+    // remove the pair which the eviction policy picks and hand it to the
+    // callback, return false if no pair was found
+    if (nrUsed() == 0) {
+      return false;
+    }
+    Key* k = nullptr;
+    Value* v = nullptr;
+    size_t layer = _tables.size() - 1;
+    bool found = false;
+    if (_eviction == Eviction::Clock) {
+      // two rounds find a pair, the first one clears all reference bits
+      for (size_t i = 0; i <= 2 * _tables.size() && !found; ++i) {
+        if (_clockLayer >= _tables.size()) {
+          _clockLayer = 0;
+          _clockSlot = 0;
+        }
+        layer = _clockLayer;
+        found = _tables[layer]->findUnreferenced(_clockSlot, k, v);
+        if (!found) {
+          ++_clockLayer;
+        }
+      }
+    } else {
+      if (_eviction == Eviction::Random) {
+        // a layer with a probability proportional to its pairs
+        uint64_t r = pseudoRandomNumber() % nrUsed();
+        for (layer = 0; layer + 1 < _tables.size(); ++layer) {
+          uint64_t n = _tables[layer]->nrUsed();
+          if (r < n) {
+            break;
+          }
+          r -= n;
+        }
+      } else {
+        // the last layer with pairs in at least 1/16 of its slots, where
+        // random probes find one quickly, or else the last one with any
+        while (layer > 0 && _tables[layer]->nrUsed() * 16 <
+                                _tables[layer]->capacity()) {
+          --layer;
+        }
+        if (_tables[layer]->nrUsed() == 0) {
+          layer = _tables.size() - 1;
+        }
+      }
+      while (layer > 0 && _tables[layer]->nrUsed() == 0) {
+        --layer;
+      }
+      found = _tables[layer]->nrUsed() > 0 &&
+              _tables[layer]->findRandomPair(k, v);
+    }
+    if (!found) {
+      return false;
+    }
+    evicted(*k, v);
+    if (_useFilters) {
+      _filters[layer]->remove(*k);
+    }
+    _tables[layer]->remove(k, v);
+    _nrUsed.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  void evicted(Key const& k, Value* slot) {
+    // hand an evicted pair to the callback of setBound, the caller removes
+    // it from its layer, if it is in one
+    _nrEvictions.fetch_add(1, std::memory_order_relaxed);
+    if (_onEvict) {
+      _onEvict(k, resolveValue(slot));
+    }
+    freeValue(slot);
+  }
+
+  uint64_t grownSize(uint64_t lastSize) {
+    // the size of the layer to append after one of lastSize slots, or 0 if
+    // the bounds of setBound allow none, see above
+    uint64_t size = lastSize * 4;
+    if (!bounded()) {
+      return size;
+    }
+    if (_tables.size() >= MaxLayers) {
+      return 0;
+    }
+    if (_maxPairs != 0) {
+      // no larger than the pairs missing up to the bound need, with
+      // incrementalResize the new layer receives all of them
+      uint64_t room = 0;
+      for (size_t i = _incremental ? _tables.size() - 1 : 0;
+           i < _tables.size(); ++i) {
+        room += _tables[i]->capacity() * MaxLoadSixteenths / 16;
+      }
+      if (room >= _maxPairs) {
+        return 0;
+      }
+      uint64_t missing = _incremental ? _maxPairs : _maxPairs - room;
+      size = std::min(size, std::max(static_cast<uint64_t>(_firstSize),
+                                     missing * 16 / MaxLoadSixteenths + 1));
+    }
+    if (_maxBytes != 0) {
+      uint64_t bytes = _tables.back()->memoryUsage();
+      if (_useFilters) {
+        bytes += _filters.back()->memoryUsage();
+      }
+      if (innerMemoryUsage() + (bytes / lastSize + 1) * size > _maxBytes) {
+        // full, from now on with the present number of pairs as the bound
+        uint64_t n = std::max(nrUsed(), static_cast<uint64_t>(1));
+        if (_maxPairs == 0 || _maxPairs > n) {
+          _maxPairs = n;
+        }
+        return 0;
+      }
+    }
+    return size;
+  }
+
+  Value const* storeValue(Value const* v, char*& handle) {
+    // with the arena, copy *v into a new block and return a pointer to the
+    // pointer to it in handle, which is what the layers store, otherwise
+    // return v itself
+    if (_arena == nullptr) {
+      return v;
+    }
+    handle = _arena->allocate();
+    std::memcpy(handle, v, _valueSize);
+    return reinterpret_cast<Value const*>(&handle);
+  }
+
+  void discardValue(bool inserted, char* handle) {
+    // give back the block of storeValue if the pair was not inserted
+    if (_arena != nullptr && !inserted) {
+      _arena->free(handle);
+    }
+  }
+
+  Value* resolveValue(Value* slot) const {
+    // the value belonging to a value slot of a layer
+    if (_arena == nullptr) {
+      return slot;
+    }
+    char* handle;
+    std::memcpy(&handle, slot, sizeof(char*));
+    return reinterpret_cast<Value*>(handle);
+  }
+
+  void freeValue(Value* slot) {
+    if (_arena != nullptr) {
+      _arena->free(reinterpret_cast<char*>(resolveValue(slot)));
+    }
   }
 
   uint64_t _randState;  // pseudo random state for move-to-front heuristic
+  Promotion _promotion;
+  uint64_t _window;           // adaptive: number of hits per window
+  uint64_t _windowHits;       // adaptive: hits in the current window
+  uint64_t _windowFrontHits;  // adaptive: those of them in the first layer
+  uint64_t _windowPromotions;  // adaptive: pairs moved in the window
+  std::vector<uint64_t> _references;  // adaptive: reference bits by hash
+  uint64_t _lookups;                // see PromotionStatistics
+  uint64_t _layerHits[MaxLayers];
+  uint64_t _promotions;
+
+  struct Counters {
+    // see Statistics, those of the layers are in _tableStatistics
+    StatisticsCounter lookups;
+    StatisticsCounter layerProbes;
+    StatisticsCounter layerHits[MaxLayers];
+    StatisticsCounter filterRejects;
+    StatisticsCounter filterFalsePositives;
+    StatisticsCounter inserts;
+    StatisticsCounter spills;
+    StatisticsCounter layersAppended;
+    StatisticsCounter lockAcquisitions;
+    StatisticsCounter lockContentions;
+    StatisticsCounter lockWaitNanoseconds;
+    StatisticsCounter optimisticRetries;
+
+    void reset() {
+      lookups.reset();
+      layerProbes.reset();
+      for (size_t i = 0; i < MaxLayers; ++i) {
+        layerHits[i].reset();
+      }
+      filterRejects.reset();
+      filterFalsePositives.reset();
+      inserts.reset();
+      spills.reset();
+      layersAppended.reset();
+      lockAcquisitions.reset();
+      lockContentions.reset();
+      lockWaitNanoseconds.reset();
+      optimisticRetries.reset();
+    }
+  };
+  Counters _counters;
+  TableStatistics _tableStatistics;  // shared by all layers
   std::vector<std::unique_ptr<Subtable>> _tables;
   std::vector<std::unique_ptr<Filter>> _filters;
   Filter _dummyFilter;
-  std::mutex _mutex;
-  uint64_t _nrUsed;
+  std::unique_ptr<VersionStripes> _versions;  // for optimistic reads and
+                                              // striped writes
+  std::atomic<size_t> _nrLayers;  // == _tables.size(), for optimistic reads
+  std::unique_ptr<WriterSlot[]> _sharedWriters;  // striped writers running
+  std::atomic<bool> _exclusive;  // the mutex holder excludes striped writers
+  mutable std::mutex _mutex;
+  std::atomic<uint64_t> _nrUsed;
   bool _useFilters;
+  bool _useTags;
+  bool _split;       // layers keep keys and values in separate arrays
+  bool _optimistic;  // lookupCopy without the mutex
+  bool _striped;     // insert and remove try to only lock stripes
+  bool _bfs;         // layers search displacement paths breadth-first
+  bool _incremental;  // growing migrates the old layers into the new one
+  size_t _migrateEnd;       // layers before this one are being drained
+  uint64_t _migrateBucket;  // next bucket of layer 0 to migrate
+  bool _readOnly;  // attached to files with PersistentMode::ReadOnly
+  AllocationPolicy _policy;  // for the memory of all layers and filters
+  std::unique_ptr<ValueArena> _arena;  // out of line values, or nullptr
+  // scratch slot values, one for each of innerInsert, the promotion in
+  // innerLookup and migrateStep, which may run nested, and a value for
+  // upsert, all used under the mutex
+  std::unique_ptr<char[]> _insertBuffer;
+  std::unique_ptr<char[]> _promoteBuffer;
+  std::unique_ptr<char[]> _migrateBuffer;
+  std::unique_ptr<char[]> _upsertBuffer;
+  uint64_t _maxPairs;  // bounds of setBound, 0 if there is none
+  uint64_t _maxBytes;
+  Eviction _eviction;
+  std::function<void(Key const&, Value const*)> _onEvict;  // or empty
+  std::atomic<uint64_t> _nrEvictions;
+  size_t _clockLayer;   // the hand of Eviction::Clock, a layer
+  uint64_t _clockSlot;  // and a slot index in it
 };
 
 #endif
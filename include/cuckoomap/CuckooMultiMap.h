@@ -84,6 +84,11 @@ class CuckooMultiMap {
                  size_t valueAlign = alignof(Value))
       : _innerMap(firstSize, valueSize, valueAlign), _valueSize(valueSize) {}
 
+  CuckooMultiMap(size_t firstSize, size_t valueSize, size_t valueAlign,
+                 AllocationPolicy const& policy)
+      : _innerMap(firstSize, valueSize, valueAlign, policy),
+        _valueSize(valueSize) {}
+
   // Destruction, copying and moving exactly as CuckooMap
 
   // This struct basically behaves like the corresponding struct in CuckooMap.
@@ -102,6 +107,8 @@ class CuckooMultiMap {
     int32_t _count;
 
    public:
+    Finding() : _map(nullptr), _count(0) {}
+
     Finding(Key const& k, CuckooMultiMap* m)
         : _map(m),
           _innerKey(k, 0),
@@ -123,6 +130,11 @@ class CuckooMultiMap {
 
     Value* value() const { return _innerFinding.value(); }
 
+    // the map whose mutex this holds, or nullptr
+    CuckooMultiMap* map() const {
+      return (_innerFinding.map() != nullptr) ? _map : nullptr;
+    }
+
     bool next() {
       if (_map == nullptr && _innerFinding.found() == 0) {
         return false;
@@ -170,7 +182,8 @@ class CuckooMultiMap {
   bool lookup(Key const& k, Finding& f) {
     *static_cast<Key*>(&f._innerKey) = k;
     f._innerKey.seq = 0;
-    if (!_innerMap.lookup(f._innerKey, f)) {
+    f._map = this;
+    if (!_innerMap.lookup(f._innerKey, f._innerFinding)) {
       f._count = 0;
       return false;
     }
@@ -195,15 +208,13 @@ class CuckooMultiMap {
 
   bool remove(Key const& k) {
     Finding f(k, this);
-    if (f._count == 0) {
-      return false;
-    }
-    for (int32_t i = f._count - 1; i >= 0; --i) {
-      f._innerKey.seq = i;
-      _innerMap.lookup(f._innerKey, f._innerFinding);
-      _innerMap.remove(f._innerFinding);
-    }
-    return true;
+    return removeAll(f);
+  }
+
+  bool remove(Key const& k, Finding& f) {
+    // remove all pairs with key k, with the mutex held by f
+    lookup(k, f);
+    return removeAll(f);
   }
 
   bool remove(Finding& f) {
@@ -228,9 +239,37 @@ class CuckooMultiMap {
     return true;
   }
 
+  void acquire(Finding& f) {
+    // make f hold the mutex without a current pair, see CuckooMap::acquire
+    f._map = this;
+    f._count = 0;
+    _innerMap.acquire(f._innerFinding);
+  }
+
   uint64_t nrUsed() const { return _innerMap.nrUsed(); }
 
+  // the hot path counters of the inner map, see CuckooMap::stats
+  typedef typename InnerCuckooMap::Statistics Statistics;
+
+  Statistics stats() const { return _innerMap.stats(); }
+
+  void resetStats() { _innerMap.resetStats(); }
+
  private:
+  bool removeAll(Finding& f) {
+    // f must just have been used to look for the key
+    if (f.found() == 0) {
+      return false;
+    }
+    for (int32_t i = f._count - 1; i >= 0; --i) {
+      f._innerKey.seq = i;
+      _innerMap.lookup(f._innerKey, f._innerFinding);
+      _innerMap.remove(f._innerFinding);
+    }
+    f._count = 0;
+    return true;
+  }
+
   bool innerInsert(Finding& f, Value const* v) {
     // f must just have been used to look for f._innerKey
     if (f.found() == 0) {
@@ -0,0 +1,344 @@
+#ifndef FROZEN_CUCKOO_MAP_H
+#define FROZEN_CUCKOO_MAP_H 1
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "CuckooHelpers.h"
+
+// An immutable map for data which is built once and then only read, as
+// made by CuckooMap::freeze() or from arrays of keys and values. All pairs
+// are in a single table of two-choice buckets of SlotsPerBucket slots,
+// whose number of buckets is not rounded to a power of two but chosen for
+// a load of MaxLoadSixteenths / 16: the hash values are mapped to buckets
+// by a multiplication. Keys and values are kept in two arrays, a bucket of
+// keys starts on a multiple of its size, such that a probe touches only
+// the keys of two buckets and a hit one value.
+// Lookups never write anything, not even statistics, and take no lock, so
+// any number of threads can look up concurrently, and a pointer returned
+// by lookup is valid as long as the map lives.
+// save(path) writes the table to a file as InternalCuckooMap does, and the
+// constructor taking a path maps it again read-only, such that all
+// processes using it share one copy in the page cache.
+// Key, Value, HashKey1, HashKey2 and CompKey are as for CuckooMap.
+
+template <class Key, class Value,
+          class HashKey1 = HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
+          class HashKey2 = HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
+          class CompKey = std::equal_to<Key>, uint32_t SlotsPerBucket = 4,
+          uint32_t MaxLoadSixteenths = 15>
+class FrozenCuckooMap {
+  static_assert(SlotsPerBucket >= 1 && SlotsPerBucket <= 16 &&
+                    (SlotsPerBucket & (SlotsPerBucket - 1)) == 0,
+                "SlotsPerBucket must be a power of two of at most 16");
+
+  // number of displacements tried for one pair before the table is built
+  // again with more buckets, and the growth, in 1/32, of those rounds
+  static constexpr uint32_t MaxKicks = 2000;
+  static constexpr uint64_t GrowthThirtySeconds = 1;
+  // number of keys whose buckets are prefetched together in lookupBatch
+  static constexpr size_t BatchSize = 16;
+
+ public:
+  typedef Key KeyType;
+  typedef Value ValueType;
+
+  FrozenCuckooMap(Key const* keys, Value const* values, size_t n,
+                  size_t valueSize = sizeof(Value),
+                  size_t valueAlign = alignof(Value),
+                  AllocationPolicy const& policy = AllocationPolicy())
+      : _valueSize(valueSize), _valueAlign(valueAlign), _nrUsed(0) {
+    // build the map from n pairs (keys[i], values[i]), where values holds
+    // n values of valueSize bytes, for equal keys the first one wins
+    computeLayout(n * 16 / (SlotsPerBucket * MaxLoadSixteenths) + 1);
+    while (!build(keys, reinterpret_cast<char const*>(values), n, policy)) {
+      destroyKeys();
+      computeLayout(_nrBuckets + (_nrBuckets * GrowthThirtySeconds) / 32 + 1);
+    }
+  }
+
+  FrozenCuckooMap(std::string const& path, size_t valueSize = sizeof(Value),
+                  size_t valueAlign = alignof(Value))
+      : _valueSize(valueSize), _valueAlign(valueAlign), _nrUsed(0) {
+    // attach read-only to a map written by save(path)
+    static_assert(std::is_trivially_copyable<Key>::value,
+                  "persistent tables need trivially copyable keys");
+    PersistentHeader header;
+    _memory.reset(new TableMemory());
+    _memory->attach(path.c_str(), PersistentMode::ReadOnly, header);
+    computeLayout(header.size);
+    checkPersistentHeader(header, persistentHeader(), dataSize(),
+                          _memory->size());
+    _base = _memory->base();
+    _values = _base + _valuesOffset;
+    _nrUsed = header.nrUsed;
+    _attached = true;
+  }
+
+  ~FrozenCuckooMap() {
+    if (_memory != nullptr && !_attached) {
+      destroyKeys();
+    }
+  }
+
+  FrozenCuckooMap(FrozenCuckooMap&&) = default;
+  FrozenCuckooMap(FrozenCuckooMap const&) = delete;
+  FrozenCuckooMap& operator=(FrozenCuckooMap const&) = delete;
+  FrozenCuckooMap& operator=(FrozenCuckooMap&&) = delete;
+
+  Value const* lookup(Key const& k) const {
+    // the value of k, or nullptr if k is not in the map
+    uint64_t hash1, hash2;
+    DualHash<Key, HashKey1, HashKey2>::compute(_hasher1, _hasher2, k, &hash1,
+                                               &hash2);
+    return innerLookup(k, hash1, hash2);
+  }
+
+  template <class KeyLike, class C = CompKey,
+            class = typename C::is_transparent>
+  Value const* lookup(KeyLike const& k) const {
+    // transparent lookups, see CuckooMap
+    uint64_t hash1, hash2;
+    DualHash<Key, HashKey1, HashKey2>::compute(_hasher1, _hasher2, k, &hash1,
+                                               &hash2);
+    return innerLookup(k, hash1, hash2);
+  }
+
+  bool lookupCopy(Key const& k, Value* v) const {
+    Value const* found = lookup(k);
+    if (found == nullptr) {
+      return false;
+    }
+    std::memcpy(v, found, _valueSize);
+    return true;
+  }
+
+  size_t lookupBatch(Key const* keys, size_t n, Value* values,
+                     bool* found) const {
+    // as CuckooMap::lookupBatch: the buckets of a group of keys are
+    // prefetched before the first of them is resolved
+    char* out = reinterpret_cast<char*>(values);
+    uint64_t hashes1[BatchSize];
+    uint64_t hashes2[BatchSize];
+    size_t nrFound = 0;
+    for (size_t start = 0; start < n; start += BatchSize) {
+      size_t count = (n - start < BatchSize) ? n - start : BatchSize;
+      for (size_t j = 0; j < count; ++j) {
+        DualHash<Key, HashKey1, HashKey2>::compute(
+            _hasher1, _hasher2, keys[start + j], &hashes1[j], &hashes2[j]);
+        __builtin_prefetch(bucketKeys(hashToPos(hashes1[j])), 0, 3);
+        __builtin_prefetch(bucketKeys(hashToPos(hashes2[j])), 0, 3);
+      }
+      for (size_t j = 0; j < count; ++j) {
+        size_t i = start + j;
+        Value const* v = innerLookup(keys[i], hashes1[j], hashes2[j]);
+        found[i] = (v != nullptr);
+        if (found[i]) {
+          std::memcpy(out + i * _valueSize, v, _valueSize);
+          ++nrFound;
+        }
+      }
+    }
+    return nrFound;
+  }
+
+  template <class Callback>
+  void scan(Callback callback) const {
+    // call callback(Key const&, Value const*) for every pair, in memory
+    // order
+    for (uint64_t slot = 0; slot < _nrBuckets * SlotsPerBucket; ++slot) {
+      Key* k = keyAt(slot);
+      if (!k->empty()) {
+        callback(static_cast<Key const&>(*k),
+                 reinterpret_cast<Value const*>(valueAt(slot)));
+      }
+    }
+  }
+
+  bool save(std::string const& path) const {
+    // write the map to path, see above, return whether this was successful
+    static_assert(std::is_trivially_copyable<Key>::value,
+                  "persistent tables need trivially copyable keys");
+    return writePersistentFile(path.c_str(), persistentHeader(), _base,
+                               dataSize());
+  }
+
+  uint64_t nrUsed() const { return _nrUsed; }
+
+  uint64_t nrBuckets() const { return _nrBuckets; }
+
+  uint64_t capacity() const { return _nrBuckets * SlotsPerBucket; }
+
+  uint64_t memoryUsage() const {
+    return sizeof(FrozenCuckooMap) + sizeof(TableMemory) + dataSize() + 64;
+  }
+
+ private:
+  void computeLayout(uint64_t nrBuckets) {
+    // the offsets for nrBuckets buckets, keys first, we assume two powers
+    // for all alignments
+    _nrBuckets = nrBuckets;
+    _keyBucketSize = sizeof(Key) * SlotsPerBucket;
+    size_t bucketAlign = 1;
+    while (bucketAlign < _keyBucketSize && bucketAlign < 64) {
+      bucketAlign *= 2;
+    }
+    _keyBucketSize = (_keyBucketSize + bucketAlign - 1) & ~(bucketAlign - 1);
+    _valueStride = (_valueSize + _valueAlign - 1) & ~(_valueAlign - 1);
+    _valuesOffset = (_nrBuckets * _keyBucketSize + 63) & ~uint64_t(63);
+  }
+
+  uint64_t dataSize() const {
+    return _valuesOffset + _nrBuckets * SlotsPerBucket * _valueStride;
+  }
+
+  PersistentHeader persistentHeader() const {
+    PersistentHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "CUCKOOZ1", sizeof(header.magic));
+    header.version = 1;
+    header.size = _nrBuckets;
+    header.nrUsed = _nrUsed;
+    Key probe;  // all bytes zero, to not depend on padding
+    std::memset(static_cast<void*>(&probe), 0, sizeof(Key));
+    header.hashCheck = _hasher1(probe) ^ (_hasher2(probe) << 1);
+    header.keySize = sizeof(Key);
+    header.slotSize = static_cast<uint32_t>(_keyBucketSize / SlotsPerBucket);
+    header.valueSize = _valueSize;
+    header.valueOffset = _valuesOffset;
+    header.extra = SlotsPerBucket;
+    return header;
+  }
+
+  uint64_t hashToPos(uint64_t hash) const {
+    // any number of buckets, without a modulo
+    return static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(hash) * _nrBuckets) >> 64);
+  }
+
+  Key* bucketKeys(uint64_t pos) const {
+    return reinterpret_cast<Key*>(_base + pos * _keyBucketSize);
+  }
+
+  Key* keyAt(uint64_t slot) const {
+    return bucketKeys(slot / SlotsPerBucket) + (slot % SlotsPerBucket);
+  }
+
+  char* valueAt(uint64_t slot) const { return _values + slot * _valueStride; }
+
+  template <class KeyLike>
+  Value const* innerLookup(KeyLike const& k, uint64_t hash1,
+                           uint64_t hash2) const {
+    uint64_t pos = hashToPos(hash1);
+    for (int round = 0; round < 2; ++round) {
+      Key* keys = bucketKeys(pos);
+      for (uint32_t i = 0; i < SlotsPerBucket; ++i) {
+        if (_compKey(keys[i], k)) {
+          return reinterpret_cast<Value const*>(
+              valueAt(pos * SlotsPerBucket + i));
+        }
+      }
+      pos = hashToPos(hash2);
+    }
+    return nullptr;
+  }
+
+  bool build(Key const* keys, char const* values, size_t n,
+             AllocationPolicy const& policy) {
+    // insert all pairs into a new table with _nrBuckets buckets, moving
+    // pairs to their other bucket along a random walk, return false if one
+    // of the walks is too long
+    _memory.reset(new TableMemory());
+    _memory->allocate(dataSize() + 64, false, policy,
+                      EmptyKeyIsZero<Key>::value);
+    _base = _memory->base();
+    _values = _base + _valuesOffset;
+    _nrUsed = 0;
+    _attached = false;
+    if (!(_memory->isZeroed() && EmptyKeyIsZero<Key>::value)) {
+      for (uint64_t slot = 0; slot < _nrBuckets * SlotsPerBucket; ++slot) {
+        new (keyAt(slot)) Key();
+      }
+    }
+    std::vector<char> carried(_valueSize);
+    std::vector<char> other(_valueSize);
+    uint64_t randState = 0x2636283625154737ULL;
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t hash1, hash2;
+      DualHash<Key, HashKey1, HashKey2>::compute(_hasher1, _hasher2, keys[i],
+                                                 &hash1, &hash2);
+      if (innerLookup(keys[i], hash1, hash2) != nullptr) {
+        continue;
+      }
+      Key k = keys[i];
+      std::memcpy(carried.data(), values + i * _valueSize, _valueSize);
+      uint64_t pos = hashToPos(hash1);
+      uint64_t pos2 = hashToPos(hash2);
+      uint32_t kicks = 0;
+      while (!placeInFreeSlot(pos, k, carried.data()) &&
+             !placeInFreeSlot(pos2, k, carried.data())) {
+        if (++kicks > MaxKicks) {
+          return false;
+        }
+        // swap with a random pair of the second bucket, which then goes
+        // to its other bucket
+        randState = randState * 997 + 17;  // ignore overflows
+        uint64_t slot =
+            pos2 * SlotsPerBucket + ((randState >> 37) % SlotsPerBucket);
+        Key* victim = keyAt(slot);
+        char* victimValue = valueAt(slot);
+        std::swap(*victim, k);
+        std::memcpy(other.data(), victimValue, _valueSize);
+        std::memcpy(victimValue, carried.data(), _valueSize);
+        std::swap(carried, other);
+        DualHash<Key, HashKey1, HashKey2>::compute(_hasher1, _hasher2, k,
+                                                   &hash1, &hash2);
+        pos = pos2;
+        pos2 = (hashToPos(hash1) == pos) ? hashToPos(hash2) : hashToPos(hash1);
+      }
+      ++_nrUsed;
+    }
+    return true;
+  }
+
+  bool placeInFreeSlot(uint64_t pos, Key const& k, char const* v) {
+    Key* keys = bucketKeys(pos);
+    for (uint32_t i = 0; i < SlotsPerBucket; ++i) {
+      if (keys[i].empty()) {
+        keys[i] = k;
+        std::memcpy(valueAt(pos * SlotsPerBucket + i), v, _valueSize);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void destroyKeys() {
+    for (uint64_t slot = 0; slot < _nrBuckets * SlotsPerBucket; ++slot) {
+      keyAt(slot)->~Key();
+    }
+  }
+
+  size_t _valueSize;
+  size_t _valueAlign;
+  size_t _valueStride;       // between two values
+  size_t _keyBucketSize;     // bytes of the keys of a bucket, aligned
+  uint64_t _nrBuckets;
+  uint64_t _valuesOffset;    // of the values behind the keys
+  uint64_t _nrUsed;
+  bool _attached = false;    // to a file, whose keys are not destroyed
+  char* _base = nullptr;     // 64-byte aligned start of the keys
+  char* _values = nullptr;
+  std::unique_ptr<TableMemory> _memory;
+  HashKey1 _hasher1;
+  HashKey2 _hasher2;
+  CompKey _compKey;
+};
+
+#endif
@@ -5,8 +5,11 @@
 #include <stdio.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <atomic>
 #include <cstring>
 #include <iostream>
+#include <type_traits>
+#include <vector>
 
 #ifndef CUCKOO_MAP_ANON
 #ifdef MAP_ANONYMOUS
@@ -38,119 +41,152 @@
 //     table no constructors or destructors or assignment operators are
 //     called for Value, the data is only copied with std::memcpy. So Value
 //     must only contain POD!
+// If useTags is set, the table keeps one tag byte per slot (derived from
+// the first hash) in a separate array behind the slots. A lookup then
+// compares the tags of both candidate buckets at once and only calls
+// CompKey on slots whose tag matches, which saves touching the key slots at
+// all for most misses.
+// If a VersionStripes object is set with setVersionStripes, every bucket is
+// marked in it before it is changed, such that a user of the table can offer
+// optimistic concurrent reads, see CuckooMap.
+// With CUCKOO_MAP_STATS, the table counts the slots its lookups probe, the
+// pairs its inserts displace and its calls of expungeRandom, by default into
+// counters of its own, or into those set with setStatistics, see
+// TableStatistics.
+// If useBfs is set, an insert into two full buckets first runs a bounded
+// breadth-first search for the shortest path of displacements that ends in
+// a free slot and applies it backwards, before it falls back to expunging
+// a random pair.
+// If splitLayout is set, the keys and the values are kept in two separate
+// arrays instead of interleaved slots. The keys of a bucket are padded to a
+// power of two bytes or a multiple of 64, such that a probe of a bucket
+// touches a single cache line for keys of up to 16 bytes and does not
+// load any value bytes, the values are only touched on a hit.
+// If EmptyKeyIsZero<Key> is specialized to true, a new table is not
+// initialized slot by slot but uses zeroed memory as it is.
+//   SlotsPerBucket is the number of slots of a bucket, a power of two of
+//     at most 16, wider buckets reach higher loads at the cost of longer
+//     probes, for example 8 slots of 8-byte keys and values fit into one
+//     cache line with splitLayout.
+//   MaxLoadSixteenths is the load, in sixteenths of the capacity, above
+//     which the table counts as overfull and an insert gives back a pair.
 // This class is not thread-safe!
 
 template <class Key, class Value,
           class HashKey1 = HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
           class HashKey2 = HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
-          class CompKey = std::equal_to<Key>>
+          class CompKey = std::equal_to<Key>, uint32_t SlotsPerBucket = 4,
+          uint32_t MaxLoadSixteenths = 15>
 class InternalCuckooMap {
-  // Note that the following has to be a power of two!
-  static constexpr uint32_t SlotsPerBucket = 4;
+  static_assert(SlotsPerBucket >= 1 && SlotsPerBucket <= 16 &&
+                    (SlotsPerBucket & (SlotsPerBucket - 1)) == 0,
+                "SlotsPerBucket must be a power of two of at most 16");
+  static_assert(MaxLoadSixteenths >= 1 && MaxLoadSixteenths <= 16,
+                "MaxLoadSixteenths must be between 1 and 16");
 
  public:
+  // Bounds for the breadth-first search for a displacement path:
+  static constexpr uint32_t MaxPathLength = 5;  // number of displacements
+  static constexpr uint32_t MaxBfsNodes = 128;  // number of buckets visited
+
+  // number of buckets scan prefetches ahead of the one it visits
+  static constexpr uint64_t ScanPrefetchDistance = 8;
+
+  struct Path {
+    // A displacement path found by findPath: for i = length - 2 down to 0
+    // the pair in slot slots[i] of bucket buckets[i] moves to slot
+    // slots[i + 1] of bucket buckets[i + 1], the last of which is free,
+    // and the new pair then goes to slot slots[0] of bucket buckets[0].
+    uint32_t length;
+    uint64_t buckets[MaxPathLength + 1];
+    uint32_t slots[MaxPathLength + 1];
+  };
+
   InternalCuckooMap(bool useMmap, uint64_t size,
                     size_t valueSize = sizeof(Value),
-                    size_t valueAlign = alignof(Value))
-    : _randState(0x2636283625154737ULL), 
+                    size_t valueAlign = alignof(Value), bool useTags = false,
+                    bool useBfs = false, bool splitLayout = false,
+                    AllocationPolicy const& policy = AllocationPolicy())
+    : _randState(0x2636283625154737ULL),
       _longRandState(0x1492918629481928ULL),
       // Sort out offsets and alignments:
       _valueSize(valueSize),
       _valueAlign(valueAlign), 
       _valueOffset(sizeof(Key)),
       _useMmap(useMmap),
+      _useTags(useTags),
+      _useBfs(useBfs),
+      _splitLayout(splitLayout),
+      _tags(nullptr),
+      _versions(nullptr),
+      _statistics(&_ownStatistics),
       _nrUsed(0) {
-    size_t mask = _valueAlign - 1;
-    _valueOffset = (_valueOffset + _valueAlign - 1) & (~mask);
-    size_t keyAlign = alignof(Key);
-    // Align the key and thus the slot at least as strong as the value!
-    // We assume two powers for all alignments.
-    if (keyAlign < valueAlign) {
-      keyAlign = valueAlign;
-    }
-    mask = keyAlign - 1;
-    _slotSize = _valueOffset + _valueSize;
-    _slotSize = (_slotSize + alignof(Key) - 1) & (~mask);
-
-    // First find the smallest power of two that is not smaller than size:
-    size /= SlotsPerBucket;
-    _size = 16;
-    _logSize = 4;
-    while (_size < size) {
-      _size <<= 1;
-      _logSize += 1;
-    }
-    _sizeMask = _size - 1;
-    _sizeShift = (64 - _logSize) / 2;
-    _capacity = _size * SlotsPerBucket;
-    _threshold = (_capacity << 4) - _capacity;
-    _allocSize = _size * _slotSize * SlotsPerBucket +
-                 64;  // give 64 bytes padding to enable 64-byte alignment
-
-    if (_useMmap) {
-      char* namePicked = std::tmpnam(_tmpFileName);
-      if (namePicked == nullptr) {
-        throw;
-      }
-      _tmpFile = open(_tmpFileName, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600);
-      if (_tmpFile == -1) {
-        throw;
-      }
-      try {
-        int result = lseek(_tmpFile, _allocSize - 1, SEEK_SET);
-        if (result == -1) {
-          throw;
-        }
-        result = write(_tmpFile, "", 1);  // make the file a certain size
-        if (result == -1) {
-          throw;
-        }
-
-        _allocBase = reinterpret_cast<char*>(mmap(nullptr, _allocSize,
-                                                  PROT_READ | PROT_WRITE,
-                                                  MAP_SHARED, _tmpFile, 0));
-        if (_allocBase == MAP_FAILED) {
-          std::cout << "MAP_FAILED in table" << std::endl;
-          throw;
-        }
-      } catch (...) {
-        close(_tmpFile);
-        std::remove(_tmpFileName);
-      }
-      _base = _allocBase;
-    } else {
-      _allocBase = new char[_allocSize];
-
-      _base = reinterpret_cast<char*>(
-          (reinterpret_cast<uintptr_t>(_allocBase) + 63) &
-          ~((uintptr_t)0x3fu));  // to actually implement the 64-byte alignment,
-                                 // shift base pointer within allocated space to
-                                 // 64-byte boundary
-    }
-    try {
-      _theBuffer = new char[_valueSize];
-    } catch (...) {
-      if (_useMmap) {
-        munmap(_allocBase, _allocSize);
-        close(_tmpFile);
-        std::remove(_tmpFileName);
-      } else {
-        delete[] _allocBase;
+    computeLayout(size);
+    _memory.allocate(_allocSize, _useMmap, policy, EmptyKeyIsZero<Key>::value);
+    _base = _memory.base();
+    bool zeroed = _memory.isZeroed();
+    if (_useTags) {
+      _tags = reinterpret_cast<uint8_t*>(_base + _tagsOffset);
+      if (!zeroed) {
+        std::memset(_tags, 0, _size * SlotsPerBucket);
       }
-      throw;
     }
+    _theBuffer = new char[_valueSize];
 
+    // Zero bytes already are empty pairs if the key type says so, then
+    // the pages are not touched here at all:
+    if (zeroed && EmptyKeyIsZero<Key>::value) {
+      return;
+    }
     // Now initialize all slots in all buckets with empty pairs:
     for (uint32_t b = 0; b < _size; ++b) {
       for (size_t i = 0; i < SlotsPerBucket; ++i) {
         Key* k = findSlotKey(b, i);
         k = new (k) Key();  // placement new, default constructor
-        Value* v = findSlotValue(b, i);
-        std::memset(v, 0, _valueSize);
+        if (!zeroed) {
+          Value* v = findSlotValue(b, i);
+          std::memset(v, 0, _valueSize);
+        }
       }
     }
   }
 
+  InternalCuckooMap(char const* fileName, PersistentMode mode,
+                    size_t valueSize = sizeof(Value),
+                    size_t valueAlign = alignof(Value), bool useBfs = false)
+    : _randState(0x2636283625154737ULL),
+      _longRandState(0x1492918629481928ULL),
+      _valueSize(valueSize),
+      _valueAlign(valueAlign),
+      _valueOffset(sizeof(Key)),
+      _useMmap(true),
+      _useTags(false),
+      _useBfs(useBfs),
+      _splitLayout(false),
+      _tags(nullptr),
+      _versions(nullptr),
+      _statistics(&_ownStatistics),
+      _nrUsed(0) {
+    // attach to a table written by save(), with ReadOnly the table must
+    // not be changed
+    static_assert(std::is_trivially_copyable<Key>::value,
+                  "persistent tables need trivially copyable keys");
+    PersistentHeader header;
+    _memory.attach(fileName, mode, header);
+    _useTags = (header.flags & 1) != 0;
+    _splitLayout = (header.flags & 2) != 0;
+    computeLayout(header.size * SlotsPerBucket);
+    checkPersistentHeader(header, persistentHeader(), dataSize(),
+                          _memory.size());
+    _theBuffer = new char[_valueSize];
+    _allocSize = _memory.size();
+    _base = _memory.base();
+    if (_useTags) {
+      _tags = reinterpret_cast<uint8_t*>(_base + _tagsOffset);
+    }
+    _nrUsed.store(header.nrUsed, std::memory_order_relaxed);
+  }
+
   ~InternalCuckooMap() {
     // destroy objects:
     for (size_t b = 0; b < _size; ++b) {
@@ -159,13 +195,6 @@ class InternalCuckooMap {
         k->~Key();
       }
     }
-    if (_useMmap) {
-      munmap(_allocBase, _allocSize);
-      close(_tmpFile);
-      std::remove(_tmpFileName);
-    } else {
-      delete[] _allocBase;
-    }
     delete[] _theBuffer;
   }
 
@@ -179,17 +208,49 @@ class InternalCuckooMap {
     // found or true. In the latter case the pointers kOut and vOut
     // are set to point to the pair in the table. This pointers are only
     // valid until the next operation on this table is called.
-    uint64_t hash = _hasher1(k);
+    uint64_t hash1, hash2;
+    DualHash<Key, HashKey1, HashKey2>::compute(_hasher1, _hasher2, k, &hash1,
+                                               &hash2);
+    return lookup(k, hash1, hash2, kOut, vOut);
+  }
+
+  template <class KeyLike>
+  bool lookup(KeyLike const& k, uint64_t hash, uint64_t hash2, Key*& kOut,
+              Value*& vOut) {
+    // as above, but with the values of HashKey1 and HashKey2 for k already
+    // computed by the caller, such that they can be shared between tables.
+    // k may be of any type which CompKey compares with Key, see the
+    // transparent lookups of CuckooMap.
     uint64_t pos = hashToPos(hash);
-    // We compute the second hash already here to allow the result to
-    // survive a mispredicted branch in the first loop. Is this sensible?
-    uint64_t hash2 = _hasher2(k);
     uint64_t pos2 = hashToPos(hash2);
+    if (_useTags) {
+      // Bits 0..SlotsPerBucket-1 are the slots in pos, the next ones those
+      // in pos2:
+      uint32_t hits = matchTags(pos, pos2, hashToTag(hash));
+      uint64_t probed = 0;
+      while (hits != 0) {
+        uint32_t j = __builtin_ctz(hits);
+        hits &= hits - 1;
+        uint64_t p = (j < SlotsPerBucket) ? pos : pos2;
+        uint64_t i = j & (SlotsPerBucket - 1);
+        Key* kTable = findSlotKey(p, i);
+        ++probed;
+        if (_compKey(*kTable, k)) {
+          kOut = kTable;
+          vOut = findSlotValue(p, i);
+          _statistics->probes.add(probed);
+          return true;
+        }
+      }
+      _statistics->probes.add(probed);
+      return false;
+    }
     for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
       Key* kTable = findSlotKey(pos, i);
       if (_compKey(*kTable, k)) {
         kOut = kTable;
         vOut = findSlotValue(pos, i);
+        _statistics->probes.add(i + 1);
         return true;
       }
     }
@@ -198,9 +259,11 @@ class InternalCuckooMap {
       if (_compKey(*kTable, k)) {
         kOut = kTable;
         vOut = findSlotValue(pos2, i);
+        _statistics->probes.add(SlotsPerBucket + i + 1);
         return true;
       }
     }
+    _statistics->probes.add(2 * SlotsPerBucket);
     return false;
   }
 
@@ -236,49 +299,34 @@ class InternalCuckooMap {
     //         table but the original one is inserted
     //
 
+    uint64_t hash1, hash2;
+    DualHash<Key, HashKey1, HashKey2>::compute(_hasher1, _hasher2, k, &hash1,
+                                               &hash2);
+    return insert(k, hash1, hash2, v, kPtr, vPtr);
+  }
+
+  int insert(Key& k, uint64_t hash1, uint64_t hash2, Value* v, Key** kPtr,
+             Value** vPtr) {
+    // the same with the hash values already computed
+    int res = insertIntoBuckets(k, hash1, hash2, v, kPtr, vPtr);
+    if (res <= 0) {
+      return res;
+    }
     Key* kTable;
     Value* vTable;
-
-    uint64_t hash1 = _hasher1(k);
     uint64_t pos1 = hashToPos(hash1);
-    // We compute the second hash already here to let it survive a mispredicted
-    // branch in the first loop:
-    uint64_t hash2 = _hasher2(k);
     uint64_t pos2 = hashToPos(hash2);
 
-    for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
-      kTable = findSlotKey(pos1, i);
-      if (kTable->empty()) {
-        vTable = findSlotValue(pos1, i);
-        *kTable = k;
-        std::memcpy(vTable, v, _valueSize);
-        ++_nrUsed;
-        if (kPtr != nullptr && vPtr != nullptr) {
-          *kPtr = kTable;
-          *vPtr = vTable;
-        }
-        return 0;
-      }
-      if (_compKey(*kTable, k)) {
-        return -1;
-      }
-    }
-    for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
-      kTable = findSlotKey(pos2, i);
-      if (kTable->empty()) {
-        vTable = findSlotValue(pos2, i);
-        *kTable = k;
-        std::memcpy(vTable, v, _valueSize);
-        ++_nrUsed;
+    if (_useBfs) {
+      Path path;
+      if (findPath(hash1, hash2, path, nullptr)) {
+        applyPath(path, k, v, hash1, true);
         if (kPtr != nullptr && vPtr != nullptr) {
-          *kPtr = kTable;
-          *vPtr = vTable;
+          *kPtr = findSlotKey(path.buckets[0], path.slots[0]);
+          *vPtr = findSlotValue(path.buckets[0], path.slots[0]);
         }
         return 0;
       }
-      if (_compKey(*kTable, k)) {
-        return -1;
-      }
     }
 
     // Now expunge a random element from any of these slots:
@@ -290,27 +338,226 @@ class InternalCuckooMap {
     // We expunge the element at position pos1 and slot i:
     kTable = findSlotKey(pos1, i);
     vTable = findSlotValue(pos1, i);
+    beginWrite(pos1);
     Key kDummy = std::move(*kTable);
     *kTable = std::move(k);
     k = std::move(kDummy);
     std::memcpy(_theBuffer, vTable, _valueSize);
     std::memcpy(vTable, v, _valueSize);
     std::memcpy(v, _theBuffer, _valueSize);
+    setTag(pos1, i, hashToTag(hash1));
+    // the pair leaving the table takes its reference bit with it
+    clearReferenceBit(pos1 * SlotsPerBucket + i);
     if (kPtr != nullptr && vPtr != nullptr) {
       *kPtr = kTable;
       *vPtr = vTable;
     }
+    _statistics->kicks.add();
     return 1;
   }
 
+  int insertIntoBuckets(Key const& k, uint64_t hash1, uint64_t hash2,
+                        Value const* v, Key** kPtr, Value** vPtr) {
+    // the first step of insert, which changes neither k nor *v: returns -1
+    // if k is in one of its two buckets, 0 if the pair was put into the
+    // first free slot of them, and 1 if both are full, in which case the
+    // table is unchanged, and insert would have to displace a pair. Both
+    // buckets are searched for k before a free slot is taken, since a free
+    // slot may come before k after a remove.
+    uint64_t pos[2] = {hashToPos(hash1), hashToPos(hash2)};
+    Key* kFree = nullptr;
+    uint64_t posFree = 0;
+    uint64_t slotFree = 0;
+    for (int b = 0; b < 2; ++b) {
+      for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
+        Key* kTable = findSlotKey(pos[b], i);
+        if (kTable->empty()) {
+          if (kFree == nullptr) {
+            kFree = kTable;
+            posFree = pos[b];
+            slotFree = i;
+          }
+        } else if (_compKey(*kTable, k)) {
+          return -1;
+        }
+      }
+    }
+    if (kFree == nullptr) {
+      return 1;
+    }
+    Value* vTable = findSlotValue(posFree, slotFree);
+    beginWrite(posFree);
+    *kFree = k;
+    std::memcpy(vTable, v, _valueSize);
+    setTag(posFree, slotFree, hashToTag(hash1));
+    _nrUsed.fetch_add(1, std::memory_order_relaxed);
+    if (kPtr != nullptr && vPtr != nullptr) {
+      *kPtr = kFree;
+      *vPtr = vTable;
+    }
+    return 0;
+  }
+
   void remove(Key* k, Value* v) {
     // remove the pair to which k and v point to in the table, this
     // pointer must have been returned by lookup before and no insert or
     // remove action must have been issued between that and this call.
+    beginWrite(bucketOf(k));
+    removeUnmarked(k, v);
+  }
+
+  bool insertIntoFreeSlot(Key const& k, Value const* v, uint64_t hash1,
+                          uint64_t hash2) {
+    // insert the pair (k, *v) into a free slot of one of its two buckets,
+    // without displacing anything. Returns false if both buckets are full.
+    // The caller must have checked that k is not yet in the table and must
+    // hold the stripe locks of both buckets with respect to the version
+    // stripes of the table, which are not marked by this. This is the only
+    // kind of insert which is safe to run concurrently with other such
+    // inserts and removeUnmarked on other buckets.
+    uint64_t pos[2] = {hashToPos(hash1), hashToPos(hash2)};
+    for (int b = 0; b < 2; ++b) {
+      for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
+        Key* kTable = findSlotKey(pos[b], i);
+        if (kTable->empty()) {
+          *kTable = k;
+          std::memcpy(findSlotValue(pos[b], i), v, _valueSize);
+          setTag(pos[b], i, hashToTag(hash1));
+          _nrUsed.fetch_add(1, std::memory_order_relaxed);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  bool findPath(uint64_t hash1, uint64_t hash2, Path& path, Key* keys) {
+    // breadth-first search for the shortest displacement path from one of
+    // the two buckets of a key with these hash values to a free slot, see
+    // Path. Returns false if there is none within the bounds. If keys is
+    // not null, copies of the keys to be moved are written to
+    // keys[0..path.length - 2], such that the path can be validated later.
+    struct Node {
+      uint64_t bucket;
+      int32_t parent;       // index of the node we came from, or -1
+      uint32_t parentSlot;  // slot in the parent's bucket which leads here
+      uint32_t depth;       // number of displacements to get here
+    };
+    Node nodes[MaxBfsNodes];
+    uint32_t tail = 0;
+    nodes[tail++] = Node{hashToPos(hash1), -1, 0, 0};
+    uint64_t pos2 = hashToPos(hash2);
+    if (pos2 != nodes[0].bucket) {
+      nodes[tail++] = Node{pos2, -1, 0, 0};
+    }
+    for (uint32_t head = 0; head < tail; ++head) {
+      Node node = nodes[head];
+      for (uint32_t i = 0; i < SlotsPerBucket; ++i) {
+        Key* kTable = findSlotKey(node.bucket, i);
+        if (kTable->empty()) {
+          // Walk back to the root to fill the path from its end:
+          path.length = node.depth + 1;
+          uint32_t step = node.depth;
+          path.buckets[step] = node.bucket;
+          path.slots[step] = i;
+          for (int32_t n = head; nodes[n].parent >= 0; n = nodes[n].parent) {
+            --step;
+            path.buckets[step] = nodes[nodes[n].parent].bucket;
+            path.slots[step] = nodes[n].parentSlot;
+            if (keys != nullptr) {
+              keys[step] = *findSlotKey(path.buckets[step], path.slots[step]);
+            }
+          }
+          return true;
+        }
+        if (node.depth < MaxPathLength && tail < MaxBfsNodes) {
+          // The pair could move to the other one of its two buckets, both
+          // hash values come from one computation as in insert:
+          uint64_t h1, h2;
+          DualHash<Key, HashKey1, HashKey2>::compute(_hasher1, _hasher2,
+                                                     *kTable, &h1, &h2);
+          uint64_t alt = hashToPos(h1);
+          if (alt == node.bucket) {
+            alt = hashToPos(h2);
+          }
+          // Paths must not visit a bucket twice:
+          bool visited = false;
+          for (int32_t n = head; n >= 0 && !visited; n = nodes[n].parent) {
+            visited = (nodes[n].bucket == alt);
+          }
+          if (!visited) {
+            nodes[tail++] = Node{alt, static_cast<int32_t>(head), i,
+                                 node.depth + 1};
+          }
+        }
+      }
+    }
+    return false;
+  }
+
+  bool pathValid(Path const& path, Key const* keys) const {
+    // check that path, found by findPath with these keys, can still be
+    // applied, that is, the same pairs are still in place and the last
+    // slot is still free.
+    for (uint32_t step = 0; step + 1 < path.length; ++step) {
+      if (!_compKey(*findSlotKey(path.buckets[step], path.slots[step]),
+                    keys[step])) {
+        return false;
+      }
+    }
+    return findSlotKey(path.buckets[path.length - 1],
+                       path.slots[path.length - 1])
+        ->empty();
+  }
+
+  void applyPath(Path const& path, Key const& k, Value const* v,
+                 uint64_t hash1, bool mark) {
+    // apply a path found by findPath, backwards, such that every move goes
+    // to a free slot, then put the pair (k, *v) into the first slot. If
+    // mark is false, the caller must hold the stripe locks of all buckets
+    // on the path instead.
+    for (uint32_t step = path.length - 1; step > 0; --step) {
+      uint64_t fromBucket = path.buckets[step - 1];
+      uint32_t fromSlot = path.slots[step - 1];
+      uint64_t toBucket = path.buckets[step];
+      uint32_t toSlot = path.slots[step];
+      if (mark) {
+        beginWrite(fromBucket);
+        beginWrite(toBucket);
+      }
+      *findSlotKey(toBucket, toSlot) =
+          std::move(*findSlotKey(fromBucket, fromSlot));
+      std::memcpy(findSlotValue(toBucket, toSlot),
+                  findSlotValue(fromBucket, fromSlot), _valueSize);
+      if (_useTags) {
+        _tags[toBucket * SlotsPerBucket + toSlot] =
+            _tags[fromBucket * SlotsPerBucket + fromSlot];
+      }
+      moveReferenceBit(fromBucket * SlotsPerBucket + fromSlot,
+                       toBucket * SlotsPerBucket + toSlot);
+    }
+    if (mark) {
+      beginWrite(path.buckets[0]);
+    }
+    *findSlotKey(path.buckets[0], path.slots[0]) = k;
+    std::memcpy(findSlotValue(path.buckets[0], path.slots[0]), v, _valueSize);
+    setTag(path.buckets[0], path.slots[0], hashToTag(hash1));
+    clearReferenceBit(path.buckets[0] * SlotsPerBucket + path.slots[0]);
+    _nrUsed.fetch_add(1, std::memory_order_relaxed);
+    _statistics->kicks.add(path.length - 1);
+  }
+
+  void removeUnmarked(Key* k, Value* v) {
+    // as remove, but without marking the bucket in the version stripes,
+    // the caller must hold the stripe lock of the bucket instead.
+    if (_useTags) {
+      _tags[slotIndexOf(k)] = 0;
+    }
+    clearReferenceBit(slotIndexOf(k));
     k->~Key();
     new (k) Key();
     std::memset(v, 0, _valueSize);
-    --_nrUsed;
+    _nrUsed.fetch_sub(1, std::memory_order_relaxed);
   }
 
   bool remove(Key const& k) {
@@ -328,60 +575,286 @@ class InternalCuckooMap {
   bool expungeRandom(Key& k, Value* v) {
     // attempt to expunge a random pair
     //
-    // If a suitable pair is not found with a few attempts, then false is
-    // returned
-    // and the table is unchanged, in this case k and *v are
-    // also unchanged. Otherwise, true is returned and k and *v are overwritten
-    // with the values of the expunged pair and 1 is returned.
+    // If the table is empty, then false is returned and the table is
+    // unchanged, in this case k and *v are also unchanged. Otherwise, true is returned, the pair is removed from
+    // the table and k and *v are overwritten with the values of the
+    // expunged pair.
 
+    _statistics->expunges.add();
     Key* kTable;
     Value* vTable;
+    if (!findRandomPair(kTable, vTable)) {
+      return false;
+    }
+    k = std::move(*kTable);
+    std::memcpy(v, vTable, _valueSize);
+    remove(kTable, vTable);
 
-    uint64_t hash;
-    uint64_t pos;
-    uint64_t slot;
-    bool foundPair = false;
-    for (unsigned i = 0; i < 1024; i++) {
-      hash = pseudoRandomHash();
-      pos = hashToPos(hash);
-      for (slot = 0; slot < SlotsPerBucket; slot++) {
-        kTable = findSlotKey(pos, slot);
+    return true;
+  }
+
+  bool findRandomPair(Key*& kOut, Value*& vOut) {
+    // point kOut and vOut to the slot of a random pair, found with a few
+    // attempts, in a sparse table the next pair after a random bucket, or
+    // return false if the table is empty
+    uint64_t pos = 0;
+    for (unsigned i = 0; i < 1024 + _size; i++) {
+      pos = (i < 1024) ? (pseudoRandomHash() & _sizeMask)
+                       : ((pos + 1) & _sizeMask);
+      for (uint64_t slot = 0; slot < SlotsPerBucket; slot++) {
+        Key* kTable = findSlotKey(pos, slot);
         if (!kTable->empty()) {
-          foundPair = true;
-          break;
+          kOut = kTable;
+          vOut = findSlotValue(pos, slot);
+          return true;
         }
       }
-      if (foundPair) break;
     }
-    if (!foundPair) return false;
+    return false;
+  }
 
-    kTable = findSlotKey(pos, slot);
-    vTable = findSlotValue(pos, slot);
-    Key kDummy = std::move(*kTable);
-    *kTable = std::move(k);
-    k = std::move(kDummy);
-    std::memcpy(_theBuffer, vTable, _valueSize);
-    std::memcpy(vTable, v, _valueSize);
-    std::memcpy(v, _theBuffer, _valueSize);
+  void enableReferenceBits() {
+    // keep a reference bit per slot for findUnreferenced, all clear
+    _referenceBits.assign((_capacity + 63) / 64, 0);
+  }
+
+  void reference(Key const* k) {
+    // set the reference bit of a slot pointer returned by lookup or insert
+    if (!_referenceBits.empty()) {
+      uint64_t i = slotIndexOf(k);
+      _referenceBits[i / 64] |= 1ULL << (i % 64);
+    }
+  }
+
+  bool findUnreferenced(uint64_t& hand, Key*& kOut, Value*& vOut) {
+    // CLOCK: go through the slots from index hand on, clearing the set
+    // reference bits of pairs (see enableReferenceBits), until a pair
+    // whose bit is clear is found, point kOut and vOut to it and move hand
+    // past it. At the end of the table, hand goes back to 0 and false is
+    // returned.
+    for (; hand < _capacity; ++hand) {
+      uint64_t pos = hand / SlotsPerBucket;
+      uint64_t slot = hand % SlotsPerBucket;
+      Key* kTable = findSlotKey(pos, slot);
+      if (kTable->empty()) {
+        continue;
+      }
+      uint64_t mask = 1ULL << (hand % 64);
+      if (!_referenceBits.empty() &&
+          (_referenceBits[hand / 64] & mask) != 0) {
+        _referenceBits[hand / 64] &= ~mask;
+        continue;
+      }
+      kOut = kTable;
+      vOut = findSlotValue(pos, slot);
+      ++hand;
+      return true;
+    }
+    hand = 0;
+    return false;
+  }
+
+  bool takeFromBucket(uint64_t pos, Key& k, Value* v) {
+    // if bucket pos holds a pair, remove one from the table, move it to k
+    // and *v and return true, otherwise return false
+    for (uint64_t slot = 0; slot < SlotsPerBucket; ++slot) {
+      Key* kTable = findSlotKey(pos, slot);
+      if (!kTable->empty()) {
+        Value* vTable = findSlotValue(pos, slot);
+        k = std::move(*kTable);
+        std::memcpy(v, vTable, _valueSize);
+        remove(kTable, vTable);
+        return true;
+      }
+    }
+    return false;
+  }
 
+  template <class Callback>
+  bool scan(uint64_t first, uint64_t end, Callback& callback) {
+    // call callback(Key*, Value*) for every pair in the buckets first to
+    // end - 1, in memory order, prefetching a few buckets ahead. With tags,
+    // the keys of empty buckets are not touched at all. If the callback
+    // returns ScanAction::Remove, the pair is removed, which moves no other
+    // pair, with ScanAction::Stop the scan ends and false is returned.
+    // The callback must not change the table otherwise.
+    for (uint64_t pos = first; pos < end; ++pos) {
+      if (pos + ScanPrefetchDistance < end) {
+        if (_useTags) {
+          __builtin_prefetch(_tags + (pos + ScanPrefetchDistance) *
+                                         SlotsPerBucket, 0, 0);
+        }
+        __builtin_prefetch(findSlotKey(pos + ScanPrefetchDistance, 0), 0, 0);
+      }
+      for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
+        Key* k = findSlotKey(pos, i);
+        if (_useTags ? (_tags[pos * SlotsPerBucket + i] == 0) : k->empty()) {
+          continue;
+        }
+        Value* v = findSlotValue(pos, i);
+        ScanAction action = callback(k, v);
+        if (action == ScanAction::Remove) {
+          remove(k, v);
+        } else if (action == ScanAction::Stop) {
+          return false;
+        }
+      }
+    }
     return true;
   }
 
+  void prefetch(uint64_t hash1, uint64_t hash2) const {
+    // issue prefetches for everything a later lookup with these hash values
+    // will touch, such that several lookups can overlap their cache misses.
+    uint64_t pos1 = hashToPos(hash1);
+    uint64_t pos2 = hashToPos(hash2);
+    if (_useTags) {
+      __builtin_prefetch(_tags + pos1 * SlotsPerBucket, 0, 3);
+      __builtin_prefetch(_tags + pos2 * SlotsPerBucket, 0, 3);
+    }
+    __builtin_prefetch(findSlotKey(pos1, 0), 0, 3);
+    __builtin_prefetch(findSlotKey(pos2, 0), 0, 3);
+  }
+
+  void setVersionStripes(VersionStripes* versions) { _versions = versions; }
+
+  void setStatistics(TableStatistics* statistics) {
+    // count into *statistics instead of the own counters, the tables of a
+    // map share one object
+    _statistics = statistics;
+  }
+
+  TableStatistics const& statistics() const { return *_statistics; }
+
+  uint64_t bucketFor(uint64_t hash) const { return hashToPos(hash); }
+
+  uint64_t bucketOf(Key const* k) const {
+    // bucket of a slot pointer returned by lookup or insert
+    return (reinterpret_cast<char const*>(k) - _base) / _keyBucketSize;
+  }
+
+  Value* valueOf(Key* k) const {
+    // value slot of a key slot pointer returned by lookup or insert
+    if (_splitLayout) {
+      return reinterpret_cast<Value*>(_base + _valuesOffset +
+                                      slotIndexOf(k) * _valueStride);
+    }
+    return reinterpret_cast<Value*>(reinterpret_cast<char*>(k) + _valueOffset);
+  }
+
+  uint64_t nrBuckets() const { return _size; }
+
+  bool save(char const* fileName) const {
+    // write the table to fileName, such that it can be attached to again
+    // with the constructor taking a file name, return whether this was
+    // successful
+    static_assert(std::is_trivially_copyable<Key>::value,
+                  "persistent tables need trivially copyable keys");
+    return writePersistentFile(fileName, persistentHeader(), _base,
+                               dataSize());
+  }
+
   uint64_t capacity() const { return _capacity; }
 
-  uint64_t nrUsed() const { return _nrUsed; }
+  static uint64_t capacityFor(uint64_t size) {
+    // the number of slots of a table constructed for size slots: a power
+    // of two of buckets, at least 16
+    uint64_t buckets = 16;
+    while (buckets < size / SlotsPerBucket) {
+      buckets <<= 1;
+    }
+    return buckets * SlotsPerBucket;
+  }
+
+  uint64_t nrUsed() const { return _nrUsed.load(std::memory_order_relaxed); }
+
+  uint64_t overfull() const { return ((nrUsed() << 4) > _threshold); }
 
-  uint64_t overfull() const { return ((_nrUsed << 4) > _threshold); }
+  // whether one more pair leaves the table not overfull
+  bool roomForOne() const { return (((nrUsed() + 1) << 4) <= _threshold); }
 
   uint64_t maxRounds() const { return 2 * _logSize; }
 
   uint64_t memoryUsage() const {
-    return sizeof(InternalCuckooMap) + _allocSize + _valueSize;
+    return sizeof(InternalCuckooMap) + _allocSize + _valueSize +
+           _referenceBits.size() * sizeof(uint64_t);
   }
 
  private:  // methods
+  void computeLayout(uint64_t size) {
+    // size is the requested number of slots
+    size_t mask = _valueAlign - 1;
+    _valueOffset = (_valueOffset + _valueAlign - 1) & (~mask);
+    size_t keyAlign = alignof(Key);
+    // Align the key and thus the slot at least as strong as the value!
+    // We assume two powers for all alignments.
+    if (keyAlign < _valueAlign) {
+      keyAlign = _valueAlign;
+    }
+    mask = keyAlign - 1;
+    _slotSize = _valueOffset + _valueSize;
+    _slotSize = (_slotSize + alignof(Key) - 1) & (~mask);
+    _keyBucketSize = _slotSize * SlotsPerBucket;
+    _valueStride = 0;
+    if (_splitLayout) {
+      // the slot only holds the key, values follow all keys
+      _slotSize = sizeof(Key);
+      _keyBucketSize = 64;
+      while (_keyBucketSize / 2 >= sizeof(Key) * SlotsPerBucket) {
+        _keyBucketSize /= 2;
+      }
+      if (_keyBucketSize < sizeof(Key) * SlotsPerBucket) {
+        _keyBucketSize = (sizeof(Key) * SlotsPerBucket + 63) & ~size_t(63);
+      }
+      _valueStride = (_valueSize + _valueAlign - 1) & ~(_valueAlign - 1);
+    }
+
+    // First find the smallest power of two that is not smaller than size:
+    _capacity = capacityFor(size);
+    _size = _capacity / SlotsPerBucket;
+    _logSize = 4;
+    while ((uint64_t(1) << _logSize) < _size) {
+      _logSize += 1;
+    }
+    _sizeMask = _size - 1;
+    _sizeShift = (64 - _logSize) / 2;
+    _threshold = _capacity * MaxLoadSixteenths;
+    _valuesOffset = 0;
+    _tagsOffset = _size * _keyBucketSize;
+    if (_splitLayout) {
+      _valuesOffset = (_tagsOffset + 63) & ~uint64_t(63);
+      _tagsOffset = _valuesOffset + _size * SlotsPerBucket * _valueStride;
+    }
+    _allocSize = _tagsOffset + (_useTags ? _size * SlotsPerBucket : 0) +
+                 64;  // give 64 bytes padding to enable 64-byte alignment
+  }
+
+  uint64_t dataSize() const {
+    // bytes of slots and tags, as written by save
+    return _tagsOffset + (_useTags ? _size * SlotsPerBucket : 0);
+  }
+
+  PersistentHeader persistentHeader() const {
+    PersistentHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "CUCKOOT1", sizeof(header.magic));
+    header.version = 1;
+    header.flags = (_useTags ? 1 : 0) | (_splitLayout ? 2 : 0);
+    header.size = _size;
+    header.nrUsed = nrUsed();
+    Key probe;  // all bytes zero, to not depend on padding
+    std::memset(static_cast<void*>(&probe), 0, sizeof(Key));
+    header.hashCheck = _hasher1(probe) ^ (_hasher2(probe) << 1);
+    header.keySize = sizeof(Key);
+    header.slotSize = _slotSize;
+    header.valueSize = _valueSize;
+    header.valueOffset = _splitLayout ? _valuesOffset : _valueOffset;
+    header.extra = SlotsPerBucket;
+    return header;
+  }
+
   Key* findSlotKey(uint64_t pos, uint64_t slot) const {
-    char* address = _base + _slotSize * (pos * SlotsPerBucket + slot);
+    char* address = _base + _keyBucketSize * pos + _slotSize * slot;
     auto ret = reinterpret_cast<Key*>(address);
     check(ret, true);
     return ret;
@@ -389,7 +862,10 @@ class InternalCuckooMap {
 
   Value* findSlotValue(uint64_t pos, uint64_t slot) const {
     char* address =
-        _base + _slotSize * (pos * SlotsPerBucket + slot) + _valueOffset;
+        _splitLayout
+            ? _base + _valuesOffset +
+                  _valueStride * (pos * SlotsPerBucket + slot)
+            : _base + _keyBucketSize * pos + _slotSize * slot + _valueOffset;
     auto ret = reinterpret_cast<Value*>(address);
     check(ret, false);
     return ret;
@@ -402,7 +878,7 @@ class InternalCuckooMap {
         _allocSize) {
     */
     // MMAP ALLOCATION
-    if ((address - reinterpret_cast<char*>(_allocBase)) +
+    if ((address - _memory.begin()) +
             (isKey ? _slotSize : _valueSize) - 1 >=
         _allocSize) {
       std::cout << "ALARM" << std::endl;
@@ -411,8 +887,73 @@ class InternalCuckooMap {
     return false;
   }
 
+  void moveReferenceBit(uint64_t from, uint64_t to) {
+    // the reference bit of a pair moving from slot index from to slot
+    // index to goes with it, the slot it leaves is clear like every free one
+    if (!_referenceBits.empty()) {
+      uint64_t bit = (_referenceBits[from / 64] >> (from % 64)) & 1;
+      _referenceBits[from / 64] &= ~(1ULL << (from % 64));
+      _referenceBits[to / 64] =
+          (_referenceBits[to / 64] & ~(1ULL << (to % 64))) | (bit << (to % 64));
+    }
+  }
+
+  void clearReferenceBit(uint64_t i) {
+    if (!_referenceBits.empty()) {
+      _referenceBits[i / 64] &= ~(1ULL << (i % 64));
+    }
+  }
+
+  uint64_t slotIndexOf(Key const* k) const {
+    // index of a key slot in all slots, as for the tags
+    uint64_t offset = reinterpret_cast<char const*>(k) - _base;
+    return (offset / _keyBucketSize) * SlotsPerBucket +
+           (offset % _keyBucketSize) / _slotSize;
+  }
+
   uint64_t hashToPos(uint64_t hash) const { return (hash >> _sizeShift) & _sizeMask; }
 
+  // The tag uses the lowest bits of the first hash, which are not used for
+  // the position unless the table is huge. 0 marks an empty slot.
+  static uint8_t hashToTag(uint64_t hash) {
+    uint8_t tag = static_cast<uint8_t>(hash & 0xff);
+    return tag ? tag : 1;
+  }
+
+  void beginWrite(uint64_t pos) {
+    if (_versions != nullptr) {
+      _versions->writeBegin(pos);
+    }
+  }
+
+  void setTag(uint64_t pos, uint64_t slot, uint8_t tag) {
+    if (_useTags) {
+      _tags[pos * SlotsPerBucket + slot] = tag;
+    }
+  }
+
+  uint32_t matchTags(uint64_t pos1, uint64_t pos2, uint8_t tag) const {
+    if (SlotsPerBucket <= 4) {
+      // the tags of both buckets fit into one word, a tag is never 0
+      uint32_t t1 = 0, t2 = 0;
+      std::memcpy(&t1, _tags + pos1 * SlotsPerBucket, SlotsPerBucket);
+      std::memcpy(&t2, _tags + pos2 * SlotsPerBucket, SlotsPerBucket);
+      return matchTagBytes(static_cast<uint64_t>(t1) |
+                               (static_cast<uint64_t>(t2)
+                                << (8 * SlotsPerBucket)),
+                           tag);
+    }
+    uint32_t hits = 0;
+    for (uint32_t i = 0; i < SlotsPerBucket; i += 8) {
+      uint64_t t1, t2;
+      std::memcpy(&t1, _tags + pos1 * SlotsPerBucket + i, sizeof(t1));
+      std::memcpy(&t2, _tags + pos2 * SlotsPerBucket + i, sizeof(t2));
+      hits |= (matchTagBytes(t1, tag) << i) |
+              (matchTagBytes(t2, tag) << (SlotsPerBucket + i));
+    }
+    return hits;
+  }
+
   uint8_t pseudoRandomChoice() {
     _randState = _randState * 997 + 17;  // ignore overflows
     return static_cast<uint8_t>((_randState >> 37) & 0xff);
@@ -430,24 +971,33 @@ class InternalCuckooMap {
 
   size_t _valueSize;    // size in bytes reserved for one element
   size_t _valueAlign;   // alignment for value type
-  size_t _slotSize;     // total size of a slot
+  size_t _slotSize;     // total size of a slot, only the key if split
   size_t _valueOffset;  // offset from start of slot to value start
+  size_t _keyBucketSize;   // distance of the keys of adjacent buckets
+  size_t _valueStride;     // distance of adjacent values if split
+  uint64_t _valuesOffset;  // offset of the value array if split
 
   uint64_t _logSize;    // logarithm (base 2) of number of buckets
   uint64_t _size;       // number of buckets, == 2^_logSize
   uint64_t _sizeMask;   // used to mask out some bits from the hash
   uint32_t _sizeShift;  // used to shift the bits down to get a position
-  uint64_t _allocSize;  // number of allocated bytes,
-                        // == _size * SlotsPerBucket * _slotSize + 64
+  uint64_t _allocSize;  // number of allocated bytes, == dataSize() + 64
   bool _useMmap;
+  bool _useTags;        // keep a tag byte per slot for the lookup probe
+  bool _useBfs;         // search displacement paths breadth-first
+  bool _splitLayout;    // keys and values in separate arrays
+  uint64_t _tagsOffset; // offset of the tag array from _base
+  uint8_t* _tags;       // one tag per slot, 0 for empty, only with _useTags
+  VersionStripes* _versions;  // marked before changing a bucket, if set
+  TableStatistics _ownStatistics;  // see setStatistics
+  TableStatistics* _statistics;    // counted into, &_ownStatistics or shared
+  TableMemory _memory;  // owns the slots and tags
   char* _base;  // pointer to allocated space, 64-byte aligned
-  char _tmpFileName[L_tmpnam + 1];
-  int _tmpFile;
-  char* _allocBase;     // base of original allocation
   char* _theBuffer;     // pointer to an area of size _valueSize for value swap
-  uint64_t _nrUsed;     // number of pairs stored in the table
+  std::atomic<uint64_t> _nrUsed;  // number of pairs stored in the table
   uint64_t _capacity;   // number of slots
   uint64_t _threshold;  // used for overfull() calculation
+  std::vector<uint64_t> _referenceBits;  // per slot, only if enabled
 
   HashKey1 _hasher1;  // Instance to compute the first hash function
   HashKey2 _hasher2;  // Instance to compute the second hash function
@@ -1,104 +1,940 @@
 #ifndef SHARDED_MAP_H
 #define SHARDED_MAP_H 1
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Pairs are distributed over the shards by a hash of their key, every
+// shard is a map of its own with its own mutex. The batch operations
+// (lookupBatch, insertBatch, removeBatch) group their keys by shard and
+// take the mutex of every shard involved only once.
+// The shards are found without a lock through a directory of 2^depth
+// entries, indexed by the lowest depth bits of the hash as in extendible
+// hashing, a shard covering fewer bits appears in several entries.
+// splitShard and splitShards split a shard in two, each covering one more
+// bit, while the map stays in use: the pairs move to the new shards in
+// short steps under the mutex of the old one, and meanwhile operations on
+// the new shards look into the old one first. Pairs only ever move from
+// the old shard to the new ones, so nothing is missed. Every operation
+// registers with its shard by an atomic counter, such that a split waits
+// for the operations which still use the old shard before freeing it.
+// Splitting needs CuckooMap shards and is not possible in affinity mode.
+// With setAffinity(true), a thread owning one shard of a partitioned,
+// write heavy workload can write through an Affinity object for its shard
+// (see affinity()), so that its writes always go to the same shard and
+// the same cache lines, instead of being spread over all shards. A pair
+// then does not necessarily live in the shard of its hash, so lookups and
+// removes which miss there go on to the other shards. Every key must only
+// ever be written through one route, either one Affinity or the map
+// itself, otherwise it might end up in two shards. Lookups returning a
+// Finding for other key types (transparent lookups) only look at the shard
+// of the hash.
+// With CuckooMap shards, a key is hashed once per operation: the shard
+// index is folded from the first hash value of the shards, and both values
+// are passed on to the shard (see CuckooMap::hash), so with FirstOf128 and
+// SecondOf128 one 128-bit hash yields the shard and both cuckoo positions.
+// Other maps as shards hash the key again, as do the batch operations.
+// As with a single map, a thread holding a Finding must not call other
+// methods of the ShardedMap, which may need the same mutex.
+
 template<class InternalMap>
 class ShardedMap {
 
-  int32_t _logNrShards;     // logarithm base
-  uint32_t _nrShards;       // = 2^_logNrShards
-  uint64_t _shardMask;      // = _nrShards - 1
+  typedef typename InternalMap::KeyType Key;
+  typedef typename InternalMap::ValueType Value;
+  typedef typename InternalMap::HashKey1Type HashKey1;
+  typedef typename InternalMap::HashKey2Type HashKey2;
+
+  static constexpr int32_t MaxDepth = 16;  // at most 2^16 shards
+  static constexpr size_t SplitStepBuckets = 256;  // per hold of the mutex
+
+  struct Shard {
+    // a map and the hash bits it covers
+    std::unique_ptr<InternalMap> map;  // gone once split and drained
+    AllocationPolicy policy;
+    int32_t depth;                  // number of lowest hash bits covered
+    uint64_t bits;                  // their value
+    std::atomic<Shard*> source;     // the shard it is being split off
+    std::atomic<bool> retired;      // split, no new operations
+    Shard* targets[2];              // once split, by the next bit
+    std::atomic<uint32_t> users;    // operations registered, see Use
+    char padding[64 - sizeof(std::atomic<uint32_t>)];
+
+    Shard(InternalMap* m, AllocationPolicy const& p, int32_t d, uint64_t b,
+          Shard* s)
+        : map(m), policy(p), depth(d), bits(b), source(s), retired(false),
+          users(0) {
+      targets[0] = nullptr;
+      targets[1] = nullptr;
+    }
+  };
+
+  struct Directory {
+    int32_t depth;
+    std::unique_ptr<std::atomic<Shard*>[]> entries;  // 2^depth
+
+    explicit Directory(int32_t d)
+        : depth(d), entries(new std::atomic<Shard*>[uint64_t(1) << d]) {}
+
+    uint64_t mask() const { return (uint64_t(1) << depth) - 1; }
+  };
+
+  class Use {
+    // the registration of an operation with a shard and, while that is
+    // being split off another one, with the other one as well, which
+    // keeps the maps used alive
+   public:
+    Use() : _shard(nullptr), _source(nullptr) {}
+
+    ~Use() {
+      if (_source != nullptr) {
+        _source->users.fetch_sub(1, std::memory_order_release);
+      }
+      if (_shard != nullptr) {
+        _shard->users.fetch_sub(1, std::memory_order_release);
+      }
+    }
+
+    Use(Use const&) = delete;
+    Use& operator=(Use const&) = delete;
+
+    bool enter(Shard* s) {
+      // fails for a retired shard, the counter and the flag are set and
+      // read in opposite orders by the operation and the split
+      s->users.fetch_add(1);
+      if (s->retired.load()) {
+        s->users.fetch_sub(1);
+        return false;
+      }
+      _shard = s;
+      Shard* source = s->source.load();
+      if (source != nullptr) {
+        source->users.fetch_add(1);
+        if (s->source.load() != nullptr) {
+          _source = source;
+        } else {
+          source->users.fetch_sub(1);
+        }
+      }
+      return true;
+    }
+
+    Shard* shard() const { return _shard; }
+
+    InternalMap& map() const { return *_shard->map; }
+
+    InternalMap* source() const {
+      // look into this one before map(), if not nullptr
+      return (_source != nullptr) ? _source->map.get() : nullptr;
+    }
+
+   private:
+    Shard* _shard;
+    Shard* _source;
+  };
 
  public:
 
   ShardedMap(size_t firstSize,
              uint32_t nrShards = 8,
              size_t valueSize = sizeof(typename InternalMap::ValueType),
-             size_t valueAlign = alignof(typename InternalMap::ValueType)) {
+             size_t valueAlign = alignof(typename InternalMap::ValueType),
+             std::vector<AllocationPolicy> const& policies =
+                 std::vector<AllocationPolicy>()) {
+    // policies[s] places the memory of shard s, for example on the NUMA
+    // node (see currentNumaNode()) of the thread mostly working on it,
+    // shards without an entry use the default policy, shards split off
+    // one use its policy
 
-    _logNrShards = 0;
-    _nrShards = 1;
-    while (_nrShards < nrShards && _logNrShards < 16) {
-      _logNrShards += 1;
-      _nrShards <<= 1;
+    _firstSize = firstSize;
+    _valueSize = valueSize;
+    _valueAlign = valueAlign;
+    _affinity = false;
+    _splitting = nullptr;
+    int32_t depth = 0;
+    while ((uint32_t(1) << depth) < nrShards && depth < MaxDepth) {
+      depth += 1;
     }
-    _shardMask = _nrShards - 1;
 
-    _tables.reserve(_nrShards);
-    for (uint32_t s = 0; s < _nrShards; ++s) {
-      auto t = new InternalMap(firstSize, valueSize, valueAlign);
-      try {
-        _tables.emplace_back(t);
-      } catch (...) {
-        delete t;
-        throw;
-      }
+    std::unique_ptr<Directory> dir(new Directory(depth));
+    _directories.push_back(std::move(dir));
+    Directory* d = _directories.back().get();
+    for (uint64_t s = 0; s <= d->mask(); ++s) {
+      std::unique_ptr<Shard> shard = newShard(
+          firstSize, s < policies.size() ? policies[s] : AllocationPolicy(),
+          depth, s, nullptr);
+      d->entries[s].store(shard.get(), std::memory_order_relaxed);
+      _shards.push_back(std::move(shard));
     }
+    _nrShards.store(static_cast<uint32_t>(d->mask() + 1));
+    _directory.store(d, std::memory_order_release);
   }
 
   typename InternalMap::Finding lookup(typename InternalMap::KeyType const& k) {
-    uint32_t shard = findShard(k);
-    InternalMap& t = *_tables[shard];
-    return t.lookup(k);
+    Use use;
+    KeyHash h = keyHash(k);
+    route(use, h.shard);
+    InternalMap* source = use.source();
+    InternalMap& first = (source != nullptr) ? *source : use.map();
+    typename InternalMap::Finding f = Shards::lookup(first, k, h);
+    if (source != nullptr && f.found() == 0) {
+      Shards::lookup(use.map(), k, h, f);
+    }
+    if (_affinity && f.found() == 0) {
+      Directory* dir = _directory.load(std::memory_order_acquire);
+      for (uint64_t s = 0; s <= dir->mask(); ++s) {
+        Shard* other = dir->entries[s].load(std::memory_order_acquire);
+        if (other != use.shard() && other->map->lookup(k, f)) {
+          break;
+        }
+      }
+    }
+    return f;
   }
 
   bool lookup(typename InternalMap::KeyType const& k,
               typename InternalMap::Finding& f) {
-    uint32_t shard = findShard(k);
-    InternalMap& t = *_tables[shard];
-    return t.lookup(k, f);
+    Use use;
+    KeyHash h = keyHash(k);
+    route(use, h.shard);
+    InternalMap* source = use.source();
+    if ((source != nullptr && Shards::lookup(*source, k, h, f)) ||
+        Shards::lookup(use.map(), k, h, f)) {
+      return true;
+    }
+    if (_affinity) {
+      Directory* dir = _directory.load(std::memory_order_acquire);
+      for (uint64_t s = 0; s <= dir->mask(); ++s) {
+        Shard* other = dir->entries[s].load(std::memory_order_acquire);
+        if (other != use.shard() && other->map->lookup(k, f)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  bool lookupCopy(typename InternalMap::KeyType const& k,
+                  typename InternalMap::ValueType* v) {
+    Use use;
+    KeyHash h = keyHash(k);
+    route(use, h.shard);
+    InternalMap* source = use.source();
+    return (source != nullptr && Shards::lookupCopy(*source, k, h, v)) ||
+           Shards::lookupCopy(use.map(), k, h, v) ||
+           (_affinity && lookupCopyElsewhere(k, v, use.shard()));
+  }
+
+  template <class KeyLike, class C = typename InternalMap::CompKeyType,
+            class = typename C::is_transparent>
+  typename InternalMap::Finding lookup(KeyLike const& k) {
+    // transparent lookups, see CuckooMap
+    Use use;
+    route(use, shardHash(k));
+    InternalMap* source = use.source();
+    InternalMap& first = (source != nullptr) ? *source : use.map();
+    typename InternalMap::Finding f = first.lookup(k);
+    if (source != nullptr && f.found() == 0) {
+      use.map().lookup(k, f);
+    }
+    return f;
+  }
+
+  template <class KeyLike, class C = typename InternalMap::CompKeyType,
+            class = typename C::is_transparent>
+  bool lookupCopy(KeyLike const& k, typename InternalMap::ValueType* v) {
+    Use use;
+    route(use, shardHash(k));
+    InternalMap* source = use.source();
+    return (source != nullptr && source->lookupCopy(k, v)) ||
+           use.map().lookupCopy(k, v) ||
+           (_affinity && lookupCopyElsewhere(k, v, use.shard()));
   }
 
   bool insert(typename InternalMap::KeyType const& k,
               typename InternalMap::ValueType const* v) {
-    uint32_t shard = findShard(k);
-    InternalMap& t = *_tables[shard];
-    return t.insert(k, v);
+    Use use;
+    KeyHash h = keyHash(k);
+    route(use, h.shard);
+    InternalMap* source = use.source();
+    if (source != nullptr) {
+      // nothing is inserted there any more, so a key not found now never
+      // shows up there later
+      typename InternalMap::Finding f = Shards::lookup(*source, k, h);
+      if (f.found() != 0) {
+        return false;
+      }
+    }
+    return Shards::insert(use.map(), k, h, v);
   }
 
   bool insert(typename InternalMap::KeyType const& k,
               typename InternalMap::ValueType const* v,
               typename InternalMap::Finding& f) {
-    uint32_t shard = findShard(k);
-    InternalMap& t = *_tables[shard];
-    return t.insert(k, v, f);
+    Use use;
+    KeyHash h = keyHash(k);
+    route(use, h.shard);
+    InternalMap* source = use.source();
+    if (source != nullptr && Shards::lookup(*source, k, h, f)) {
+      Shards::lookup(use.map(), k, h, f);
+      return false;
+    }
+    return Shards::insert(use.map(), k, h, v, f);
+  }
+
+  bool insertOrAssign(Key const& k, Value const* v) {
+    // see CuckooMap, only for maps of CuckooMaps
+    return upsert(k, [this, v](Value* slot, bool) {
+      std::memcpy(slot, v, _valueSize);
+    });
+  }
+
+  template <class Updater>
+  bool upsert(Key const& k, Updater updater) {
+    // see CuckooMap, a pair the split of its shard has not moved yet is
+    // updated where it is
+    Use use;
+    KeyHash h = keyHash(k);
+    route(use, h.shard);
+    InternalMap* source = use.source();
+    if (source != nullptr) {
+      typename InternalMap::Finding f = Shards::lookup(*source, k, h);
+      if (f.found() != 0) {
+        updater(f.value(), false);
+        return false;
+      }
+    }
+    return Shards::upsert(use.map(), k, h, updater);
   }
 
   bool remove(typename InternalMap::KeyType const& k) {
-    uint32_t shard = findShard(k);
-    InternalMap& t = *_tables[shard];
-    return t.remove(k);
+    Use use;
+    KeyHash h = keyHash(k);
+    route(use, h.shard);
+    InternalMap* source = use.source();
+    return (source != nullptr && Shards::remove(*source, k, h)) ||
+           Shards::remove(use.map(), k, h) ||
+           (_affinity && removeElsewhere(k, use.shard()));
   }
 
   bool remove(typename InternalMap::Finding& f) {
-    uint32_t shard = findShard(*f.key());
-    InternalMap& t = *_tables[shard];
-    return t.remove(f);
+    // the pair is in the map whose mutex f holds
+    return f.map() != nullptr && f.map()->remove(f);
+  }
+
+  size_t lookupBatch(Key const* keys, size_t n, Value* values, bool* found) {
+    // look up n keys as CuckooMap::lookupBatch does, with one acquisition
+    // of the mutex per shard involved: the keys are grouped by shard and
+    // every group is looked up as a batch of its shard, with prefetching.
+    // Returns the number of keys found.
+    char* out = reinterpret_cast<char*>(values);
+    std::vector<Key> groupKeys;
+    std::vector<char> groupValues;
+    std::unique_ptr<bool[]> groupFound(new bool[n]);
+    size_t nrFound = 0;
+    grouped(keys, n,
+            [&](Use& use, size_t const* indexes, size_t count) {
+              groupKeys.resize(count);
+              for (size_t i = 0; i < count; ++i) {
+                groupKeys[i] = keys[indexes[i]];
+              }
+              groupValues.resize(count * _valueSize);
+              nrFound += use.map().lookupBatch(
+                  groupKeys.data(), count,
+                  reinterpret_cast<Value*>(groupValues.data()),
+                  groupFound.get());
+              for (size_t i = 0; i < count; ++i) {
+                size_t j = indexes[i];
+                found[j] = groupFound[i];
+                if (found[j]) {
+                  std::memcpy(out + j * _valueSize,
+                              &groupValues[i * _valueSize], _valueSize);
+                } else if (_affinity) {
+                  Value* v = reinterpret_cast<Value*>(out + j * _valueSize);
+                  found[j] = lookupCopyElsewhere(keys[j], v, use.shard());
+                  nrFound += found[j] ? 1 : 0;
+                }
+              }
+            },
+            [&](size_t j) {
+              Value* v = reinterpret_cast<Value*>(out + j * _valueSize);
+              found[j] = lookupCopy(keys[j], v);
+              nrFound += found[j] ? 1 : 0;
+            });
+    return nrFound;
+  }
+
+  size_t insertBatch(Key const* keys, Value const* values, size_t n) {
+    // insert n pairs as CuckooMap::bulkLoad does, with one acquisition of
+    // the mutex per shard involved, and return the number of pairs
+    // inserted. Keys already in the map and all but the first of equal
+    // keys are skipped.
+    char const* in = reinterpret_cast<char const*>(values);
+    std::vector<Key> groupKeys;
+    std::vector<char> groupValues;
+    size_t nrInserted = 0;
+    grouped(keys, n,
+            [&](Use& use, size_t const* indexes, size_t count) {
+              groupKeys.resize(count);
+              groupValues.resize(count * _valueSize);
+              for (size_t i = 0; i < count; ++i) {
+                groupKeys[i] = keys[indexes[i]];
+                std::memcpy(&groupValues[i * _valueSize],
+                            in + indexes[i] * _valueSize, _valueSize);
+              }
+              nrInserted += use.map().bulkLoad(
+                  groupKeys.data(),
+                  reinterpret_cast<Value const*>(groupValues.data()), count);
+            },
+            [&](size_t j) {
+              Value const* v =
+                  reinterpret_cast<Value const*>(in + j * _valueSize);
+              nrInserted += insert(keys[j], v) ? 1 : 0;
+            });
+    return nrInserted;
+  }
+
+  size_t removeBatch(Key const* keys, size_t n) {
+    // remove the pairs with the n given keys with one acquisition of the
+    // mutex per shard involved, return the number of pairs removed
+    std::vector<Key> groupKeys;
+    std::unique_ptr<bool[]> removed(new bool[n]);
+    size_t nrRemoved = 0;
+    grouped(keys, n,
+            [&](Use& use, size_t const* indexes, size_t count) {
+              groupKeys.resize(count);
+              for (size_t i = 0; i < count; ++i) {
+                groupKeys[i] = keys[indexes[i]];
+              }
+              nrRemoved += use.map().removeBatch(groupKeys.data(), count,
+                                                 removed.get());
+              for (size_t i = 0; _affinity && i < count; ++i) {
+                if (!removed[i] && removeElsewhere(groupKeys[i], use.shard())) {
+                  ++nrRemoved;
+                }
+              }
+            },
+            [&](size_t j) { nrRemoved += remove(keys[j]) ? 1 : 0; });
+    return nrRemoved;
+  }
+
+  class Affinity {
+    // the writes of a thread owning one shard, see above; lookups and
+    // removes try the own shard first. Cheap to copy, valid as long as
+    // the map.
+   public:
+    uint32_t shard() const { return _index; }
+
+    bool insert(Key const& k, Value const* v) {
+      return _shard->map->insert(k, v);
+    }
+
+    size_t insertBatch(Key const* keys, Value const* values, size_t n) {
+      // all under one acquisition of the mutex of the shard, see bulkLoad
+      return _shard->map->bulkLoad(keys, values, n);
+    }
+
+    bool lookupCopy(Key const& k, Value* v) {
+      return _shard->map->lookupCopy(k, v) ||
+             _map->lookupCopyElsewhere(k, v, _shard);
+    }
+
+    bool remove(Key const& k) {
+      return _shard->map->remove(k) || _map->removeElsewhere(k, _shard);
+    }
+
+   private:
+    friend class ShardedMap;
+    Affinity(ShardedMap* map, Shard* shard, uint32_t index)
+        : _map(map), _shard(shard), _index(index) {}
+
+    ShardedMap* _map;
+    Shard* _shard;
+    uint32_t _index;
+  };
+
+  void setAffinity(bool affinity) {
+    // allow writes through Affinity objects, see above, must be set before
+    // the map is used by several threads and not be switched off again
+    // while pairs might live outside the shard of their hash
+    _affinity = affinity;
+  }
+
+  Affinity affinity(uint32_t shard) {
+    // the writes of the calling thread to shard modulo nrShards(), for
+    // example with shard the index of the thread
+    if (!_affinity) {
+      throw std::runtime_error("ShardedMap is not in affinity mode");
+    }
+    Directory* dir = _directory.load(std::memory_order_acquire);
+    uint32_t index = static_cast<uint32_t>(shard & dir->mask());
+    return Affinity(this, dir->entries[index].load(std::memory_order_acquire),
+                    index);
+  }
+
+  uint32_t nrShards() const {
+    // the number of shards, a split counts once it is complete
+    return _nrShards.load(std::memory_order_relaxed);
+  }
+
+  bool splitShard(typename InternalMap::KeyType const& k) {
+    // split the shard of k in two, for example a hot one, return false if
+    // it covers MaxDepth bits already. Waits for a split running in
+    // another thread. Readers and writers go on meanwhile, see above.
+    std::lock_guard<std::mutex> guard(_splitMutex);
+    startSplitting();
+    Shard* s;
+    {
+      std::lock_guard<std::mutex> structure(_structureMutex);
+      Directory* dir = _directory.load(std::memory_order_relaxed);
+      s = dir->entries[shardHash(k) & dir->mask()].load(
+          std::memory_order_relaxed);
+    }
+    if (s->depth >= MaxDepth) {
+      return false;
+    }
+    split(s);
+    return true;
+  }
+
+  size_t splitShards(uint64_t maxPairs) {
+    // split every shard with more than maxPairs pairs, and the new shards
+    // again, until no shard has more or covers MaxDepth bits. Returns the
+    // number of splits, see splitShard.
+    std::lock_guard<std::mutex> guard(_splitMutex);
+    startSplitting();
+    size_t nrSplits = 0;
+    while (true) {
+      Shard* s = nullptr;
+      {
+        std::lock_guard<std::mutex> structure(_structureMutex);
+        Directory* dir = _directory.load(std::memory_order_relaxed);
+        for (uint64_t i = 0; i <= dir->mask() && s == nullptr; ++i) {
+          Shard* t = dir->entries[i].load(std::memory_order_relaxed);
+          if ((i >> t->depth) == 0 && t->depth < MaxDepth &&
+              t->map->nrUsed() > maxPairs) {
+            s = t;
+          }
+        }
+      }
+      if (s == nullptr) {
+        return nrSplits;
+      }
+      split(s);
+      ++nrSplits;
+    }
+  }
+
+  template <class Callback>
+  bool scan(Callback callback, uint32_t nrThreads = 1,
+            bool snapshot = false) {
+    // call callback(Key const&, Value const*) for every pair, see
+    // CuckooMap::scan, with nrThreads workers which take the shards one at
+    // a time, so the callback must be safe to call concurrently. Every
+    // shard is scanned under its own mutex, so each shard is a consistent
+    // snapshot, but two shards may be seen at different times. With
+    // snapshot, all shards are locked before the first one is scanned and
+    // released after the last one, such that all pairs are from the same
+    // moment, at the cost of blocking all writers for the whole scan.
+    // Returns false if a callback returned ScanAction::Stop, the other
+    // workers then stop as well. A split in progress is completed first,
+    // new ones wait for the end of the scan.
+    std::lock_guard<std::mutex> guard(_splitMutex);
+    if (_splitting != nullptr) {
+      drain(_splitting);
+    }
+    std::vector<InternalMap*> maps;
+    forEachMap([&maps](InternalMap& m) { maps.push_back(&m); });
+    uint32_t nrMaps = static_cast<uint32_t>(maps.size());
+    std::unique_ptr<typename InternalMap::Finding[]> holds;
+    if (snapshot) {
+      // the Findings release the mutexes on the way out, in this thread
+      holds.reset(new typename InternalMap::Finding[nrMaps]);
+      for (uint32_t shard = 0; shard < nrMaps; ++shard) {
+        maps[shard]->acquire(holds[shard]);
+      }
+    }
+    std::atomic<uint32_t> nextShard(0);
+    std::atomic<bool> stopped(false);
+    auto work = [&maps, nrMaps, &callback, &holds, &nextShard, &stopped]() {
+      auto visit = [&callback, &stopped](Key const& k,
+                                         Value const* v) -> ScanAction {
+        if (stopped.load(std::memory_order_relaxed)) {
+          return ScanAction::Stop;
+        }
+        ScanAction action = callback(k, v);
+        if (action == ScanAction::Stop) {
+          stopped.store(true, std::memory_order_relaxed);
+        }
+        return action;
+      };
+      while (!stopped.load(std::memory_order_relaxed)) {
+        uint32_t shard = nextShard.fetch_add(1);
+        if (shard >= nrMaps) {
+          break;
+        }
+        if (holds) {
+          maps[shard]->scan(visit, holds[shard]);
+        } else {
+          maps[shard]->scan(visit);
+        }
+      }
+    };
+    std::vector<std::thread> workers;
+    for (uint32_t t = 1; t < nrThreads && t < nrMaps; ++t) {
+      workers.emplace_back(work);
+    }
+    work();
+    for (auto& w : workers) {
+      w.join();
+    }
+    return !stopped.load();
   }
 
   uint64_t nrUsed() {
+    // pairs being moved by a split may be counted twice or not at all
     uint64_t res = 0;
-    for (size_t shard = 0; shard < _tables.size(); ++shard) {
-      res += _tables[shard]->nrUsed();
-    }
+    forEachMap([&res](InternalMap& m) { res += m.nrUsed(); });
     return res;
   }
 
+  typename InternalMap::Statistics stats() {
+    // the sum of the hot path counters of all shards, see CuckooMap::stats
+    typename InternalMap::Statistics res = typename InternalMap::Statistics();
+    forEachMap([&res](InternalMap& m) { res.add(m.stats()); });
+    return res;
+  }
+
+  void resetStats() {
+    forEachMap([](InternalMap& m) { m.resetStats(); });
+  }
+
  private:
 
-  uint32_t findShard(typename InternalMap::KeyType const& k) {
-    uint64_t hash = _hasher1(k);
+  std::unique_ptr<Shard> newShard(size_t size, AllocationPolicy const& policy,
+                                  int32_t depth, uint64_t bits,
+                                  Shard* source) {
+    std::unique_ptr<InternalMap> map(
+        new InternalMap(size, _valueSize, _valueAlign, policy));
+    std::unique_ptr<Shard> shard(
+        new Shard(map.get(), policy, depth, bits, source));
+    map.release();
+    return shard;
+  }
+
+  void route(Use& use, uint64_t hash) {
+    // register use with the shard of the hash, which takes no lock
+    while (true) {
+      Directory* dir = _directory.load(std::memory_order_acquire);
+      std::atomic<Shard*>& entry = dir->entries[hash & dir->mask()];
+      Shard* s = entry.load(std::memory_order_acquire);
+      if (use.enter(s)) {
+        return;
+      }
+      // s is being split, its entries move on to the new shards soon
+      while (_directory.load(std::memory_order_acquire) == dir &&
+             entry.load(std::memory_order_acquire) == s) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  template <class Batch, class Single>
+  void grouped(Key const* keys, size_t n, Batch batch, Single single) {
+    // group the indexes of the keys by shard and call batch(use, indexes,
+    // count) for every group, with use registered with its shard, or
+    // single(index) for every key of a shard being split, which needs the
+    // single operations; equal keys stay in their order
+    Directory* dir = _directory.load(std::memory_order_acquire);
+    std::vector<Shard*> shards(n);
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) {
+      shards[i] = dir->entries[shardHash(keys[i]) & dir->mask()].load(
+          std::memory_order_acquire);
+      order[i] = i;
+    }
+    std::less<Shard*> before;
+    std::stable_sort(order.begin(), order.end(),
+              [&shards, &before](size_t a, size_t b) {
+                return before(shards[a], shards[b]);
+              });
+    for (size_t first = 0; first < n;) {
+      Shard* s = shards[order[first]];
+      size_t end = first + 1;
+      while (end < n && shards[order[end]] == s) {
+        ++end;
+      }
+      bool done = false;
+      {
+        Use use;
+        if (use.enter(s) && use.source() == nullptr) {
+          batch(use, &order[first], end - first);
+          done = true;
+        }
+      }
+      for (size_t i = first; !done && i < end; ++i) {
+        single(order[i]);
+      }
+      first = end;
+    }
+  }
+
+  template <class Visit>
+  void forEachMap(Visit visit) {
+    // visit(map) for the map of every shard and the one being split off,
+    // each once, maps stay alive while the structure is locked
+    std::lock_guard<std::mutex> structure(_structureMutex);
+    Directory* dir = _directory.load(std::memory_order_relaxed);
+    for (uint64_t i = 0; i <= dir->mask(); ++i) {
+      Shard* s = dir->entries[i].load(std::memory_order_relaxed);
+      if ((i >> s->depth) == 0) {
+        visit(*s->map);
+      }
+    }
+    if (_splitting != nullptr) {
+      visit(*_splitting->map);
+    }
+  }
+
+  void startSplitting() {
+    // with _splitMutex held, complete a split ended by an exception
+    if (_affinity) {
+      throw std::runtime_error("ShardedMap cannot split in affinity mode");
+    }
+    if (_splitting != nullptr) {
+      drain(_splitting);
+    }
+  }
+
+  void split(Shard* s) {
+    // with _splitMutex held: retire s, wait for the operations still using
+    // it, let its entries point to two new shards, which look into s as
+    // long as it has pairs, and move the pairs over
+    uint64_t size = s->map->nrUsed();
+    size = (size > _firstSize) ? size : _firstSize;
+    int32_t depth = s->depth;
+    std::unique_ptr<Shard> low =
+        newShard(size, s->policy, depth + 1, s->bits, s);
+    std::unique_ptr<Shard> high = newShard(
+        size, s->policy, depth + 1, s->bits | (uint64_t(1) << depth), s);
+    {
+      std::lock_guard<std::mutex> structure(_structureMutex);
+      Directory* dir = _directory.load(std::memory_order_relaxed);
+      if (depth == dir->depth) {
+        // twice the entries, the old directory may still be read
+        std::unique_ptr<Directory> larger(new Directory(depth + 1));
+        for (uint64_t i = 0; i <= larger->mask(); ++i) {
+          larger->entries[i].store(
+              dir->entries[i & dir->mask()].load(std::memory_order_relaxed),
+              std::memory_order_relaxed);
+        }
+        _directories.push_back(std::move(larger));
+        _directory.store(_directories.back().get(), std::memory_order_release);
+      }
+      _shards.reserve(_shards.size() + 2);
+      s->targets[0] = low.get();
+      s->targets[1] = high.get();
+      _shards.push_back(std::move(low));
+      _shards.push_back(std::move(high));
+      s->retired.store(true);
+    }
+    while (s->users.load() != 0) {
+      std::this_thread::yield();
+    }
+    {
+      std::lock_guard<std::mutex> structure(_structureMutex);
+      Directory* dir = _directory.load(std::memory_order_relaxed);
+      uint64_t step = uint64_t(1) << depth;
+      for (uint64_t i = s->bits; i <= dir->mask(); i += step) {
+        dir->entries[i].store(s->targets[(i >> depth) & 1],
+                              std::memory_order_release);
+      }
+      _splitting = s;
+    }
+    drain(s);
+  }
+
+  void drain(Shard* s) {
+    // move the pairs of the retired shard s to its targets, nothing else
+    // is inserted into it, then free its map. On an exception the split
+    // stays in progress and is completed before the next one.
+    int32_t bit = s->depth;
+    auto move = [this, s, bit](Key const& k, Value const* v) -> ScanAction {
+      KeyHash h = keyHash(k);
+      Shards::insert(*s->targets[(h.shard >> bit) & 1]->map, k, h, v);
+      return ScanAction::Remove;
+    };
+    uint64_t cursor = 0;
+    while (s->map->nrUsed() > 0) {
+      s->map->scanStep(move, cursor, SplitStepBuckets);
+    }
+    s->targets[0]->source.store(nullptr);
+    s->targets[1]->source.store(nullptr);
+    while (s->users.load() != 0) {
+      std::this_thread::yield();
+    }
+    {
+      // Findings obtained before may still hold the mutex
+      typename InternalMap::Finding f;
+      s->map->acquire(f);
+    }
+    std::unique_ptr<InternalMap> gone;
+    {
+      std::lock_guard<std::mutex> structure(_structureMutex);
+      gone = std::move(s->map);
+      _splitting = nullptr;
+      _nrShards.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  template <class KeyLike>
+  bool lookupCopyElsewhere(KeyLike const& k, Value* v, Shard* except) {
+    // with affinity, the pair may be in any shard
+    Directory* dir = _directory.load(std::memory_order_acquire);
+    for (uint64_t s = 0; s <= dir->mask(); ++s) {
+      Shard* other = dir->entries[s].load(std::memory_order_acquire);
+      if (other != except && other->map->lookupCopy(k, v)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool removeElsewhere(Key const& k, Shard* except) {
+    Directory* dir = _directory.load(std::memory_order_acquire);
+    for (uint64_t s = 0; s <= dir->mask(); ++s) {
+      Shard* other = dir->entries[s].load(std::memory_order_acquire);
+      if (other != except && other->map->remove(k)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <class KeyLike>
+  uint64_t shardHash(KeyLike const& k) {
+    // the lowest bits index the directory, whatever its depth
+    return fold(_hasher1(k));
+  }
+
+  static uint64_t fold(uint64_t hash) {
     hash = hash ^ (hash >> 32);
     hash = hash ^ (hash >> 16);
-    if (_logNrShards <= 8) {
-      hash = hash ^ (hash >> 8);
-      return static_cast<uint32_t>(hash & _shardMask);
-    } else {
-      return static_cast<uint32_t>(hash & _shardMask);
-    }
+    return hash ^ (hash >> 8);
+  }
+
+  struct KeyHash {
+    uint64_t shard;  // as shardHash
+    uint64_t hash1;  // of the shards, only with HashedShards
+    uint64_t hash2;
+  };
+
+  // the shards take hash values if they have CuckooMap::hash
+  template <class M>
+  static std::true_type takesHashes(decltype(&M::template hash<Key>));
+  template <class M>
+  static std::false_type takesHashes(...);
+  typedef decltype(takesHashes<InternalMap>(nullptr)) HashedShards;
+
+  KeyHash keyHash(Key const& k) {
+    KeyHash h;
+    keyHash(k, h, HashedShards());
+    return h;
+  }
+
+  void keyHash(Key const& k, KeyHash& h, std::true_type) {
+    DualHash<Key, HashKey1, HashKey2>::compute(_hasher1, _hasher2, k,
+                                               &h.hash1, &h.hash2);
+    h.shard = fold(h.hash1);
   }
-    
-  std::vector<std::unique_ptr<InternalMap>> _tables;
-  typename InternalMap::HashKey1Type _hasher1;
+
+  void keyHash(Key const& k, KeyHash& h, std::false_type) {
+    h.shard = shardHash(k);
+    h.hash1 = h.hash2 = 0;
+  }
+
+  template <bool Hashed, class M = InternalMap>
+  struct ShardAccess {
+    // the operations on a shard, which hashes k itself
+    typedef typename M::Finding Finding;
+    static Finding lookup(M& m, Key const& k, KeyHash const&) {
+      return m.lookup(k);
+    }
+    static bool lookup(M& m, Key const& k, KeyHash const&, Finding& f) {
+      return m.lookup(k, f);
+    }
+    static bool lookupCopy(M& m, Key const& k, KeyHash const&, Value* v) {
+      return m.lookupCopy(k, v);
+    }
+    static bool insert(M& m, Key const& k, KeyHash const&, Value const* v) {
+      return m.insert(k, v);
+    }
+    static bool insert(M& m, Key const& k, KeyHash const&, Value const* v,
+                       Finding& f) {
+      return m.insert(k, v, f);
+    }
+    template <class Updater>
+    static bool upsert(M& m, Key const& k, KeyHash const&, Updater updater) {
+      return m.upsert(k, updater);
+    }
+    static bool remove(M& m, Key const& k, KeyHash const&) {
+      return m.remove(k);
+    }
+  };
+
+  template <class M>
+  struct ShardAccess<true, M> {
+    // the same with the hash values of KeyHash
+    typedef typename M::Finding Finding;
+    static Finding lookup(M& m, Key const& k, KeyHash const& h) {
+      return m.lookup(k, h.hash1, h.hash2);
+    }
+    static bool lookup(M& m, Key const& k, KeyHash const& h, Finding& f) {
+      return m.lookup(k, h.hash1, h.hash2, f);
+    }
+    static bool lookupCopy(M& m, Key const& k, KeyHash const& h, Value* v) {
+      return m.lookupCopy(k, h.hash1, h.hash2, v);
+    }
+    static bool insert(M& m, Key const& k, KeyHash const& h, Value const* v) {
+      return m.insert(k, h.hash1, h.hash2, v);
+    }
+    static bool insert(M& m, Key const& k, KeyHash const& h, Value const* v,
+                       Finding& f) {
+      return m.insert(k, h.hash1, h.hash2, v, f);
+    }
+    template <class Updater>
+    static bool upsert(M& m, Key const& k, KeyHash const& h,
+                       Updater updater) {
+      return m.upsert(k, h.hash1, h.hash2, updater);
+    }
+    static bool remove(M& m, Key const& k, KeyHash const& h) {
+      return m.remove(k, h.hash1, h.hash2);
+    }
+  };
+
+  typedef ShardAccess<HashedShards::value> Shards;
+
+  size_t _firstSize;         // of the shards made by the constructor
+  size_t _valueSize;         // of the values of all shards
+  size_t _valueAlign;
+  bool _affinity;            // pairs may live outside the shard of the hash
+  std::atomic<Directory*> _directory;  // the current one
+  std::vector<std::unique_ptr<Directory>> _directories;  // all, see split
+  std::vector<std::unique_ptr<Shard>> _shards;  // all, split ones included
+  std::atomic<uint32_t> _nrShards;  // those in the directory
+  Shard* _splitting;         // split, not yet drained
+  std::mutex _splitMutex;    // one split or scan at a time
+  std::mutex _structureMutex;  // for the directory, _shards and _splitting
+  HashKey1 _hasher1;
+  HashKey2 _hasher2;
 };
 
 #endif
@@ -0,0 +1,127 @@
+#ifndef SHORT_STRING_KEY_H
+#define SHORT_STRING_KEY_H 1
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "CuckooHelpers.h"
+
+// A view of bytes, for the transparent lookups of a CuckooMap with
+// ShortStringKeys. It does not own the bytes.
+struct ByteSpan {
+  char const* data;
+  size_t size;
+
+  ByteSpan(char const* d, size_t n) : data(d), size(n) {}
+  ByteSpan(char const* s) : data(s), size(std::strlen(s)) {}
+  ByteSpan(std::string const& s) : data(s.data()), size(s.size()) {}
+};
+
+// A key of at most Capacity bytes, kept inline in the slot together with
+// its length and its hash, which is computed once on construction. So
+// neither inserts nor lookups allocate, and displacements, migrations and
+// filters take the hash from the slot instead of going over the bytes
+// again. The empty string is the empty key and cannot be stored, all bytes
+// zero is the empty key as well, see EmptyKeyIsZero. Use it with the hash
+// functions and the comparison it names:
+//   typedef ShortStringKey<> Key;
+//   CuckooMap<Key, Value, Key::HashKey1, Key::HashKey2, Key::CompKey> m(...);
+// Then lookup and lookupCopy also take a ByteSpan, a std::string or a
+// C string, without building a Key.
+template <size_t Capacity = 23>
+class ShortStringKey;
+
+template <size_t Capacity>
+class ShortStringHash {
+  // the two hash values of a ShortStringKey as one 128-bit hash, see
+  // FirstOf128
+ public:
+  void operator()(ShortStringKey<Capacity> const& k, uint64_t* first,
+                  uint64_t* second) const {
+    split(k.hash(), first, second);
+  }
+  void operator()(ByteSpan const& s, uint64_t* first, uint64_t* second) const {
+    split(ShortStringKey<Capacity>::hashBytes(s.data, s.size), first, second);
+  }
+
+ private:
+  static void split(uint64_t hash, uint64_t* first, uint64_t* second) {
+    *first = avalanche64(hash ^ 0x9e3779b185ebca87ULL);
+    *second = avalanche64(hash ^ 0xc2b2ae3d27d4eb4fULL);
+  }
+};
+
+template <size_t Capacity>
+struct ShortStringEqual {
+  typedef void is_transparent;
+
+  bool operator()(ShortStringKey<Capacity> const& a,
+                  ShortStringKey<Capacity> const& b) const {
+    // most different keys already differ by their hash
+    return a.hash() == b.hash() && a.size() == b.size() &&
+           std::memcmp(a.data(), b.data(), a.size()) == 0;
+  }
+  bool operator()(ShortStringKey<Capacity> const& a, ByteSpan const& b) const {
+    // an empty span must not find an empty slot
+    return a.size() == b.size && b.size != 0 &&
+           std::memcmp(a.data(), b.data, b.size) == 0;
+  }
+};
+
+template <size_t Capacity>
+class ShortStringKey {
+  static_assert(Capacity >= 1 && Capacity <= 255,
+                "the length of a ShortStringKey must fit into a byte");
+
+ public:
+  typedef FirstOf128<ShortStringKey, ShortStringHash<Capacity>> HashKey1;
+  typedef SecondOf128<ShortStringKey, ShortStringHash<Capacity>> HashKey2;
+  typedef ShortStringEqual<Capacity> CompKey;
+
+  ShortStringKey() : _hash(0), _length(0) {
+    std::memset(_bytes, 0, Capacity);
+  }
+
+  ShortStringKey(char const* data, size_t size) {
+    // throws std::length_error if size exceeds Capacity
+    if (size > Capacity) {
+      throw std::length_error("string too long for ShortStringKey");
+    }
+    _hash = (size == 0) ? 0 : hashBytes(data, size);
+    _length = static_cast<uint8_t>(size);
+    std::memcpy(_bytes, data, size);
+    std::memset(_bytes + size, 0, Capacity - size);
+  }
+
+  explicit ShortStringKey(ByteSpan const& s) : ShortStringKey(s.data, s.size) {}
+
+  explicit ShortStringKey(std::string const& s)
+      : ShortStringKey(s.data(), s.size()) {}
+
+  bool empty() const { return _length == 0; }
+
+  char const* data() const { return _bytes; }
+
+  size_t size() const { return _length; }
+
+  uint64_t hash() const { return _hash; }
+
+  std::string toString() const { return std::string(_bytes, _length); }
+
+  static uint64_t hashBytes(char const* data, size_t size) {
+    // the hash kept in the key
+    return foldhash64(data, size, 0x5ca1ab1e0ddba11ULL);
+  }
+
+ private:
+  uint64_t _hash;   // of the bytes, 0 for the empty key
+  uint8_t _length;  // number of bytes used
+  char _bytes[Capacity];  // zero padded
+};
+
+template <size_t Capacity>
+struct EmptyKeyIsZero<ShortStringKey<Capacity>> : std::true_type {};
+
+#endif
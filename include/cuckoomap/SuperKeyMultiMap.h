@@ -0,0 +1,187 @@
+#ifndef SUPER_KEY_MULTI_MAP_H
+#define SUPER_KEY_MULTI_MAP_H 1
+
+#include <cstdint>
+#include <type_traits>
+
+#include "ChunkedCuckooMultiMap.h"
+#include "CuckooMultiMap.h"
+
+// A CuckooMultiMap with an index from super keys to the keys in the map:
+// SuperKeyOf maps a Key to its SuperKey, for example a prefix or a
+// grouping attribute, with
+//   SuperKey operator()(Key const& k) const;
+// and lookupSuper finds all keys with a given super key and their pairs
+// at once, without a scan. The index is a ChunkedCuckooMultiMap from
+// super keys to keys, such that the keys of a super key lie next to each
+// other and can be processed as a batch. It is kept in sync by insert and
+// remove, which change it with the mutex of the map held, so map and
+// index always agree, and the mutex of the index is never contended.
+// Key must be trivially copyable, since the index copies it as a value,
+// SuperKey must be what ChunkedCuckooMultiMap accepts as a key.
+
+template <class Key, class Value, class SuperKey, class SuperKeyOf,
+          class HashKey1 = HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
+          class HashKey2 = HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
+          class CompKey = std::equal_to<Key>,
+          class SuperHashKey1 = HashWithSeed<SuperKey, 0xdeadbeefdeadbeefULL>,
+          class SuperHashKey2 = HashWithSeed<SuperKey, 0xabcdefabcdef1234ULL>,
+          class SuperCompKey = std::equal_to<SuperKey>>
+class SuperKeyMultiMap {
+  static_assert(std::is_trivially_copyable<Key>::value,
+                "the index copies keys with std::memcpy");
+
+  typedef CuckooMultiMap<Key, Value, HashKey1, HashKey2, CompKey> DataMap;
+  typedef ChunkedCuckooMultiMap<SuperKey, Key, SuperHashKey1, SuperHashKey2,
+                                SuperCompKey>
+      IndexMap;
+
+  DataMap _map;
+  IndexMap _index;
+  SuperKeyOf _superKeyOf;
+  CompKey _compKey;
+
+ public:
+  typedef Key KeyType;
+  typedef Value ValueType;
+  typedef SuperKey SuperKeyType;
+  typedef typename DataMap::Finding Finding;
+
+  SuperKeyMultiMap(size_t firstSize, size_t valueSize = sizeof(Value),
+                   size_t valueAlign = alignof(Value))
+      : _map(firstSize, valueSize, valueAlign), _index(firstSize) {}
+
+  SuperKeyMultiMap(size_t firstSize, size_t valueSize, size_t valueAlign,
+                   AllocationPolicy const& policy)
+      : _map(firstSize, valueSize, valueAlign, policy),
+        _index(firstSize, sizeof(Key), alignof(Key), policy) {}
+
+  // The result of lookupSuper: the keys with the super key, which keys()
+  // gives all at once, key() is the current one, and the pairs of that
+  // key, which finding() goes through as a Finding of CuckooMultiMap.
+  // next() moves to the next pair, of the same key or of the next one.
+  // As long as this lives, it holds the mutexes of the map and the index.
+
+  struct SuperFinding {
+    friend class SuperKeyMultiMap;
+
+   private:
+    SuperKeyMultiMap* _map;
+    Finding _finding;                     // holds the mutex of the map
+    typename IndexMap::Finding _members;  // and this that of the index
+
+   public:
+    SuperFinding() : _map(nullptr) {}
+
+    int32_t found() const {
+      // the number of keys with the super key
+      return _members.found();
+    }
+
+    Key* keys() const {
+      // all of them, next to each other, or nullptr
+      return _members.values();
+    }
+
+    Key* key() const { return _members.value(); }
+
+    Value* value() const { return _finding.value(); }
+
+    Finding& finding() { return _finding; }
+
+    bool next() { return _finding.next() || nextKey(); }
+
+    bool nextKey() {
+      // to the first pair of the next key
+      return _members.next() &&
+             _map->_map.lookup(*_members.value(), _finding);
+    }
+  };
+
+  Finding lookup(Key const& k) { return _map.lookup(k); }
+
+  bool lookup(Key const& k, Finding& f) { return _map.lookup(k, f); }
+
+  SuperFinding lookupSuper(SuperKey const& sk) {
+    // find all keys with super key sk, see SuperFinding
+    SuperFinding f;
+    lookupSuper(sk, f);
+    return f;
+  }
+
+  bool lookupSuper(SuperKey const& sk, SuperFinding& f) {
+    // the same into an existing f, the mutex of the map is always taken
+    // before that of the index
+    f._map = this;
+    _map.acquire(f._finding);
+    return _index.lookup(sk, f._members) &&
+           _map.lookup(*f._members.value(), f._finding);
+  }
+
+  bool insert(Key const& k, Value const* v) {
+    // inserts a pair (k, v), a new key is added to the index as well
+    Finding f = _map.lookup(k);
+    bool isNew = (f.found() == 0);
+    if (isNew) {
+      _index.insert(_superKeyOf(k), &k);
+    }
+    try {
+      _map.insert(k, v, f);
+    } catch (...) {
+      if (isNew) {
+        unindex(k);
+      }
+      throw;
+    }
+    return true;
+  }
+
+  bool remove(Key const& k) {
+    // remove all pairs with key k and the key from the index, this takes
+    // time linear in the number of keys with its super key
+    Finding f;
+    if (!_map.remove(k, f)) {
+      return false;
+    }
+    unindex(k);
+    return true;
+  }
+
+  uint64_t removeSuper(SuperKey const& sk) {
+    // remove all pairs whose keys have super key sk, return the number of
+    // keys removed
+    Finding f;
+    _map.acquire(f);
+    typename IndexMap::Finding members = _index.lookup(sk);
+    uint64_t n = members.found();
+    if (n == 0) {
+      return 0;
+    }
+    Key* keys = members.values();
+    for (uint64_t i = 0; i < n; ++i) {
+      _map.remove(keys[i], f);
+    }
+    _index.remove(sk, members);
+    return n;
+  }
+
+  uint64_t nrUsed() const { return _map.nrUsed(); }
+
+  uint64_t nrKeys() const { return _index.nrUsed(); }
+
+  uint64_t nrSuperKeys() const { return _index.nrKeys(); }
+
+ private:
+  void unindex(Key const& k) {
+    // remove k from the keys of its super key
+    typename IndexMap::Finding members = _index.lookup(_superKeyOf(k));
+    for (int32_t i = 0; members.get(i); ++i) {
+      if (_compKey(*members.value(), k)) {
+        _index.remove(members);
+        return;
+      }
+    }
+  }
+};
+
+#endif
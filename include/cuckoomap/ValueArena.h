@@ -0,0 +1,95 @@
+#ifndef VALUE_ARENA_H
+#define VALUE_ARENA_H 1
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "CuckooHelpers.h"
+
+// A slab allocator for values of a fixed byte size and alignment which are
+// kept out of line, see the valueArena option of CuckooMap. Blocks are cut
+// from chunks of growing size, placed according to an AllocationPolicy,
+// and freed blocks are kept in a free list for reuse. Chunks are only given
+// back when the arena is destroyed, so a pointer to a block stays valid
+// until the block itself is freed.
+// This class is thread-safe, allocate and free take a mutex of their own.
+
+class ValueArena {
+  static constexpr size_t FirstChunkBlocks = 64;
+  static constexpr size_t MaxChunkBlocks = 65536;
+
+ public:
+  ValueArena(size_t valueSize, size_t valueAlign,
+             AllocationPolicy const& policy = AllocationPolicy())
+      : _blockSize(valueSize),
+        _chunkBlocks(FirstChunkBlocks),
+        _freeList(nullptr),
+        _next(nullptr),
+        _end(nullptr),
+        _nrBlocks(0),
+        _policy(policy) {
+    // a free block holds the pointer to the next one, we assume two powers
+    // for all alignments, up to 64
+    size_t align = (valueAlign < alignof(char*)) ? alignof(char*) : valueAlign;
+    if (_blockSize < sizeof(char*)) {
+      _blockSize = sizeof(char*);
+    }
+    _blockSize = (_blockSize + align - 1) & ~(align - 1);
+  }
+
+  ValueArena(ValueArena const&) = delete;
+  ValueArena& operator=(ValueArena const&) = delete;
+
+  char* allocate() {
+    // return an uninitialized block, throws std::bad_alloc on failure
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (_freeList != nullptr) {
+      char* block = _freeList;
+      std::memcpy(&_freeList, block, sizeof(char*));
+      return block;
+    }
+    if (_next == _end) {
+      std::unique_ptr<TableMemory> chunk(new TableMemory());
+      chunk->allocate(_chunkBlocks * _blockSize + 64, false, _policy);
+      _next = chunk->base();
+      _end = _next + _chunkBlocks * _blockSize;
+      _nrBlocks += _chunkBlocks;
+      _chunks.push_back(std::move(chunk));
+      if (_chunkBlocks < MaxChunkBlocks) {
+        _chunkBlocks *= 2;
+      }
+    }
+    char* block = _next;
+    _next += _blockSize;
+    return block;
+  }
+
+  void free(char* block) {
+    // give back a block returned by allocate
+    std::lock_guard<std::mutex> guard(_mutex);
+    std::memcpy(block, &_freeList, sizeof(char*));
+    _freeList = block;
+  }
+
+  uint64_t memoryUsage() {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return sizeof(ValueArena) + _nrBlocks * _blockSize +
+           _chunks.size() * (sizeof(TableMemory) + 64);
+  }
+
+ private:
+  size_t _blockSize;    // value size rounded up to the alignment
+  size_t _chunkBlocks;  // number of blocks of the next chunk
+  char* _freeList;      // first free block, or nullptr
+  char* _next;          // next never used block of the last chunk
+  char* _end;           // end of the last chunk
+  uint64_t _nrBlocks;   // in all chunks
+  AllocationPolicy _policy;
+  std::vector<std::unique_ptr<TableMemory>> _chunks;
+  std::mutex _mutex;
+};
+
+#endif
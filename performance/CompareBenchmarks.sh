@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Compares the last two commits in a benchmark history written by
+# RunBattery.sh: lists every configuration whose throughput dropped or whose
+# p99 latency of some operation grew by more than the threshold in percent.
+# Columns: commit, 9 parameters, target, threads, final size, Mops/s, then
+# p50, p95, p99 and p99.9 of insert, lookup and remove.
+
+historyFile=${1:-benchmarkHistory.csv}
+threshold=${2:-10}
+
+awk -F, -v threshold=$threshold '
+  {
+    if ($1 != current) {
+      previous = current
+      current = $1
+    }
+    key = $2
+    for (i = 3; i <= 11; i++) {
+      key = key "," $i
+    }
+    row[$1, key] = $0
+    keys[key] = 1
+  }
+  END {
+    if (previous == "") {
+      print "Only one commit in the history, nothing to compare."
+      exit 0
+    }
+    print "Comparing " current " against " previous ":"
+    regressions = 0
+    for (key in keys) {
+      if (!((previous, key) in row) || !((current, key) in row)) {
+        continue
+      }
+      split(row[previous, key], a, ",")
+      split(row[current, key], b, ",")
+      if (a[14] > 0 && b[14] < a[14] * (1 - threshold / 100)) {
+        print "  " key ": throughput " a[14] " -> " b[14] " Mops/s"
+        regressions++
+      }
+      split("insert lookup remove", names, " ")
+      for (op = 0; op < 3; op++) {
+        f = 17 + 4 * op
+        if (a[f] > 0 && b[f] > a[f] * (1 + threshold / 100)) {
+          print "  " key ": " names[op + 1] " p99 " a[f] " -> " b[f] " ns"
+          regressions++
+        }
+      }
+    }
+    print regressions " regressions beyond " threshold "%"
+  }' $historyFile
@@ -24,3 +24,26 @@ done
 
 $(./FormatResults.sh)
 rm $outputFile
+
+# The multithreaded battery: every line of benchmark.csv holds the
+# parameters of Benchmark without target and seed, every target runs on it.
+# The results are appended to benchmarkHistory.csv, one line per run led by
+# the commit and the parameters, so the history covers all commits measured.
+# Afterwards the last two commits in the history are compared.
+benchmarkInput='benchmark.csv'
+historyFile='benchmarkHistory.csv'
+if [ -x ../Benchmark ] && [ -f $benchmarkInput ] ; then
+  commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+  list=($(<$benchmarkInput))
+  for item in ${list[@]}
+  do
+    params=$(echo $item | sed 's/,/ /g')
+    for target in {0..4}
+    do
+      command=$(echo '../Benchmark' $target $params $seed)
+      result=$(eval $command)
+      echo $commit,$item,$result >> $historyFile
+    done
+  done
+  ./CompareBenchmarks.sh $historyFile
+fi
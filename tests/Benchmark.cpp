@@ -0,0 +1,403 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cuckoomap/CuckooHelpers.h>
+#include <cuckoomap/CuckooMap.h>
+#include <cuckoomap/CuckooMultiMap.h>
+#include <cuckoomap/ShardedMap.h>
+#include <qdigest.h>
+
+// A multithreaded benchmark: nThreads threads run a mix of inserts, lookups
+// and removes on one shared map, with keys drawn from a Zipfian
+// distribution. Every thread gets its operations as a pre-generated stream,
+// so the timed loop neither allocates nor draws random numbers. The output
+// is one CSV line for performance/RunBattery.sh:
+//   target,nThreads,finalSize,Mops/s,
+//   insert p50,p95,p99,p99.9,lookup p50,...,remove p50,...
+// with the latencies in nanoseconds.
+//
+// Usage: Benchmark [target] [nThreads] [nOpCount] [nInitialSize]
+//          [nKeySpace] [pInsert] [pLookup] [pRemove] [theta] [pMiss] [seed]
+//    [target]: 0 = std::unordered_map with a mutex, 1 = CuckooMap,
+//              2 = CuckooMap with optimistic reads and striped writes,
+//              3 = ShardedMap<CuckooMap>, 4 = CuckooMultiMap
+//    [nThreads]: Number of threads sharing the map
+//    [nOpCount]: Number of operations to run, over all threads
+//    [nInitialSize]: Number of keys inserted before the measurement, the
+//                    hottest ones first
+//    [nKeySpace]: Number of different keys inserts, removes and lookups use
+//    [pInsert]: Probability of insert
+//    [pLookup]: Probability of lookup
+//    [pRemove]: Probability of remove
+//    [theta]: Skew of the Zipfian distribution, 0 <= theta < 1, 0 is uniform
+//    [pMiss]: Probability of lookup for a key outside of the key space
+//    [seed]: Seed for PRNG
+
+struct Key {
+  uint64_t k;
+  Key() : k(0) {}
+  Key(uint64_t i) : k(i) {}
+  bool empty() { return k == 0; }
+};
+
+struct Value {
+  uint64_t v;
+  Value() : v(0) {}
+  Value(uint64_t i) : v(i) {}
+  bool empty() { return v == 0; }
+};
+
+namespace std {
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+typedef HashWithSeed<Key, 0xdeadbeefdeadbeefULL> KeyHash;
+
+class Zipfian {
+  // Ranks in [0, n) with rank r drawn with a probability proportional to
+  // 1 / (r + 1)^theta, after Gray et al., "Quickly generating billion-record
+  // synthetic databases", as in YCSB. The constructor takes O(n).
+ public:
+  Zipfian(uint64_t n, double theta) : _n(n) {
+    _second = 1.0 + std::pow(0.5, theta);
+    _zetan = 0.0;
+    for (uint64_t i = 1; i <= n; ++i) {
+      _zetan += 1.0 / std::pow(static_cast<double>(i), theta);
+    }
+    _alpha = 1.0 / (1.0 - theta);
+    _eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - _second / _zetan);
+  }
+
+  template <class Rng>
+  uint64_t next(Rng& rng) const {
+    double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    double uz = u * _zetan;
+    if (uz < 1.0) {
+      return 0;
+    }
+    if (uz < _second) {
+      return (_n > 1) ? 1 : 0;
+    }
+    uint64_t r = static_cast<uint64_t>(_n * std::pow(_eta * u - _eta + 1.0,
+                                                     _alpha));
+    return (r < _n) ? r : _n - 1;
+  }
+
+ private:
+  uint64_t _n;
+  double _zetan;
+  double _alpha;
+  double _eta;
+  double _second;
+};
+
+class KeyScrambler {
+  // maps the ranks [0, n) bijectively to the keys [1, n], such that the hot
+  // keys are spread over the key space instead of being the smallest ones
+ public:
+  explicit KeyScrambler(uint64_t n) : _n(n) {
+    _factor = 0x9e3779b97f4a7c15ULL % n;
+    while (gcd(_factor, n) != 1) {
+      ++_factor;
+    }
+  }
+
+  uint64_t key(uint64_t rank) const {
+    unsigned __int128 p = static_cast<unsigned __int128>(rank % _n) * _factor;
+    return 1 + static_cast<uint64_t>(p % _n);
+  }
+
+ private:
+  static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+      uint64_t t = a % b;
+      a = b;
+      b = t;
+    }
+    return a;
+  }
+
+  uint64_t _n;
+  uint64_t _factor;
+};
+
+enum OpType : uint32_t { OpInsert = 0, OpLookup = 1, OpRemove = 2 };
+
+struct Op {
+  uint64_t key;
+  uint32_t type;
+};
+
+// The targets, all with the same three operations on a shared map:
+
+class UnorderedTarget {
+  std::mutex _mutex;
+  std::unordered_map<Key, Value, KeyHash> _map;
+
+ public:
+  UnorderedTarget(size_t initialSize, uint32_t) : _map(initialSize) {}
+  bool insert(Key const& k, Value const& v) {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _map.emplace(k, v).second;
+  }
+  bool lookup(Key const& k, Value* v) {
+    std::lock_guard<std::mutex> guard(_mutex);
+    auto it = _map.find(k);
+    if (it == _map.end()) {
+      return false;
+    }
+    *v = it->second;
+    return true;
+  }
+  bool remove(Key const& k) {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _map.erase(k) > 0;
+  }
+  uint64_t nrUsed() { return _map.size(); }
+};
+
+class CuckooTarget {
+  CuckooMap<Key, Value> _map;
+
+ public:
+  CuckooTarget(size_t initialSize, uint32_t, bool concurrent = false)
+      : _map(initialSize, sizeof(Value), alignof(Value), options(concurrent)) {
+  }
+  bool insert(Key const& k, Value const& v) { return _map.insert(k, &v); }
+  bool lookup(Key const& k, Value* v) { return _map.lookupCopy(k, v); }
+  bool remove(Key const& k) { return _map.remove(k); }
+  uint64_t nrUsed() { return _map.nrUsed(); }
+
+ private:
+  static CuckooMapOptions options(bool concurrent) {
+    // tags, optimistic reads and striped writes for the concurrent target
+    CuckooMapOptions options;
+    options.useTags = concurrent;
+    options.optimisticReads = concurrent;
+    options.stripedWrites = concurrent;
+    return options;
+  }
+};
+
+class ConcurrentCuckooTarget : public CuckooTarget {
+ public:
+  ConcurrentCuckooTarget(size_t initialSize, uint32_t nThreads)
+      : CuckooTarget(initialSize, nThreads, true) {}
+};
+
+class ShardedTarget {
+  ShardedMap<CuckooMap<Key, Value>> _map;
+
+ public:
+  ShardedTarget(size_t initialSize, uint32_t nThreads)
+      : _map(initialSize / (4 * nThreads) + 1, 4 * nThreads) {}
+  bool insert(Key const& k, Value const& v) { return _map.insert(k, &v); }
+  bool lookup(Key const& k, Value* v) { return _map.lookupCopy(k, v); }
+  bool remove(Key const& k) { return _map.remove(k); }
+  uint64_t nrUsed() { return _map.nrUsed(); }
+};
+
+class MultiTarget {
+  // inserts add one more pair for a key already there, removes take all
+  // pairs of a key
+  CuckooMultiMap<Key, Value> _map;
+
+ public:
+  MultiTarget(size_t initialSize, uint32_t) : _map(initialSize) {}
+  bool insert(Key const& k, Value const& v) { return _map.insert(k, &v); }
+  bool lookup(Key const& k, Value* v) {
+    auto f = _map.lookup(k);
+    if (f.found() == 0) {
+      return false;
+    }
+    *v = *f.value();
+    return true;
+  }
+  bool remove(Key const& k) { return _map.remove(k); }
+  uint64_t nrUsed() { return _map.nrUsed(); }
+};
+
+template <class Target>
+void runThread(Target& map, std::vector<Op> const& ops,
+               std::vector<uint32_t>& latencies, std::atomic<bool>& go) {
+  while (!go.load(std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+  Value result;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    Op const& op = ops[i];
+    Key k(op.key);
+    auto start = std::chrono::steady_clock::now();
+    switch (op.type) {
+      case OpInsert:
+        map.insert(k, Value(op.key));
+        break;
+      case OpLookup:
+        map.lookup(k, &result);
+        break;
+      default:
+        map.remove(k);
+        break;
+    }
+    auto finish = std::chrono::steady_clock::now();
+    uint64_t ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start)
+            .count();
+    latencies[i] = static_cast<uint32_t>(ns < UINT32_MAX ? ns : UINT32_MAX);
+  }
+}
+
+template <class Target>
+int runBenchmark(int target, uint32_t nThreads,
+                 std::vector<std::vector<Op>> const& streams,
+                 uint64_t nInitialSize, KeyScrambler const& scrambler) {
+  Target map(nInitialSize < 1048576 ? nInitialSize : 1048576, nThreads);
+  for (uint64_t r = 0; r < nInitialSize; ++r) {
+    uint64_t key = scrambler.key(r);
+    map.insert(Key(key), Value(key));
+  }
+
+  std::vector<std::vector<uint32_t>> latencies(nThreads);
+  for (uint32_t t = 0; t < nThreads; ++t) {
+    latencies[t].resize(streams[t].size());
+  }
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < nThreads; ++t) {
+    threads.emplace_back([&map, &streams, &latencies, &go, t]() {
+      runThread(map, streams[t], latencies[t], go);
+    });
+  }
+  auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  // the digests are filled afterwards, from the recorded latencies
+  qdigest::QDigest digests[3] = {qdigest::QDigest(10000),
+                                 qdigest::QDigest(10000),
+                                 qdigest::QDigest(10000)};
+  uint64_t nOps = 0;
+  for (uint32_t t = 0; t < nThreads; ++t) {
+    for (size_t i = 0; i < streams[t].size(); ++i) {
+      digests[streams[t][i].type].insert(latencies[t][i], 1);
+    }
+    nOps += streams[t].size();
+  }
+
+  std::cout << target << "," << nThreads << "," << map.nrUsed() << ","
+            << nOps / elapsed.count() / 1e6;
+  for (int d = 0; d < 3; ++d) {
+    std::cout << "," << digests[d].percentile(0.500) << ","
+              << digests[d].percentile(0.950) << ","
+              << digests[d].percentile(0.990) << ","
+              << digests[d].percentile(0.999);
+  }
+  std::cout << std::endl;
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 12) {
+    std::cerr << "Incorrect number of parameters." << std::endl;
+    return -1;
+  }
+
+  int target = atoi(argv[1]);
+  uint32_t nThreads = static_cast<uint32_t>(atoi(argv[2]));
+  uint64_t nOpCount = atoll(argv[3]);
+  uint64_t nInitialSize = atoll(argv[4]);
+  uint64_t nKeySpace = atoll(argv[5]);
+  double pInsert = atof(argv[6]);
+  double pLookup = atof(argv[7]);
+  double pRemove = atof(argv[8]);
+  double theta = atof(argv[9]);
+  double pMiss = atof(argv[10]);
+  uint64_t seed = atoll(argv[11]);
+
+  if (target < 0 || target > 4) {
+    std::cerr << "Keep 0 <= target <= 4." << std::endl;
+    return -1;
+  }
+  if (nThreads == 0 || nKeySpace == 0 || nInitialSize > nKeySpace) {
+    std::cerr << "Invalid thread/initial/key space numbers." << std::endl;
+    return -1;
+  }
+  if (theta < 0.0 || theta >= 1.0) {
+    std::cerr << "Keep 0 <= theta < 1." << std::endl;
+    return -1;
+  }
+  if (pMiss < 0.0 || pMiss > 1.0) {
+    std::cerr << "Keep 0 <= pMiss <= 1." << std::endl;
+    return -1;
+  }
+
+  // pre-generate the operations of every thread
+  Zipfian zipf(nKeySpace, theta);
+  KeyScrambler scrambler(nKeySpace);
+  double total = pInsert + pLookup + pRemove;
+  if (total <= 0.0) {
+    std::cerr << "Some operation needs a positive probability." << std::endl;
+    return -1;
+  }
+  std::vector<std::vector<Op>> streams(nThreads);
+  for (uint32_t t = 0; t < nThreads; ++t) {
+    std::mt19937_64 rng(seed + t);
+    std::uniform_real_distribution<double> uniform(0.0, total);
+    std::uniform_real_distribution<double> missed(0.0, 1.0);
+    uint64_t n = nOpCount / nThreads + (t < nOpCount % nThreads ? 1 : 0);
+    streams[t].resize(n);
+    for (uint64_t i = 0; i < n; ++i) {
+      double p = uniform(rng);
+      Op& op = streams[t][i];
+      op.type = (p < pInsert) ? OpInsert
+                              : ((p < pInsert + pLookup) ? OpLookup : OpRemove);
+      uint64_t rank = zipf.next(rng);
+      if (op.type == OpLookup && missed(rng) < pMiss) {
+        // beyond the key space, never inserted
+        op.key = nKeySpace + 1 + rank;
+      } else {
+        op.key = scrambler.key(rank);
+      }
+    }
+  }
+
+  try {
+    switch (target) {
+      case 0:
+        return runBenchmark<UnorderedTarget>(target, nThreads, streams,
+                                             nInitialSize, scrambler);
+      case 1:
+        return runBenchmark<CuckooTarget>(target, nThreads, streams,
+                                          nInitialSize, scrambler);
+      case 2:
+        return runBenchmark<ConcurrentCuckooTarget>(target, nThreads, streams,
+                                                    nInitialSize, scrambler);
+      case 3:
+        return runBenchmark<ShardedTarget>(target, nThreads, streams,
+                                           nInitialSize, scrambler);
+      default:
+        return runBenchmark<MultiTarget>(target, nThreads, streams,
+                                         nInitialSize, scrambler);
+    }
+  } catch (std::bad_alloc const&) {
+    std::cout << target << "," << nThreads << ",0,0,0,0,0,0,0,0,0,0,0,0,0,0"
+              << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#include <cuckoomap/CuckooMap.h>
+
+// Compares the bucket geometries of CuckooMap: for every number of slots
+// per bucket and maximal load, the load a single table reaches before the
+// first insert gives back a pair, the time per insert and per positive and
+// negative lookup in a map with n pairs, and the memory used per pair. All
+// tables use tags and the breadth-first search for displacement paths.
+// Usage: BucketGeometryBenchmark [n]
+
+struct Key {
+  uint64_t k;
+  Key() : k(0) {}
+  Key(uint64_t i) : k(i) {}
+  bool empty() { return k == 0; }
+};
+
+namespace std {
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+struct Value {
+  uint64_t v;
+};
+
+static double nanosecondsSince(
+    std::chrono::steady_clock::time_point const& start, uint64_t nrOps) {
+  std::chrono::duration<double, std::nano> d =
+      std::chrono::steady_clock::now() - start;
+  return d.count() / nrOps;
+}
+
+template <uint32_t SlotsPerBucket, uint32_t MaxLoadSixteenths>
+void runGeometry(uint64_t n, bool splitLayout) {
+  typedef CuckooMap<Key, Value, HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
+                    HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
+                    std::equal_to<Key>,
+                    HashWithSeed<uint16_t, 0xfedcbafedcba4321ULL>,
+                    SlotsPerBucket, MaxLoadSixteenths>
+      Map;
+
+  // load of a single table at the first insert which has to give back a pair
+  typename Map::Subtable table(false, 1 << 16, sizeof(Value), alignof(Value),
+                               true, true, splitLayout);
+  Value v = {0};
+  uint64_t i = 1;
+  while (true) {
+    Key k(i);
+    if (table.insert(k, &v, nullptr, nullptr) != 0) {
+      break;
+    }
+    ++i;
+  }
+  double load = static_cast<double>(table.nrUsed()) / table.capacity();
+
+  CuckooMapOptions options;
+  options.useTags = true;
+  options.bfsInsert = true;
+  options.splitLayout = splitLayout;
+  Map m(1024, sizeof(Value), alignof(Value), options);
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t j = 1; j <= n; ++j) {
+    v.v = j;
+    m.insert(Key(j), &v);
+  }
+  double insertTime = nanosecondsSince(start, n);
+
+  start = std::chrono::steady_clock::now();
+  uint64_t found = 0;
+  for (uint64_t j = 1; j <= n; ++j) {
+    found += m.lookupCopy(Key(j), &v) ? 1 : 0;
+  }
+  double hitTime = nanosecondsSince(start, n);
+
+  start = std::chrono::steady_clock::now();
+  for (uint64_t j = n + 1; j <= 2 * n; ++j) {
+    found += m.lookupCopy(Key(j), &v) ? 1 : 0;
+  }
+  double missTime = nanosecondsSince(start, n);
+
+  std::cout << SlotsPerBucket << " slots, max load " << MaxLoadSixteenths
+            << "/16, splitLayout " << splitLayout
+            << ": table load at first failure " << load << ", insert "
+            << insertTime << " ns, hit " << hitTime << " ns, miss "
+            << missTime << " ns, " << m.nrLayers() << " layers, "
+            << static_cast<double>(m.memoryUsage()) / n << " bytes per pair"
+            << std::endl;
+  if (found != n) {
+    std::cout << "ERROR: found " << found << " of " << n << " pairs"
+              << std::endl;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t n = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+  for (int split = 0; split < 2; ++split) {
+    runGeometry<2, 15>(n, split != 0);
+    runGeometry<4, 15>(n, split != 0);
+    runGeometry<8, 15>(n, split != 0);
+    runGeometry<8, 16>(n, split != 0);
+    runGeometry<16, 16>(n, split != 0);
+  }
+  return 0;
+}
@@ -0,0 +1,250 @@
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <cuckoomap/ChunkedCuckooMultiMap.h>
+#include <cuckoomap/CuckooMultiMap.h>
+#include <cuckoomap/ShardedMap.h>
+
+struct Key {
+  int k;
+  Key() : k(0) {}
+  Key(int i) : k(i) {}
+};
+
+namespace std {
+
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+struct Value {
+  int v;
+  Value() : v(0) {}
+  Value(int i) : v(i) {}
+};
+
+typedef ChunkedCuckooMultiMap<Key, Value> Map;
+
+static int64_t sumValues(Map& m, int x, int32_t& count) {
+  // all values of x through next()
+  int64_t sum = 0;
+  auto f = m.lookup(Key(x));
+  count = f.found();
+  if (count > 0) {
+    do {
+      assert(f.key()->k == x);
+      sum += f.value()->v;
+    } while (f.next());
+  }
+  return sum;
+}
+
+void checkBasics() {
+  Map m(16);
+  int nrKeys = 100;
+  int perKey = 1000;
+  for (int x = 1; x <= nrKeys; ++x) {
+    for (int y = 0; y < perKey; ++y) {
+      Value v(x + y * nrKeys);
+      bool inserted = m.insert(Key(x), &v);
+      assert(inserted);
+      (void)inserted;
+    }
+  }
+  assert(m.nrUsed() == static_cast<uint64_t>(nrKeys * perKey));
+  assert(m.nrKeys() == static_cast<uint64_t>(nrKeys));
+
+  for (int x = 1; x <= nrKeys; ++x) {
+    int32_t count;
+    int64_t sum = sumValues(m, x, count);
+    assert(count == perKey);
+    assert(sum == int64_t(x) * perKey +
+                      int64_t(nrKeys) * perKey * (perKey - 1) / 2);
+    (void)sum;
+    // values keep their order of insertion as long as none is removed:
+    auto f = m.lookup(Key(x));
+    assert(f.get(perKey - 1) && f.value()->v == x + (perKey - 1) * nrKeys);
+    assert(!f.get(perKey) && !f.get(-1));
+    assert(f.get(0) && f.value()->v == x);
+    Value* values = f.values();
+    for (int y = 0; y < perKey; ++y) {
+      Value* v = reinterpret_cast<Value*>(reinterpret_cast<char*>(values) +
+                                          y * m.valueStride());
+      assert(v->v == x + y * nrKeys);
+      (void)v;
+    }
+  }
+  assert(m.lookup(Key(nrKeys + 1)).found() == 0);
+
+  // remove every other value of key 1 while going through them
+  {
+    auto f = m.lookup(Key(1));
+    int32_t pos = 0;
+    while (f.get(pos)) {
+      if ((f.value()->v / nrKeys) % 2 == 0) {
+        bool removed = m.remove(f);
+        assert(removed);
+        (void)removed;
+      } else {
+        ++pos;
+      }
+    }
+    assert(f.found() == perKey / 2);
+  }
+  int32_t count;
+  sumValues(m, 1, count);
+  assert(count == perKey / 2);
+  assert(m.nrUsed() == static_cast<uint64_t>(nrKeys * perKey - perKey / 2));
+
+  // removing all values of a key one by one removes the key
+  {
+    auto f = m.lookup(Key(2));
+    while (f.found() > 0) {
+      f.get(f.found() - 1);
+      m.remove(f);
+    }
+    assert(f.value() == nullptr && !m.remove(f));
+  }
+  assert(m.lookup(Key(2)).found() == 0);
+  assert(m.nrKeys() == static_cast<uint64_t>(nrKeys - 1));
+
+  // and the map shrinks the chunks, taking them from the free lists again
+  uint64_t memory = m.memoryUsage();
+  for (int x = 3; x <= nrKeys; ++x) {
+    bool removed = m.remove(Key(x));
+    assert(removed);
+    (void)removed;
+  }
+  assert(!m.remove(Key(3)));
+  assert(m.nrKeys() == 1 && m.nrUsed() == static_cast<uint64_t>(perKey / 2));
+  for (int x = 3; x <= nrKeys; ++x) {
+    for (int y = 0; y < perKey; ++y) {
+      Value v(y);
+      m.insert(Key(x), &v);
+    }
+  }
+  assert(m.memoryUsage() <= memory);
+  std::cout << "basics: ok, " << m.memoryUsage() << " bytes" << std::endl;
+}
+
+void checkFinding() {
+  // inserting with a Finding leaves it at the new value
+  Map m(16);
+  Map::Finding f;
+  assert(f.map() == nullptr && f.found() == 0);
+  for (int y = 0; y < 10; ++y) {
+    Value v(y);
+    m.insert(Key(7), &v, f);
+    assert(f.map() == &m && f.found() == y + 1 && f.value()->v == y);
+  }
+  m.insert(Key(8), &f.values()[3], f);
+  assert(f.found() == 1 && f.value()->v == 3);
+  assert(m.lookup(Key(7), f) && f.found() == 10 && f.value()->v == 0);
+  assert(!m.lookup(Key(9), f) && f.map() == &m);
+}
+
+void checkValueSize() {
+  // a value size only known at runtime, with an odd number of bytes
+  size_t valueSize = 13;
+  ChunkedCuckooMultiMap<Key, char> m(64, valueSize, 1);
+  assert(m.valueStride() == valueSize);
+  std::vector<char> v(valueSize);
+  for (int y = 0; y < 300; ++y) {
+    std::memset(v.data(), y % 100, valueSize);
+    m.insert(Key(1), v.data());
+  }
+  auto f = m.lookup(Key(1));
+  assert(f.found() == 300);
+  int y = 0;
+  do {
+    for (size_t i = 0; i < valueSize; ++i) {
+      assert(f.value()[i] == y % 100);
+    }
+    ++y;
+  } while (f.next());
+  assert(y == 300);
+}
+
+void checkSharded() {
+  ShardedMap<Map> m(16, 8);
+  for (int x = 0; x < 10; ++x) {
+    for (int y = 0; y < 10; ++y) {
+      Value v(x + y * 10);
+      bool inserted = m.insert(Key(x), &v);
+      assert(inserted);
+      (void)inserted;
+    }
+  }
+  for (int x = 0; x < 10; ++x) {
+    auto f = m.lookup(Key(x));
+    assert(f.found() == 10);
+    do {
+      assert(f.value()->v % 10 == x);
+    } while (f.next());
+  }
+  for (int x = 0; x < 5; ++x) {
+    bool removed = m.remove(Key(x));
+    assert(removed);
+    (void)removed;
+  }
+  for (int x = 0; x < 10; ++x) {
+    assert(m.lookup(Key(x)).found() == (x < 5 ? 0 : 10));
+  }
+  assert(m.nrUsed() == 50);
+}
+
+template <class M>
+double iterate(M& m, int nrKeys, int64_t& sum) {
+  // seconds to go through all values of all keys
+  auto start = std::chrono::steady_clock::now();
+  for (int x = 1; x <= nrKeys; ++x) {
+    auto f = m.lookup(Key(x));
+    if (f.found() > 0) {
+      do {
+        sum += f.value()->v;
+      } while (f.next());
+    }
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+void compare() {
+  // keys with many values, where CuckooMultiMap hashes every value
+  int nrKeys = 1000;
+  int perKey = 200;
+  Map chunked(1024);
+  CuckooMultiMap<Key, Value> multi(1024);
+  for (int y = 0; y < perKey; ++y) {
+    for (int x = 1; x <= nrKeys; ++x) {
+      Value v(y);
+      chunked.insert(Key(x), &v);
+      multi.insert(Key(x), &v);
+    }
+  }
+  int64_t sumChunked = 0;
+  int64_t sumMulti = 0;
+  double chunkedTime = iterate(chunked, nrKeys, sumChunked);
+  double multiTime = iterate(multi, nrKeys, sumMulti);
+  assert(sumChunked == sumMulti);
+  std::cout << "going through " << nrKeys * perKey << " values: chunked "
+            << chunkedTime << "s, " << chunked.memoryUsage()
+            << " bytes, CuckooMultiMap " << multiTime << "s" << std::endl;
+}
+
+int main(int /*argc*/, char* /*argv*/[]) {
+  checkBasics();
+  checkFinding();
+  checkValueSize();
+  checkSharded();
+  compare();
+  std::cout << "all ok" << std::endl;
+  return 0;
+}
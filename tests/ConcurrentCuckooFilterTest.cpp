@@ -0,0 +1,172 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <cuckoomap/ConcurrentCuckooFilter.h>
+
+struct Key {
+  int k;
+  Key() : k(0) {}
+  Key(int i) : k(i) {}
+  bool empty() { return k == 0; }
+};
+
+template <class Filter>
+void checkSingleThreaded(char const* name) {
+  // fill a filter to 90% of its capacity, all keys must be found, also
+  // after removing every other one
+  Filter f(false, 50000);
+  int n = static_cast<int>(f.capacity() * 0.9);
+  for (int i = 1; i <= n; ++i) {
+    bool inserted = f.insert(Key(i));
+    assert(inserted);
+    (void)inserted;
+  }
+  assert(f.nrUsed() == static_cast<uint64_t>(n));
+  for (int i = 1; i <= n; ++i) {
+    assert(f.lookup(Key(i)));
+  }
+  int falsePositives = 0;
+  for (int i = n + 1; i <= 2 * n; ++i) {
+    falsePositives += f.lookup(Key(i)) ? 1 : 0;
+  }
+  for (int i = 1; i <= n; i += 2) {
+    bool removed = f.remove(Key(i));
+    assert(removed);
+    (void)removed;
+  }
+  for (int i = 2; i <= n; i += 2) {
+    assert(f.lookup(Key(i)));
+  }
+  std::cout << name << ": false positive rate "
+            << static_cast<double>(falsePositives) / n << std::endl;
+
+  // inserting into a full filter fails without losing fingerprints:
+  Filter g(false, 1000);
+  int m = 0;
+  while (g.insert(Key(m + 1))) {
+    ++m;
+  }
+  assert(g.nrUsed() == static_cast<uint64_t>(m));
+  for (int i = 1; i <= m; ++i) {
+    assert(g.lookup(Key(i)));
+  }
+  std::cout << name << ": load at first failure "
+            << static_cast<double>(m) / g.capacity() << std::endl;
+}
+
+void checkConcurrent(int nrThreads) {
+  // writers insert and remove keys while readers check that keys inserted
+  // before are never missed, although their fingerprints are moved around
+  typedef ConcurrentCuckooFilter<Key> Filter;
+  Filter f(false, 200000);
+  int n = static_cast<int>(f.capacity() * 0.4);
+  for (int i = 1; i <= n; ++i) {
+    bool inserted = f.insert(Key(i));
+    assert(inserted);
+    (void)inserted;
+  }
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> misses(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < nrThreads; ++t) {
+    readers.emplace_back([&f, &stop, &misses, n]() {
+      while (!stop.load()) {
+        for (int i = 1; i <= n; ++i) {
+          if (!f.lookup(Key(i))) {
+            misses.fetch_add(1);
+          }
+        }
+      }
+    });
+  }
+  std::vector<std::thread> writers;
+  std::atomic<uint64_t> failures(0);
+  int perWriter = static_cast<int>(f.capacity() * 0.5) / nrThreads;
+  for (int t = 0; t < nrThreads; ++t) {
+    writers.emplace_back([&f, &failures, n, t, perWriter]() {
+      int first = n + 1 + t * perWriter;
+      for (int round = 0; round < 3; ++round) {
+        for (int i = first; i < first + perWriter; ++i) {
+          if (!f.insert(Key(i))) {
+            failures.fetch_add(1);
+          }
+        }
+        if (round < 2) {
+          for (int i = first; i < first + perWriter; ++i) {
+            f.remove(Key(i));
+          }
+        }
+      }
+    });
+  }
+  for (auto& w : writers) {
+    w.join();
+  }
+  stop.store(true);
+  for (auto& r : readers) {
+    r.join();
+  }
+  assert(misses.load() == 0);
+  assert(failures.load() == 0);
+  for (int i = 1; i < n + 1 + nrThreads * perWriter; ++i) {
+    assert(f.lookup(Key(i)));
+  }
+  assert(f.nrUsed() == static_cast<uint64_t>(n + nrThreads * perWriter));
+  std::cout << "concurrent with " << nrThreads << " readers and writers: ok"
+            << std::endl;
+}
+
+void timeLookups() {
+  // lookups per second with growing numbers of threads
+  typedef ConcurrentCuckooFilter<Key> Filter;
+  Filter f(false, 1000000);
+  int n = static_cast<int>(f.capacity() * 0.9);
+  for (int i = 1; i <= n; ++i) {
+    f.insert(Key(i));
+  }
+  unsigned maxThreads = std::thread::hardware_concurrency();
+  maxThreads = (maxThreads == 0) ? 1 : ((maxThreads > 8) ? 8 : maxThreads);
+  for (unsigned nrThreads = 1; nrThreads <= maxThreads; nrThreads *= 2) {
+    std::atomic<uint64_t> found(0);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nrThreads; ++t) {
+      threads.emplace_back([&f, &found, n]() {
+        uint64_t count = 0;
+        for (int i = 1; i <= n; ++i) {
+          count += f.lookup(Key(i)) ? 1 : 0;
+        }
+        found.fetch_add(count);
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    assert(found.load() == static_cast<uint64_t>(n) * nrThreads);
+    std::cout << nrThreads << " threads: "
+              << static_cast<double>(n) * nrThreads / d.count() / 1e6
+              << " million lookups per second" << std::endl;
+  }
+}
+
+int main() {
+  checkSingleThreaded<ConcurrentCuckooFilter<Key>>("16 bits");
+  checkSingleThreaded<ConcurrentCuckooFilter<
+      Key, HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
+      HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
+      HashWithSeed<uint16_t, 0xfedcbafedcba4321ULL>, 8, 8>>("8 slots, 8 bits");
+  checkSingleThreaded<ConcurrentCuckooFilter<
+      Key, HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
+      HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
+      HashWithSeed<uint16_t, 0xfedcbafedcba4321ULL>, 4, 32>>("32 bits");
+  checkConcurrent(1);
+  checkConcurrent(4);
+  timeLookups();
+  return 0;
+}
@@ -1,5 +1,7 @@
 #include <cassert>
+#include <cstdio>
 #include <iostream>
+#include <vector>
 
 #include <cuckoomap/CuckooFilter.h>
 
@@ -18,6 +20,53 @@ struct equal_to<Key> {
 };
 }
 
+template <class Filter>
+void checkFingerprints(char const* name, double maxFalsePositives) {
+  // fill a filter to 90% of its capacity, all keys must be found, and
+  // count how many keys which were never inserted are found anyway
+  Filter f(false, 50000);
+  int n = static_cast<int>(f.capacity() * 0.9);
+  for (int i = 1; i <= n; ++i) {
+    Key k(i);
+    bool inserted = f.insert(k);
+    assert(inserted);
+    (void)inserted;
+  }
+  for (int i = 1; i <= n; ++i) {
+    assert(f.lookup(Key(i)));
+  }
+  int falsePositives = 0;
+  for (int i = n + 1; i <= 2 * n; ++i) {
+    falsePositives += f.lookup(Key(i)) ? 1 : 0;
+  }
+  double rate = static_cast<double>(falsePositives) / n;
+  // the batch lookup agrees with single lookups:
+  std::vector<Key> keys;
+  for (int i = 1; i <= 2 * n; ++i) {
+    keys.emplace_back(i);
+  }
+  std::vector<uint64_t> hits((keys.size() + 63) / 64);
+  size_t nrHits = f.lookupBatch(keys.data(), keys.size(), hits.data());
+  assert(nrHits == static_cast<size_t>(n + falsePositives));
+  for (size_t i = 0; i < keys.size(); ++i) {
+    assert(((hits[i / 64] >> (i % 64)) & 1) == (f.lookup(keys[i]) ? 1 : 0));
+  }
+  (void)nrHits;
+  for (int i = 1; i <= n; i += 2) {
+    bool removed = f.remove(Key(i));
+    assert(removed);
+    (void)removed;
+  }
+  for (int i = 2; i <= n; i += 2) {
+    assert(f.lookup(Key(i)));
+  }
+  assert(f.nrUsed() == static_cast<uint64_t>(n / 2));
+  std::cout << name << ": false positive rate " << rate << ", "
+            << static_cast<double>(f.memoryUsage() * 8) / f.capacity()
+            << " bits per slot" << std::endl;
+  assert(rate <= maxFalsePositives);
+}
+
 int main(int /*argc*/, char* /*argv*/[]) {
   CuckooFilter<Key> m(false, 100);
   auto insert = [&]() -> void {
@@ -65,4 +114,65 @@ int main(int /*argc*/, char* /*argv*/[]) {
   show();
   remove();
   notShow();
+
+  // Save the filter and attach to the file again:
+  char const* fileName = "CuckooFilterTest.persistent";
+  bool saved = m.save(fileName);
+  assert(saved);
+  (void)saved;
+  for (int mode = 0; mode < 2; ++mode) {
+    CuckooFilter<Key> p(fileName, mode == 0 ? PersistentMode::ReadOnly
+                                            : PersistentMode::CopyOnWrite);
+    assert(p.nrUsed() == m.nrUsed());
+    for (int i = 50; i < 100; ++i) {
+      Key k(i);
+      assert(p.lookup(k));
+    }
+    if (mode == 1) {
+      Key k(50);
+      bool removed = p.remove(k);
+      assert(removed);
+      (void)removed;
+    }
+  }
+  CuckooFilter<Key> again(fileName, PersistentMode::ReadOnly);
+  assert(again.lookup(Key(50)));  // copy on write did not change the file
+  std::remove(fileName);
+  std::cout << "persistent filter done" << std::endl;
+
+  // Other fingerprint widths, bit-packed and semi-sorted:
+  typedef HashWithSeed<Key, 0xdeadbeefdeadbeefULL> H1;
+  typedef HashWithSeed<Key, 0xabcdefabcdef1234ULL> H2;
+  typedef HashWithSeed<uint16_t, 0xfedcbafedcba4321ULL> HS;
+  typedef std::equal_to<Key> Eq;
+  checkFingerprints<CuckooFilter<Key, H1, H2, HS, Eq, 4, 8>>("8 bits", 0.04);
+  checkFingerprints<CuckooFilter<Key, H1, H2, HS, Eq, 4, 12>>("12 bits",
+                                                              0.004);
+  checkFingerprints<CuckooFilter<Key, H1, H2, HS, Eq, 4, 16>>("16 bits",
+                                                              0.0004);
+  checkFingerprints<CuckooFilter<Key, H1, H2, HS, Eq, 4, 32>>("32 bits",
+                                                              0.0001);
+  checkFingerprints<CuckooFilter<Key, H1, H2, HS, Eq, 8, 12>>(
+      "12 bits, 8 slots", 0.008);
+  checkFingerprints<CuckooFilter<Key, H1, H2, HS, Eq, 4, 13, true>>(
+      "13 bits semi-sorted", 0.004);
+  checkFingerprints<CuckooFilter<Key, H1, H2, HS, Eq, 4, 16, true>>(
+      "16 bits semi-sorted", 0.0004);
+
+  // A semi-sorted filter survives saving as well:
+  {
+    CuckooFilter<Key, H1, H2, HS, Eq, 4, 9, true> ss(false, 1000);
+    for (int i = 1; i <= 1000; ++i) {
+      Key k(i);
+      ss.insert(k);
+    }
+    saved = ss.save(fileName);
+    assert(saved);
+    CuckooFilter<Key, H1, H2, HS, Eq, 4, 9, true> sp(fileName,
+                                                     PersistentMode::ReadOnly);
+    for (int i = 1; i <= 1000; ++i) {
+      assert(sp.lookup(Key(i)));
+    }
+    std::remove(fileName);
+  }
 }
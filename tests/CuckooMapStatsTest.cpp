@@ -0,0 +1,170 @@
+// the counters only exist with this defined before the first include:
+#define CUCKOO_MAP_STATS 1
+
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <cuckoomap/CuckooMap.h>
+#include <cuckoomap/CuckooMultiMap.h>
+#include <cuckoomap/ShardedMap.h>
+
+struct Key {
+  int k;
+  Key() : k(0) {}
+  Key(int i) : k(i) {}
+  bool empty() { return k == 0; }
+};
+
+namespace std {
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+typedef CuckooMap<Key, int> Map;
+
+static uint64_t sum(std::vector<uint64_t> const& v) {
+  uint64_t s = 0;
+  for (uint64_t x : v) {
+    s += x;
+  }
+  return s;
+}
+
+static void print(char const* name, Map::Statistics const& s) {
+  std::cout << name << ": " << s.lookups << " lookups, "
+            << static_cast<double>(s.slotProbes) / s.lookups
+            << " slot probes and "
+            << static_cast<double>(s.layerProbes) / s.lookups
+            << " layers per lookup, "
+            << static_cast<double>(s.kicks) / s.inserts
+            << " kicks per insert, " << s.spills << " spills, " << s.expunges
+            << " expunges, " << s.layersAppended << " layers, "
+            << s.filterRejects << " filter rejects, " << s.filterFalsePositives
+            << " filter false positives, " << s.lockContentions << " of "
+            << s.lockAcquisitions << " lock acquisitions waited "
+            << s.lockWaitNanoseconds << "ns, " << s.optimisticRetries
+            << " optimistic retries" << std::endl;
+}
+
+void checkCounters(bool useFilters, bool useTags) {
+  CuckooMapOptions options;
+  options.useFilters = useFilters;
+  options.useTags = useTags;
+  Map m(1024, sizeof(int), alignof(int), options);
+  Map::Statistics s = m.stats();
+  assert(s.enabled && s.lookups == 0 && s.inserts == 0);
+  // the first layer is appended by the constructor:
+  assert(s.layersAppended == 1 && s.layerHits.size() == 1);
+
+  int n = 100000;
+  for (int i = 1; i <= n; ++i) {
+    m.insert(Key(i), &i);
+  }
+  s = m.stats();
+  assert(s.inserts == static_cast<uint64_t>(n));
+  assert(s.layersAppended == m.nrLayers() && m.nrLayers() > 1);
+  assert(s.kicks > 0 && s.spills > 0 && s.expunges > 0);
+  assert(s.lockAcquisitions >= s.inserts);
+  assert(s.lockContentions == 0);
+
+  Map::Statistics inserted = s;
+  m.resetStats();
+  s = m.stats();
+  assert(s.lookups == 0 && s.inserts == 0 && s.kicks == 0 &&
+         s.lockAcquisitions == 0 && sum(s.layerHits) == 0);
+
+  int v;
+  for (int i = 1; i <= 2 * n; ++i) {
+    bool found = m.lookupCopy(Key(i), &v);
+    assert(found == (i <= n));
+    (void)found;
+  }
+  s = m.stats();
+  assert(s.lookups == static_cast<uint64_t>(2 * n));
+  assert(s.layerHits.size() == m.nrLayers());
+  assert(sum(s.layerHits) == static_cast<uint64_t>(n));
+  assert(s.layerProbes >= s.lookups && s.slotProbes > 0);
+  if (useFilters) {
+    // misses are mostly rejected by the filters of all layers:
+    assert(s.filterRejects >= static_cast<uint64_t>(n));
+    assert(s.filterFalsePositives < s.filterRejects / 10);
+  } else {
+    assert(s.filterRejects == 0 && s.filterFalsePositives == 0);
+  }
+  if (useTags) {
+    // only slots with a matching tag are compared:
+    assert(s.slotProbes < s.lookups * 2);
+  }
+  inserted.add(s);
+  print(useFilters ? (useTags ? "filters and tags" : "filters")
+                   : (useTags ? "tags" : "plain"),
+        inserted);
+}
+
+void checkConcurrent() {
+  // contention for the mutex and optimistic lookups
+  CuckooMapOptions options;
+  options.useTags = true;
+  options.optimisticReads = true;
+  Map m(1024, sizeof(int), alignof(int), options);
+  int n = 200000;
+  int nrThreads = 4;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nrThreads; ++t) {
+    threads.emplace_back([&m, n, t, nrThreads]() {
+      for (int i = t + 1; i <= n; i += nrThreads) {
+        m.insert(Key(i), &i);
+        int v;
+        m.lookupCopy(Key(i), &v);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  Map::Statistics s = m.stats();
+  assert(s.inserts == static_cast<uint64_t>(n));
+  assert(s.lookups == static_cast<uint64_t>(n));
+  assert(sum(s.layerHits) == static_cast<uint64_t>(n));
+  assert(s.lockContentions <= s.lockAcquisitions);
+  assert(s.lockContentions == 0 || s.lockWaitNanoseconds > 0);
+  print("concurrent", s);
+}
+
+void checkSharded() {
+  // the counters of a ShardedMap are the sums of those of its shards
+  ShardedMap<Map> sm(256, 4);
+  for (int i = 1; i <= 20000; ++i) {
+    sm.insert(Key(i), &i);
+  }
+  for (int i = 1; i <= 40000; ++i) {
+    int v;
+    sm.lookupCopy(Key(i), &v);
+  }
+  Map::Statistics s = sm.stats();
+  assert(s.inserts == 20000 && s.lookups == 40000);
+  assert(sum(s.layerHits) == 20000);
+  sm.resetStats();
+  assert(sm.stats().lookups == 0);
+
+  CuckooMultiMap<Key, int> mm(256);
+  for (int i = 1; i <= 1000; ++i) {
+    mm.insert(Key(i % 100 + 1), &i);
+  }
+  assert(mm.stats().inserts >= 1000);
+  std::cout << "sharded and multi map counters: ok" << std::endl;
+}
+
+int main() {
+  for (int config = 0; config < 4; ++config) {
+    checkCounters((config & 1) != 0, (config & 2) != 0);
+  }
+  checkConcurrent();
+  checkSharded();
+  return 0;
+}
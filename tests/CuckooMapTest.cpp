@@ -1,5 +1,13 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <cuckoomap/CuckooMap.h>
 
@@ -18,6 +26,11 @@ struct equal_to<Key> {
 };
 }
 
+// All layers of the maps below come from zeroed memory without
+// initialization:
+template <>
+struct EmptyKeyIsZero<Key> : std::true_type {};
+
 struct Value {
   int v;
   Value() : v(0) {}
@@ -25,65 +38,813 @@ struct Value {
   bool empty() { return v == 0; }
 };
 
-int main(int /*argc*/, char* /*argv*/[]) {
-  CuckooMap<Key, Value> m(16);
-  auto insert = [&]() -> void {
-    for (int i = 1; i < 100; ++i) {
-      Key k(i);
-      Value v(i * i);
-      if (m.insert(k, &v)) {
-        std::cout << "Inserted pair ";
-      } else {
-        std::cout << "Could not insert pair ";
-        assert(false);
-      }
-      std::cout << "(" << i << ", " << i * i << ")" << std::endl;
+struct LargeValue {
+  int v;
+  char payload[252];
+};
+
+template <class Hash1, class Hash2>
+void checkHashes(char const* name) {
+  // a map with other hash functions works as with the default ones, and
+  // computing both hash values together gives the same as separately
+  Hash1 hash1;
+  Hash2 hash2;
+  for (int i = 1; i <= 1000; ++i) {
+    uint64_t first, second;
+    DualHash<Key, Hash1, Hash2>::compute(hash1, hash2, Key(i), &first,
+                                         &second);
+    assert(first == hash1(Key(i)) && second == hash2(Key(i)));
+    assert(first != second);
+    (void)first;
+    (void)second;
+  }
+  for (int useFilters = 0; useFilters < 2; ++useFilters) {
+    CuckooMapOptions options;
+    options.useFilters = useFilters != 0;
+    options.useTags = true;
+    CuckooMap<Key, Value, Hash1, Hash2> m(1024, sizeof(Value), alignof(Value),
+                                          options);
+    for (int i = 1; i <= 100000; ++i) {
+      Value v(i);
+      bool inserted = m.insert(Key(i), &v);
+      assert(inserted);
+      (void)inserted;
     }
+    for (int i = 1; i <= 200000; ++i) {
+      Value v;
+      bool found = m.lookupCopy(Key(i), &v);
+      assert(found == (i <= 100000) && (!found || v.v == i));
+      (void)found;
+    }
+    for (int i = 1; i <= 100000; i += 2) {
+      bool removed = m.remove(Key(i));
+      assert(removed);
+      (void)removed;
+    }
+    assert(m.nrUsed() == 50000);
+    std::cout << name << " hashes done, useFilters: " << useFilters << ", "
+              << m.nrLayers() << " layers" << std::endl;
+  }
+}
+
+void checkScan(bool useFilters, bool useTags, bool valueArena,
+               bool splitLayout) {
+  // scans see every pair once, over all layers, and can remove pairs
+  CuckooMapOptions options;
+  options.useFilters = useFilters;
+  options.useTags = useTags;
+  options.valueArena = valueArena;
+  options.splitLayout = splitLayout;
+  CuckooMap<Key, Value> m(64, sizeof(Value), alignof(Value), options);
+  int n = 20000;
+  for (int i = 1; i <= n; ++i) {
+    Value v(2 * i);
+    m.insert(Key(i), &v);
+  }
+  assert(m.nrLayers() > 1);
+  std::vector<bool> seen(n + 1, false);
+  bool complete = m.scan([&](Key const& k, Value const* v) {
+    assert(k.k >= 1 && k.k <= n && !seen[k.k] && v->v == 2 * k.k);
+    seen[k.k] = true;
+    return ScanAction::Continue;
+  });
+  assert(complete);
+  assert(std::count(seen.begin(), seen.end(), true) == n);
+  (void)complete;
+
+  // a sweep removing the odd keys:
+  m.scan([](Key const& k, Value const*) {
+    return (k.k % 2 != 0) ? ScanAction::Remove : ScanAction::Continue;
+  });
+  assert(m.nrUsed() == static_cast<uint64_t>(n / 2));
+  for (int i = 1; i <= n; ++i) {
+    Value v;
+    assert(m.lookupCopy(Key(i), &v) == (i % 2 == 0));
+  }
+
+  // stop early:
+  int visited = 0;
+  complete = m.scan([&](Key const&, Value const*) {
+    return (++visited == 10) ? ScanAction::Stop : ScanAction::Continue;
+  });
+  assert(!complete && visited == 10);
+
+  // the same in steps of a few buckets, which come back to the start:
+  std::fill(seen.begin(), seen.end(), false);
+  uint64_t cursor = 0;
+  int steps = 0;
+  while (m.scanStep(
+      [&](Key const& k, Value const*) {
+        assert(!seen[k.k]);
+        seen[k.k] = true;
+        return ScanAction::Continue;
+      },
+      cursor, 64)) {
+    ++steps;
+  }
+  assert(cursor == 0 && steps > 1);
+  assert(std::count(seen.begin(), seen.end(), true) == n / 2);
+  (void)steps;
+  std::cout << "scan done, useFilters: " << useFilters << ", useTags: "
+            << useTags << ", valueArena: " << valueArena
+            << ", splitLayout: " << splitLayout << std::endl;
+}
+
+void checkUpsert(bool useFilters, bool valueArena, bool incrementalResize) {
+  // a key is in the map at most once, in whatever layer, and
+  // insertOrAssign and upsert overwrite or insert with one probe
+  CuckooMapOptions options;
+  options.useFilters = useFilters;
+  options.incrementalResize = incrementalResize;
+  options.valueArena = valueArena;
+  CuckooMap<Key, Value> m(64, sizeof(Value), alignof(Value), options);
+  int n = 20000;
+  for (int i = 1; i <= n; ++i) {
+    Value v(i);
+    m.insert(Key(i), &v);
+  }
+  assert(m.nrLayers() > 1 || incrementalResize);
+  for (int i = 1; i <= n; ++i) {
+    Value v(-i);
+    bool inserted = m.insert(Key(i), &v);
+    assert(!inserted);
+    (void)inserted;
+  }
+  assert(m.nrUsed() == static_cast<uint64_t>(n));
+
+  for (int i = 1; i <= 2 * n; i += 2) {
+    Value v(3 * i);
+    bool isNew = m.insertOrAssign(Key(i), &v);
+    assert(isNew == (i > n));
+    (void)isNew;
+  }
+  assert(m.nrUsed() == static_cast<uint64_t>(n + n / 2));
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 1; i <= 2 * n; ++i) {
+      m.upsert(Key(i), [i](Value* v, bool isNew) {
+        assert(!isNew || v->v == 0);
+        v->v = isNew ? -i : v->v + 1;
+      });
+    }
+  }
+  assert(m.nrUsed() == static_cast<uint64_t>(2 * n));
+  for (int i = 1; i <= 2 * n; ++i) {
+    Value v;
+    bool found = m.lookupCopy(Key(i), &v);
+    int expected = (i % 2 != 0) ? 3 * i + 3 : ((i <= n) ? i + 3 : -i + 2);
+    assert(found && v.v == expected);
+    (void)found;
+    (void)expected;
+  }
+  for (int i = 1; i <= 2 * n; ++i) {
+    bool removed = m.remove(Key(i));
+    assert(removed);
+    (void)removed;
+  }
+  assert(m.nrUsed() == 0);
+  std::cout << "upsert done, useFilters: " << useFilters
+            << ", valueArena: " << valueArena
+            << ", incrementalResize: " << incrementalResize << std::endl;
+}
+
+void checkBound(Eviction eviction, bool useFilters, bool valueArena) {
+  // a bounded map evicts instead of growing and reports every pair it
+  // evicts exactly once, all other pairs stay
+  int n = 50000;
+  int bound = 5000;
+  std::vector<int> evicted(n + 1, 0);
+  auto onEvict = [&evicted](Key const& k, Value const* v) {
+    assert(v->v == 2 * k.k);
+    ++evicted[k.k];
   };
-  auto show = [&]() {
-    for (int i = 99; i > 0; --i) {
-      Key k(i);
-      auto f = m.lookup(k);
-      if (f.found()) {
-        std::cout << "Found key " << i << " with value " << f.value()->v
-                  << std::endl;
-        assert(f.value()->v == i * i);
-        assert(f.key()->k == i);
-      } else {
-        std::cout << "Did not find expected key " << i << std::endl;
-        assert(false);
+  CuckooMapOptions options;
+  options.useFilters = useFilters;
+  options.valueArena = valueArena;
+  CuckooMap<Key, Value> m(64, sizeof(Value), alignof(Value), options);
+  for (int i = 1; i <= 2 * bound; ++i) {
+    Value v(2 * i);
+    m.insert(Key(i), &v);
+  }
+  m.setBound(bound, 0, eviction, onEvict);
+  assert(m.nrUsed() == static_cast<uint64_t>(bound));
+  int hot = 100;
+  for (int i = 2 * bound + 1; i <= n; ++i) {
+    Value v(2 * i);
+    m.insert(Key(i), &v);
+    assert(m.nrUsed() <= static_cast<uint64_t>(bound));
+    if (i % 100 == 0) {
+      // the first keys of the last bound are hot from now on
+      for (int j = n - bound + 1; j <= n - bound + hot; ++j) {
+        m.lookupCopy(Key(j), &v);
       }
     }
-  };
-  auto remove = [&]() -> void {
-    for (int i = 1; i < 50; ++i) {
-      Key k(i);
-      if (m.remove(k)) {
-        std::cout << "Removed key " << i << std::endl;
-      } else {
-        std::cout << "Did not find key " << i << " to remove" << std::endl;
-        assert(false);
+  }
+  uint64_t nrEvicted = 0;
+  int hotLeft = 0;
+  for (int i = 1; i <= n; ++i) {
+    Value v;
+    bool found = m.lookupCopy(Key(i), &v);
+    assert(evicted[i] == (found ? 0 : 1) && (!found || v.v == 2 * i));
+    nrEvicted += evicted[i];
+    hotLeft += (found && i > n - bound && i <= n - bound + hot) ? 1 : 0;
+  }
+  assert(nrEvicted == m.nrEvictions() && m.nrUsed() + nrEvicted ==
+                                              static_cast<uint64_t>(n));
+  assert(m.nrUsed() >= static_cast<uint64_t>(bound) * 9 / 10);
+  assert(eviction != Eviction::Clock || hotLeft >= hot * 9 / 10);
+  (void)nrEvicted;
+
+  // with a memory bound no layer beyond it is added
+  CuckooMap<Key, Value> mb(64, sizeof(Value), alignof(Value), options);
+  uint64_t maxBytes = 256 * 1024;
+  mb.setBound(0, maxBytes, eviction);
+  for (int i = 1; i <= n; ++i) {
+    Value v(2 * i);
+    bool inserted = mb.insert(Key(i), &v);
+    assert(inserted && mb.memoryUsage() <= maxBytes);
+    (void)inserted;
+  }
+  assert(mb.nrEvictions() > 0 &&
+         mb.nrUsed() + mb.nrEvictions() == static_cast<uint64_t>(n));
+  std::cout << "bound done, eviction: " << static_cast<int>(eviction)
+            << ", useFilters: " << useFilters
+            << ", valueArena: " << valueArena << ", " << hotLeft << " of "
+            << hot << " hot keys left, " << mb.nrUsed()
+            << " pairs in " << mb.memoryUsage() << " bytes" << std::endl;
+}
+
+struct WideKey {
+  uint64_t a;
+  uint64_t b;
+};
+
+template <class Hash>
+void checkCollisions(char const* name) {
+  // the 128 bits of a hash of random 16-byte keys have no collisions, of
+  // one half or both, as with 64 independent bits per half, and neither
+  // with another seed
+  Hash hash;
+  size_t n = 1000000;
+  std::vector<std::pair<uint64_t, uint64_t>> hashes(n);
+  uint64_t x = 0x2545f4914f6cdd1dULL;
+  for (size_t i = 0; i < n; ++i) {
+    WideKey k;
+    k.a = x = splitmix64(x);
+    k.b = x = splitmix64(x);
+    hash(k, &hashes[i].first, &hashes[i].second);
+  }
+  std::sort(hashes.begin(), hashes.end());
+  size_t nrFull = 0;
+  size_t nrLow = 0;
+  for (size_t i = 1; i < n; ++i) {
+    nrLow += (hashes[i].first == hashes[i - 1].first) ? 1 : 0;
+    nrFull += (hashes[i] == hashes[i - 1]) ? 1 : 0;
+  }
+  assert(nrFull == 0 && nrLow == 0);
+  (void)nrFull;
+  (void)nrLow;
+  std::cout << name << " collisions done" << std::endl;
+}
+
+int main(int /*argc*/, char* /*argv*/[]) {
+  for (int config = 0; config < 16; ++config) {
+    bool useFilters = (config & 1) != 0;
+    bool useTags = (config & 2) != 0;
+    bool optimisticReads = (config & 4) != 0;
+    bool bfsInsert = (config & 8) != 0;
+    std::cout << "useFilters: " << useFilters << ", useTags: " << useTags
+              << ", optimisticReads: " << optimisticReads
+              << ", bfsInsert: " << bfsInsert << std::endl;
+    CuckooMapOptions options;
+    options.useFilters = useFilters;
+    options.useTags = useTags;
+    options.optimisticReads = optimisticReads;
+    options.bfsInsert = bfsInsert;
+    CuckooMap<Key, Value> m(16, sizeof(Value), alignof(Value), options);
+    auto insert = [&]() -> void {
+      for (int i = 1; i < 100; ++i) {
+        Key k(i);
+        Value v(i * i);
+        if (m.insert(k, &v)) {
+          std::cout << "Inserted pair ";
+        } else {
+          std::cout << "Could not insert pair ";
+          assert(false);
+        }
+        std::cout << "(" << i << ", " << i * i << ")" << std::endl;
+      }
+    };
+    auto show = [&]() {
+      for (int i = 99; i > 0; --i) {
+        Key k(i);
+        auto f = m.lookup(k);
+        if (f.found()) {
+          std::cout << "Found key " << i << " with value " << f.value()->v
+                    << std::endl;
+          assert(f.value()->v == i * i);
+          assert(f.key()->k == i);
+        } else {
+          std::cout << "Did not find expected key " << i << std::endl;
+          assert(false);
+        }
+      }
+    };
+    auto remove = [&]() -> void {
+      for (int i = 1; i < 50; ++i) {
+        Key k(i);
+        if (m.remove(k)) {
+          std::cout << "Removed key " << i << std::endl;
+        } else {
+          std::cout << "Did not find key " << i << " to remove" << std::endl;
+          assert(false);
+        }
+      }
+    };
+    auto showSome = [&]() {
+      for (int i = 99; i > 0; --i) {
+        Key k(i);
+        auto f = m.lookup(k);
+        if (f.found()) {
+          std::cout << "Found key " << i << " with value " << f.value()->v
+                    << std::endl;
+          assert(f.value()->v == i * i);
+          assert(f.key()->k == i);
+        } else {
+          std::cout << "Did not find key " << i << std::endl;
+          assert(i < 50);
+        }
+      }
+    };
+    auto showBatch = [&]() {
+      // keys 1 to 120, of which only 50 to 99 are still in the map:
+      Key keys[120];
+      Value values[120];
+      bool found[120];
+      for (int i = 0; i < 120; ++i) {
+        keys[i] = Key(i + 1);
+      }
+      size_t nrFound = m.lookupBatch(keys, 120, values, found);
+      std::cout << "Found " << nrFound << " keys in batch" << std::endl;
+      assert(nrFound == 50);
+      for (int i = 0; i < 120; ++i) {
+        assert(found[i] == (i + 1 >= 50 && i + 1 < 100));
+        if (found[i]) {
+          assert(values[i].v == (i + 1) * (i + 1));
+        }
+      }
+    };
+    auto showCopy = [&]() {
+      for (int i = 1; i < 100; ++i) {
+        Value v;
+        bool found = m.lookupCopy(Key(i), &v);
+        assert(found == (i >= 50));
+        if (found) {
+          assert(v.v == i * i);
+        }
       }
+    };
+    std::cout << "map was made" << std::endl;
+    insert();
+    show();
+    remove();
+    showSome();
+    showBatch();
+    showCopy();
+  }
+
+  // Optimistic readers running concurrently with a writer, which keeps
+  // moving pairs around by inserting, removing and promoting other keys:
+  CuckooMapOptions optimistic;
+  optimistic.useTags = true;
+  optimistic.optimisticReads = true;
+  CuckooMap<Key, Value> m(16, sizeof(Value), alignof(Value), optimistic);
+  for (int i = 1; i <= 1000; ++i) {
+    Value v(i * i);
+    m.insert(Key(i), &v);
+  }
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; ++t) {
+    readers.emplace_back([&m, &stop, t]() {
+      int i = t;
+      while (!stop.load()) {
+        i = i % 1000 + 1;
+        Value v;
+        bool found = m.lookupCopy(Key(i), &v);
+        assert(found);
+        assert(v.v == i * i);
+        (void)found;
+      }
+    });
+  }
+  for (int round = 0; round < 20; ++round) {
+    for (int i = 10000; i < 12000; ++i) {
+      Value v(i);
+      m.insert(Key(i), &v);
+      auto f = m.lookup(Key(i / 2 % 1000 + 1));
+      assert(f.found());
     }
-  };
-  auto showSome = [&]() {
-    for (int i = 99; i > 0; --i) {
-      Key k(i);
-      auto f = m.lookup(k);
-      if (f.found()) {
-        std::cout << "Found key " << i << " with value " << f.value()->v
-                  << std::endl;
-        assert(f.value()->v == i * i);
-        assert(f.key()->k == i);
-      } else {
-        std::cout << "Did not find key " << i << std::endl;
-        assert(i < 50);
+    for (int i = 10000; i < 12000; ++i) {
+      m.remove(Key(i));
+    }
+  }
+  stop.store(true);
+  for (auto& r : readers) {
+    r.join();
+  }
+  std::cout << "concurrent optimistic reads done" << std::endl;
+
+  // Striped writers inserting and removing disjoint ranges concurrently,
+  // with a thread going through the mutex in between:
+  for (int bfsInsert = 0; bfsInsert < 2; ++bfsInsert) {
+    CuckooMapOptions options;
+    options.useTags = true;
+    options.optimisticReads = true;
+    options.stripedWrites = true;
+    options.bfsInsert = bfsInsert != 0;
+    CuckooMap<Key, Value> ms(1024, sizeof(Value), alignof(Value), options);
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; ++t) {
+      writers.emplace_back([&ms, t]() {
+        for (int i = t * 100000 + 1; i <= t * 100000 + 20000; ++i) {
+          Value v(i);
+          bool inserted = ms.insert(Key(i), &v);
+          assert(inserted);
+          (void)inserted;
+        }
+        for (int i = t * 100000 + 1; i <= t * 100000 + 20000; i += 2) {
+          bool removed = ms.remove(Key(i));
+          assert(removed);
+          (void)removed;
+        }
+      });
+    }
+    writers.emplace_back([&ms]() {
+      for (int i = 0; i < 2000; ++i) {
+        auto f = ms.lookup(Key(i % 20000 + 1));
       }
+    });
+    for (auto& w : writers) {
+      w.join();
     }
-  };
-  std::cout << "map was made" << std::endl;
-  insert();
-  show();
-  remove();
-  showSome();
+    assert(ms.nrUsed() == 4 * 10000);
+    for (int t = 0; t < 4; ++t) {
+      for (int i = t * 100000 + 1; i <= t * 100000 + 20000; ++i) {
+        Value v;
+        bool found = ms.lookupCopy(Key(i), &v);
+        assert(found == (i % 2 == 0));
+        assert(!found || v.v == i);
+        (void)found;
+      }
+    }
+    std::cout << "concurrent striped writes done, bfsInsert: " << bfsInsert
+              << std::endl;
+  }
+
+  // Growing with incremental resize, from a single layer to a single layer,
+  // the second time with keys and values in separate arrays:
+  for (int useFilters = 0; useFilters < 2; ++useFilters) {
+    CuckooMapOptions options;
+    options.useFilters = useFilters != 0;
+    options.useTags = true;
+    options.stripedWrites = true;
+    options.bfsInsert = true;
+    options.incrementalResize = true;
+    options.splitLayout = useFilters != 0;
+    CuckooMap<Key, Value> mi(16, sizeof(Value), alignof(Value), options);
+    size_t maxLayers = 0;
+    for (int i = 1; i <= 20000; ++i) {
+      Value v(i);
+      bool inserted = mi.insert(Key(i), &v);
+      assert(inserted);
+      (void)inserted;
+      if (i % 3 == 0) {
+        bool removed = mi.remove(Key(i / 3));
+        assert(removed);
+        (void)removed;
+      }
+      maxLayers = std::max(maxLayers, mi.nrLayers());
+    }
+    while (mi.migrate()) {
+    }
+    assert(mi.nrLayers() == 1);
+    assert(mi.nrUsed() == 20000 - 20000 / 3);
+    for (int i = 1; i <= 20000; ++i) {
+      Value v;
+      bool found = mi.lookupCopy(Key(i), &v);
+      assert(found == (i > 20000 / 3));
+      assert(!found || v.v == i);
+      (void)found;
+    }
+    std::cout << "incremental resize done, useFilters: " << useFilters
+              << ", at most " << maxLayers << " layers" << std::endl;
+  }
+
+  // Shrinking after most pairs are gone, explicitly and automatically:
+  for (int incremental = 0; incremental < 2; ++incremental) {
+    CuckooMapOptions options;
+    options.useFilters = true;
+    options.incrementalResize = incremental != 0;
+    CuckooMap<Key, Value> mc(16, sizeof(Value), alignof(Value), options);
+    for (int i = 1; i <= 20000; ++i) {
+      Value v(i);
+      mc.insert(Key(i), &v);
+    }
+    uint64_t full = mc.memoryUsage();
+    for (int i = 1; i <= 19900; ++i) {
+      bool removed = mc.remove(Key(i));
+      assert(removed);
+      (void)removed;
+    }
+    uint64_t reclaimed = mc.compact();
+    uint64_t small = mc.memoryUsage();
+    std::cout << "compacted from " << full << " to " << small
+              << " bytes, reclaimed by compact: " << reclaimed << std::endl;
+    assert(small * 10 < full);
+    assert(incremental != 0 || reclaimed == full - small);
+    assert(mc.nrLayers() == 1);
+    assert(mc.nrUsed() == 100);
+    for (int i = 19901; i <= 20000; ++i) {
+      Value v;
+      bool found = mc.lookupCopy(Key(i), &v);
+      assert(found && v.v == i);
+      (void)found;
+    }
+    // a compacted layer stays, the pairs do not move
+    Key* slot = mc.lookup(Key(19950)).key();
+    assert(mc.compact() == 0 && mc.lookup(Key(19950)).key() == slot);
+    (void)slot;
+  }
+  {
+    // neither does the first layer of a new map, which is rounded up
+    CuckooMap<Key, Value> mf(1000);
+    Value v(1);
+    mf.insert(Key(1), &v);
+    Key* slot = mf.lookup(Key(1)).key();
+    assert(mf.compact() == 0 && mf.lookup(Key(1)).key() == slot);
+    (void)slot;
+  }
+
+  // Bulk loading into an empty map and into a map which is not empty:
+  for (int useFilters = 0; useFilters < 2; ++useFilters) {
+    CuckooMapOptions options;
+    options.useFilters = useFilters != 0;
+    CuckooMap<Key, Value> mb(16, sizeof(Value), alignof(Value), options);
+    std::vector<Key> keys;
+    std::vector<Value> values;
+    for (int i = 1; i <= 50000; ++i) {
+      keys.emplace_back(i);
+      values.emplace_back(i);
+    }
+    keys.emplace_back(17);  // the first of several equal keys wins
+    values.emplace_back(-1);
+    size_t nrInserted = mb.bulkLoad(keys.data(), values.data(), keys.size());
+    assert(nrInserted == 50000);
+    assert(mb.nrUsed() == 50000);
+    keys.clear();
+    values.clear();
+    for (int i = 40001; i <= 60000; ++i) {
+      keys.emplace_back(i);
+      values.emplace_back(i);
+    }
+    nrInserted = mb.bulkLoad(keys.data(), values.data(), keys.size());
+    assert(nrInserted == 10000);
+    assert(mb.nrUsed() == 60000);
+    for (int i = 1; i <= 60000; ++i) {
+      Value v;
+      bool found = mb.lookupCopy(Key(i), &v);
+      assert(found && v.v == i);
+      (void)found;
+      auto f = mb.lookup(Key(i));
+      assert(f.found());
+    }
+    std::cout << "bulk load done, useFilters: " << useFilters << ", "
+              << mb.nrLayers() << " layers" << std::endl;
+    (void)nrInserted;
+  }
+
+  // Saving a map with several layers and attaching to it again:
+  for (int config = 0; config < 4; ++config) {
+    bool useFilters = (config & 1) != 0;
+    bool splitLayout = (config & 2) != 0;
+    std::string path = "CuckooMapTest.persistent";
+    size_t nrLayers;
+    {
+      CuckooMapOptions options;
+      options.useFilters = useFilters;
+      options.useTags = true;
+      options.splitLayout = splitLayout;
+      CuckooMap<Key, Value> ms(16, sizeof(Value), alignof(Value), options);
+      for (int i = 1; i <= 5000; ++i) {
+        Value v(i);
+        ms.insert(Key(i), &v);
+      }
+      nrLayers = ms.nrLayers();
+      bool saved = ms.save(path);
+      assert(saved);
+      (void)saved;
+    }
+    {
+      CuckooMap<Key, Value> mr(path, PersistentMode::ReadOnly);
+      assert(mr.nrLayers() == nrLayers && mr.nrUsed() == 5000);
+      for (int i = 1; i <= 5000; ++i) {
+        auto f = mr.lookup(Key(i));
+        assert(f.found() && f.value()->v == i);
+      }
+      Value v(1);
+      assert(!mr.insert(Key(6000), &v));
+      assert(!mr.remove(Key(1)));
+    }
+    {
+      CuckooMap<Key, Value> mw(path, PersistentMode::CopyOnWrite);
+      for (int i = 1; i <= 1000; ++i) {
+        bool removed = mw.remove(Key(i));
+        assert(removed);
+        (void)removed;
+      }
+      for (int i = 5001; i <= 10000; ++i) {
+        Value v(i);
+        bool inserted = mw.insert(Key(i), &v);
+        assert(inserted);
+        (void)inserted;
+      }
+      assert(mw.nrUsed() == 9000);
+    }
+    {
+      CuckooMap<Key, Value> mr(path, PersistentMode::ReadOnly);
+      Value v;
+      assert(mr.nrUsed() == 5000 && mr.lookupCopy(Key(1), &v));
+    }
+    std::remove(path.c_str());
+    for (size_t layer = 0; layer < nrLayers; ++layer) {
+      std::remove((path + ".layer" + std::to_string(layer)).c_str());
+      std::remove((path + ".filter" + std::to_string(layer)).c_str());
+    }
+    std::cout << "persistent map done, useFilters: " << useFilters
+              << ", splitLayout: " << splitLayout << ", " << nrLayers
+              << " layers" << std::endl;
+  }
+
+  // Maps whose table memory is allocated according to a policy, all of
+  // these must work whether or not the system supports the placement:
+  for (int variant = 0; variant < 4; ++variant) {
+    AllocationPolicy policy;
+    policy.anonymous = true;
+    policy.hugePages = variant == 1;
+    policy.explicitHugePages = variant == 2;
+    if (variant == 3) {
+      policy.numaNode = currentNumaNode();
+      policy.interleave = numaNodeCount() > 1;
+    }
+    CuckooMap<Key, Value> mp(1024, sizeof(Value), alignof(Value), policy);
+    for (int i = 1; i <= 20000; ++i) {
+      Value v(i);
+      bool inserted = mp.insert(Key(i), &v);
+      assert(inserted);
+      (void)inserted;
+    }
+    for (int i = 1; i <= 20000; ++i) {
+      auto f = mp.lookup(Key(i));
+      assert(f.found() && f.value()->v == i);
+    }
+    std::cout << "allocation policy variant " << variant << " done, "
+              << mp.nrLayers() << " layers" << std::endl;
+  }
+
+  // Large values kept out of line in the arena of the map, with every
+  // option which moves pairs around:
+  for (int config = 0; config < 8; ++config) {
+    bool useFilters = (config & 1) != 0;
+    bool striped = (config & 2) != 0;
+    bool incremental = (config & 4) != 0;
+    CuckooMapOptions options;
+    options.useFilters = useFilters;
+    options.useTags = true;
+    options.stripedWrites = striped;
+    options.bfsInsert = true;
+    options.incrementalResize = incremental;
+    options.valueArena = true;
+    CuckooMap<Key, LargeValue> ma(16, sizeof(LargeValue), alignof(LargeValue),
+                                  options);
+    LargeValue lv;
+    std::memset(&lv, 0, sizeof(lv));
+    for (int i = 1; i <= 20000; ++i) {
+      lv.v = i;
+      lv.payload[251] = static_cast<char>(i);
+      bool inserted = ma.insert(Key(i), &lv);
+      assert(inserted);
+      (void)inserted;
+    }
+    for (int i = 1; i <= 20000; ++i) {
+      auto f = ma.lookup(Key(i));
+      assert(f.found() && f.value()->v == i &&
+             f.value()->payload[251] == static_cast<char>(i));
+    }
+    // pairs removed again give their values back for reuse
+    uint64_t usage = ma.memoryUsage();
+    for (int round = 0; round < 4; ++round) {
+      for (int i = 1; i <= 5000; ++i) {
+        lv.v = -i;
+        bool inserted = ma.insert(Key(20000 + i), &lv);
+        assert(inserted);
+        (void)inserted;
+      }
+      for (int i = 1; i <= 5000; ++i) {
+        bool removed = ma.remove(Key(20000 + i));
+        assert(removed);
+        (void)removed;
+      }
+    }
+    assert(ma.memoryUsage() <= usage + 5000 * sizeof(LargeValue) + 4096);
+    LargeValue out;
+    for (int i = 1; i <= 20000; ++i) {
+      bool found = ma.lookupCopy(Key(i), &out);
+      assert(found && out.v == i);
+      (void)found;
+    }
+    assert(!ma.save("CuckooMapTest.arena"));
+    std::cout << "value arena done, config: " << config << ", "
+              << ma.nrLayers() << " layers" << std::endl;
+  }
+
+  // A skewed access pattern: a small hot set inserted last, thus in the
+  // last layer, and looked up over and over between single lookups of cold
+  // keys. With adaptive promotion the first layer serves almost all hits:
+  for (int adaptive = 0; adaptive < 2; ++adaptive) {
+    CuckooMapOptions options;
+    options.useTags = true;
+    CuckooMap<Key, Value> mp(4096, sizeof(Value), alignof(Value), options);
+    if (adaptive != 0) {
+      mp.setPromotion(Promotion::Adaptive);
+    }
+    int cold = 200000;
+    int hot = 1000;
+    for (int i = 1; i <= cold + hot; ++i) {
+      Value v(i);
+      mp.insert(Key(i), &v);
+    }
+    auto lookupRound = [&](int round) {
+      for (int i = 1; i <= hot; ++i) {
+        {
+          auto f = mp.lookup(Key(cold + i));
+          assert(f.found() && f.value()->v == cold + i);
+        }
+        if (i % 10 == 0) {
+          auto f = mp.lookup(Key(1 + (round * hot + i) % cold));
+          assert(f.found());
+        }
+      }
+    };
+    for (int round = 0; round < 50; ++round) {
+      lookupRound(round);
+    }
+    mp.resetPromotionStatistics();
+    for (int round = 50; round < 60; ++round) {
+      lookupRound(round);
+    }
+    auto statistics = mp.promotionStatistics();
+    uint64_t hits = 0;
+    for (uint64_t h : statistics.layerHits) {
+      hits += h;
+    }
+    assert(hits == statistics.lookups);
+    double frontRate = static_cast<double>(statistics.layerHits[0]) / hits;
+    assert(adaptive == 0 || frontRate >= 0.85);
+    (void)frontRate;
+    std::cout << "skewed lookups done, adaptive: " << adaptive
+              << ", first layer hit rate " << frontRate << ", "
+              << statistics.promotions << " promotions, " << mp.nrLayers()
+              << " layers" << std::endl;
+  }
+
+  for (int config = 0; config < 16; ++config) {
+    checkScan((config & 1) != 0, (config & 2) != 0, (config & 4) != 0,
+              (config & 8) != 0);
+  }
+
+  for (int config = 0; config < 8; ++config) {
+    checkUpsert((config & 1) != 0, (config & 2) != 0, (config & 4) != 0);
+  }
+
+  for (int config = 0; config < 4; ++config) {
+    for (Eviction eviction :
+         {Eviction::Random, Eviction::Clock, Eviction::DeepestLayer}) {
+      checkBound(eviction, (config & 1) != 0, (config & 2) != 0);
+    }
+  }
+
+  // Alternative hash functions, also as the two halves of one 128-bit hash:
+  checkHashes<HashFold<Key, 1>, HashFold<Key, 2>>("fold");
+  checkHashes<HashCrc32c<Key, 1>, HashCrc32c<Key, 2>>("crc32c");
+  checkHashes<HashInteger<Key, 1>, HashInteger<Key, 2>>("integer");
+  checkCollisions<HashFold<WideKey, 1>>("fold");
+  checkCollisions<HashFold<WideKey, 777>>("fold, other seed");
+  checkCollisions<HashCrc32c<WideKey, 1>>("crc32c");
+  checkCollisions<HashCrc32c<WideKey, 777>>("crc32c, other seed");
+  checkHashes<FirstOf128<Key, HashFold<Key, 1>>,
+              SecondOf128<Key, HashFold<Key, 1>>>("128-bit fold");
+  checkHashes<FirstOf128<Key, HashCrc32c<Key, 1>>,
+              SecondOf128<Key, HashCrc32c<Key, 1>>>("128-bit crc32c");
+  checkHashes<FirstOf128<Key, HashInteger<Key, 1>>,
+              SecondOf128<Key, HashInteger<Key, 1>>>("128-bit integer");
 }
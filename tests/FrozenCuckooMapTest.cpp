@@ -0,0 +1,201 @@
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cuckoomap/CuckooMap.h>
+#include <cuckoomap/FrozenCuckooMap.h>
+
+struct Key {
+  int k;
+  Key() : k(0) {}
+  Key(int i) : k(i) {}
+  bool empty() const { return k == 0; }
+};
+
+namespace std {
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+typedef CuckooMap<Key, int> Map;
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+void checkFreeze(bool valueArena) {
+  int n = 200000;
+  CuckooMapOptions options;
+  options.useFilters = true;
+  options.useTags = true;
+  options.valueArena = valueArena;
+  Map m(1024, sizeof(int), alignof(int), options);
+  for (int i = 1; i <= n; ++i) {
+    int v = 3 * i;
+    m.insert(Key(i), &v);
+  }
+  assert(m.nrLayers() > 1);
+  Map::Frozen frozen = m.freeze();
+  assert(frozen.nrUsed() == static_cast<uint64_t>(n));
+  // a single table, almost full:
+  assert(frozen.nrUsed() * 16 >= frozen.capacity() * 14);
+  for (int i = 1; i <= 2 * n; ++i) {
+    int const* v = frozen.lookup(Key(i));
+    assert((v != nullptr) == (i <= n));
+    assert(v == nullptr || *v == 3 * i);
+    (void)v;
+  }
+  // the map is unchanged and independent of the copy:
+  assert(m.nrUsed() == static_cast<uint64_t>(n));
+  m.remove(Key(1));
+  assert(frozen.lookup(Key(1)) != nullptr);
+
+  uint64_t count = 0;
+  int64_t sum = 0;
+  frozen.scan([&count, &sum](Key const& k, int const* v) {
+    assert(*v == 3 * k.k);
+    ++count;
+    sum += k.k;
+  });
+  assert(count == static_cast<uint64_t>(n));
+  assert(sum == int64_t(n) * (n + 1) / 2);
+  std::cout << "freeze" << (valueArena ? " with a value arena" : "")
+            << ": ok, " << frozen.memoryUsage() << " bytes instead of "
+            << m.memoryUsage() << std::endl;
+}
+
+void checkArrays() {
+  // built from arrays, for equal keys the first one wins
+  std::vector<Key> keys;
+  std::vector<int> values;
+  for (int i = 1; i <= 1000; ++i) {
+    keys.push_back(Key(i));
+    values.push_back(i);
+  }
+  keys.push_back(Key(5));
+  values.push_back(-5);
+  Map::Frozen frozen(keys.data(), values.data(), keys.size());
+  assert(frozen.nrUsed() == 1000);
+  assert(*frozen.lookup(Key(5)) == 5);
+
+  std::vector<Key> batch;
+  for (int i = 0; i < 100; ++i) {
+    batch.push_back(Key(i * 17));
+  }
+  std::vector<int> out(batch.size());
+  std::unique_ptr<bool[]> found(new bool[batch.size()]);
+  size_t nrFound =
+      frozen.lookupBatch(batch.data(), batch.size(), out.data(), found.get());
+  size_t expectedFound = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    bool in = batch[i].k >= 1 && batch[i].k <= 1000;
+    assert(found[i] == in);
+    assert(!in || out[i] == batch[i].k);
+    expectedFound += in ? 1 : 0;
+  }
+  assert(nrFound == expectedFound);
+  (void)nrFound;
+
+  // an empty map works as well
+  Map::Frozen empty(keys.data(), values.data(), 0);
+  assert(empty.nrUsed() == 0 && empty.lookup(Key(1)) == nullptr);
+  std::cout << "arrays: ok" << std::endl;
+}
+
+void checkSave() {
+  std::vector<Key> keys;
+  std::vector<int> values;
+  for (int i = 1; i <= 50000; ++i) {
+    keys.push_back(Key(i));
+    values.push_back(i + 7);
+  }
+  Map::Frozen frozen(keys.data(), values.data(), keys.size());
+  std::string path = "FrozenCuckooMapTest.frozen";
+  bool saved = frozen.save(path);
+  assert(saved);
+  (void)saved;
+  {
+    Map::Frozen attached(path);
+    assert(attached.nrUsed() == 50000);
+    assert(attached.nrBuckets() == frozen.nrBuckets());
+    for (int i = 1; i <= 60000; ++i) {
+      int v;
+      bool found = attached.lookupCopy(Key(i), &v);
+      assert(found == (i <= 50000));
+      assert(!found || v == i + 7);
+      (void)found;
+    }
+  }
+  bool mismatch = false;
+  try {
+    FrozenCuckooMap<Key, int64_t> other(path);
+  } catch (std::runtime_error const&) {
+    mismatch = true;
+  }
+  assert(mismatch);
+  (void)mismatch;
+  std::remove(path.c_str());
+  std::cout << "save: ok" << std::endl;
+}
+
+void checkConcurrent() {
+  // lookups from many threads without a lock, compared with the map
+  int n = 1000000;
+  Map m(1024);
+  for (int i = 1; i <= n; ++i) {
+    m.insert(Key(i), &i);
+  }
+  Map::Frozen frozen = m.freeze();
+  int nrThreads = 4;
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < nrThreads; ++t) {
+    threads.emplace_back([&frozen, n, t]() {
+      for (int i = 1 + t; i <= n; i += 3) {
+        int const* v = frozen.lookup(Key(i));
+        assert(v != nullptr && *v == i);
+        (void)v;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  double frozenTime = seconds(start);
+  threads.clear();
+  start = std::chrono::steady_clock::now();
+  for (int t = 0; t < nrThreads; ++t) {
+    threads.emplace_back([&m, n, t]() {
+      for (int i = 1 + t; i <= n; i += 3) {
+        int v;
+        bool found = m.lookupCopy(Key(i), &v);
+        assert(found && v == i);
+        (void)found;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  double mapTime = seconds(start);
+  std::cout << "concurrent lookups: frozen " << frozenTime << "s, map "
+            << mapTime << "s" << std::endl;
+}
+
+int main(int /*argc*/, char* /*argv*/[]) {
+  checkFreeze(false);
+  checkFreeze(true);
+  checkArrays();
+  checkSave();
+  checkConcurrent();
+  return 0;
+}
@@ -18,6 +18,17 @@ struct equal_to<Key> {
 };
 }
 
+struct ZeroKey {
+  int k;
+  ZeroKey() : k(0) {}
+  ZeroKey(int i) : k(i) {}
+  bool empty() { return k == 0; }
+  bool operator==(ZeroKey const& other) const { return k == other.k; }
+};
+
+template <>
+struct EmptyKeyIsZero<ZeroKey> : std::true_type {};
+
 struct Value {
   int v;
   Value() : v(0) {}
@@ -25,54 +36,190 @@ struct Value {
   bool empty() { return v == 0; }
 };
 
+template <class Table>
+void fillGeometry(Table& m) {
+  // insert, look up and remove pairs in a table of some bucket geometry
+  for (int i = 1; i <= 2000; ++i) {
+    Key k(i);
+    Value v(i);
+    int res = m.insert(k, &v, nullptr, nullptr);
+    assert(res == 0);
+    (void)res;
+  }
+  for (int i = 1; i <= 4000; ++i) {
+    Key k(i);
+    Key* kp;
+    Value* vp;
+    bool found = m.lookup(k, kp, vp);
+    assert(found == (i <= 2000));
+    assert(!found || (vp->v == i && kp->k == i));
+    (void)found;
+  }
+  for (int i = 1; i <= 1000; ++i) {
+    Key k(i);
+    bool removed = m.remove(k);
+    assert(removed);
+    (void)removed;
+  }
+  assert(m.nrUsed() == 1000);
+}
+
 int main(int /*argc*/, char* /*argv*/[]) {
-  InternalCuckooMap<Key, Value> m(false, 1000);
-  auto insert = [&]() -> void {
-    for (int i = 1; i < 100; ++i) {
-      Key k(i);
-      Value v(i * i);
-      int res = 1;
-      while (res > 0) {
-        res = m.insert(k, &v, nullptr, nullptr);
+  for (int config = 0; config < 8; ++config) {
+    bool useTags = (config & 1) != 0;
+    bool useBfs = (config & 2) != 0;
+    bool splitLayout = (config & 4) != 0;
+    std::cout << "useTags: " << useTags << ", useBfs: " << useBfs
+              << ", splitLayout: " << splitLayout << std::endl;
+    InternalCuckooMap<Key, Value> m(false, 1000, sizeof(Value), alignof(Value),
+                                    useTags, useBfs, splitLayout);
+    auto insert = [&]() -> void {
+      for (int i = 1; i < 100; ++i) {
+        Key k(i);
+        Value v(i * i);
+        int res = 1;
+        while (res > 0) {
+          res = m.insert(k, &v, nullptr, nullptr);
+        }
+        if (res == 0) {
+          std::cout << "Inserted pair ";
+        } else {
+          std::cout << "Could not insert pair ";
+          assert(false);
+        }
+        std::cout << "(" << i << ", " << i * i << ")" << std::endl;
       }
-      if (res == 0) {
-        std::cout << "Inserted pair ";
-      } else {
-        std::cout << "Could not insert pair ";
-        assert(false);
+    };
+    auto show = [&]() {
+      for (int i = 99; i >= 1; --i) {
+        Key k(i);
+        Key* kFound;
+        Value* vFound;
+        if (m.lookup(k, kFound, vFound)) {
+          std::cout << "Found key " << i << " with value " << vFound->v
+                    << std::endl;
+          assert(vFound->v == i * i);
+          assert(kFound->k == i);
+        } else {
+          std::cout << "Did not find key " << i << std::endl;
+        }
       }
-      std::cout << "(" << i << ", " << i * i << ")" << std::endl;
-    }
-  };
-  auto show = [&]() {
-    for (int i = 99; i >= 1; --i) {
+    };
+    auto remove = [&]() -> void {
+      for (int i = 1; i < 50; ++i) {
+        Key k(i);
+        if (m.remove(k)) {
+          std::cout << "Removed key " << i << std::endl;
+        } else {
+          std::cout << "Did not find key " << i << std::endl;
+          assert(false);
+        }
+      }
+    };
+    std::cout << "map was made" << std::endl;
+    insert();
+    show();
+    remove();
+    show();
+  }
+
+  // Fill a table until the first insert has to give back a pair, and
+  // compare the load factors reached by both displacement strategies:
+  for (int useBfs = 0; useBfs < 2; ++useBfs) {
+    InternalCuckooMap<Key, Value> m(false, 4096, sizeof(Value), alignof(Value),
+                                    false, useBfs != 0);
+    int i = 1;
+    while (true) {
       Key k(i);
-      Key* kFound;
-      Value* vFound;
-      if (m.lookup(k, kFound, vFound)) {
-        std::cout << "Found key " << i << " with value " << vFound->v
-                  << std::endl;
-        assert(vFound->v == i * i);
-        assert(kFound->k == i);
-      } else {
-        std::cout << "Did not find key " << i << std::endl;
+      Value v(i);
+      if (m.insert(k, &v, nullptr, nullptr) != 0) {
+        break;
       }
+      ++i;
     }
-  };
-  auto remove = [&]() -> void {
-    for (int i = 1; i < 50; ++i) {
-      Key k(i);
-      if (m.remove(k)) {
-        std::cout << "Removed key " << i << std::endl;
-      } else {
-        std::cout << "Did not find key " << i << std::endl;
-        assert(false);
+    double load = static_cast<double>(m.nrUsed()) / m.capacity();
+    std::cout << "useBfs: " << useBfs << ", load at first failure: " << load
+              << std::endl;
+    if (useBfs) {
+      assert(load >= 0.9);
+    }
+  }
+
+  // Reference bits move with their pairs when breadth-first insertion
+  // displaces them, and a new pair starts without one: with every pair
+  // referenced right after its insertion, a sweep finds none unreferenced,
+  // except a pair put into the slot of one kicked out at the end.
+  {
+    InternalCuckooMap<Key, Value> m(false, 4096, sizeof(Value),
+                                    alignof(Value), true, true);
+    m.enableReferenceBits();
+    int res = 0;
+    int last = 0;
+    Key* kp = nullptr;
+    Value* vp = nullptr;
+    while (res == 0 && m.nrUsed() < m.capacity()) {
+      Key k(++last);
+      Value v(last);
+      res = m.insert(k, &v, &kp, &vp);
+      if (res == 0) {
+        m.reference(kp);
       }
     }
-  };
-  std::cout << "map was made" << std::endl;
-  insert();
-  show();
-  remove();
-  show();
+    assert(m.nrUsed() >= m.capacity() * 9 / 10);
+    uint64_t hand = 0;
+    int nrUnreferenced = 0;
+    while (m.findUnreferenced(hand, kp, vp)) {
+      assert(res == 1 && kp->k == last);
+      ++nrUnreferenced;
+    }
+    assert(nrUnreferenced == res);
+    uint64_t nrSwept = 0;
+    while (m.findUnreferenced(hand, kp, vp)) {
+      ++nrSwept;
+    }
+    assert(nrSwept == m.nrUsed());
+    (void)nrSwept;
+    std::cout << "reference bits done, " << m.nrUsed() << " pairs"
+              << std::endl;
+  }
+
+  // Other bucket geometries, with and without tags:
+  for (int useTags = 0; useTags < 2; ++useTags) {
+    typedef HashWithSeed<Key, 0xdeadbeefdeadbeefULL> H1;
+    typedef HashWithSeed<Key, 0xabcdefabcdef1234ULL> H2;
+    InternalCuckooMap<Key, Value, H1, H2, std::equal_to<Key>, 2> m2(
+        false, 4096, sizeof(Value), alignof(Value), useTags != 0, true);
+    InternalCuckooMap<Key, Value, H1, H2, std::equal_to<Key>, 8, 16> m8(
+        false, 4096, sizeof(Value), alignof(Value), useTags != 0, true, true);
+    InternalCuckooMap<Key, Value, H1, H2, std::equal_to<Key>, 16, 16> m16(
+        false, 4096, sizeof(Value), alignof(Value), useTags != 0, true);
+    fillGeometry(m2);
+    fillGeometry(m8);
+    fillGeometry(m16);
+    std::cout << "bucket geometries done, useTags: " << useTags << std::endl;
+  }
+
+  // Tables of a key type whose empty key is all zero bytes skip the
+  // initialization of their slots, on the heap and in mapped memory:
+  for (int useMmap = 0; useMmap < 2; ++useMmap) {
+    InternalCuckooMap<ZeroKey, Value> m(useMmap != 0, 1 << 20, sizeof(Value),
+                                        alignof(Value), true);
+    for (int i = 1; i <= 1000; ++i) {
+      ZeroKey k(i);
+      Value v(i);
+      int res = m.insert(k, &v, nullptr, nullptr);
+      assert(res == 0);
+      (void)res;
+    }
+    for (int i = 1; i <= 2000; ++i) {
+      ZeroKey k(i);
+      ZeroKey* kp;
+      Value* vp;
+      bool found = m.lookup(k, kp, vp);
+      assert(found == (i <= 1000));
+      assert(!found || vp->v == i);
+      (void)found;
+    }
+    std::cout << "zeroed table done, useMmap: " << useMmap << std::endl;
+  }
 }
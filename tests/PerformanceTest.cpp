@@ -80,7 +80,7 @@ class WeightedSelector {
 };
 
 typedef HashWithSeed<Key, 0xdeadbeefdeadbeefULL> KeyHash;
-typedef std::unordered_map<Key, Value*, KeyHash> unordered_map_for_key;
+typedef std::unordered_map<Key, Value, KeyHash> unordered_map_for_key;
 
 class TestMap {
  private:
@@ -97,14 +97,15 @@ class TestMap {
       return (element.found() ? element.value() : nullptr);
     } else {
       auto element = _unordered.find(k);
-      return (element != _unordered.end()) ? (*element).second : nullptr;
+      return (element != _unordered.end()) ? &(*element).second : nullptr;
     }
   }
-  bool insert(Key const& k, Value* v) {
+  bool insert(Key const& k, Value const* v) {
+    // both maps copy the value, as the caller's one lives on the stack
     if (_useCuckoo) {
       return _cuckoo.insert(k, v);
     } else {
-      return _unordered.emplace(k, v).second;
+      return _unordered.emplace(k, *v).second;
     }
   }
   bool remove(Key const& k) {
@@ -194,8 +195,7 @@ int main(int argc, char* argv[]) {
   uint64_t current;
   uint64_t barrier, nHot, nCold;
   bool success;
-  Key* k;
-  Value* v;
+  Value* found;
 
   auto insertStart = std::chrono::high_resolution_clock::now();
   auto now = std::chrono::high_resolution_clock::now();
@@ -210,11 +210,9 @@ int main(int argc, char* argv[]) {
         break;
       }
       current = maxElement++;
-      k = new Key(current);
-      v = new Value(current);
-      success = map.insert(*k, v);
-      delete k;
-      delete v;
+      Key k(current);
+      Value v(current);
+      success = map.insert(k, &v);
       if (!success) {
         std::cout << "Failed to insert " << current << " with range ("
                   << minElement << ", " << maxElement << ")" << std::endl;
@@ -235,13 +233,14 @@ int main(int argc, char* argv[]) {
           }
 
           current = maxElement++;
-          k = new Key(current);
-          v = new Value(current);
-          currentStart = std::chrono::high_resolution_clock::now();
-          success = map.insert(*k, v);
-          currentFinish = std::chrono::high_resolution_clock::now();
-          delete k;
-          delete v;
+          {
+            // on the stack, the timed section must not allocate
+            Key k(current);
+            Value v(current);
+            currentStart = std::chrono::high_resolution_clock::now();
+            success = map.insert(k, &v);
+            currentFinish = std::chrono::high_resolution_clock::now();
+          }
           if (!success) {
             std::cout << "Failed to insert " << current << " with range ("
                       << minElement << ", " << maxElement << ")" << std::endl;
@@ -268,11 +267,10 @@ int main(int argc, char* argv[]) {
                             : minElement + r.nextInRange(nHot);
           }
 
-          k = new Key(current);
           currentStart = std::chrono::high_resolution_clock::now();
-          v = map.lookup(current);
+          found = map.lookup(Key(current));
           currentFinish = std::chrono::high_resolution_clock::now();
-          delete k;
+          (void)found;
           digestL.insert(std::chrono::duration_cast<std::chrono::nanoseconds>(
                              currentFinish - currentStart)
                              .count(),
@@ -285,11 +283,9 @@ int main(int argc, char* argv[]) {
           }
           current = working.next() ? minElement++ : --maxElement;
 
-          k = new Key(current);
           currentStart = std::chrono::high_resolution_clock::now();
-          success = map.remove(current);
+          success = map.remove(Key(current));
           currentFinish = std::chrono::high_resolution_clock::now();
-          delete k;
           if (!success) {
             std::cout << "Failed to remove " << current << " with range ("
                       << minElement << ", " << maxElement << ")" << std::endl;
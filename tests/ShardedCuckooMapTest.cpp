@@ -1,5 +1,10 @@
+#include <atomic>
 #include <cassert>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include <cuckoomap/CuckooMap.h>
 #include <cuckoomap/ShardedMap.h>
@@ -26,6 +31,16 @@ struct Value {
   bool empty() { return v == 0; }
 };
 
+// counts its computations, one per operation on a ShardedMap of CuckooMaps
+static std::atomic<uint64_t> nrHashes(0);
+
+struct CountingHash {
+  void operator()(Key const& k, uint64_t* first, uint64_t* second) const {
+    nrHashes.fetch_add(1);
+    HashFold<Key, 1>()(k, first, second);
+  }
+};
+
 int main(int /*argc*/, char* /*argv*/[]) {
   ShardedMap<CuckooMap<Key, Value>> m(16, 8);
   auto insert = [&]() -> void {
@@ -71,4 +86,330 @@ int main(int /*argc*/, char* /*argv*/[]) {
   show();
   remove();
   show();
+
+  // One allocation policy per shard, the shards beyond the given policies
+  // use the default one:
+  std::vector<AllocationPolicy> policies(4);
+  for (size_t s = 0; s < policies.size(); ++s) {
+    policies[s].anonymous = true;
+    policies[s].numaNode = static_cast<int>(s % numaNodeCount());
+  }
+  ShardedMap<CuckooMap<Key, Value>> mp(16, 8, sizeof(Value), alignof(Value),
+                                       policies);
+  for (int i = 1; i < 1000; ++i) {
+    Value v(i);
+    bool inserted = mp.insert(Key(i), &v);
+    assert(inserted);
+    (void)inserted;
+  }
+  for (int i = 1; i < 1000; ++i) {
+    auto f = mp.lookup(Key(i));
+    assert(f.found() && f.value()->v == i);
+  }
+  std::cout << "sharded map with allocation policies done" << std::endl;
+
+  // Parallel scans, one shard at a time per worker:
+  ShardedMap<CuckooMap<Key, Value>> ms(64, 16);
+  int n = 50000;
+  for (int i = 1; i <= n; ++i) {
+    Value v(i);
+    ms.insert(Key(i), &v);
+  }
+  for (int snapshot = 0; snapshot < 2; ++snapshot) {
+    for (uint32_t nrThreads = 1; nrThreads <= 8; nrThreads *= 2) {
+      std::unique_ptr<std::atomic<bool>[]> seen(new std::atomic<bool>[n + 1]);
+      for (int i = 0; i <= n; ++i) {
+        seen[i].store(false);
+      }
+      std::atomic<int> count(0);
+      bool complete = ms.scan(
+          [&](Key const& k, Value const* v) {
+            assert(v->v == k.k && !seen[k.k].exchange(true));
+            count.fetch_add(1);
+            return ScanAction::Continue;
+          },
+          nrThreads, snapshot != 0);
+      assert(complete && count.load() == n);
+      (void)complete;
+    }
+  }
+  // a stop in one worker ends the others, too:
+  std::atomic<int> visited(0);
+  bool complete = ms.scan(
+      [&](Key const&, Value const*) {
+        return (visited.fetch_add(1) == 100) ? ScanAction::Stop
+                                             : ScanAction::Continue;
+      },
+      4);
+  assert(!complete && visited.load() < n);
+  // a snapshot sweep removing the even keys while another thread inserts
+  // new ones, which wait for the shards to be released:
+  std::thread writer([&ms, n]() {
+    for (int i = n + 1; i <= 2 * n; ++i) {
+      Value v(i);
+      ms.insert(Key(i), &v);
+    }
+  });
+  std::atomic<int> removed(0);
+  ms.scan(
+      [&](Key const& k, Value const*) {
+        if (k.k <= n && k.k % 2 == 0) {
+          removed.fetch_add(1);
+          return ScanAction::Remove;
+        }
+        return ScanAction::Continue;
+      },
+      4, true);
+  writer.join();
+  assert(removed.load() == n / 2);
+  assert(ms.nrUsed() == static_cast<uint64_t>(n + n / 2));
+  for (int i = 1; i <= n; ++i) {
+    Value v;
+    assert(ms.lookupCopy(Key(i), &v) == (i % 2 != 0));
+  }
+  std::cout << "parallel scans done" << std::endl;
+
+  // batches over all shards give the same results as single operations:
+  ShardedMap<CuckooMap<Key, Value>> mb(256, 8);
+  std::vector<Key> keys;
+  std::vector<Value> values;
+  for (int i = 1; i <= n; ++i) {
+    keys.push_back(Key(i));
+    values.push_back(Value(i * 3));
+  }
+  keys.push_back(Key(1));  // all but the first of equal keys are skipped
+  values.push_back(Value(7));
+  size_t nrInserted = mb.insertBatch(keys.data(), values.data(), keys.size());
+  assert(nrInserted == static_cast<size_t>(n) && mb.nrUsed() == nrInserted);
+  std::vector<Key> probe;
+  for (int i = 1; i <= 2 * n; i += 3) {
+    probe.push_back(Key(i));
+  }
+  std::vector<Value> got(probe.size());
+  std::unique_ptr<bool[]> found(new bool[probe.size()]);
+  size_t nrFound = mb.lookupBatch(probe.data(), probe.size(), got.data(),
+                                  found.get());
+  size_t expected = 0;
+  for (size_t j = 0; j < probe.size(); ++j) {
+    Value v;
+    assert(found[j] == mb.lookupCopy(probe[j], &v));
+    assert(!found[j] || (got[j].v == v.v && v.v == probe[j].k * 3));
+    expected += found[j] ? 1 : 0;
+  }
+  assert(nrFound == expected);
+  size_t nrRemoved = mb.removeBatch(probe.data(), probe.size());
+  assert(nrRemoved == expected && mb.nrUsed() == n - expected);
+  for (int i = 1; i <= n; ++i) {
+    Value v;
+    assert(mb.lookupCopy(Key(i), &v) == ((i - 1) % 3 != 0));
+  }
+  (void)nrInserted;
+  (void)nrFound;
+  (void)nrRemoved;
+  std::cout << "batches done" << std::endl;
+
+  // every thread writes its own keys to its own shard:
+  ShardedMap<CuckooMap<Key, Value>> ma(256, 4);
+  bool refused = false;
+  try {
+    ma.affinity(0);
+  } catch (std::runtime_error const&) {
+    refused = true;
+  }
+  assert(refused);
+  (void)refused;
+  ma.setAffinity(true);
+  int nrWriters = 4;
+  std::vector<std::thread> writers;
+  for (int t = 0; t < nrWriters; ++t) {
+    writers.emplace_back([&ma, n, t, nrWriters]() {
+      auto own = ma.affinity(t);
+      std::vector<Key> ks;
+      std::vector<Value> vs;
+      for (int i = t + 1; i <= n; i += nrWriters) {
+        if (i % 8 == t + 1) {
+          Value v(i);
+          own.insert(Key(i), &v);
+        } else {
+          ks.push_back(Key(i));
+          vs.push_back(Value(i));
+        }
+      }
+      own.insertBatch(ks.data(), vs.data(), ks.size());
+      for (int i = t + 1; i <= n; i += nrWriters) {
+        Value v;
+        bool ok = own.lookupCopy(Key(i), &v);
+        assert(ok && v.v == i);
+        (void)ok;
+      }
+    });
+  }
+  for (auto& t : writers) {
+    t.join();
+  }
+  assert(ma.nrUsed() == static_cast<uint64_t>(n));
+  auto own = ma.affinity(1);
+  for (int i = 1; i <= n; ++i) {
+    // pairs written by one thread are found from everywhere:
+    Value v;
+    assert(ma.lookupCopy(Key(i), &v) && v.v == i);
+    assert(own.lookupCopy(Key(i), &v) && v.v == i);
+    auto f = ma.lookup(Key(i));
+    assert(f.found() && f.value()->v == i);
+  }
+  for (int i = 1; i <= n; i += 4) {
+    assert(own.remove(Key(i)));
+  }
+  for (int i = 2; i <= n; i += 4) {
+    assert(ma.remove(Key(i)));
+  }
+  for (int i = 3; i <= n; i += 4) {
+    auto f = ma.lookup(Key(i));
+    assert(f.found() && ma.remove(f));
+  }
+  assert(ma.nrUsed() == static_cast<uint64_t>(n / 4));
+  for (int i = 1; i <= n; ++i) {
+    Value v;
+    assert(ma.lookupCopy(Key(i), &v) == (i % 4 == 0));
+  }
+  std::cout << "affinity done" << std::endl;
+
+  // splitting large shards, the pairs stay where they were:
+  ShardedMap<CuckooMap<Key, Value>> mr(256, 2);
+  assert(mr.nrShards() == 2);
+  for (int i = 1; i <= n; ++i) {
+    Value v(i);
+    mr.insert(Key(i), &v);
+  }
+  size_t nrSplits = mr.splitShards(n / 8);
+  assert(nrSplits >= 6 && mr.nrShards() == 2 + nrSplits);
+  assert(mr.nrUsed() == static_cast<uint64_t>(n));
+  for (int i = 1; i <= 2 * n; ++i) {
+    Value v;
+    bool found = mr.lookupCopy(Key(i), &v);
+    assert(found == (i <= n) && (!found || v.v == i));
+    (void)found;
+  }
+  assert(mr.splitShard(Key(1)) && mr.nrShards() == 3 + nrSplits);
+  std::unique_ptr<bool[]> foundAfter(new bool[keys.size()]);
+  std::vector<Value> gotAfter(keys.size());
+  assert(mr.lookupBatch(keys.data(), keys.size(), gotAfter.data(),
+                        foundAfter.get()) == keys.size());
+  assert(mr.removeBatch(keys.data(), n / 2) == static_cast<size_t>(n / 2));
+  assert(mr.nrUsed() == static_cast<uint64_t>(n - n / 2));
+  (void)nrSplits;
+  bool refusedSplit = false;
+  try {
+    ma.splitShard(Key(1));
+  } catch (std::runtime_error const&) {
+    refusedSplit = true;
+  }
+  assert(refusedSplit);
+  (void)refusedSplit;
+
+  // and while readers and writers go on:
+  ShardedMap<CuckooMap<Key, Value>> mc(256, 1);
+  for (int i = 1; i <= n; ++i) {
+    Value v(i);
+    mc.insert(Key(i), &v);
+  }
+  std::atomic<bool> splitting(true);
+  std::vector<std::thread> users;
+  for (int t = 0; t < 2; ++t) {
+    users.emplace_back([&mc, &splitting, n, t]() {
+      // the first n keys are always there
+      uint64_t x = t + 1;
+      while (splitting.load()) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        int i = static_cast<int>((x >> 33) % n) + 1;
+        Value v;
+        bool found = mc.lookupCopy(Key(i), &v);
+        assert(found && v.v == i);
+        auto f = mc.lookup(Key(i));
+        assert(f.found() && f.value()->v == i);
+        (void)found;
+      }
+    });
+  }
+  for (int t = 0; t < 2; ++t) {
+    users.emplace_back([&mc, n, t]() {
+      // insert new keys, remove every other one of them again
+      for (int i = n + 1 + t; i <= 3 * n; i += 2) {
+        Value v(i);
+        bool inserted = mc.insert(Key(i), &v);
+        assert(inserted && !mc.insert(Key(i), &v));
+        (void)inserted;
+        if (i % 4 < 2) {
+          bool removed = mc.remove(Key(i));
+          assert(removed);
+          (void)removed;
+        }
+      }
+    });
+  }
+  users.emplace_back([&mc, n]() {
+    // count upserts of the keys from 3 * n + 1 on, each round once
+    for (int round = 0; round < 4; ++round) {
+      for (int i = 3 * n + 1; i <= 4 * n; ++i) {
+        mc.upsert(Key(i), [](Value* v, bool isNew) {
+          v->v = isNew ? 1 : v->v + 1;
+        });
+      }
+    }
+  });
+  for (int i = 1; mc.nrShards() < 16; i += 7919) {
+    mc.splitShard(Key(i));
+  }
+  splitting.store(false);
+  for (auto& t : users) {
+    t.join();
+  }
+  for (int i = 1; i <= 3 * n; ++i) {
+    Value v;
+    bool found = mc.lookupCopy(Key(i), &v);
+    assert(found == (i <= n || i % 4 >= 2) && (!found || v.v == i));
+    (void)found;
+  }
+  for (int i = 3 * n + 1; i <= 4 * n; ++i) {
+    Value v(i);
+    bool found = mc.lookupCopy(Key(i), &v);
+    assert(found && v.v == 4);
+    bool isNew = mc.insertOrAssign(Key(i), &v);
+    assert(!isNew);
+    (void)found;
+    (void)isNew;
+  }
+  assert(mc.nrUsed() == static_cast<uint64_t>(3 * n));
+  std::cout << "splitting shards done, " << mc.nrShards() << " shards"
+            << std::endl;
+
+  // The shard and both positions in it come from one 128-bit hash.
+  ShardedMap<CuckooMap<Key, Value, FirstOf128<Key, CountingHash>,
+                       SecondOf128<Key, CountingHash>>> mh(4096, 4);
+  for (int i = 1; i <= 1000; ++i) {
+    Value v(i);
+    uint64_t before = nrHashes.load();
+    bool inserted = mh.insert(Key(i), &v);
+    bool found = mh.lookupCopy(Key(i), &v);
+    bool isNew = mh.upsert(Key(i), [](Value* w, bool) { ++w->v; });
+    bool stillFound = mh.lookup(Key(i)).found() > 0;
+    assert(inserted && found && !isNew && stillFound);
+    assert(nrHashes.load() - before == 4);
+    (void)inserted;
+    (void)found;
+    (void)isNew;
+    (void)stillFound;
+    (void)before;
+  }
+  for (int i = 1; i <= 1000; ++i) {
+    Value v;
+    assert(mh.lookupCopy(Key(i), &v) && v.v == i + 1);
+    uint64_t before = nrHashes.load();
+    bool removed = mh.remove(Key(i));
+    assert(removed && nrHashes.load() - before == 1);
+    (void)removed;
+    (void)before;
+  }
+  assert(mh.nrUsed() == 0);
+  std::cout << "one hash per operation done" << std::endl;
 }
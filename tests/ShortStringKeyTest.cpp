@@ -0,0 +1,107 @@
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <cuckoomap/CuckooMap.h>
+#include <cuckoomap/ShardedMap.h>
+#include <cuckoomap/ShortStringKey.h>
+
+typedef ShortStringKey<> Key;
+typedef CuckooMap<Key, uint64_t, Key::HashKey1, Key::HashKey2, Key::CompKey>
+    Map;
+
+static std::string name(int i) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "key-%08d", i);
+  return std::string(buffer);
+}
+
+int main(int /*argc*/, char* /*argv*/[]) {
+  static_assert(sizeof(Key) == 32, "a ShortStringKey<> fills 32 bytes");
+
+  // keys know their length and hash, the empty string is the empty key:
+  Key a(name(1));
+  Key b(ByteSpan(name(1).c_str()));
+  assert(a.size() == 12 && a.toString() == name(1));
+  assert(a.hash() == b.hash() && Key::CompKey()(a, b));
+  assert(!Key::CompKey()(a, Key(name(2))));
+  assert(Key("", 0).empty() && Key().empty() && !a.empty());
+  bool thrown = false;
+  try {
+    Key tooLong(std::string(24, 'x'));
+  } catch (std::length_error const&) {
+    thrown = true;
+  }
+  assert(thrown);
+  (void)thrown;
+
+  for (int config = 0; config < 4; ++config) {
+    bool useFilters = (config & 1) != 0;
+    bool optimisticReads = (config & 2) != 0;
+    CuckooMapOptions options;
+    options.useFilters = useFilters;
+    options.useTags = true;
+    options.optimisticReads = optimisticReads;
+    Map m(1024, sizeof(uint64_t), alignof(uint64_t), options);
+    int n = 50000;
+    for (int i = 1; i <= n; ++i) {
+      uint64_t v = i;
+      bool inserted = m.insert(Key(name(i)), &v);
+      assert(inserted);
+      (void)inserted;
+    }
+    uint64_t v = 0;
+    // transparent lookups with a std::string, a span and a C string, and
+    // the usual ones with a Key:
+    for (int i = 1; i <= 2 * n; ++i) {
+      std::string s = name(i);
+      bool found = m.lookupCopy(s, &v);
+      assert(found == (i <= n) && (!found || v == static_cast<uint64_t>(i)));
+      assert(m.lookupCopy(ByteSpan(s.data(), s.size()), &v) == found);
+      assert(m.lookupCopy(s.c_str(), &v) == found);
+      assert(m.lookupCopy(Key(s), &v) == found);
+      (void)found;
+    }
+    for (int i = 1; i <= n; i += 7) {
+      auto f = m.lookup(name(i));
+      assert(f.found() && f.key()->toString() == name(i));
+      *f.value() = 2 * i;
+    }
+    for (int i = 1; i <= n; i += 7) {
+      bool found = m.lookupCopy(name(i), &v);
+      assert(found && v == static_cast<uint64_t>(2 * i));
+      (void)found;
+    }
+    // an empty string never finds an empty slot:
+    assert(!m.lookupCopy(std::string(), &v));
+    for (int i = 1; i <= n; i += 2) {
+      bool removed = m.remove(Key(name(i)));
+      assert(removed);
+      (void)removed;
+    }
+    for (int i = 1; i <= n; ++i) {
+      assert(m.lookupCopy(name(i), &v) == (i % 2 == 0));
+    }
+    std::cout << "short string keys done, useFilters: " << useFilters
+              << ", optimisticReads: " << optimisticReads << ", "
+              << m.nrLayers() << " layers" << std::endl;
+  }
+
+  ShardedMap<Map> sm(1024, 4);
+  for (int i = 1; i <= 10000; ++i) {
+    uint64_t v = i;
+    sm.insert(Key(name(i)), &v);
+  }
+  for (int i = 1; i <= 20000; ++i) {
+    uint64_t v = 0;
+    bool found = sm.lookupCopy(name(i), &v);
+    assert(found == (i <= 10000) && (!found || v == static_cast<uint64_t>(i)));
+    (void)found;
+    auto f = sm.lookup(name(i));
+    assert((f.found() != 0) == (i <= 10000));
+  }
+  std::cout << "sharded short string keys done" << std::endl;
+  return 0;
+}
@@ -0,0 +1,179 @@
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <cuckoomap/SuperKeyMultiMap.h>
+
+struct Key {
+  int k;
+  Key() : k(0) {}
+  Key(int i) : k(i) {}
+};
+
+namespace std {
+
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+struct Group {
+  // the super key, where 0 is a group like any other
+  int g;
+  Group() : g(0) {}
+  Group(int i) : g(i) {}
+};
+
+namespace std {
+
+template <>
+struct equal_to<Group> {
+  bool operator()(Group const& a, Group const& b) const { return a.g == b.g; }
+};
+}
+
+struct GroupOf {
+  Group operator()(Key const& k) const { return Group(k.k / 100); }
+};
+
+typedef SuperKeyMultiMap<Key, int, Group, GroupOf> Map;
+
+static int64_t sumGroup(Map& m, int g, int32_t& nrKeys, int32_t& nrPairs) {
+  // go through all pairs of a group with next()
+  int64_t sum = 0;
+  nrPairs = 0;
+  auto f = m.lookupSuper(Group(g));
+  nrKeys = f.found();
+  if (nrKeys > 0) {
+    do {
+      assert(f.key()->k / 100 == g);
+      assert(*f.value() % 1000 == f.key()->k % 1000);
+      sum += *f.value();
+      ++nrPairs;
+    } while (f.next());
+  }
+  return sum;
+}
+
+void checkBasics() {
+  Map m(16);
+  // groups 0 to 9 with 100 keys of 3 values each
+  for (int k = 0; k < 1000; ++k) {
+    for (int y = 0; y < 3; ++y) {
+      int v = k + y * 1000;
+      bool inserted = m.insert(Key(k), &v);
+      assert(inserted);
+      (void)inserted;
+    }
+  }
+  assert(m.nrUsed() == 3000 && m.nrKeys() == 1000 && m.nrSuperKeys() == 10);
+
+  for (int g = 0; g < 10; ++g) {
+    int32_t nrKeys, nrPairs;
+    int64_t sum = sumGroup(m, g, nrKeys, nrPairs);
+    assert(nrKeys == 100 && nrPairs == 300);
+    assert(sum == 3 * (100 * g * 100 + 4950) + 100 * 3000);
+    (void)sum;
+  }
+  int32_t nrKeys, nrPairs;
+  sumGroup(m, 10, nrKeys, nrPairs);
+  assert(nrKeys == 0 && nrPairs == 0);
+
+  // the keys of a group are given as one batch, in the order of insertion
+  {
+    auto f = m.lookupSuper(Group(3));
+    Key* keys = f.keys();
+    for (int i = 0; i < f.found(); ++i) {
+      assert(keys[i].k == 300 + i);
+    }
+    // and each key's pairs as a Finding of the map
+    assert(f.finding().found() == 3);
+    assert(f.nextKey() && f.key()->k == 301 && f.finding().found() == 3);
+  }
+
+  // removing a key takes it out of the index
+  for (int k = 300; k < 350; ++k) {
+    bool removed = m.remove(Key(k));
+    assert(removed);
+    (void)removed;
+  }
+  assert(!m.remove(Key(300)));
+  sumGroup(m, 3, nrKeys, nrPairs);
+  assert(nrKeys == 50 && nrPairs == 150);
+  // (a Finding holds the mutex, so only one at a time)
+  assert(m.lookup(Key(320)).found() == 0);
+  assert(m.lookup(Key(360)).found() == 3);
+
+  // a key inserted again is indexed once
+  for (int k = 320; k <= 360; k += 40) {
+    int v = k + 3000;
+    m.insert(Key(k), &v);
+  }
+  sumGroup(m, 3, nrKeys, nrPairs);
+  assert(nrKeys == 51 && nrPairs == 152);
+
+  // and removing a group removes all its keys and pairs
+  assert(m.removeSuper(Group(3)) == 51);
+  assert(m.removeSuper(Group(3)) == 0);
+  assert(m.lookup(Key(360)).found() == 0);
+  assert(m.lookupSuper(Group(3)).found() == 0);
+  assert(m.nrUsed() == 2700 && m.nrKeys() == 900 && m.nrSuperKeys() == 9);
+
+  // a SuperFinding may be used again
+  Map::SuperFinding f;
+  assert(m.lookupSuper(Group(4), f) && f.found() == 100);
+  assert(!m.lookupSuper(Group(3), f) && f.found() == 0);
+  assert(m.lookupSuper(Group(5), f) && f.key()->k == 500);
+  std::cout << "basics: ok" << std::endl;
+}
+
+void checkConcurrent() {
+  // the index always agrees with the map, even while others write
+  Map m(1024);
+  int nrThreads = 4;
+  int n = 20000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nrThreads; ++t) {
+    threads.emplace_back([&m, t, n, nrThreads]() {
+      for (int k = t; k < n; k += nrThreads) {
+        m.insert(Key(k), &k);
+        m.insert(Key(k), &k);
+        if (k % 3 == 0) {
+          m.remove(Key(k));
+        }
+      }
+    });
+  }
+  threads.emplace_back([&m, n]() {
+    for (int i = 0; i < 2000; ++i) {
+      auto f = m.lookupSuper(Group(i % (n / 100)));
+      for (int j = 0; j < f.found(); ++j) {
+        // every key of the index has pairs in the map
+        assert(f.finding().found() > 0);
+        assert(f.keys()[j].k == f.key()->k);
+        f.nextKey();
+      }
+    }
+  });
+  for (auto& t : threads) {
+    t.join();
+  }
+  int expected = n - (n + 2) / 3;
+  assert(m.nrKeys() == static_cast<uint64_t>(expected));
+  assert(m.nrUsed() == 2 * static_cast<uint64_t>(expected));
+  uint64_t total = 0;
+  for (int g = 0; g < n / 100; ++g) {
+    total += m.lookupSuper(Group(g)).found();
+  }
+  assert(total == static_cast<uint64_t>(expected));
+  std::cout << "concurrent: ok" << std::endl;
+}
+
+int main(int /*argc*/, char* /*argv*/[]) {
+  checkBasics();
+  checkConcurrent();
+  return 0;
+}